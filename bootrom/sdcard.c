@@ -20,13 +20,9 @@
 
 #define DATA_START_TOKEN	0xfe
 #define BLOCK_SIZE		512
-
-/*
- * Load into the middle of SDRAM, this should be flexible enough for ELF files
- * that want to run in the bottom or top of SDRAM.
- */
-static void *load_buffer = (void *)(0x20000000 + (16 * 1024 * 1024));
-#define LOAD_BUFFER_SIZE (16 * 1024 * 1024)
+/* Bytes transferred at a time when streaming a multiple block read. */
+#define STREAM_CHUNK		4096
+#define MAX_BUSY_POLLS		65536
 
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
@@ -39,19 +35,6 @@ typedef signed long long int64_t;
 
 #include "elf.h"
 
-struct elf_info {
-	const void *elf;
-	const Elf32_Ehdr *ehdr;
-	const Elf32_Shdr *shdrs;
-	const Elf32_Phdr *phdrs;
-	const char *secstrings;
-};
-
-#define for_each_phdr(phdr, elf) \
-	for ((phdr) = (elf)->phdrs; \
-	     (phdr) < (elf)->phdrs + (elf)->ehdr->e_phnum; \
-	     (phdr)++)
-
 static volatile unsigned char *spi_cmd_buf =
 	(volatile unsigned char *)(SPI_BASE_ADDRESS + SPI_XFER_BUF_OFFS);
 
@@ -120,11 +103,16 @@ static void flush_fifo(void)
 	spi_wait_idle();
 }
 
+static unsigned long spi_cmd_len(const struct spi_cmd *cmd)
+{
+	return 1 + 6 + cmd->tx_datalen + cmd->rx_datalen + SD_NCR;
+}
+
 static void spi_do_command(const struct spi_cmd *cmd)
 {
 	unsigned long m, cmdlen;
 
-	cmdlen = 1 + 6 + cmd->tx_datalen + cmd->rx_datalen + SD_NCR;
+	cmdlen = spi_cmd_len(cmd);
 
 	/* The command. */
 	spi_cmd_buf[0] = 0xff;
@@ -355,8 +343,6 @@ static int read_sector(unsigned long address, unsigned char *dst)
 
 	uart_putc('#');
 
-	spi_write_reg(SPI_CTRL_REG, SD_FAST_DIVIDER);
-
 	spi_do_command(&cmd);
 	r1ptr = find_r1_response(&r1);
 	if (!r1ptr) {
@@ -374,6 +360,165 @@ static int read_sector(unsigned long address, unsigned char *dst)
 	return 0;
 }
 
+/*
+ * Multiple block reads stream through the transfer buffer STREAM_CHUNK bytes
+ * at a time with the chip select held, the card carries on sending where it
+ * left off.  Each byte is set back to 0xff as it's consumed so the next chunk
+ * only ever transmits 0xff.
+ */
+struct sd_stream {
+	unsigned long pos;
+	unsigned long len;
+};
+
+static unsigned char stream_next(struct sd_stream *s)
+{
+	unsigned char v;
+
+	if (s->pos == s->len) {
+		spi_write_reg(SPI_XFER_CTRL_REG, XFER_START | STREAM_CHUNK);
+		spi_wait_idle();
+		s->pos = 0;
+		s->len = STREAM_CHUNK;
+	}
+
+	v = spi_cmd_buf[s->pos];
+	spi_cmd_buf[s->pos++] = 0xff;
+
+	return v;
+}
+
+static void stream_copy(struct sd_stream *s, unsigned char *dst,
+			unsigned long len)
+{
+	while (len) {
+		unsigned long m, n;
+
+		if (s->pos == s->len) {
+			spi_write_reg(SPI_XFER_CTRL_REG,
+				      XFER_START | STREAM_CHUNK);
+			spi_wait_idle();
+			s->pos = 0;
+			s->len = STREAM_CHUNK;
+		}
+
+		n = s->len - s->pos;
+		if (n > len)
+			n = len;
+		for (m = 0; m < n; ++m) {
+			dst[m] = spi_cmd_buf[s->pos + m];
+			spi_cmd_buf[s->pos + m] = 0xff;
+		}
+
+		s->pos += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+static int sd_wait_not_busy(void)
+{
+	unsigned long m;
+
+	for (m = 0; m < MAX_BUSY_POLLS; ++m) {
+		spi_cmd_buf[0] = 0xff;
+		spi_write_reg(SPI_XFER_CTRL_REG, XFER_START | 1);
+		spi_wait_idle();
+		if (spi_cmd_buf[0] == 0xff)
+			return 0;
+	}
+
+	return -1;
+}
+
+static int stop_transmission(void)
+{
+	struct spi_cmd cmd = {
+		.cmd = 0x4c,
+		/* stuff byte, r1b */
+		.rx_datalen = 2,
+	};
+	const volatile unsigned char *p, *end = spi_cmd_buf + spi_cmd_len(&cmd);
+
+	spi_do_command(&cmd);
+
+	/* The byte after the command is a stuff byte. */
+	for (p = spi_cmd_buf + 8; p < end && *p == 0xff; ++p)
+		continue;
+	if (p == end || (*p & R1_ERROR_MASK)) {
+		putstr("stop transmission failed\n");
+		return -1;
+	}
+
+	return sd_wait_not_busy();
+}
+
+static int read_blocks(unsigned long address, unsigned char *dst,
+		       unsigned long nr_blocks)
+{
+	struct spi_cmd cmd = {
+		.cmd = 0x52,
+		.arg = { (address >> 24) & 0xff,
+			 (address >> 16) & 0xff,
+			 (address >> 8)  & 0xff,
+			 (address >> 0)  & 0xff
+		},
+		.rx_datalen = 1,
+	};
+	struct r1_response r1;
+	const volatile unsigned char *r1ptr;
+	volatile unsigned char *p;
+	struct sd_stream s;
+	unsigned long m;
+
+	if (nr_blocks == 1)
+		return read_sector(address, dst);
+
+	uart_putc('*');
+
+	for (m = 0; m < STREAM_CHUNK; ++m)
+		spi_cmd_buf[m] = 0xff;
+
+	spi_do_command(&cmd);
+	r1ptr = find_r1_response(&r1);
+	if (!r1ptr) {
+		putstr("failed to find r1 response\n");
+		return -1;
+	}
+	if (r1.v & R1_ERROR_MASK) {
+		putstr("read blocks failed\n");
+		return -1;
+	}
+
+	/* The data follows the response in the same transfer. */
+	for (p = spi_cmd_buf; p <= r1ptr; ++p)
+		*p = 0xff;
+	s.pos = r1ptr + 1 - spi_cmd_buf;
+	s.len = spi_cmd_len(&cmd);
+
+	while (nr_blocks--) {
+		unsigned long timeout = MAX_DATA_START_OFFS;
+		unsigned char v;
+
+		do {
+			v = stream_next(&s);
+		} while (v == 0xff && --timeout);
+		if (v != DATA_START_TOKEN) {
+			putstr("no data start token\n");
+			stop_transmission();
+			return -1;
+		}
+
+		stream_copy(&s, dst, BLOCK_SIZE);
+		/* CRC16 */
+		stream_next(&s);
+		stream_next(&s);
+		dst += BLOCK_SIZE;
+	}
+
+	return stop_transmission();
+}
+
 static void find_boot_partition(unsigned long *start, unsigned long *size)
 {
 	static unsigned char mbr[BLOCK_SIZE];
@@ -406,6 +551,9 @@ static int get_boot_partition_address(unsigned long *start,
 	if (rc)
 		putstr("readmbr: warning: failed to wait for SD to become ready\n");
 
+	/* Initialization is over, everything else can run at full speed. */
+	spi_write_reg(SPI_CTRL_REG, SD_FAST_DIVIDER);
+
 	rc = sd_set_blocklen();
 	if (rc) {
 		putstr("readmbr: failed to set blocklen\n");
@@ -474,26 +622,46 @@ static inline unsigned long fat_read32(const unsigned char *p)
 	return *p | (*(p + 1) << 8) | (*(p + 2) << 16) | (*(p + 3) << 24);
 }
 
+/*
+ * Whole blocks are read straight into dst with a multiple block read, partial
+ * blocks through a single cached sector as FAT and directory lookups keep
+ * coming back to the same one.
+ */
 static int sd_read(const struct fat_superblock *sb, void *dst, unsigned len,
 		   unsigned long offset)
 {
-	static unsigned char sector_buf[512];
-	unsigned bytes_read = 0;
-
-	while (bytes_read < len) {
-		unsigned sector_num = (offset / 512) + sb->partition_lba;
-		unsigned sector_offset = offset % 512;
-		unsigned bytes_to_sector_end = 512 - sector_offset;
-		unsigned long bytes_remaining = len - bytes_read;
-		unsigned read_len = bytes_to_sector_end < bytes_remaining ?
-			bytes_to_sector_end : bytes_remaining;
-
-		if (read_sector(sector_num * 512, sector_buf))
-			return -1;
-
-		memcpy(dst + bytes_read, sector_buf + sector_offset, read_len);
+	static unsigned char sector_buf[BLOCK_SIZE];
+	static unsigned long cached_sector = ~0UL;
+	unsigned char *p = dst;
+
+	while (len) {
+		unsigned long sector_num = (offset / BLOCK_SIZE) + sb->partition_lba;
+		unsigned sector_offset = offset % BLOCK_SIZE;
+		unsigned long read_len;
+
+		if (sector_offset == 0 && len >= BLOCK_SIZE) {
+			unsigned long nr_blocks = len / BLOCK_SIZE;
+
+			if (read_blocks(sector_num * BLOCK_SIZE, p, nr_blocks))
+				return -1;
+			read_len = nr_blocks * BLOCK_SIZE;
+		} else {
+			read_len = BLOCK_SIZE - sector_offset;
+			if (read_len > len)
+				read_len = len;
+
+			if (sector_num != cached_sector) {
+				cached_sector = ~0UL;
+				if (read_sector(sector_num * BLOCK_SIZE,
+						sector_buf))
+					return -1;
+				cached_sector = sector_num;
+			}
+			memcpy(p, sector_buf + sector_offset, read_len);
+		}
 
-		bytes_read += read_len;
+		p += read_len;
+		len -= read_len;
 		offset += read_len;
 	}
 
@@ -695,10 +863,9 @@ static int fat_read_dirent(const struct fat_superblock *sb,
 	return 0;
 }
 
-static unsigned long fat_read_from_cluster(const struct fat_superblock *sb,
-				     void *dst, unsigned long cluster, unsigned long len)
+static unsigned long fat_cluster_offs(const struct fat_superblock *sb,
+				      unsigned long cluster)
 {
-	unsigned long cluster_addr = 0;
 	unsigned long data_sector_base;
 
 	data_sector_base =
@@ -711,72 +878,95 @@ static unsigned long fat_read_from_cluster(const struct fat_superblock *sb,
 	/*
 	 * Clusters 0&1 are reserved so we start from cluster 2, hence the -2.
 	 */
-	cluster_addr = data_sector_base * sb->bytes_per_sector + (cluster - 2) *
+	return data_sector_base * sb->bytes_per_sector + (cluster - 2) *
 		sb->sectors_per_cluster * sb->bytes_per_sector;
-	if (sd_read(sb, dst, len, cluster_addr)) {
-		putstr("failed to read from cluster\n");
-		return 0;
-	}
-
-	return len;
 }
 
-static unsigned long fat_read_buf(const struct fat_superblock *sb,
-			    const struct fat_dirent *dirent, void *dst,
-			    unsigned long len, unsigned offs)
+/*
+ * Read len bytes from offs in the file, each run of contiguous clusters with
+ * a single sd_read().
+ */
+static int fat_read_file(const struct fat_superblock *sb,
+			 const struct fat_dirent *dirent, void *dst,
+			 unsigned long len, unsigned long offs)
 {
-	unsigned long cluster = dirent->first_cluster;
-	unsigned long pos = 0, copied = 0;
 	unsigned long bytes_per_cluster = sb->bytes_per_sector * sb->sectors_per_cluster;
+	unsigned long cluster = dirent->first_cluster;
+	unsigned char *p = dst;
 
-	while (len > 0) {
-		if (pos >= offs) {
-			unsigned long cluster_offs = offs % bytes_per_cluster;
-			unsigned long clen = bytes_per_cluster - cluster_offs;
+	while (offs >= bytes_per_cluster) {
+		cluster = fat_read_entry(sb, cluster);
+		if (cluster == sb->eoc_marker)
+			return -1;
+		offs -= bytes_per_cluster;
+	}
 
-			if (clen > len)
-				clen = len;
-			if (clen > bytes_per_cluster)
-				clen = bytes_per_cluster;
+	while (len) {
+		unsigned long first = cluster;
+		unsigned long run = bytes_per_cluster - offs;
 
-			fat_read_from_cluster(sb, dst + copied, cluster, clen);
+		while (run < len &&
+		       fat_read_entry(sb, cluster) == cluster + 1) {
+			++cluster;
+			run += bytes_per_cluster;
+		}
+		if (run > len)
+			run = len;
 
-			offs += cluster_offs;
-			copied += clen;
-			len -= clen;
+		if (sd_read(sb, p, run, fat_cluster_offs(sb, first) + offs)) {
+			putstr("failed to read from cluster\n");
+			return -1;
 		}
 
-		cluster = fat_read_entry(sb, cluster);
-		if (cluster == sb->eoc_marker)
-			break;
+		p += run;
+		len -= run;
+		offs = 0;
 
-		pos += bytes_per_cluster;
+		if (len) {
+			cluster = fat_read_entry(sb, cluster);
+			if (cluster == sb->eoc_marker)
+				return -1;
+		}
 	}
 
 	return 0;
 }
 
-static void load_elf(const void *buf)
+/*
+ * Read each loadable segment straight from the card to its load address
+ * rather than loading the whole file first.
+ */
+static void load_elf(const struct fat_superblock *sb,
+		     const struct fat_dirent *dirent)
 {
-	struct elf_info info = {
-		.elf = buf,
-	};
-	const Elf32_Phdr *phdr;
+	Elf32_Ehdr ehdr;
+	unsigned m;
 
-	info.ehdr = info.elf;
-	info.shdrs = (const void *)info.ehdr + info.ehdr->e_shoff;
-	info.phdrs = (const void *)info.ehdr + info.ehdr->e_phoff;
-	info.secstrings = (const void *)info.ehdr +
-		info.shdrs[info.ehdr->e_shstrndx].sh_offset;
+	if (fat_read_file(sb, dirent, &ehdr, sizeof(ehdr), 0)) {
+		putstr("failed to read ELF header\n");
+		return;
+	}
 
-	for_each_phdr(phdr, &info) {
-		if (phdr->p_type != PT_LOAD)
+	for (m = 0; m < ehdr.e_phnum; ++m) {
+		Elf32_Phdr phdr;
+
+		if (fat_read_file(sb, dirent, &phdr, sizeof(phdr),
+				  ehdr.e_phoff + m * ehdr.e_phentsize)) {
+			putstr("failed to read program header\n");
+			return;
+		}
+
+		if (phdr.p_type != PT_LOAD)
 			continue;
 
-		memcpy((void *)phdr->p_vaddr, info.elf + phdr->p_offset, phdr->p_filesz);
+		if (fat_read_file(sb, dirent, (void *)phdr.p_vaddr,
+				  phdr.p_filesz, phdr.p_offset)) {
+			putstr("failed to load segment\n");
+			return;
+		}
 	}
 
-	asm volatile("b		%0" :: "r"(info.ehdr->e_entry));
+	asm volatile("b		%0" :: "r"(ehdr.e_entry));
 }
 
 static void find_and_exec_boot_elf(const struct fat_superblock *sb)
@@ -794,10 +984,8 @@ static void find_and_exec_boot_elf(const struct fat_superblock *sb)
 		}
 
 		if (!wstrcmp(dirent.name, u"BOOT.ELF")) {
-			if (!fat_dirent_is_dir(&dirent)) {
-				fat_read_buf(sb, &dirent, load_buffer, LOAD_BUFFER_SIZE, 0);
-				load_elf(load_buffer);
-			}
+			if (!fat_dirent_is_dir(&dirent))
+				load_elf(sb, &dirent);
 		}
 	}
 }
@@ -1,15 +1,17 @@
 /*
  * User breakpoints.
  *
- * Breakpoints are implemented by replacing the instruction at the target
- * address with a 'bkp' instruction.
+ * Targets that check breakpoints themselves are given the set of enabled
+ * breakpoint addresses.  Otherwise breakpoints are implemented by replacing
+ * the instruction at the target address with a 'bkp' instruction.
  *
  * Users register a breakpoint with breakpoint_register().  When execution
  * stops, use breakpoint_at_addr() to determine whether an enabled breakpoint
  * was hit or not.  If it was then execution must be resumed with
  * breakpoint_exec_orig().  This replaces the instruction at the breakpoint
  * address with the real instruction, steps for a single cycle to run the real
- * instruction then puts the breakpoint back.
+ * instruction then puts the breakpoint back.  Native breakpoints don't stop
+ * the first instruction after resuming, so there's nothing to do for them.
  */
 #include <assert.h>
 #include <err.h>
@@ -42,21 +44,61 @@ struct breakpoint *breakpoint_register(struct target *t, uint32_t addr)
 	/* Until we have a need for lots of breakpoints this'll do. */
 	assert(next_id != INT_MAX);
 
+	list_add_tail(&bkp->head, &bkp_list);
+
 	if (breakpoint_enable(bkp)) {
+		list_del(&bkp->head);
 		free(bkp);
 		return NULL;
 	}
 
-	list_add_tail(&bkp->head, &bkp_list);
-
 	return bkp;
 }
 
+/* Upload the addresses of all enabled native breakpoints on the target. */
+static int sync_native(struct target *t)
+{
+	struct list_head *pos;
+	uint32_t *addrs;
+	size_t nr = 0;
+	int rc;
+
+	list_for_each(pos, &bkp_list) {
+		struct breakpoint *bp = to_breakpoint(pos);
+
+		if (bp->target == t && bp->enabled && bp->native)
+			++nr;
+	}
+
+	addrs = malloc((nr ? nr : 1) * sizeof(*addrs));
+	assert(addrs != NULL);
+
+	nr = 0;
+	list_for_each(pos, &bkp_list) {
+		struct breakpoint *bp = to_breakpoint(pos);
+
+		if (bp->target == t && bp->enabled && bp->native)
+			addrs[nr++] = bp->addr;
+	}
+
+	rc = dbg_set_breakpoints(t, addrs, nr);
+	free(addrs);
+
+	return rc;
+}
+
 int breakpoint_enable(struct breakpoint *bkp)
 {
 	if (bkp->enabled)
 		return 0;
 
+	if (dbg_native_breakpoints(bkp->target)) {
+		bkp->enabled = bkp->native = true;
+		if (!sync_native(bkp->target))
+			return 0;
+		bkp->enabled = bkp->native = false;
+	}
+
 	if (dbg_read32(bkp->target, bkp->addr, &bkp->orig_instr) ||
 	    dbg_write32(bkp->target, bkp->addr, bkp_insn)) {
 		warnx("failed to write breakpoint at %08x", bkp->addr);
@@ -73,6 +115,18 @@ int breakpoint_disable(struct breakpoint *bkp)
 	if (!bkp->enabled)
 		return 0;
 
+	if (bkp->native) {
+		bkp->enabled = false;
+		if (sync_native(bkp->target)) {
+			bkp->enabled = true;
+			warnx("failed to clear breakpoint at %08x", bkp->addr);
+			return -EIO;
+		}
+		bkp->native = false;
+
+		return 0;
+	}
+
 	if (dbg_write32(bkp->target, bkp->addr, bkp->orig_instr)) {
 		warnx("failed to write breakpoint at %08x", bkp->addr);
 		return -EIO;
@@ -126,6 +180,9 @@ struct breakpoint *breakpoint_at_addr(uint32_t addr)
 
 void breakpoint_exec_orig(struct breakpoint *bkp)
 {
+	if (bkp->native)
+		return;
+
 	if (breakpoint_disable(bkp) || dbg_step(bkp->target) ||
 	    breakpoint_enable(bkp))
 		err(1, "failed to execute instruction at breakpoint (%08x)",
@@ -17,6 +17,8 @@ struct target;
 struct breakpoint {
 	int id;
 	bool enabled;
+	/* Checked by the target rather than patched into memory. */
+	bool native;
 	uint32_t addr;
 	struct list_head head;
 	uint32_t orig_instr;
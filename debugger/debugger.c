@@ -6,16 +6,21 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -26,8 +31,10 @@
 
 #include "breakpoint.h"
 #include "debugger.h"
+#include "local.h"
 #include "protocol.h"
 #include "loadsyms.h"
+#include "shm_link.h"
 
 #define NUM_HISTORY_LINES	1000
 #define PSR_BASE		32
@@ -40,9 +47,51 @@ const char *argp_program_version = "0.1";
 const char *argp_program_bug_address = "jamie@jamieiles.com";
 static char doc[] = "Oldland CPU debugger.";
 
+/*
+ * Requests are queued and sent TARGET_TX_BATCH at a time without waiting
+ * for their responses, the oldest responses are only read once
+ * TARGET_WINDOW requests are outstanding or on dbg_flush().  The protocol
+ * keeps responses in order so reads are resolved as they arrive and errors
+ * are held until the flush.
+ */
+#define TARGET_WINDOW		128
+#define TARGET_TX_BATCH		32
+
+/* How often waits on a shared memory link check that the target is alive. */
+#define SHM_POLL_MS		100
+
 struct target {
 	int fd;
+	/* Requests and responses go through here instead of fd if set... */
+	struct shm_link *shm;
+	/* ... or to the simulator linked into the debugger. */
+	struct local_target *local;
 	bool interrupted;
+	/* The server supports protocol version 2 batches. */
+	bool batching;
+	/* ... and version 3 block transfers... */
+	bool blocks;
+	/* ... and version 4 register snapshots... */
+	bool snapshots;
+	/* ... and version 5 running to a set of addresses... */
+	bool run_until;
+	/* ... and version 6 waiting for the CPU to stop... */
+	bool stop_events;
+	/* ... and version 7 breakpoints checked by the target, if accepted. */
+	bool native_bkpts;
+
+	/* Sorted, for stepping to them on older targets. */
+	uint32_t *stop_pcs;
+	size_t nr_stop_pcs;
+	uint32_t run_limit;
+
+	struct dbg_request txq[TARGET_TX_BATCH];
+	unsigned int nr_tx;
+	/* Where to store each outstanding request's response data. */
+	uint32_t *results[TARGET_WINDOW];
+	unsigned int rx_head;
+	unsigned int nr_outstanding;
+	int queue_status;
 
 	bool addr_written;
 	uint32_t cached_addr;
@@ -53,6 +102,10 @@ struct target {
 	bool mem_written;
 
 	bool breakpoint_hit;
+	bool watchpoint_hit;
+
+	/* Slots in use have a non-zero length. */
+	struct dbg_watchpoint watchpoints[DBG_MAX_WATCHPOINTS];
 
 	uint32_t psr;
 
@@ -64,84 +117,372 @@ struct target {
 
 static struct target *target;
 static bool interactive;
+/* Written by the SIGINT handler to wake anything waiting on the target. */
+static int sigint_pipe[2] = { -1, -1 };
 
-static int target_exchange(const struct target *t,
-			   const struct dbg_request *req,
-			   struct dbg_response *resp)
+static int read_full(int fd, void *buf, size_t len)
 {
-	ssize_t rc;
-	struct iovec reqv = {
-		.iov_base = (void *)req,
-		.iov_len = sizeof(*req)
+	unsigned char *p = buf;
+
+	while (len) {
+		ssize_t rc = read(fd, p, len);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -EIO;
+		p += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+static int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t rc = writev(fd, iov, iovcnt);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -EIO;
+
+		while (iovcnt && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt) {
+			iov->iov_base = (unsigned char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The target never writes to the socket once a shared memory link is up, so
+ * it being readable means the target has gone.
+ */
+static bool shm_target_gone(struct target *t)
+{
+	struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+static int shm_read_full(struct target *t, void *buf, size_t len)
+{
+	struct shm_ring *r = &t->shm->to_host;
+	unsigned char *p = buf;
+
+	for (;;) {
+		size_t n = shm_ring_read(r, p, len);
+
+		p += n;
+		len -= n;
+		if (!len)
+			return 0;
+		if (shm_ring_wait_readable(r, SHM_POLL_MS) == -ETIMEDOUT &&
+		    shm_target_gone(t))
+			return -EIO;
+	}
+}
+
+static int shm_writev_full(struct target *t, const struct iovec *iov,
+			   int iovcnt)
+{
+	struct shm_ring *r = &t->shm->to_target;
+
+	for (; iovcnt; ++iov, --iovcnt) {
+		const unsigned char *p = iov->iov_base;
+		size_t len = iov->iov_len;
+
+		for (;;) {
+			size_t n = shm_ring_write(r, p, len);
+
+			p += n;
+			len -= n;
+			if (!len)
+				break;
+			if (shm_ring_wait_writable(r, SHM_POLL_MS) ==
+			    -ETIMEDOUT && shm_target_gone(t))
+				return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/* Responses still to come need the CPU to run until it stops. */
+static int local_read_full(struct target *t, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+
+	for (;;) {
+		size_t n = local_target_read(t->local, p, len);
+
+		p += n;
+		len -= n;
+		if (!len)
+			return 0;
+		if (!local_target_run(t->local))
+			return -EIO;
+	}
+}
+
+static int target_read(struct target *t, void *buf, size_t len)
+{
+	if (t->local)
+		return local_read_full(t, buf, len);
+
+	return t->shm ? shm_read_full(t, buf, len) : read_full(t->fd, buf, len);
+}
+
+static int target_writev(struct target *t, struct iovec *iov, int iovcnt)
+{
+	return t->shm ? shm_writev_full(t, iov, iovcnt) :
+		writev_full(t->fd, iov, iovcnt);
+}
+
+/*
+ * Wait for a response to arrive or fd to become readable.  Returns 1 for a
+ * response, 0 for fd or a negative errno.
+ */
+static int target_poll(struct target *t, int fd)
+{
+	struct pollfd pfds[2] = {
+		{ .fd = t->fd, .events = POLLIN },
+		{ .fd = fd, .events = POLLIN },
 	};
-	struct iovec respv = {
-		.iov_base = resp,
-		.iov_len = sizeof(*resp)
+
+	while (t->local) {
+		if (local_target_readable(t->local))
+			return 1;
+		if (poll(&pfds[1], 1, 0) > 0)
+			return 0;
+		if (!local_target_run(t->local))
+			return -EIO;
+	}
+
+	for (;;) {
+		if (t->shm && shm_ring_readable(&t->shm->to_host))
+			return 1;
+		if (poll(pfds, 2, t->shm ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (pfds[1].revents)
+			return 0;
+		if (pfds[0].revents)
+			return t->shm ? -EIO : 1;
+		if (t->shm)
+			shm_ring_wait_readable(&t->shm->to_host, SHM_POLL_MS);
+	}
+}
+
+static void queue_fail(struct target *t, int rc)
+{
+	if (!t->queue_status)
+		t->queue_status = rc;
+}
+
+/*
+ * Send the queued requests, as a batch if the server supports them, along
+ * with an optional payload for a block write that must follow the last.
+ */
+static int queue_send(struct target *t, const void *payload, size_t len)
+{
+	struct dbg_request hdr = {
+		.addr = REG_BATCH,
+		.value = t->nr_tx,
+	};
+	struct iovec iov[3] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = t->txq, .iov_len = t->nr_tx * sizeof(*t->txq) },
+		{ .iov_base = (void *)payload, .iov_len = len },
 	};
+	bool batch = t->batching && t->nr_tx > 1;
+	int rc;
 
-	rc = writev(t->fd, &reqv, 1);
-	if (rc < 0)
-		return -EIO;
-	if (rc != (ssize_t)sizeof(*req))
-		return -EIO;
+	if (!t->nr_tx && !len)
+		return 0;
+
+	if (t->local) {
+		local_target_send(t->local, t->txq, t->nr_tx, payload, len);
+		t->nr_tx = 0;
+		return 0;
+	}
+
+	rc = target_writev(t, batch ? iov : iov + 1, batch ? 3 : 2);
+	t->nr_tx = 0;
+	if (rc)
+		queue_fail(t, rc);
 
-	rc = readv(t->fd, &respv, 1);
-	if (rc < 0)
+	return rc;
+}
+
+/* Read the responses to the nr oldest outstanding requests. */
+static int queue_reap(struct target *t, unsigned int nr)
+{
+	struct dbg_response resps[TARGET_WINDOW];
+	unsigned int m;
+	int rc = 0;
+
+	if (nr > t->nr_outstanding - t->nr_tx)
+		rc = queue_send(t, NULL, 0);
+	if (!rc)
+		rc = target_read(t, resps, nr * sizeof(*resps));
+	if (rc) {
+		/* The stream can't be trusted any more. */
+		queue_fail(t, rc);
+		t->nr_outstanding = t->nr_tx = 0;
 		return rc;
-	if (rc != (ssize_t)sizeof(*resp))
-		return -EIO;
+	}
+
+	for (m = 0; m < nr; ++m) {
+		uint32_t *result = t->results[t->rx_head];
+
+		t->rx_head = (t->rx_head + 1) % TARGET_WINDOW;
+		if (resps[m].status)
+			queue_fail(t, resps[m].status);
+		if (result)
+			*result = resps[m].data;
+	}
+	t->nr_outstanding -= nr;
 
 	return 0;
 }
 
-static int dbg_write(struct target *t, enum dbg_reg addr, uint32_t value)
+static void queue_request(struct target *t, const struct dbg_request *req,
+			  uint32_t *result)
+{
+	if (t->nr_outstanding == TARGET_WINDOW)
+		queue_reap(t, TARGET_TX_BATCH);
+
+	t->txq[t->nr_tx++] = *req;
+	t->results[(t->rx_head + t->nr_outstanding++) % TARGET_WINDOW] = result;
+
+	if (t->nr_tx == TARGET_TX_BATCH)
+		queue_send(t, NULL, 0);
+}
+
+/*
+ * Writes to the address and write data registers are skipped if the
+ * register already holds the value.
+ */
+static void queue_write(struct target *t, enum dbg_reg addr, uint32_t value)
 {
 	struct dbg_request req = {
 		.addr = addr,
 		.value = value,
 		.read_not_write = 0,
 	};
-	struct dbg_response resp;
-	int rc;
 
 	if (addr == REG_ADDRESS) {
 		if (value == t->cached_addr && t->addr_written)
-			return 0;
+			return;
 		t->cached_addr = value;
 		t->addr_written = true;
 	}
 
 	if (addr == REG_WDATA) {
 		if (value == t->cached_wdata && t->wdata_written)
-			return 0;
+			return;
 		t->cached_wdata = value;
 		t->wdata_written = true;
 	}
 
-	rc = target_exchange(t, &req, &resp);
-	if (!rc)
-		rc = resp.status;
-
-	return rc;
+	queue_request(t, &req, NULL);
 }
 
-static int dbg_read(struct target *t, enum dbg_reg addr, uint32_t *value)
+/* value is written when the response arrives, by dbg_flush() at the latest. */
+static void queue_read(struct target *t, enum dbg_reg addr, uint32_t *value)
 {
 	struct dbg_request req = {
 		.addr = addr,
 		.read_not_write = 1,
 	};
-	struct dbg_response resp;
+
+	queue_request(t, &req, value);
+}
+
+/*
+ * Wait for every outstanding request, returning the first error since the
+ * last flush.
+ */
+int dbg_flush(struct target *t)
+{
 	int rc;
 
-	rc = target_exchange(t, &req, &resp);
-	if (!rc)
-		rc = resp.status;
-	*value = resp.data;
+	if (t->nr_outstanding)
+		queue_reap(t, t->nr_outstanding);
+
+	rc = t->queue_status;
+	t->queue_status = 0;
+	/* Don't trust the cached registers after a failure. */
+	if (rc)
+		t->addr_written = t->wdata_written = false;
+
+	return rc;
+}
+
+/*
+ * A single CMD_RMEM_BLOCK or CMD_WMEM_BLOCK, the payload goes out straight
+ * after the command or is read after its response.
+ */
+static int target_block(struct target *t, enum dbg_cmd cmd, uint32_t addr,
+			void *data, uint32_t len)
+{
+	struct dbg_request req = {
+		.addr = REG_CMD,
+		.value = cmd,
+	};
+	bool write = cmd == CMD_WMEM_BLOCK || cmd == CMD_WRITE_REGS ||
+		cmd == CMD_SET_STOP_PCS || cmd == CMD_SET_BREAKPOINTS ||
+		cmd == CMD_SET_WATCHPOINTS || cmd == CMD_SAVE_CHECKPOINT ||
+		cmd == CMD_RESTORE_CHECKPOINT;
+	uint32_t count = 0;
+	int rc;
+
+	queue_write(t, REG_ADDRESS, addr);
+	queue_write(t, REG_WDATA, len);
+	/* A read's response data is the payload length. */
+	queue_request(t, &req, &count);
+	/* The block leaves the address and data registers undefined. */
+	t->addr_written = t->wdata_written = false;
+
+	if (write)
+		queue_send(t, data, len);
+
+	rc = dbg_flush(t);
+	if (!write && count) {
+		if (count != len)
+			return -EIO;
+		if (target_read(t, data, len))
+			return -EIO;
+	}
 
 	return rc;
 }
 
+static int dbg_write(struct target *t, enum dbg_reg addr, uint32_t value)
+{
+	queue_write(t, addr, value);
+
+	return dbg_flush(t);
+}
+
+static int dbg_read(struct target *t, enum dbg_reg addr, uint32_t *value)
+{
+	queue_read(t, addr, value);
+
+	return dbg_flush(t);
+}
+
 static int dbg_term(struct target *t)
 {
 	return dbg_write(t, REG_CMD, CMD_SIM_TERM);
@@ -152,14 +493,17 @@ static int dbg_start_trace(struct target *t)
 	return dbg_write(t, REG_CMD, CMD_START_TRACE);
 }
 
-int dbg_stop(struct target *t)
+static int dbg_dump_trace(struct target *t)
 {
-	int rc = dbg_write(t, REG_CMD, CMD_STOP);
+	return dbg_write(t, REG_CMD, CMD_DUMP_TRACE);
+}
 
-	if (!rc)
-		rc = dbg_read(t, REG_RDATA, &t->pc);
+int dbg_stop(struct target *t)
+{
+	queue_write(t, REG_CMD, CMD_STOP);
+	queue_read(t, REG_RDATA, &t->pc);
 
-	return rc;
+	return dbg_flush(t);
 }
 
 static int dbg_cache_sync(struct target *t)
@@ -194,10 +538,141 @@ int dbg_step(struct target *t)
 
 	if (!rc)
 		rc = dbg_cache_sync(t);
+	if (!rc) {
+		queue_write(t, REG_CMD, CMD_STEP);
+		queue_read(t, REG_RDATA, &t->pc);
+		rc = dbg_flush(t);
+	}
+
+	return rc;
+}
+
+/* Starts running to the stop set, run_limit cycles at most if non-zero. */
+static int dbg_run_until(struct target *t)
+{
+	int rc = regcache_sync(t->regcache);
+
 	if (!rc)
-		rc = dbg_write(t, REG_CMD, CMD_STEP);
-	if (!rc)
-		rc = dbg_read(t, REG_RDATA, &t->pc);
+		rc = dbg_cache_sync(t);
+	if (!rc) {
+		queue_write(t, REG_WDATA, t->run_limit);
+		queue_write(t, REG_CMD, CMD_RUN_UNTIL);
+		rc = dbg_flush(t);
+	}
+
+	return rc;
+}
+
+static int dbg_get_run_cycles(struct target *t, uint32_t *cycles)
+{
+	queue_write(t, REG_CMD, CMD_GET_RUN_CYCLES);
+	queue_read(t, REG_RDATA, cycles);
+
+	return dbg_flush(t);
+}
+
+static int compare_pcs(const void *a, const void *b)
+{
+	uint32_t pa = *(const uint32_t *)a, pb = *(const uint32_t *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static bool is_stop_pc(const struct target *t, uint32_t pc)
+{
+	return t->nr_stop_pcs &&
+		bsearch(&pc, t->stop_pcs, t->nr_stop_pcs, sizeof(pc),
+			compare_pcs);
+}
+
+int dbg_set_stop_pcs(struct target *t, const uint32_t *pcs, size_t nr)
+{
+	uint32_t *stop_pcs = NULL;
+
+	if (nr * sizeof(*pcs) > DBG_MAX_BLOCK)
+		return -E2BIG;
+
+	if (nr) {
+		stop_pcs = malloc(nr * sizeof(*pcs));
+		if (!stop_pcs)
+			return -ENOMEM;
+		memcpy(stop_pcs, pcs, nr * sizeof(*pcs));
+		qsort(stop_pcs, nr, sizeof(*pcs), compare_pcs);
+	}
+
+	free(t->stop_pcs);
+	t->stop_pcs = stop_pcs;
+	t->nr_stop_pcs = nr;
+
+	if (!t->run_until)
+		return 0;
+
+	return target_block(t, CMD_SET_STOP_PCS, 0, stop_pcs,
+			    nr * sizeof(*pcs));
+}
+
+bool dbg_native_breakpoints(struct target *t)
+{
+	return t->native_bkpts;
+}
+
+int dbg_set_breakpoints(struct target *t, const uint32_t *pcs, size_t nr)
+{
+	int rc;
+
+	if (!t->native_bkpts)
+		return -EOPNOTSUPP;
+	if (nr * sizeof(*pcs) > DBG_MAX_BLOCK)
+		return -E2BIG;
+
+	rc = target_block(t, CMD_SET_BREAKPOINTS, 0, (void *)pcs,
+			  nr * sizeof(*pcs));
+	/* RTL targets reject them, patch memory from now on. */
+	if (rc == -EINVAL)
+		t->native_bkpts = false;
+
+	return rc;
+}
+
+static int dbg_sync_watchpoints(struct target *t)
+{
+	struct dbg_watchpoint watchpoints[DBG_MAX_WATCHPOINTS];
+	size_t nr = 0, m;
+
+	for (m = 0; m < DBG_MAX_WATCHPOINTS; ++m)
+		if (t->watchpoints[m].len)
+			watchpoints[nr++] = t->watchpoints[m];
+
+	return target_block(t, CMD_SET_WATCHPOINTS, 0, watchpoints,
+			    nr * sizeof(*watchpoints));
+}
+
+static int dbg_get_watch_addr(struct target *t, uint32_t *addr)
+{
+	queue_write(t, REG_CMD, CMD_GET_WATCH_ADDR);
+	queue_read(t, REG_RDATA, addr);
+
+	return dbg_flush(t);
+}
+
+/* The path is sent NUL terminated and padded to a whole number of words. */
+static int dbg_checkpoint(struct target *t, enum dbg_cmd cmd,
+			  const char *path)
+{
+	size_t len = (strlen(path) + sizeof(uint32_t)) & ~(sizeof(uint32_t) - 1);
+	char *block;
+	int rc;
+
+	if (len > DBG_MAX_BLOCK)
+		return -ENAMETOOLONG;
+
+	block = calloc(1, len);
+	if (!block)
+		return -ENOMEM;
+	strcpy(block, path);
+
+	rc = target_block(t, cmd, 0, block, len);
+	free(block);
 
 	return rc;
 }
@@ -224,59 +699,70 @@ static int dbg_reset(struct target *t)
  */
 static int dbg_reload_pc(struct target *t)
 {
-	int rc = dbg_write(t, REG_ADDRESS, PC);
+	queue_write(t, REG_ADDRESS, PC);
+	queue_write(t, REG_CMD, CMD_READ_REG);
+	queue_read(t, REG_RDATA, &t->pc);
 
+	return dbg_flush(t);
+}
+
+/*
+ * Read every register in one transfer and give them all to the regcache so
+ * that inspecting a stopped target doesn't take a round trip per register.
+ */
+static int dbg_reload_regs(struct target *t)
+{
+	uint32_t snapshot[DBG_SNAPSHOT_REGS];
+	unsigned int m;
+	int rc;
+
+	rc = target_block(t, CMD_READ_ALL_REGS, 0, snapshot,
+			  DBG_SNAPSHOT_SIZE);
 	if (rc)
 		return rc;
-	rc = dbg_write(t, REG_CMD, CMD_READ_REG);
-	if (rc)
-		return rc;
 
-	return dbg_read(t, REG_RDATA, &t->pc);
+	t->pc = snapshot[PC];
+	for (m = 0; m < DBG_SNAPSHOT_REGS; ++m)
+		regcache_fill(t->regcache, dbg_snapshot_regnum(m),
+			      snapshot[m]);
+
+	return 0;
 }
 
-int dbg_read_reg(struct target *t, unsigned reg, uint32_t *val)
+static void queue_read_reg(struct target *t, unsigned reg, uint32_t *val)
 {
-	int rc;
+	queue_write(t, REG_ADDRESS, reg);
+	queue_write(t, REG_CMD, CMD_READ_REG);
+	queue_read(t, REG_RDATA, val);
+}
 
+int dbg_read_reg(struct target *t, unsigned reg, uint32_t *val)
+{
 	if (reg == PC) {
 		*val = t->pc;
 		return 0;
 	}
 
-	rc = dbg_write(t, REG_ADDRESS, reg);
-	if (rc)
-		return rc;
-	rc = dbg_write(t, REG_CMD, CMD_READ_REG);
-	if (rc)
-		return rc;
+	queue_read_reg(t, reg, val);
 
-	return dbg_read(t, REG_RDATA, val);
+	return dbg_flush(t);
 }
 
 int dbg_read_cpuid(struct target *t, unsigned reg, uint32_t *val)
 {
-	int rc;
+	queue_write(t, REG_ADDRESS, reg);
+	queue_write(t, REG_CMD, CMD_CPUID);
+	queue_read(t, REG_RDATA, val);
 
-	rc = dbg_write(t, REG_ADDRESS, reg);
-	if (rc)
-		return rc;
-	rc = dbg_write(t, REG_CMD, CMD_CPUID);
-	if (rc)
-		return rc;
-
-	return dbg_read(t, REG_RDATA, val);
+	return dbg_flush(t);
 }
 
 int dbg_get_exec_status(struct target *t, uint32_t *status)
 {
-	int rc;
+	queue_write(t, REG_CMD, CMD_GET_EXEC_STATUS);
+	queue_read(t, REG_RDATA, status);
 
-	rc = dbg_write(t, REG_CMD, CMD_GET_EXEC_STATUS);
-	if (rc)
-		return rc;
-
-	return dbg_read(t, REG_RDATA, status);
+	return dbg_flush(t);
 }
 
 static void assert_target(lua_State *L)
@@ -287,6 +773,23 @@ static void assert_target(lua_State *L)
 	}
 }
 
+static void queue_read_mem(struct target *t, enum dbg_cmd cmd, uint32_t addr,
+			   uint32_t *val)
+{
+	queue_write(t, REG_ADDRESS, addr);
+	queue_write(t, REG_CMD, cmd);
+	queue_read(t, REG_RDATA, val);
+}
+
+static void queue_write_mem(struct target *t, enum dbg_cmd cmd,
+			    uint32_t addr, uint32_t val)
+{
+	queue_write(t, REG_ADDRESS, addr);
+	queue_write(t, REG_WDATA, val);
+	queue_write(t, REG_CMD, cmd);
+	t->mem_written = 1;
+}
+
 #define MEM_READ_FN(width)							\
 int dbg_read##width(struct target *t, unsigned addr, uint32_t *val)		\
 {										\
@@ -296,14 +799,9 @@ int dbg_read##width(struct target *t, unsigned addr, uint32_t *val)		\
 	if (rc)									\
 		return rc;							\
 										\
-	rc = dbg_write(t, REG_ADDRESS, addr);					\
-	if (rc)									\
-		return rc;							\
-	rc = dbg_write(t, REG_CMD, CMD_RMEM##width);				\
-	if (rc)									\
-		return rc;							\
+	queue_read_mem(t, CMD_RMEM##width, addr, val);				\
 										\
-	return dbg_read(t, REG_RDATA, val);					\
+	return dbg_flush(t);							\
 }										\
 										\
 static int lua_read##width(lua_State *L)					\
@@ -332,22 +830,9 @@ static int lua_read##width(lua_State *L)					\
 #define MEM_WRITE_FN(width)							\
 int dbg_write##width(struct target *t, unsigned addr, uint32_t val)		\
 {										\
-	int rc;									\
-										\
-	rc = dbg_write(t, REG_ADDRESS, addr);					\
-	if (rc)									\
-		return rc;							\
-	rc = dbg_write(t, REG_WDATA, val);					\
-	if (rc)									\
-		return rc;							\
+	queue_write_mem(t, CMD_WMEM##width, addr, val);				\
 										\
-	rc = dbg_write(t, REG_CMD, CMD_WMEM##width);				\
-	if (rc)									\
-		return rc;							\
-										\
-	t->mem_written = 1;							\
-										\
-	return rc;								\
+	return dbg_flush(t);							\
 }										\
 										\
 static int lua_write##width(lua_State *L)					\
@@ -371,31 +856,231 @@ static int lua_write##width(lua_State *L)					\
 	return 0;								\
 }
 
-MEM_READ_FN(32);
-MEM_READ_FN(16);
-MEM_READ_FN(8);
-MEM_WRITE_FN(32);
-MEM_WRITE_FN(16);
-MEM_WRITE_FN(8);
+MEM_READ_FN(32);
+MEM_READ_FN(16);
+MEM_READ_FN(8);
+MEM_WRITE_FN(32);
+MEM_WRITE_FN(16);
+MEM_WRITE_FN(8);
+
+int dbg_read_block(struct target *t, uint32_t addr, void *data, size_t len)
+{
+	uint32_t words[TARGET_WINDOW / 4];
+	uint8_t *p = data;
+	size_t chunk, m;
+	int rc;
+
+	rc = dbg_cache_sync(t);
+
+	while (len && !rc) {
+		if (addr & 3 || len < 4) {
+			/* Unaligned ends a byte at a time. */
+			queue_read_mem(t, CMD_RMEM8, addr, &words[0]);
+			rc = dbg_flush(t);
+			*p = words[0];
+			chunk = 1;
+		} else if (t->blocks) {
+			chunk = len & ~3;
+			if (chunk > DBG_MAX_BLOCK)
+				chunk = DBG_MAX_BLOCK;
+			rc = target_block(t, CMD_RMEM_BLOCK, addr, p, chunk);
+		} else {
+			chunk = len & ~3;
+			if (chunk > sizeof(words))
+				chunk = sizeof(words);
+			for (m = 0; m < chunk / 4; ++m)
+				queue_read_mem(t, CMD_RMEM32, addr + m * 4,
+					       &words[m]);
+			rc = dbg_flush(t);
+			memcpy(p, words, chunk);
+		}
+
+		addr += chunk;
+		p += chunk;
+		len -= chunk;
+	}
+
+	return rc;
+}
+
+int dbg_write_block(struct target *t, uint32_t addr, const void *data,
+		    size_t len)
+{
+	const uint8_t *p = data;
+	size_t chunk;
+	uint32_t v;
+	int rc;
+
+	while (len) {
+		if (addr & 3 || len < 4) {
+			queue_write_mem(t, CMD_WMEM8, addr, *p);
+			chunk = 1;
+		} else if (t->blocks) {
+			chunk = len & ~3;
+			if (chunk > DBG_MAX_BLOCK)
+				chunk = DBG_MAX_BLOCK;
+			t->mem_written = 1;
+			rc = target_block(t, CMD_WMEM_BLOCK, addr, (void *)p,
+					  chunk);
+			if (rc)
+				return rc;
+		} else {
+			memcpy(&v, p, 4);
+			queue_write_mem(t, CMD_WMEM32, addr, v);
+			chunk = 4;
+		}
+
+		addr += chunk;
+		p += chunk;
+		len -= chunk;
+	}
+
+	return dbg_flush(t);
+}
+
+static int lua_read_block(lua_State *L)
+{
+	lua_Integer addr, len;
+	void *buf;
+
+	assert_target(L);
+
+	if (lua_gettop(L) != 2) {
+		lua_pushstring(L, "no address/length provided");
+		lua_error(L);
+	}
+
+	addr = lua_tointeger(L, 1);
+	len = lua_tointeger(L, 2);
+	lua_pop(L, 2);
+
+	buf = malloc(len);
+	if (!buf) {
+		lua_pushstring(L, "failed to allocate buffer");
+		lua_error(L);
+	}
+
+	if (dbg_read_block(target, addr, buf, len)) {
+		warnx("failed to read %u bytes at %u", (unsigned)len,
+		      (unsigned)addr);
+		lua_pushnil(L);
+	} else {
+		lua_pushlstring(L, buf, len);
+	}
+	free(buf);
+
+	return 1;
+}
+
+static int lua_write_block(lua_State *L)
+{
+	lua_Integer addr;
+	const char *data;
+	size_t len;
+
+	assert_target(L);
+
+	if (lua_gettop(L) != 2) {
+		lua_pushstring(L, "no address/data provided");
+		lua_error(L);
+	}
+
+	addr = lua_tointeger(L, 1);
+	data = lua_tolstring(L, 2, &len);
+	if (data && dbg_write_block(target, addr, data, len))
+		warnx("failed to write %zu bytes at %u", len, (unsigned)addr);
+	lua_pop(L, 2);
+
+	return 0;
+}
+
+void dbg_queue_write_reg(struct target *t, unsigned reg, uint32_t val)
+{
+	queue_write(t, REG_ADDRESS, reg);
+	queue_write(t, REG_WDATA, val);
+	queue_write(t, REG_CMD, CMD_WRITE_REG);
+	if (reg == PC)
+		t->pc = val;
+}
+
+int dbg_write_reg(struct target *t, unsigned reg, uint32_t val)
+{
+	uint32_t pc = t->pc;
+	int rc;
+
+	dbg_queue_write_reg(t, reg, val);
+	rc = dbg_flush(t);
+	if (rc)
+		t->pc = pc;
+
+	return rc;
+}
+
+int dbg_write_regs(struct target *t, uint64_t mask, const uint32_t *regs)
+{
+	uint32_t snapshot[DBG_SNAPSHOT_REGS] = {}, snapshot_mask = 0;
+	unsigned int reg, m;
+
+	if (!t->snapshots) {
+		for (reg = 0; reg < NR_REGS; ++reg)
+			if (mask & (1LLU << reg))
+				dbg_queue_write_reg(t, reg, regs[reg]);
+		return dbg_flush(t);
+	}
+
+	for (m = 0; m < DBG_SNAPSHOT_REGS; ++m) {
+		reg = dbg_snapshot_regnum(m);
+		if (!(mask & (1LLU << reg)))
+			continue;
+		snapshot[m] = regs[reg];
+		snapshot_mask |= 1U << m;
+		mask &= ~(1LLU << reg);
+	}
+
+	/* Anything left isn't a register the target has, let it say so. */
+	for (reg = 0; reg < NR_REGS; ++reg)
+		if (mask & (1LLU << reg))
+			dbg_queue_write_reg(t, reg, regs[reg]);
+
+	if (!snapshot_mask)
+		return dbg_flush(t);
+
+	if (snapshot_mask & (1U << PC))
+		t->pc = snapshot[PC];
+
+	return target_block(t, CMD_WRITE_REGS, snapshot_mask, snapshot,
+			    DBG_SNAPSHOT_SIZE);
+}
+
+static bool is_local_transport(const char *hostname)
+{
+	return !strcmp(hostname, "unix") || !strcmp(hostname, "shm");
+}
 
-int dbg_write_reg(struct target *t, unsigned reg, uint32_t val)
+static int open_unix_server(const char *path)
 {
-	int rc;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
 
-	rc = dbg_write(t, REG_ADDRESS, reg);
-	if (rc)
-		return rc;
-	rc = dbg_write(t, REG_WDATA, val);
-	if (rc)
-		return rc;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
 
-	rc = dbg_write(t, REG_CMD, CMD_WRITE_REG);
-	if (!rc && reg == PC)
-		t->pc = val;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -EADDRNOTAVAIL;
+	}
 
-	return rc;
+	return fd;
 }
 
+/*
+ * hostname is "unix" or "shm" for a simulator on this host, with the path of
+ * its Unix domain socket in place of the port.
+ */
 int open_server(const char *hostname, const char *port)
 {
 	struct addrinfo *result, *rp, hints = {
@@ -404,6 +1089,9 @@ int open_server(const char *hostname, const char *port)
 	};
 	int s, fd;
 
+	if (is_local_transport(hostname))
+		return open_unix_server(port);
+
 	s = getaddrinfo(hostname, port, &hints, &result);
 	if (s)
 		return -errno;
@@ -425,24 +1113,99 @@ int open_server(const char *hostname, const char *port)
 	return fd;
 }
 
+/*
+ * Switch a Unix domain socket connection over to the target's shared memory
+ * link, the memfd arrives along with the response.
+ */
+static int shm_connect(struct target *t)
+{
+	struct dbg_request req = {
+		.addr = REG_SHM_LINK,
+		.read_not_write = 1,
+	};
+	struct dbg_response resp;
+	struct iovec iov = { .iov_base = &resp, .iov_len = sizeof(resp) };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf),
+	};
+	struct cmsghdr *c;
+	void *link;
+	int fd = -1;
+
+	if (write(t->fd, &req, sizeof(req)) != sizeof(req) ||
+	    recvmsg(t->fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(resp))
+		return -EIO;
+
+	c = CMSG_FIRSTHDR(&msg);
+	if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(c), sizeof(fd));
+	if (resp.status || resp.data != sizeof(struct shm_link) || fd < 0) {
+		if (fd >= 0)
+			close(fd);
+		return resp.status ? resp.status : -EPROTO;
+	}
+
+	link = mmap(NULL, sizeof(struct shm_link), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	close(fd);
+	if (link == MAP_FAILED)
+		return -errno;
+	t->shm = link;
+
+	return 0;
+}
+
 static struct target *target_alloc(const char *hostname,
 				   const char *port)
 {
 	struct target *t = calloc(1, sizeof(*t));
+	uint32_t version = 0;
 
 	if (!t)
 		err(1, "failed to allocate target");
 
-	t->fd = open_server(hostname, port);
-	if (t->fd < 0) {
-		warn("failed to connect to server");
-		free(t);
-		return NULL;
+	if (!strcmp(hostname, "local")) {
+		t->fd = -1;
+		t->local = local_target_new(port && *port ? port : NULL);
+		if (!t->local) {
+			warn("failed to create local target");
+			free(t);
+			return NULL;
+		}
+	} else {
+		t->fd = open_server(hostname, port);
+		if (t->fd < 0) {
+			warn("failed to connect to server");
+			free(t);
+			return NULL;
+		}
 	}
 
+	/* Version 1 servers fail the read. */
+	t->batching = !dbg_read(t, REG_VERSION, &version) && version >= 2;
+	t->blocks = t->batching && version >= 3;
+	t->snapshots = t->blocks && version >= 4;
+	t->run_until = t->snapshots && version >= 5;
+	t->stop_events = t->run_until && version >= 6;
+	t->native_bkpts = t->stop_events && version >= 7;
+
+	if (!strcmp(hostname, "shm") &&
+	    (version < 8 || shm_connect(t)))
+		warnx("no shared memory link, using the socket");
+
 	t->regcache = regcache_new(t);
 	if (!t->regcache) {
-		close(t->fd);
+		if (t->local)
+			local_target_free(t->local);
+		else
+			close(t->fd);
 		free(t);
 		t = NULL;
 	}
@@ -454,13 +1217,14 @@ static void disable_mmu(struct target *t)
 {
 	uint32_t psr;
 
-	if (dbg_read_reg(t, CR_BASE + 1, &psr))
+	if (regcache_read(t->regcache, CR_BASE + 1, &psr))
 		err(1, "failed to read psr");
 	target->psr = psr;
 	psr &= ~(1 << 7);
 
 	if (dbg_write_reg(t, CR_BASE + 1, psr))
 		err(1, "failed to write psr");
+	regcache_fill(t->regcache, CR_BASE + 1, psr);
 }
 
 static void restore_mmu(struct target *t)
@@ -469,20 +1233,80 @@ static void restore_mmu(struct target *t)
 		err(1, "failed to write psr");
 }
 
+static void drain_sigint_pipe(void)
+{
+	char c;
+
+	while (sigint_pipe[0] >= 0 && read(sigint_pipe[0], &c, 1) == 1)
+		continue;
+}
+
+/*
+ * Block until the target says that it has stopped, stopping it on SIGINT.
+ * The stop ends the wait so both responses are read in order.
+ */
+static int dbg_wait_stopped(struct target *t, uint32_t *exec_status)
+{
+	struct dbg_request req = {
+		.addr = REG_CMD,
+		.value = CMD_WAIT_STOPPED,
+	};
+	bool stopping = false;
+	int rc;
+
+	drain_sigint_pipe();
+	queue_request(t, &req, exec_status);
+	rc = queue_send(t, NULL, 0);
+
+	while (!rc && !stopping) {
+		int ready = target_poll(t, sigint_pipe[0]);
+
+		if (ready < 0)
+			rc = ready;
+		if (ready)
+			break;
+
+		drain_sigint_pipe();
+		queue_write(t, REG_CMD, CMD_STOP);
+		rc = queue_send(t, NULL, 0);
+		stopping = true;
+	}
+
+	if (!rc)
+		rc = dbg_flush(t);
+	/* The wait reports running if it was ended by the stop. */
+	if (stopping)
+		*exec_status &= ~EXEC_STATUS_RUNNING;
+
+	return rc;
+}
+
 static void wait_until_stopped(struct target *t)
 {
-	target->interrupted = false;
 	uint32_t exec_status = 0;
 
-	do {
-		if (dbg_get_exec_status(target, &exec_status))
-			err(1, "failed to get execution status.");
-	} while (!target->interrupted && (exec_status & EXEC_STATUS_RUNNING));
+	target->interrupted = false;
+
+	if (t->stop_events) {
+		if (dbg_wait_stopped(t, &exec_status))
+			err(1, "failed to wait for the target to stop");
+	} else {
+		do {
+			if (dbg_get_exec_status(target, &exec_status))
+				err(1, "failed to get execution status.");
+		} while (!target->interrupted &&
+			 (exec_status & EXEC_STATUS_RUNNING));
+	}
 
-	if (dbg_reload_pc(t))
+	if (t->snapshots) {
+		if (dbg_reload_regs(t))
+			err(1, "failed to read registers");
+	} else if (dbg_reload_pc(t)) {
 		err(1, "failed to read PC");
+	}
 
 	target->breakpoint_hit = exec_status & EXEC_STATUS_STOPPED_ON_BKPT;
+	target->watchpoint_hit = exec_status & EXEC_STATUS_STOPPED_ON_WATCH;
 }
 
 static void do_exec(struct target *target,
@@ -504,6 +1328,16 @@ static void do_exec(struct target *target,
 	bkp = breakpoint_at_addr(target->pc);
 	if (bkp)
 		printf("breakpoint %d hit at %08x\n", bkp->id, bkp->addr);
+
+	if (target->watchpoint_hit) {
+		uint32_t addr;
+
+		if (dbg_get_watch_addr(target, &addr))
+			warnx("failed to read watchpoint address");
+		else
+			printf("watchpoint hit accessing %08x, pc %08x\n",
+			       addr, target->pc);
+	}
 }
 
 static int lua_step(lua_State *L)
@@ -515,6 +1349,45 @@ static int lua_step(lua_State *L)
 	return 0;
 }
 
+/*
+ * Run until the PC reaches a testpoint, or for at most the given number of
+ * cycles.  Returns the number of cycles run.  Targets without run-until are
+ * stepped, checking the PC after each step.
+ */
+static int lua_run_until(lua_State *L)
+{
+	lua_Integer limit = 0;
+	uint32_t cycles = 0;
+
+	assert_target(L);
+
+	if (lua_gettop(L) >= 1)
+		limit = lua_tointeger(L, 1);
+	if (limit < 0 || limit > UINT32_MAX) {
+		lua_pushstring(L, "invalid cycle limit");
+		lua_error(L);
+	}
+	target->run_limit = limit;
+
+	if (target->run_until) {
+		do_exec(target, dbg_run_until);
+		if (dbg_get_run_cycles(target, &cycles))
+			warnx("failed to read run cycles");
+	} else {
+		target->interrupted = false;
+		do {
+			do_exec(target, dbg_step);
+			++cycles;
+		} while (!is_stop_pc(target, target->pc) &&
+			 !target->breakpoint_hit && !target->interrupted &&
+			 cycles != target->run_limit);
+	}
+
+	lua_pushinteger(L, cycles);
+
+	return 1;
+}
+
 static int lua_term(lua_State *L)
 {
 	assert_target(L);
@@ -533,6 +1406,90 @@ static int lua_start_trace(lua_State *L)
 	return 0;
 }
 
+static int lua_dump_trace(lua_State *L)
+{
+	assert_target(L);
+
+	if (dbg_dump_trace(target))
+		warnx("failed to dump trace");
+
+	return 0;
+}
+
+/*
+ * clock() returns a monotonic time in seconds for timing target operations.
+ */
+static double monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int lua_clock(lua_State *L)
+{
+	lua_pushnumber(L, monotonic_seconds());
+
+	return 1;
+}
+
+/*
+ * Register reads waiting for each response in turn against the same reads
+ * streamed through the request queue: the per-request latency of the
+ * target versus the throughput that pipelining gets.
+ */
+static int lua_bench_exchange(lua_State *L)
+{
+	lua_Integer nr_arg = lua_gettop(L) == 1 ? lua_tointeger(L, 1) : 10000;
+	double start, sync, pipelined;
+	unsigned int m, nr;
+	uint32_t *vals;
+	int rc = 0;
+
+	assert_target(L);
+
+	if (nr_arg <= 0 || nr_arg > 1000000) {
+		lua_pushstring(L, "invalid number of requests");
+		lua_error(L);
+	}
+	nr = nr_arg;
+
+	vals = calloc(nr, sizeof(*vals));
+	if (!vals) {
+		lua_pushstring(L, "failed to allocate results");
+		lua_error(L);
+	}
+
+	start = monotonic_seconds();
+	for (m = 0; m < nr && !rc; ++m)
+		rc = dbg_read_reg(target, m % PC, &vals[m]);
+	sync = monotonic_seconds() - start;
+
+	start = monotonic_seconds();
+	for (m = 0; m < nr && !rc; ++m)
+		queue_read_reg(target, m % PC, &vals[m]);
+	if (!rc)
+		rc = dbg_flush(target);
+	pipelined = monotonic_seconds() - start;
+
+	free(vals);
+
+	if (rc) {
+		warnx("failed to read registers");
+		return 0;
+	}
+
+	printf("%u register reads\n", nr);
+	printf("  synchronous: %8.2fus per read, %8.0f reads/s\n",
+	       sync * 1e6 / nr, nr / sync);
+	printf("  pipelined:   %8.2fus per read, %8.0f reads/s\n",
+	       pipelined * 1e6 / nr, nr / pipelined);
+
+	return 0;
+}
+
 static int lua_stop(lua_State *L)
 {
 	assert_target(L);
@@ -564,6 +1521,70 @@ static int lua_reset(lua_State *L)
 	return 0;
 }
 
+/*
+ * The target saves the PSR as the CPU sees it, not with the MMU disabled
+ * for the debugger.
+ */
+static int lua_save_checkpoint(lua_State *L)
+{
+	const char *path;
+	int rc;
+
+	assert_target(L);
+
+	path = lua_tostring(L, 1);
+	if (!path) {
+		lua_pushstring(L, "no checkpoint path");
+		lua_error(L);
+	}
+
+	restore_mmu(target);
+	rc = regcache_sync(target->regcache);
+	if (!rc)
+		rc = dbg_cache_sync(target);
+	if (!rc)
+		rc = dbg_checkpoint(target, CMD_SAVE_CHECKPOINT, path);
+	disable_mmu(target);
+
+	if (rc) {
+		lua_pushstring(L, "failed to save checkpoint");
+		lua_error(L);
+	}
+
+	return 0;
+}
+
+static int lua_restore_checkpoint(lua_State *L)
+{
+	const char *path;
+	int rc;
+
+	assert_target(L);
+
+	path = lua_tostring(L, 1);
+	if (!path) {
+		lua_pushstring(L, "no checkpoint path");
+		lua_error(L);
+	}
+
+	rc = regcache_sync(target->regcache);
+	if (!rc)
+		rc = dbg_checkpoint(target, CMD_RESTORE_CHECKPOINT, path);
+	/* A restore that fails part way through resets the CPU. */
+	(void)regcache_sync(target->regcache);
+	target->mem_written = 0;
+	if (dbg_reload_pc(target))
+		warnx("failed to read PC");
+	disable_mmu(target);
+
+	if (rc) {
+		lua_pushstring(L, "failed to restore checkpoint");
+		lua_error(L);
+	}
+
+	return 0;
+}
+
 static int lua_read_reg(lua_State *L)
 {
 	uint32_t v;
@@ -656,6 +1677,107 @@ static int lua_del_bkp(lua_State *L)
 	return 0;
 }
 
+/*
+ * Stop after the CPU loads or stores within len bytes of addr.  The optional
+ * third argument is "r", "w" or "rw" (the default).  Only targets that check
+ * breakpoints themselves support watchpoints.
+ */
+static int lua_set_watch(lua_State *L)
+{
+	struct dbg_watchpoint *w = NULL;
+	const char *access = "rw";
+	unsigned int m;
+
+	assert_target(L);
+
+	if (lua_gettop(L) < 2) {
+		lua_pushstring(L, "no watchpoint address and length");
+		lua_error(L);
+	}
+	if (lua_gettop(L) >= 3)
+		access = lua_tostring(L, 3);
+
+	if (!target->native_bkpts) {
+		lua_pushstring(L, "target doesn't support watchpoints");
+		lua_error(L);
+	}
+
+	for (m = 0; m < DBG_MAX_WATCHPOINTS; ++m)
+		if (!target->watchpoints[m].len) {
+			w = &target->watchpoints[m];
+			break;
+		}
+	if (!w) {
+		lua_pushstring(L, "no free watchpoints");
+		lua_error(L);
+	}
+
+	w->addr = lua_tointeger(L, 1);
+	w->len = lua_tointeger(L, 2);
+	w->flags = (access && strchr(access, 'r') ? WATCH_READ : 0) |
+		(access && strchr(access, 'w') ? WATCH_WRITE : 0);
+	if (!w->len || !w->flags || dbg_sync_watchpoints(target)) {
+		memset(w, 0, sizeof(*w));
+		lua_pushstring(L, "failed to set watchpoint");
+		lua_error(L);
+	}
+
+	lua_settop(L, 0);
+	lua_pushinteger(L, m);
+
+	return 1;
+}
+
+static int lua_del_watch(lua_State *L)
+{
+	lua_Integer id;
+
+	assert_target(L);
+
+	if (lua_gettop(L) != 1) {
+		lua_pushstring(L, "no watchpoint id");
+		lua_error(L);
+	}
+
+	id = lua_tointeger(L, 1);
+	if (id < 0 || id >= DBG_MAX_WATCHPOINTS ||
+	    !target->watchpoints[id].len) {
+		lua_pushstring(L, "failed to delete watchpoint");
+		lua_error(L);
+	}
+
+	memset(&target->watchpoints[id], 0, sizeof(target->watchpoints[id]));
+	if (dbg_sync_watchpoints(target))
+		warnx("failed to remove watchpoint");
+	lua_pop(L, 1);
+
+	return 0;
+}
+
+/*
+ * The address accessed if the target last stopped on a watchpoint, nil if it
+ * stopped for any other reason.
+ */
+static int lua_watch_hit(lua_State *L)
+{
+	uint32_t addr;
+
+	assert_target(L);
+
+	if (!target->watchpoint_hit) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if (dbg_get_watch_addr(target, &addr)) {
+		lua_pushstring(L, "failed to read watchpoint address");
+		lua_error(L);
+	}
+	lua_pushinteger(L, addr);
+
+	return 1;
+}
+
 static int lua_write_reg(lua_State *L)
 {
 	lua_Integer regnum, val;
@@ -734,8 +1856,9 @@ static void push_testpoint(lua_State *L, const struct testpoint *tp)
 static int lua_loadelf(lua_State *L)
 {
 	const char *path;
-	struct testpoint *testpoints;
-	size_t nr_testpoints;
+	struct testpoint *testpoints = NULL;
+	size_t nr_testpoints = 0;
+	uint32_t *stop_pcs;
 	size_t n;
 
 	assert_target(L);
@@ -758,6 +1881,16 @@ static int lua_loadelf(lua_State *L)
 
 	lua_setglobal(L, "testpoints");
 
+	stop_pcs = calloc(nr_testpoints ? nr_testpoints : 1, sizeof(*stop_pcs));
+	if (!stop_pcs)
+		err(1, "failed to allocate testpoints");
+	for (n = 0; n < nr_testpoints; ++n)
+		stop_pcs[n] = testpoints[n].addr;
+	if (dbg_set_stop_pcs(target, stop_pcs, nr_testpoints))
+		warnx("failed to set testpoints on target");
+	free(stop_pcs);
+	free(testpoints);
+
 	return 0;
 }
 
@@ -765,14 +1898,16 @@ static int lua_connect(lua_State *L)
 {
 	const char *host, *port;
 
-	if (lua_gettop(L) != 2) {
+	host = lua_tostring(L, 1);
+	port = lua_tostring(L, 2);
+
+	/* The local target takes an optional bootrom in place of the port. */
+	if (!host || lua_gettop(L) > 2 ||
+	    (lua_gettop(L) != 2 && strcmp(host, "local"))) {
 		lua_pushstring(L, "host and port required");
 		lua_error(L);
 	}
 
-	host = lua_tostring(L, 1);
-	port = lua_tostring(L, 2);
-
 	target = target_alloc(host, port) ;
 	if (!target) {
 		lua_pushstring(L, "failed to connect to host");
@@ -801,6 +1936,7 @@ static int lua_connect(lua_State *L)
 static const struct luaL_Reg dbg_funcs[] = {
 	{ "step", lua_step },
 	{ "run", lua_run },
+	{ "run_until", lua_run_until },
 	{ "stop", lua_stop },
 	{ "read_reg", lua_read_reg },
 	{ "write_reg", lua_write_reg },
@@ -810,15 +1946,25 @@ static const struct luaL_Reg dbg_funcs[] = {
 	{ "write16", lua_write16 },
 	{ "read8", lua_read8 },
 	{ "write8", lua_write8 },
+	{ "read_block", lua_read_block },
+	{ "write_block", lua_write_block },
 	{ "loadelf", lua_loadelf },
 	{ "loadsyms", lua_loadsyms },
 	{ "connect", lua_connect },
 	{ "term", lua_term },
 	{ "start_trace", lua_start_trace },
+	{ "dump_trace", lua_dump_trace },
 	{ "reset", lua_reset },
+	{ "save_checkpoint", lua_save_checkpoint },
+	{ "restore_checkpoint", lua_restore_checkpoint },
 	{ "read_cpuid", lua_read_cpuid },
 	{ "set_bkp", lua_set_bkp },
 	{ "del_bkp", lua_del_bkp },
+	{ "set_watch", lua_set_watch },
+	{ "del_watch", lua_del_watch },
+	{ "watch_hit", lua_watch_hit },
+	{ "clock", lua_clock },
+	{ "bench_exchange", lua_bench_exchange },
 	{}
 };
 
@@ -838,11 +1984,19 @@ static void load_support(lua_State *L)
 
 static void sigint_handler(int s)
 {
+	int saved_errno = errno;
+	ssize_t rc;
+
 	if (target)
 		target->interrupted = true;
 
-	if (target)
+	/* Targets with stop events are stopped by whoever is waiting. */
+	if (target && !target->stop_events)
 		dbg_stop(target);
+
+	rc = write(sigint_pipe[1], "", 1);
+	(void)rc;
+	errno = saved_errno;
 }
 
 static void run_interactive(lua_State *L)
@@ -855,6 +2009,8 @@ static void run_interactive(lua_State *L)
 	using_history();
 	read_history(history_path);
 
+	if (pipe2(sigint_pipe, O_NONBLOCK | O_CLOEXEC))
+		err(1, "failed to create signal pipe");
 	signal(SIGINT, sigint_handler);
 
 	for (;;) {
@@ -1,6 +1,8 @@
 #ifndef __DEBUGGER_H__
 #define __DEBUGGER_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 enum regs {
@@ -45,12 +47,35 @@ int dbg_run(struct target *t);
 int dbg_step(struct target *t);
 int dbg_read_reg(struct target *t, unsigned reg, uint32_t *val);
 int dbg_write_reg(struct target *t, unsigned reg, uint32_t val);
+/*
+ * Queued operations don't wait for the target, errors are returned by the
+ * next dbg_flush().
+ */
+void dbg_queue_write_reg(struct target *t, unsigned reg, uint32_t val);
+int dbg_flush(struct target *t);
+/* Write every register set in mask, regs is indexed by register number. */
+int dbg_write_regs(struct target *t, uint64_t mask, const uint32_t *regs);
 int dbg_read32(struct target *t, unsigned addr, uint32_t *val);
 int dbg_read16(struct target *t, unsigned addr, uint32_t *val);
 int dbg_read8(struct target *t, unsigned addr, uint32_t *val);
 int dbg_write32(struct target *t, unsigned addr, uint32_t val);
 int dbg_write16(struct target *t, unsigned addr, uint32_t val);
 int dbg_write8(struct target *t, unsigned addr, uint32_t val);
+/*
+ * Block commands where the target supports them, single accesses for any
+ * unaligned ends and older targets.
+ */
+int dbg_read_block(struct target *t, uint32_t addr, void *data, size_t len);
+int dbg_write_block(struct target *t, uint32_t addr, const void *data,
+		    size_t len);
+/* Addresses for run-until to stop at, usually the testpoints. */
+int dbg_set_stop_pcs(struct target *t, const uint32_t *pcs, size_t nr);
+/*
+ * Whether the target checks breakpoints itself, replacing the whole set with
+ * dbg_set_breakpoints().  Cleared if the target rejects the set.
+ */
+bool dbg_native_breakpoints(struct target *t);
+int dbg_set_breakpoints(struct target *t, const uint32_t *pcs, size_t nr);
 int load_elf(struct target *t, const char *path,
 	     struct testpoint **testpoints, size_t *nr_testpoints);
 
@@ -59,5 +84,7 @@ void regcache_free(struct regcache *r);
 int regcache_sync(struct regcache *r);
 int regcache_read(struct regcache *r, enum regs reg, uint32_t *val);
 int regcache_write(struct regcache *r, enum regs reg, uint32_t val);
+/* Cache a value read from the target, replacing any clean copy. */
+void regcache_fill(struct regcache *r, enum regs reg, uint32_t val);
 
 #endif /* __DEBUGGER_H__ */
@@ -0,0 +1,268 @@
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "local.h"
+
+#ifdef HAVE_LOCAL_TARGET
+
+#include "../sim/cpu.h"
+#include "../sim/debug_ctrl.h"
+
+/* Cycles to run between checks for an interrupt while waiting. */
+#define LOCAL_RUN_QUANTUM	16384
+
+struct local_target {
+	struct cpu *cpu;
+	struct debug_ctrl *ctrl;
+	uint32_t wdata;
+
+	/* A block write waiting for its payload, REG_WDATA bytes of it. */
+	struct dbg_request block_req;
+	bool block_receiving;
+	uint32_t block_len;
+	uint32_t block_pos;
+	uint32_t block_data[DBG_MAX_BLOCK / sizeof(uint32_t)];
+
+	/* Responses and their payloads not yet read. */
+	unsigned char *rx_buf;
+	size_t rx_size;
+	size_t rx_pos;
+	size_t rx_len;
+};
+
+struct local_target *local_target_new(const char *bootrom)
+{
+	struct local_target *l = calloc(1, sizeof(*l));
+
+	if (!l)
+		return NULL;
+
+	l->cpu = new_cpu(NULL, CPU_NOTRACE, bootrom, NULL);
+	l->ctrl = debug_ctrl_new(l->cpu);
+	if (!l->ctrl) {
+		free(l);
+		return NULL;
+	}
+
+	return l;
+}
+
+void local_target_free(struct local_target *l)
+{
+	debug_ctrl_free(l->ctrl);
+	free(l->rx_buf);
+	free(l);
+}
+
+static void queue_bytes(struct local_target *l, const void *data, size_t len)
+{
+	if (l->rx_pos == l->rx_len)
+		l->rx_pos = l->rx_len = 0;
+
+	if (l->rx_len + len > l->rx_size) {
+		l->rx_size = (l->rx_len + len) * 2;
+		l->rx_buf = realloc(l->rx_buf, l->rx_size);
+		if (!l->rx_buf)
+			err(1, "failed to allocate response buffer");
+	}
+
+	memcpy(l->rx_buf + l->rx_len, data, len);
+	l->rx_len += len;
+}
+
+static void queue_response(struct local_target *l,
+			   const struct dbg_response *resp)
+{
+	queue_bytes(l, resp, sizeof(*resp));
+}
+
+static void ctrl_request(struct local_target *l, const struct dbg_request *req)
+{
+	struct dbg_response resp;
+	uint32_t payload_len;
+
+	if (!debug_ctrl_request(l->ctrl, req, l->block_data, &resp,
+				&payload_len))
+		return;
+
+	queue_response(l, &resp);
+	queue_bytes(l, l->block_data, payload_len);
+}
+
+/* Registers that the debug server would answer itself. */
+static void server_request(struct local_target *l,
+			   const struct dbg_request *req)
+{
+	struct dbg_response resp = { .status = -EINVAL };
+
+	/* Batches make no difference here. */
+	if (req->addr == REG_BATCH && !req->read_not_write)
+		return;
+
+	if (req->addr == REG_VERSION && req->read_not_write) {
+		resp.status = 0;
+		resp.data = DBG_PROTOCOL_VERSION;
+	}
+
+	queue_response(l, &resp);
+}
+
+static bool is_block_write(const struct dbg_request *req)
+{
+	if (req->addr != REG_CMD || req->read_not_write)
+		return false;
+
+	return req->value == CMD_WMEM_BLOCK ||
+		req->value == CMD_WRITE_REGS ||
+		req->value == CMD_SET_STOP_PCS ||
+		req->value == CMD_SET_BREAKPOINTS ||
+		req->value == CMD_SET_WATCHPOINTS ||
+		req->value == CMD_SAVE_CHECKPOINT ||
+		req->value == CMD_RESTORE_CHECKPOINT;
+}
+
+static void end_block(struct local_target *l)
+{
+	struct dbg_response resp = { .status = -EINVAL };
+
+	l->block_receiving = false;
+	/* Oversized payloads are still consumed, but thrown away. */
+	if (l->block_len > sizeof(l->block_data))
+		queue_response(l, &resp);
+	else
+		ctrl_request(l, &l->block_req);
+}
+
+static void handle_request(struct local_target *l,
+			   const struct dbg_request *req)
+{
+	struct dbg_response resp;
+
+	if (debug_ctrl_terminated(l->ctrl))
+		return;
+
+	/* Anything else from the debugger ends a wait. */
+	if (debug_ctrl_stop_response(l->ctrl, true, &resp))
+		queue_response(l, &resp);
+
+	if (req->addr >= REG_VERSION) {
+		server_request(l, req);
+		return;
+	}
+
+	if (!req->read_not_write && req->addr == REG_WDATA)
+		l->wdata = req->value;
+
+	if (!is_block_write(req)) {
+		ctrl_request(l, req);
+		return;
+	}
+
+	l->block_req = *req;
+	l->block_len = l->wdata;
+	l->block_pos = 0;
+	l->block_receiving = true;
+	if (!l->block_len)
+		end_block(l);
+}
+
+static void receive_payload(struct local_target *l, const void *payload,
+			    size_t len)
+{
+	while (len && l->block_receiving) {
+		size_t n = l->block_len - l->block_pos;
+
+		if (n > len)
+			n = len;
+		if (l->block_len <= sizeof(l->block_data))
+			memcpy((unsigned char *)l->block_data + l->block_pos,
+			       payload, n);
+		l->block_pos += n;
+		payload = (const unsigned char *)payload + n;
+		len -= n;
+
+		if (l->block_pos == l->block_len)
+			end_block(l);
+	}
+}
+
+void local_target_send(struct local_target *l, const struct dbg_request *reqs,
+		       unsigned int nr, const void *payload, size_t len)
+{
+	unsigned int m;
+
+	for (m = 0; m < nr; ++m)
+		handle_request(l, &reqs[m]);
+
+	receive_payload(l, payload, len);
+}
+
+size_t local_target_readable(const struct local_target *l)
+{
+	return l->rx_len - l->rx_pos;
+}
+
+size_t local_target_read(struct local_target *l, void *buf, size_t len)
+{
+	size_t n = local_target_readable(l);
+
+	if (n > len)
+		n = len;
+	memcpy(buf, l->rx_buf + l->rx_pos, n);
+	l->rx_pos += n;
+
+	return n;
+}
+
+bool local_target_run(struct local_target *l)
+{
+	struct dbg_response resp;
+
+	if (!debug_ctrl_running(l->ctrl) || debug_ctrl_terminated(l->ctrl))
+		return false;
+
+	debug_ctrl_run(l->ctrl, LOCAL_RUN_QUANTUM);
+	if (debug_ctrl_stop_response(l->ctrl, false, &resp))
+		queue_response(l, &resp);
+
+	return true;
+}
+
+#else /* !HAVE_LOCAL_TARGET */
+
+struct local_target *local_target_new(const char *bootrom)
+{
+	errno = ENOSYS;
+
+	return NULL;
+}
+
+void local_target_free(struct local_target *l)
+{
+}
+
+void local_target_send(struct local_target *l, const struct dbg_request *reqs,
+		       unsigned int nr, const void *payload, size_t len)
+{
+}
+
+size_t local_target_readable(const struct local_target *l)
+{
+	return 0;
+}
+
+size_t local_target_read(struct local_target *l, void *buf, size_t len)
+{
+	return 0;
+}
+
+bool local_target_run(struct local_target *l)
+{
+	return false;
+}
+
+#endif /* HAVE_LOCAL_TARGET */
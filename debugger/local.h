@@ -0,0 +1,35 @@
+#ifndef __LOCAL_H__
+#define __LOCAL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * The simulator linked into the debugger as the "local" target.  Requests
+ * go straight to the simulator's debug controller as they are sent and the
+ * responses are queued to be read back in order, the CPU only runs while
+ * the debugger waits for a response.
+ */
+struct local_target;
+
+/*
+ * bootrom may be NULL for the installed one.  Returns NULL with errno set
+ * to ENOSYS if the debugger was built without the simulator.
+ */
+struct local_target *local_target_new(const char *bootrom);
+void local_target_free(struct local_target *l);
+/* Handle nr requests, payload following the last as it would on a socket. */
+void local_target_send(struct local_target *l, const struct dbg_request *reqs,
+		       unsigned int nr, const void *payload, size_t len);
+size_t local_target_readable(const struct local_target *l);
+/* Copies out up to len bytes of responses, returns the number copied. */
+size_t local_target_read(struct local_target *l, void *buf, size_t len);
+/*
+ * Run the CPU for a while.  Returns false if it was already stopped, when
+ * nothing more will arrive without another request.
+ */
+bool local_target_run(struct local_target *l);
+
+#endif /* __LOCAL_H__ */
@@ -9,9 +9,13 @@ write_reg = target.write_reg
 write32 = target.write32
 write16 = target.write16
 write8 = target.write8
+write_block = target.write_block
+bench_exchange = target.bench_exchange
 loadelf = target.loadelf
 connect = target.connect
 reset = target.reset
+save_checkpoint = target.save_checkpoint
+restore_checkpoint = target.restore_checkpoint
 
 function read_reg(reg)
 	print(string.format("%08x", target.read_reg(reg)))
@@ -101,11 +105,15 @@ end
 
 function dump_mem(start, len)
 	count = 0
+	data = target.read_block(start, len)
+	if data == nil then
+		return
+	end
 
 	while count < len do
 		row = {}
 		for col = 1, math.min(len - count, 16) do
-			row[col] = target.read8(start + count + col - 1)
+			row[col] = string.byte(data, count + col)
 		end
 
 		for i, v in ipairs(row) do
@@ -19,7 +19,21 @@ enum dbg_cmd {
 	CMD_CACHE_SYNC,
 	CMD_CPUID,
 	CMD_GET_EXEC_STATUS,
+	CMD_RMEM_BLOCK,
+	CMD_WMEM_BLOCK,
+	CMD_READ_ALL_REGS,
+	CMD_WRITE_REGS,
+	CMD_SET_STOP_PCS,
+	CMD_RUN_UNTIL,
+	CMD_GET_RUN_CYCLES,
+	CMD_WAIT_STOPPED,
+	CMD_SET_BREAKPOINTS,
+	CMD_SET_WATCHPOINTS,
+	CMD_GET_WATCH_ADDR,
+	CMD_SAVE_CHECKPOINT,
+	CMD_RESTORE_CHECKPOINT,
 
+	CMD_DUMP_TRACE = -3,
 	CMD_START_TRACE = -2,
 	CMD_SIM_TERM = -1,
 };
@@ -29,8 +43,111 @@ enum dbg_reg {
 	REG_ADDRESS,	/* Address register. */
 	REG_WDATA,	/* Write data (write-only). */
 	REG_RDATA,	/* Read data (read-only). */
+
+	/*
+	 * Handled by the server rather than the debug controller, version 1
+	 * servers reject these with -EINVAL.
+	 */
+	REG_VERSION	= 0x100, /* Read returns DBG_PROTOCOL_VERSION. */
+	REG_BATCH	= 0x101, /* Write N: the next N requests are a batch. */
+	REG_SHM_LINK	= 0x102, /* Read switches to a shared memory link. */
 };
 
+/*
+ * Version 2 adds batches: a write of N to REG_BATCH, which has no response
+ * of its own, followed by N requests.  The requests are performed in order
+ * and their N responses sent together once the last has completed, so a
+ * batch costs a single round trip.
+ */
+#define DBG_PROTOCOL_VERSION	9
+#define DBG_MAX_BATCH		256
+
+/*
+ * Version 3 adds block transfers between the socket and word aligned memory
+ * at REG_ADDRESS, with the length in bytes, a multiple of 4, in REG_WDATA.
+ * The payload of CMD_WMEM_BLOCK follows the command write, that of
+ * CMD_RMEM_BLOCK follows its response, whose data is the number of payload
+ * bytes: zero if the block was rejected.  Payloads hold the words in the
+ * same byte order as the rest of the protocol.  REG_ADDRESS and REG_WDATA
+ * are undefined after a block.
+ */
+#define DBG_MAX_BLOCK		65536
+
+/*
+ * Version 4 adds register snapshots, transferred like blocks with
+ * DBG_SNAPSHOT_SIZE in REG_WDATA.  A snapshot is r0-r15, pc then the
+ * control registers.  CMD_READ_ALL_REGS reads all of them and
+ * CMD_WRITE_REGS writes those whose snapshot index is set in the REG_ADDRESS
+ * mask.
+ */
+#define DBG_NR_CONTROL_REGS	7
+#define DBG_SNAPSHOT_REGS	(17 + DBG_NR_CONTROL_REGS)
+#define DBG_SNAPSHOT_SIZE	(DBG_SNAPSHOT_REGS * sizeof(uint32_t))
+
+/* Control registers are numbered from 32 in register commands. */
+static inline unsigned int dbg_snapshot_regnum(unsigned int index)
+{
+	return index < 17 ? index : 32 + index - 17;
+}
+
+/*
+ * Version 5 adds running to a set of addresses.  CMD_SET_STOP_PCS replaces
+ * the set with a block of addresses, which may be empty.  CMD_RUN_UNTIL
+ * then steps the CPU until the PC is in the set, a breakpoint is hit or
+ * REG_WDATA cycles have run, zero meaning no limit.  The target reports
+ * running until then, CMD_GET_RUN_CYCLES gives the number of cycles run in
+ * REG_RDATA.
+ */
+
+/*
+ * Version 6 adds CMD_WAIT_STOPPED, whose response is held back until the CPU
+ * stops so that debuggers needn't poll CMD_GET_EXEC_STATUS.  The response
+ * data is the execution status.  Sending any other request ends the wait
+ * early, with the status at that point, before the request is handled.
+ */
+
+/*
+ * Version 7 adds breakpoints and watchpoints checked by the target instead of
+ * patched into memory.  CMD_SET_BREAKPOINTS replaces the breakpoint set with a
+ * block of addresses: the CPU stops with the PC at one of them before running
+ * the instruction there, other than the first instruction after resuming.
+ * CMD_SET_WATCHPOINTS replaces the watchpoints with a block of struct
+ * dbg_watchpoint: the CPU stops after a load or store that touches a range,
+ * reporting EXEC_STATUS_STOPPED_ON_WATCH with EXEC_STATUS_STOPPED_ON_BKPT,
+ * and CMD_GET_WATCH_ADDR then gives the address accessed in REG_RDATA.
+ * Targets that can't check them, such as the RTL simulations, fail all three
+ * with -EINVAL and debuggers fall back to patching in bkp instructions.
+ */
+#define DBG_MAX_WATCHPOINTS	16
+
+enum dbg_watch_flags {
+	WATCH_READ	= (1 << 0),
+	WATCH_WRITE	= (1 << 1),
+};
+
+struct dbg_watchpoint {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t flags;
+};
+
+/*
+ * Version 8 adds shared memory links for clients on a Unix domain socket.
+ * Reading REG_SHM_LINK, outside of a batch, returns the size of a struct
+ * shm_link with the memfd holding it passed in SCM_RIGHTS alongside the
+ * response.  Everything after that response goes through the link's rings
+ * rather than the socket, which only stays open to notice either side going
+ * away.  Other clients have the read fail with -EINVAL.
+ */
+
+/*
+ * Version 9 adds checkpoints of the whole simulated machine.
+ * CMD_SAVE_CHECKPOINT and CMD_RESTORE_CHECKPOINT take a block holding the
+ * path of the checkpoint file on the target's host, NUL terminated and
+ * padded to a multiple of 4 bytes.  Only the C simulator supports them,
+ * other targets fail them with -EINVAL.
+ */
+
 struct dbg_request {
 	uint32_t addr;
 	uint32_t value;
@@ -45,6 +162,7 @@ struct dbg_response {
 enum exec_status {
 	EXEC_STATUS_RUNNING		= (1 << 0),
 	EXEC_STATUS_STOPPED_ON_BKPT	= (1 << 1),
+	EXEC_STATUS_STOPPED_ON_WATCH	= (1 << 2),
 };
 
 #endif /* __PROTOCOL_H__ */
@@ -29,16 +29,7 @@ void regcache_free(struct regcache *r)
 
 int regcache_sync(struct regcache *r)
 {
-	int rc = 0;
-	unsigned reg = 0;
-
-	for (reg = 0; reg < NR_REGS; ++reg) {
-		if (r->dirty_mask & (1LLU << reg)) {
-			rc = dbg_write_reg(r->target, reg, r->regs[reg]);
-			if (rc)
-				break;
-		}
-	}
+	int rc = dbg_write_regs(r->target, r->dirty_mask, r->regs);
 
 	r->dirty_mask = r->valid_mask = 0;
 
@@ -67,6 +58,15 @@ int regcache_read(struct regcache *r, enum regs reg, uint32_t *val)
 	return rc;
 }
 
+void regcache_fill(struct regcache *r, enum regs reg, uint32_t val)
+{
+	if (reg >= NR_REGS || reg < 0 || (r->dirty_mask & (1LLU << reg)))
+		return;
+
+	r->regs[reg] = val;
+	r->valid_mask |= (1LLU << reg);
+}
+
 int regcache_write(struct regcache *r, enum regs reg, uint32_t val)
 {
 	int rc = 0;
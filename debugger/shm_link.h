@@ -0,0 +1,156 @@
+#ifndef __SHM_LINK_H__
+#define __SHM_LINK_H__
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+ * A shared memory link between the debugger and a simulator on the same
+ * host: a pair of single producer, single consumer byte rings carrying
+ * exactly the stream that would otherwise go over the socket.  Each side
+ * spins for a little while on an empty or full ring before sleeping on the
+ * futex of the index that it is waiting for, and only then does the other
+ * side need to make a system call to wake it.  Spinning only holds up the
+ * other side on a single CPU so they go straight to sleep there.
+ */
+#define SHM_RING_SIZE		(256 * 1024)
+#define SHM_SPIN_LOOPS		4096
+
+struct shm_ring {
+	/* Free running byte counts, head is written by the producer. */
+	uint32_t head;
+	uint32_t tail;
+	/* Set while the consumer sleeps on head or the producer on tail. */
+	uint32_t head_waiters;
+	uint32_t tail_waiters;
+	/* Set by the simulator when the connection goes away. */
+	uint32_t closed;
+	unsigned char data[SHM_RING_SIZE];
+};
+
+struct shm_link {
+	struct shm_ring to_target;
+	struct shm_ring to_host;
+};
+
+static inline unsigned int shm_spin_loops(void)
+{
+	static long nr_cpus;
+
+	if (!nr_cpus)
+		nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return nr_cpus > 1 ? SHM_SPIN_LOOPS : 0;
+}
+
+static inline void shm_futex_wake(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline size_t shm_ring_readable(struct shm_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+}
+
+static inline size_t shm_ring_writable(struct shm_ring *r)
+{
+	return SHM_RING_SIZE -
+		(r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static inline bool shm_ring_closed(struct shm_ring *r)
+{
+	return __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+}
+
+/* Publish a new index, waking the other side if it went to sleep. */
+static inline void shm_ring_publish(uint32_t *index, uint32_t val,
+				    uint32_t *waiters)
+{
+	__atomic_store_n(index, val, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+		shm_futex_wake(index);
+}
+
+/* Copy out up to len bytes without blocking, returns the number copied. */
+static inline size_t shm_ring_read(struct shm_ring *r, void *buf, size_t len)
+{
+	size_t n = shm_ring_readable(r), off = r->tail % SHM_RING_SIZE, first;
+
+	if (n > len)
+		n = len;
+	first = n < SHM_RING_SIZE - off ? n : SHM_RING_SIZE - off;
+	memcpy(buf, r->data + off, first);
+	memcpy((unsigned char *)buf + first, r->data, n - first);
+	if (n)
+		shm_ring_publish(&r->tail, r->tail + n, &r->tail_waiters);
+
+	return n;
+}
+
+/* Copy in up to len bytes without blocking, returns the number copied. */
+static inline size_t shm_ring_write(struct shm_ring *r, const void *buf,
+				    size_t len)
+{
+	size_t n = shm_ring_writable(r), off = r->head % SHM_RING_SIZE, first;
+
+	if (n > len)
+		n = len;
+	first = n < SHM_RING_SIZE - off ? n : SHM_RING_SIZE - off;
+	memcpy(r->data + off, buf, first);
+	memcpy(r->data, (const unsigned char *)buf + first, n - first);
+	if (n)
+		shm_ring_publish(&r->head, r->head + n, &r->head_waiters);
+
+	return n;
+}
+
+/*
+ * Wait for *index to move on from val, giving up after timeout_ms.  Returns
+ * 0 if it moved or -ETIMEDOUT, signals and spurious wakeups return early so
+ * callers recheck their condition in a loop.
+ */
+static inline int shm_ring_wait(uint32_t *index, uint32_t val,
+				uint32_t *waiters, int timeout_ms)
+{
+	struct timespec ts;
+	unsigned int i, nr_spins = shm_spin_loops();
+	int rc = 0;
+
+	for (i = 0; i < nr_spins; ++i)
+		if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != val)
+			return 0;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	__atomic_store_n(waiters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(index, __ATOMIC_SEQ_CST) == val &&
+	    syscall(SYS_futex, index, FUTEX_WAIT, val, &ts, NULL, 0) &&
+	    errno == ETIMEDOUT)
+		rc = -ETIMEDOUT;
+	__atomic_store_n(waiters, 0, __ATOMIC_SEQ_CST);
+
+	return rc;
+}
+
+static inline int shm_ring_wait_readable(struct shm_ring *r, int timeout_ms)
+{
+	return shm_ring_wait(&r->head, r->tail, &r->head_waiters, timeout_ms);
+}
+
+static inline int shm_ring_wait_writable(struct shm_ring *r, int timeout_ms)
+{
+	return shm_ring_wait(&r->tail, r->head - SHM_RING_SIZE,
+			     &r->tail_waiters, timeout_ms);
+}
+
+#endif /* __SHM_LINK_H__ */
@@ -0,0 +1,681 @@
+/*
+ * GDB remote serial protocol stub.
+ *
+ * Each packet becomes a short sequence of debug requests appended to the
+ * server's receive buffer, so the simulator services them natively and the
+ * RTL stubs get blocks, snapshots and waits expanded by the server exactly
+ * as for oldland-debug.  Only one packet is in flight at a time: the next
+ * isn't parsed until every response to the current one has been collected.
+ *
+ * Registers are transferred as a snapshot, r0-r15, pc then the control
+ * registers, and memory and registers are in target (little endian) order.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "../debugger/protocol.h"
+#include "gdbstub.h"
+#include "jtag.h"
+
+/* bkp: class 3, opcode 0. */
+#define BKP_INSN		0xc0000000U
+#define PC_REGNUM		16
+
+static const char hex_chars[] = "0123456789abcdef";
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+static const char *parse_hex(const char *p, uint32_t *val)
+{
+	int v;
+
+	for (*val = 0; (v = hex_digit(*p)) >= 0; ++p)
+		*val = (*val << 4) | v;
+
+	return p;
+}
+
+/* Returns the number of bytes decoded, stopping at the first non-hex pair. */
+static size_t hex_decode(unsigned char *out, const char *in, size_t max)
+{
+	size_t n;
+
+	for (n = 0; n < max; ++n, in += 2) {
+		int hi = hex_digit(in[0]), lo = hi < 0 ? -1 : hex_digit(in[1]);
+
+		if (lo < 0)
+			break;
+		out[n] = hi << 4 | lo;
+	}
+
+	return n;
+}
+
+static void hex_encode(char *out, const unsigned char *in, size_t len)
+{
+	while (len--) {
+		*out++ = hex_chars[*in >> 4];
+		*out++ = hex_chars[*in++ & 0xf];
+	}
+	*out = '\0';
+}
+
+static void send_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+		ssize_t bs = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (bs < 0 && errno == EAGAIN) {
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (bs <= 0)
+			return;
+
+		buf += bs;
+		len -= bs;
+	}
+}
+
+static void reply(struct jtag_debug_data *d, const char *payload)
+{
+	char frame[2 * GDB_PACKET_SIZE + 8];
+	unsigned char csum = 0;
+	size_t len = strlen(payload), m;
+
+	for (m = 0; m < len; ++m)
+		csum += payload[m];
+
+	frame[0] = '$';
+	memcpy(frame + 1, payload, len);
+	snprintf(frame + 1 + len, 4, "#%02x", csum);
+	send_all(d->client_fd, frame, len + 4);
+}
+
+static void reply_status(struct jtag_debug_data *d)
+{
+	reply(d, d->gdb->status ? "E01" : "OK");
+}
+
+static void emit(struct jtag_debug_data *d, uint32_t addr, uint32_t value,
+		 bool read)
+{
+	struct dbg_request req = {
+		.addr = addr,
+		.value = value,
+		.read_not_write = read,
+	};
+
+	memcpy(d->rx_buf + d->rx_len, &req, sizeof(req));
+	d->rx_len += sizeof(req);
+	++d->gdb->nr_responses;
+}
+
+static void emit_write(struct jtag_debug_data *d, uint32_t addr,
+		       uint32_t value)
+{
+	emit(d, addr, value, false);
+}
+
+static void emit_cmd(struct jtag_debug_data *d, enum dbg_cmd cmd)
+{
+	emit_write(d, REG_CMD, cmd);
+}
+
+static void emit_payload(struct jtag_debug_data *d, const void *data,
+			 size_t len)
+{
+	memcpy(d->rx_buf + d->rx_len, data, len);
+	d->rx_len += len;
+}
+
+static void emit_read_regs(struct jtag_debug_data *d)
+{
+	emit_write(d, REG_WDATA, DBG_SNAPSHOT_SIZE);
+	emit_cmd(d, CMD_READ_ALL_REGS);
+}
+
+static void emit_write_regs(struct jtag_debug_data *d, uint32_t mask,
+			    const void *regs)
+{
+	emit_write(d, REG_ADDRESS, mask);
+	emit_write(d, REG_WDATA, DBG_SNAPSHOT_SIZE);
+	emit_cmd(d, CMD_WRITE_REGS);
+	emit_payload(d, regs, DBG_SNAPSHOT_SIZE);
+}
+
+static void emit_write32(struct jtag_debug_data *d, uint32_t addr,
+			 uint32_t val)
+{
+	emit_write(d, REG_ADDRESS, addr);
+	emit_write(d, REG_WDATA, val);
+	emit_cmd(d, CMD_WMEM32);
+	emit_cmd(d, CMD_CACHE_SYNC);
+}
+
+/* Unaligned ends are written a byte at a time around an aligned block. */
+static void emit_mem_write(struct jtag_debug_data *d, uint32_t addr,
+			   const unsigned char *p, size_t len)
+{
+	size_t words;
+
+	for (; len && ((addr & 3) || len < 4); ++addr, ++p, --len) {
+		emit_write(d, REG_ADDRESS, addr);
+		emit_write(d, REG_WDATA, *p);
+		emit_cmd(d, CMD_WMEM8);
+	}
+
+	words = len & ~(size_t)3;
+	if (words) {
+		emit_write(d, REG_ADDRESS, addr);
+		emit_write(d, REG_WDATA, words);
+		emit_cmd(d, CMD_WMEM_BLOCK);
+		emit_payload(d, p, words);
+		addr += words;
+		p += words;
+		len -= words;
+	}
+
+	for (; len; ++addr, ++p, --len) {
+		emit_write(d, REG_ADDRESS, addr);
+		emit_write(d, REG_WDATA, *p);
+		emit_cmd(d, CMD_WMEM8);
+	}
+
+	emit_cmd(d, CMD_CACHE_SYNC);
+}
+
+static int find_breakpoint(const struct gdb_stub *g, uint32_t addr)
+{
+	unsigned int m;
+
+	for (m = 0; m < g->nr_bkps; ++m)
+		if (g->bkps[m].addr == addr)
+			return m;
+
+	return -1;
+}
+
+/* X payloads escape '#', '$', '}' and '*' as '}' then the byte ^ 0x20. */
+static size_t unescape(unsigned char *out, const char *in, size_t len,
+		       size_t max)
+{
+	size_t n = 0;
+
+	while (len && n < max) {
+		if (*in == '}' && len > 1) {
+			out[n++] = in[1] ^ 0x20;
+			in += 2;
+			len -= 2;
+		} else {
+			out[n++] = *in++;
+			--len;
+		}
+	}
+
+	return n;
+}
+
+static void handle_mem(struct jtag_debug_data *d, const char *pkt,
+		       size_t pkt_len)
+{
+	struct gdb_stub *g = d->gdb;
+	uint32_t addr, len, start;
+	const char *p = parse_hex(pkt + 1, &addr);
+
+	if (*p != ',') {
+		reply(d, "E00");
+		return;
+	}
+	p = parse_hex(p + 1, &len);
+
+	if (pkt[0] == 'm') {
+		if (len > GDB_PACKET_SIZE / 2)
+			len = GDB_PACKET_SIZE / 2;
+		if (!len) {
+			reply(d, "");
+			return;
+		}
+		start = addr & ~3U;
+		g->addr = addr - start;
+		g->len = len;
+		emit_write(d, REG_ADDRESS, start);
+		emit_write(d, REG_WDATA, (addr + len + 3 - start) & ~3U);
+		emit_cmd(d, CMD_RMEM_BLOCK);
+		return;
+	}
+
+	if (*p != ':' || len > sizeof(g->buf)) {
+		reply(d, "E00");
+		return;
+	}
+	++p;
+	if (pkt[0] == 'X')
+		g->buf_len = unescape(g->buf, p, pkt_len - (p - pkt), len);
+	else
+		g->buf_len = hex_decode(g->buf, p, len);
+	if (g->buf_len != len) {
+		reply(d, "E00");
+		return;
+	}
+
+	/* gdb probes for X support with an empty write. */
+	if (!len) {
+		reply(d, "OK");
+		return;
+	}
+
+	emit_mem_write(d, addr, g->buf, len);
+}
+
+static void handle_breakpoint(struct jtag_debug_data *d, const char *pkt)
+{
+	struct gdb_stub *g = d->gdb;
+	uint32_t addr;
+	int bkp;
+
+	/* Only software breakpoints, gdb falls back for the rest. */
+	if (pkt[1] != '0' || pkt[2] != ',') {
+		reply(d, "");
+		return;
+	}
+	parse_hex(pkt + 3, &addr);
+	bkp = find_breakpoint(g, addr);
+
+	if (pkt[0] == 'z') {
+		if (bkp < 0) {
+			reply(d, "OK");
+			return;
+		}
+		g->addr = bkp;
+		emit_write32(d, addr, g->bkps[bkp].orig);
+		return;
+	}
+
+	if (bkp >= 0) {
+		reply(d, "OK");
+		return;
+	}
+	if ((addr & 3) || g->nr_bkps == GDB_MAX_BREAKPOINTS) {
+		reply(d, "E01");
+		return;
+	}
+
+	/* Read the original instruction, then replace it once it's saved. */
+	g->addr = addr;
+	emit_write(d, REG_ADDRESS, addr);
+	emit_cmd(d, CMD_RMEM32);
+	emit(d, REG_RDATA, 0, true);
+}
+
+static void handle_resume(struct jtag_debug_data *d, char action,
+			  const char *args)
+{
+	struct gdb_stub *g = d->gdb;
+	uint32_t addr;
+
+	/* c and s take an optional address to resume from. */
+	if (*args && *args != ';' && *parse_hex(args, &addr) == '\0') {
+		emit_write(d, REG_ADDRESS, PC_REGNUM);
+		emit_write(d, REG_WDATA, addr);
+		emit_cmd(d, CMD_WRITE_REG);
+	}
+
+	g->op = action;
+	if (action == 's') {
+		emit_cmd(d, CMD_STEP);
+	} else {
+		g->interrupted = false;
+		emit_cmd(d, CMD_RUN);
+		emit_cmd(d, CMD_WAIT_STOPPED);
+	}
+}
+
+static void handle_vcont(struct jtag_debug_data *d, const char *pkt)
+{
+	/* There's only one thread so the first action applies to it. */
+	if (!strcmp(pkt, "vCont?")) {
+		reply(d, "vCont;c;C;s;S");
+	} else if (pkt[5] == ';' && (pkt[6] == 'c' || pkt[6] == 'C')) {
+		handle_resume(d, 'c', "");
+	} else if (pkt[5] == ';' && (pkt[6] == 's' || pkt[6] == 'S')) {
+		handle_resume(d, 's', "");
+	} else {
+		reply(d, "");
+	}
+}
+
+static void handle_query(struct jtag_debug_data *d, const char *pkt)
+{
+	if (!strncmp(pkt, "qSupported", 10))
+		reply(d, "PacketSize=1000;QStartNoAckMode+");
+	else if (!strcmp(pkt, "qAttached"))
+		reply(d, "1");
+	else if (!strcmp(pkt, "qC"))
+		reply(d, "QC1");
+	else if (!strcmp(pkt, "qfThreadInfo"))
+		reply(d, "m1");
+	else if (!strcmp(pkt, "qsThreadInfo"))
+		reply(d, "l");
+	else
+		reply(d, "");
+}
+
+static void handle_packet(struct jtag_debug_data *d, char *pkt, size_t len)
+{
+	struct gdb_stub *g = d->gdb;
+	unsigned char regs[DBG_SNAPSHOT_SIZE] = {};
+	uint32_t regnum, val;
+	const char *p;
+
+	g->op = pkt[0];
+	g->phase = 0;
+	g->status = 0;
+
+	switch (pkt[0]) {
+	case '?':
+		/* Attaching stops the target. */
+		emit_cmd(d, CMD_STOP);
+		break;
+	case 'g':
+		emit_read_regs(d);
+		break;
+	case 'G':
+		if (hex_decode(regs, pkt + 1, sizeof(regs)) != sizeof(regs)) {
+			reply(d, "E00");
+			break;
+		}
+		emit_write_regs(d, (1U << DBG_SNAPSHOT_REGS) - 1, regs);
+		break;
+	case 'p':
+		parse_hex(pkt + 1, &regnum);
+		if (regnum >= DBG_SNAPSHOT_REGS) {
+			reply(d, "E00");
+			break;
+		}
+		g->addr = regnum;
+		emit_read_regs(d);
+		break;
+	case 'P':
+		p = parse_hex(pkt + 1, &regnum);
+		if (regnum >= DBG_SNAPSHOT_REGS || *p != '=' ||
+		    hex_decode(regs + regnum * sizeof(val), p + 1,
+			       sizeof(val)) != sizeof(val)) {
+			reply(d, "E00");
+			break;
+		}
+		emit_write_regs(d, 1U << regnum, regs);
+		break;
+	case 'm':
+	case 'M':
+	case 'X':
+		handle_mem(d, pkt, len);
+		break;
+	case 'Z':
+	case 'z':
+		handle_breakpoint(d, pkt);
+		break;
+	case 'c':
+	case 's':
+		handle_resume(d, pkt[0], pkt + 1);
+		break;
+	case 'v':
+		if (!strncmp(pkt, "vCont", 5))
+			handle_vcont(d, pkt);
+		else
+			reply(d, "");
+		break;
+	case 'D':
+		emit_cmd(d, CMD_RUN);
+		break;
+	case 'H':
+	case 'T':
+		reply(d, "OK");
+		break;
+	case 'q':
+		handle_query(d, pkt);
+		break;
+	case 'Q':
+		if (!strcmp(pkt, "QStartNoAckMode")) {
+			reply(d, "OK");
+			g->no_ack = true;
+		} else {
+			reply(d, "");
+		}
+		break;
+	case 'k':
+		/* gdb drops the connection, leave the target as it is. */
+		break;
+	default:
+		reply(d, "");
+		break;
+	}
+
+	if (!g->nr_responses)
+		g->op = 0;
+}
+
+/* All of the responses for the current packet are in. */
+static void complete(struct jtag_debug_data *d)
+{
+	struct gdb_stub *g = d->gdb;
+	char out[2 * GDB_PACKET_SIZE + 1];
+	char op = g->op;
+
+	g->op = 0;
+
+	switch (op) {
+	case '?':
+		reply(d, "S05");
+		break;
+	case 'g':
+	case 'p':
+		if (g->status || g->buf_len != DBG_SNAPSHOT_SIZE) {
+			reply(d, "E01");
+			break;
+		}
+		if (op == 'g')
+			hex_encode(out, g->buf, DBG_SNAPSHOT_SIZE);
+		else
+			hex_encode(out, g->buf + g->addr * sizeof(uint32_t),
+				   sizeof(uint32_t));
+		reply(d, out);
+		break;
+	case 'm':
+		if (g->status) {
+			reply(d, "E01");
+			break;
+		}
+		hex_encode(out, g->buf + g->addr, g->len);
+		reply(d, out);
+		break;
+	case 'Z':
+		if (g->status) {
+			reply(d, "E01");
+		} else if (!g->phase++) {
+			g->op = op;
+			g->bkps[g->nr_bkps].addr = g->addr;
+			g->bkps[g->nr_bkps].orig = g->data;
+			emit_write32(d, g->addr, BKP_INSN);
+		} else {
+			++g->nr_bkps;
+			reply(d, "OK");
+		}
+		break;
+	case 'z':
+		if (!g->status)
+			g->bkps[g->addr] = g->bkps[--g->nr_bkps];
+		reply_status(d);
+		break;
+	case 'c':
+		reply(d, g->interrupted ? "S02" : "S05");
+		break;
+	case 's':
+		reply(d, "S05");
+		break;
+	default:
+		reply_status(d);
+		break;
+	}
+
+	g->buf_len = 0;
+}
+
+/*
+ * Parse and handle the next complete packet from gdb, returns false if there
+ * isn't one yet.
+ */
+static bool next_packet(struct jtag_debug_data *d)
+{
+	struct gdb_stub *g = d->gdb;
+	char pkt[GDB_PACKET_SIZE + 1];
+	char *start, *end;
+	unsigned char csum = 0;
+	int sent;
+	size_t len, m;
+
+	start = memchr(g->in, '$', g->in_len);
+	if (!start) {
+		/* Acks and interrupts while stopped are dropped. */
+		g->in_len = 0;
+		return false;
+	}
+	end = memchr(start, '#', g->in + g->in_len - start);
+	if (!end || end + 3 > g->in + g->in_len)
+		return false;
+
+	len = end - start - 1;
+	for (m = 0; m < len; ++m)
+		csum += start[1 + m];
+	sent = hex_digit(end[1]) < 0 || hex_digit(end[2]) < 0 ||
+		len > GDB_PACKET_SIZE ? -1 :
+		hex_digit(end[1]) << 4 | hex_digit(end[2]);
+	if (sent >= 0) {
+		memcpy(pkt, start + 1, len);
+		pkt[len] = '\0';
+	}
+
+	g->in_len -= end + 3 - g->in;
+	memmove(g->in, end + 3, g->in_len);
+
+	if (!g->no_ack)
+		send_all(d->client_fd, sent == csum ? "+" : "-", 1);
+	if (sent == csum)
+		handle_packet(d, pkt, len);
+
+	return true;
+}
+
+/* While running, the only thing gdb sends is a ^C to stop the target. */
+static bool take_interrupt(struct gdb_stub *g)
+{
+	char *intr = memchr(g->in, 0x03, g->in_len);
+
+	if (!intr)
+		return false;
+
+	g->in_len -= intr + 1 - g->in;
+	memmove(g->in, intr + 1, g->in_len);
+
+	return true;
+}
+
+static int read_input(struct jtag_debug_data *d)
+{
+	struct gdb_stub *g = d->gdb;
+	ssize_t br;
+
+	if (g->in_len == sizeof(g->in)) {
+		if (g->op) {
+			d->more_data = 0;
+			return -EAGAIN;
+		}
+		/* Too long to be a packet. */
+		g->in_len = 0;
+	}
+
+	br = read(d->client_fd, g->in + g->in_len, sizeof(g->in) - g->in_len);
+	if (br < 0 && errno == EAGAIN) {
+		d->more_data = 0;
+		return -EAGAIN;
+	} else if (br <= 0) {
+		d->more_data = 0;
+		return -EIO;
+	}
+	g->in_len += br;
+
+	return 0;
+}
+
+int gdb_fill(struct jtag_debug_data *d)
+{
+	struct gdb_stub *g = d->gdb;
+	size_t start = d->rx_len;
+	int rc;
+
+	while (d->rx_len == start) {
+		if (g->op && !g->nr_responses) {
+			complete(d);
+			continue;
+		}
+		if (!g->op && next_packet(d))
+			continue;
+		if (g->op == 'c' && !g->interrupted && take_interrupt(g)) {
+			g->interrupted = true;
+			emit_cmd(d, CMD_STOP);
+			continue;
+		}
+
+		rc = read_input(d);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+int gdb_response(struct jtag_debug_data *d, const struct dbg_response *resp,
+		 const void *data, size_t len)
+{
+	struct gdb_stub *g = d->gdb;
+
+	if (!g->nr_responses)
+		return 0;
+
+	if (resp->status && !g->status)
+		g->status = resp->status;
+	g->data = resp->data;
+	if (len) {
+		g->buf_len = len < sizeof(g->buf) ? len : sizeof(g->buf);
+		memcpy(g->buf, data, g->buf_len);
+	}
+
+	/* Have get_request() come back for the reply. */
+	if (!--g->nr_responses)
+		d->more_data = 1;
+
+	return 0;
+}
+
+void gdb_reset(struct gdb_stub *g)
+{
+	memset(g, 0, sizeof(*g));
+}
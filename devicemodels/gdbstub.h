@@ -0,0 +1,53 @@
+#ifndef __GDBSTUB_H__
+#define __GDBSTUB_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../debugger/protocol.h"
+
+/*
+ * GDB remote serial protocol front end for the debug server.  Packets from
+ * gdb are translated into debug requests in the server's receive buffer, so
+ * they take exactly the same path as requests from oldland-debug, and the
+ * responses are collected into the packet's reply.
+ */
+#define GDB_PORT		"36001"
+#define GDB_PACKET_SIZE		4096
+#define GDB_MAX_BREAKPOINTS	64
+
+struct jtag_debug_data;
+
+struct gdb_stub {
+	/* Raw bytes from gdb not yet parsed. */
+	char in[GDB_PACKET_SIZE + 8];
+	size_t in_len;
+	bool no_ack;
+
+	/* The packet being serviced and its responses still to come. */
+	char op;
+	unsigned int phase;
+	unsigned int nr_responses;
+	int status;
+	uint32_t data;
+	bool interrupted;
+	uint32_t addr;
+	uint32_t len;
+	unsigned char buf[GDB_PACKET_SIZE + 8];
+	size_t buf_len;
+
+	struct {
+		uint32_t addr;
+		uint32_t orig;
+	} bkps[GDB_MAX_BREAKPOINTS];
+	unsigned int nr_bkps;
+};
+
+void gdb_reset(struct gdb_stub *g);
+/* Called in place of reading the socket, same return values as rx_fill(). */
+int gdb_fill(struct jtag_debug_data *d);
+int gdb_response(struct jtag_debug_data *d, const struct dbg_response *resp,
+		 const void *data, size_t len);
+
+#endif /* __GDBSTUB_H__ */
@@ -2,66 +2,739 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include "../debugger/protocol.h"
+#include "gdbstub.h"
 #include "jtag.h"
 
-int get_request(struct jtag_debug_data *d, struct dbg_request *req)
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
 {
-	ssize_t br;
-	int rc = -EAGAIN;
+	while (iovcnt) {
+		struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+		ssize_t bs = writev(fd, iov, iovcnt);
 
-	pthread_mutex_lock(&d->lock);
+		if (bs < 0 && errno == EAGAIN) {
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (bs <= 0)
+			return -EIO;
 
-	if (d->client_fd < 0)
-		goto out;
+		while (iovcnt && (size_t)bs >= iov->iov_len) {
+			bs -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt) {
+			iov->iov_base = (unsigned char *)iov->iov_base + bs;
+			iov->iov_len -= bs;
+		}
+	}
 
-	if (!d->more_data)
-		goto out;
+	return 0;
+}
 
-	br = read(d->client_fd, req, sizeof(*req));
-	if (br < 0 && errno == EAGAIN) {
-		d->more_data = 0;
-	} else if (br != sizeof(*req)) {
-		d->more_data = 0;
-		rc = -EIO;
-	} else {
-		rc = 0;
+/* Blocks while the ring is full unless the client goes away. */
+static int shm_writev_all(struct shm_ring *r, const struct iovec *iov,
+			  int iovcnt)
+{
+	for (; iovcnt; ++iov, --iovcnt) {
+		const unsigned char *p = iov->iov_base;
+		size_t len = iov->iov_len;
+
+		for (;;) {
+			size_t n = shm_ring_write(r, p, len);
+
+			p += n;
+			len -= n;
+			if (!len)
+				break;
+			if (shm_ring_closed(r))
+				return -EIO;
+			shm_ring_wait_writable(r, 100);
+		}
 	}
 
-out:
-	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
 
-	return rc;
+static int block_response(struct jtag_debug_data *d,
+			  const struct dbg_response *resp);
+
+/*
+ * A response followed by len bytes of payload.  Payloads can't be held back
+ * with the rest of a batch so anything batched so far goes out with it.
+ */
+int send_block_response(struct jtag_debug_data *d,
+			const struct dbg_response *resp,
+			const void *data, size_t len)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = (void *)resp, .iov_len = sizeof(*resp) },
+		{ .iov_base = (void *)data, .iov_len = len },
+	};
+
+	if (d->block_expanding)
+		return block_response(d, resp);
+	if (d->gdb_client)
+		return gdb_response(d, resp, data, len);
+
+	if (d->batch_remaining) {
+		d->batch[d->nr_batched++] = *resp;
+		if (--d->batch_remaining && !len)
+			return 0;
+
+		iov[0].iov_base = d->batch;
+		iov[0].iov_len = d->nr_batched * sizeof(*resp);
+		d->nr_batched = 0;
+	}
+
+	if (d->shm)
+		return shm_writev_all(&d->shm->to_host, iov, 2);
+
+	return writev_all(d->client_fd, iov, 2);
+}
+
+static bool is_block_cmd(const struct dbg_request *req)
+{
+	if (req->addr != REG_CMD || req->read_not_write)
+		return false;
+
+	switch (req->value) {
+	case CMD_RMEM_BLOCK:
+	case CMD_WMEM_BLOCK:
+	case CMD_READ_ALL_REGS:
+	case CMD_WRITE_REGS:
+	case CMD_SET_STOP_PCS:
+	case CMD_SET_BREAKPOINTS:
+	case CMD_SET_WATCHPOINTS:
+	case CMD_SAVE_CHECKPOINT:
+	case CMD_RESTORE_CHECKPOINT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_checkpoint(uint32_t cmd)
+{
+	return cmd == CMD_SAVE_CHECKPOINT || cmd == CMD_RESTORE_CHECKPOINT;
+}
+
+static bool is_block_write(const struct jtag_debug_data *d)
+{
+	return d->block_req.value == CMD_WMEM_BLOCK ||
+		d->block_req.value == CMD_WRITE_REGS ||
+		d->block_req.value == CMD_SET_STOP_PCS ||
+		d->block_req.value == CMD_SET_BREAKPOINTS ||
+		d->block_req.value == CMD_SET_WATCHPOINTS ||
+		is_checkpoint(d->block_req.value);
+}
+
+/*
+ * Only the simulator can check breakpoints and watchpoints itself, or save
+ * its state.
+ */
+static bool is_native_only(uint32_t cmd)
+{
+	return cmd == CMD_SET_BREAKPOINTS || cmd == CMD_SET_WATCHPOINTS ||
+		cmd == CMD_GET_WATCH_ADDR || is_checkpoint(cmd);
+}
+
+static bool is_snapshot(const struct jtag_debug_data *d)
+{
+	return d->block_req.value == CMD_READ_ALL_REGS ||
+		d->block_req.value == CMD_WRITE_REGS;
+}
+
+static void start_block(struct jtag_debug_data *d,
+			const struct dbg_request *req)
+{
+	d->block_req = *req;
+	d->block_addr = d->shadow_addr;
+	d->block_len = d->shadow_wdata;
+	if (is_snapshot(d))
+		d->block_valid = d->block_len == DBG_SNAPSHOT_SIZE;
+	else if (is_checkpoint(d->block_req.value))
+		d->block_valid = d->block_len &&
+			d->block_len <= DBG_MAX_BLOCK && !(d->block_len & 3);
+	else if (d->block_req.value == CMD_SET_STOP_PCS ||
+		 d->block_req.value == CMD_SET_BREAKPOINTS)
+		d->block_valid = d->block_len <= DBG_MAX_BLOCK &&
+			!(d->block_len & 3);
+	else if (d->block_req.value == CMD_SET_WATCHPOINTS)
+		d->block_valid = d->block_len <= DBG_MAX_WATCHPOINTS *
+			sizeof(struct dbg_watchpoint) &&
+			!(d->block_len % sizeof(struct dbg_watchpoint));
+	else
+		d->block_valid = d->block_len &&
+			d->block_len <= DBG_MAX_BLOCK &&
+			!(d->block_len & 3) && !(d->block_addr & 3);
+	d->block_pos = 0;
+	/* Invalid write payloads are still consumed, but thrown away. */
+	d->block_receiving = is_block_write(d);
+}
+
+static uint32_t snapshot_write_mask(const struct jtag_debug_data *d)
+{
+	return d->block_addr & ((1U << DBG_SNAPSHOT_REGS) - 1);
+}
+
+static int compare_pcs(const void *a, const void *b)
+{
+	uint32_t pa = *(const uint32_t *)a, pb = *(const uint32_t *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static bool is_stop_pc(const struct jtag_debug_data *d, uint32_t pc)
+{
+	return d->nr_stop_pcs &&
+		bsearch(&pc, d->stop_pcs, d->nr_stop_pcs, sizeof(pc),
+			compare_pcs);
+}
+
+/* The server runs to the stop set for consumers without native support. */
+static void set_stop_pcs(struct jtag_debug_data *d)
+{
+	struct dbg_response resp = {};
+
+	d->nr_stop_pcs = d->block_len / sizeof(uint32_t);
+	memcpy(d->stop_pcs, d->block_data, d->block_len);
+	qsort(d->stop_pcs, d->nr_stop_pcs, sizeof(uint32_t), compare_pcs);
+
+	send_block_response(d, &resp, NULL, 0);
+}
+
+/*
+ * Expanded blocks take three controller accesses per word or register:
+ * setting the address, the data or command and the command or read.
+ */
+static unsigned int block_nr_accesses(const struct jtag_debug_data *d)
+{
+	if (d->block_req.value == CMD_WRITE_REGS)
+		return 3 * __builtin_popcount(snapshot_write_mask(d));
+
+	return 3 * (d->block_len / sizeof(uint32_t));
+}
+
+/*
+ * Called once any payload has arrived, returns true if req should be passed
+ * on to the consumer.
+ */
+static bool block_ready(struct jtag_debug_data *d, struct dbg_request *req)
+{
+	struct dbg_response resp = { .status = -EINVAL };
+
+	if (!d->block_valid ||
+	    (!d->native_blocks && is_native_only(d->block_req.value))) {
+		send_block_response(d, &resp, NULL, 0);
+		return false;
+	}
+
+	if (d->native_blocks) {
+		*req = d->block_req;
+		return true;
+	}
+
+	if (d->block_req.value == CMD_SET_STOP_PCS) {
+		set_stop_pcs(d);
+		return false;
+	}
+
+	d->block_expanding = true;
+	d->block_issued = d->block_completed = 0;
+	d->block_item = 0;
+	d->block_status = 0;
+
+	/* Writing an empty set of registers is already done. */
+	if (!block_nr_accesses(d)) {
+		d->block_expanding = false;
+		resp.status = 0;
+		send_block_response(d, &resp, NULL, 0);
+	}
+
+	return false;
+}
+
+/*
+ * Run-until steps, reads back the PC and then the execution status to catch
+ * breakpoints, waiting for each response before deciding whether to carry
+ * on.
+ */
+/* How often to poll the debug controller while waiting for a stop. */
+#define STOP_POLL_INTERVAL_NS	1000000ULL
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool block_can_issue(const struct jtag_debug_data *d)
+{
+	if (d->block_req.value == CMD_RUN_UNTIL)
+		return d->block_issued == d->block_completed;
+	if (d->block_req.value == CMD_WAIT_STOPPED)
+		return d->block_issued == d->block_completed &&
+			now_ns() >= d->next_stop_poll;
+
+	return d->block_issued < block_nr_accesses(d);
+}
+
+static void next_run_until_request(struct jtag_debug_data *d,
+				   struct dbg_request *req)
+{
+	unsigned int step = d->block_issued++ % 4;
+	bool read = step % 2;
+
+	*req = (struct dbg_request) {
+		.addr = read ? REG_RDATA : REG_CMD,
+		.value = read ? 0 : step ? CMD_GET_EXEC_STATUS : CMD_STEP,
+		.read_not_write = read,
+	};
+}
+
+/* Waiting for a stop polls the execution status. */
+static void next_stop_wait_request(struct jtag_debug_data *d,
+				   struct dbg_request *req)
+{
+	bool read = d->block_issued++ % 2;
+
+	*req = (struct dbg_request) {
+		.addr = read ? REG_RDATA : REG_CMD,
+		.value = read ? 0 : CMD_GET_EXEC_STATUS,
+		.read_not_write = read,
+	};
+}
+
+static void next_block_request(struct jtag_debug_data *d,
+			       struct dbg_request *req)
+{
+	bool write = is_block_write(d);
+	bool regs = is_snapshot(d);
+	unsigned int item;
+
+	if (d->block_req.value == CMD_RUN_UNTIL) {
+		next_run_until_request(d, req);
+		return;
+	}
+	if (d->block_req.value == CMD_WAIT_STOPPED) {
+		next_stop_wait_request(d, req);
+		return;
+	}
+
+	if (d->block_req.value == CMD_WRITE_REGS && d->block_issued % 3 == 0)
+		while (!(snapshot_write_mask(d) & (1U << d->block_item)))
+			++d->block_item;
+	item = d->block_item;
+
+	*req = (struct dbg_request) {};
+
+	switch (d->block_issued++ % 3) {
+	case 0:
+		req->addr = REG_ADDRESS;
+		req->value = regs ? dbg_snapshot_regnum(item) :
+			d->block_addr + item * sizeof(uint32_t);
+		break;
+	case 1:
+		req->addr = write ? REG_WDATA : REG_CMD;
+		if (write)
+			req->value = d->block_data[item];
+		else
+			req->value = regs ? CMD_READ_REG : CMD_RMEM32;
+		break;
+	case 2:
+		req->addr = write ? REG_CMD : REG_RDATA;
+		if (write)
+			req->value = regs ? CMD_WRITE_REG : CMD_WMEM32;
+		req->read_not_write = !write;
+		++d->block_item;
+		break;
+	}
+}
+
+static int run_until_response(struct jtag_debug_data *d,
+			      const struct dbg_response *resp)
+{
+	struct dbg_response done = { .status = resp->status };
+	unsigned int step = d->block_completed++ % 4;
+
+	if (!resp->status) {
+		if (step == 1)
+			d->run_pc = resp->data;
+		if (step != 3)
+			return 0;
+		++d->run_cycles;
+		if (!(resp->data & EXEC_STATUS_STOPPED_ON_BKPT) &&
+		    !is_stop_pc(d, d->run_pc) &&
+		    d->run_cycles != d->run_limit)
+			return 0;
+	}
+
+	d->block_expanding = false;
+
+	return send_block_response(d, &done, NULL, 0);
+}
+
+static int end_stop_wait(struct jtag_debug_data *d, int status)
+{
+	struct dbg_response resp = {
+		.status = status,
+		.data = d->stop_status,
+	};
+
+	d->block_expanding = false;
+
+	return send_block_response(d, &resp, NULL, 0);
+}
+
+static int stop_wait_response(struct jtag_debug_data *d,
+			      const struct dbg_response *resp)
+{
+	bool read = d->block_completed++ % 2;
+
+	if (resp->status)
+		return end_stop_wait(d, resp->status);
+	if (!read)
+		return 0;
+
+	d->stop_status = resp->data;
+	if (!(d->stop_status & EXEC_STATUS_RUNNING))
+		return end_stop_wait(d, 0);
+
+	d->next_stop_poll = now_ns() + STOP_POLL_INTERVAL_NS;
+
+	return 0;
+}
+
+static int block_response(struct jtag_debug_data *d,
+			  const struct dbg_response *resp)
+{
+	unsigned int step;
+	struct dbg_response block_resp;
+	bool write = is_block_write(d);
+
+	if (d->block_req.value == CMD_RUN_UNTIL)
+		return run_until_response(d, resp);
+	if (d->block_req.value == CMD_WAIT_STOPPED)
+		return stop_wait_response(d, resp);
+
+	step = d->block_completed++;
+
+	if (resp->status && !d->block_status)
+		d->block_status = resp->status;
+	if (!write && step % 3 == 2)
+		d->block_data[step / 3] = resp->data;
+
+	if (d->block_completed < block_nr_accesses(d))
+		return 0;
+
+	d->block_expanding = false;
+	block_resp.status = d->block_status;
+	block_resp.data = write ? 0 : d->block_len;
+
+	return send_block_response(d, &block_resp, d->block_data,
+				   block_resp.data);
 }
 
 int send_response(struct jtag_debug_data *d, const struct dbg_response *resp)
 {
-	ssize_t bs;
-	struct iovec iov = {
-		.iov_base = (void *)resp,
-		.iov_len = sizeof(*resp)
+	return send_block_response(d, resp, NULL, 0);
+}
+
+/*
+ * Hand a Unix domain socket client the shared memory link with the response
+ * and switch over to it.  The link is only created once and cleared for each
+ * client.
+ */
+static int shm_attach(struct jtag_debug_data *d)
+{
+	struct dbg_response resp = { .data = sizeof(struct shm_link) };
+	struct iovec iov = { .iov_base = &resp, .iov_len = sizeof(resp) };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg = {};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf),
 	};
 
-	bs = writev(d->client_fd, &iov, 1);
-	if (bs < 0 && errno == EAGAIN)
+	if (!d->shm_link) {
+		void *link;
+		int fd = memfd_create("oldland-shm-link", MFD_CLOEXEC);
+
+		if (fd < 0)
+			return -errno;
+		if (ftruncate(fd, sizeof(struct shm_link))) {
+			close(fd);
+			return -errno;
+		}
+		link = mmap(NULL, sizeof(struct shm_link),
+			    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (link == MAP_FAILED) {
+			close(fd);
+			return -errno;
+		}
+		d->shm_fd = fd;
+		d->shm_link = link;
+	}
+	memset(d->shm_link, 0, sizeof(*d->shm_link));
+
+	cmsg.hdr.cmsg_level = SOL_SOCKET;
+	cmsg.hdr.cmsg_type = SCM_RIGHTS;
+	cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(&cmsg.hdr), &d->shm_fd, sizeof(int));
+
+	if (sendmsg(d->client_fd, &msg, MSG_NOSIGNAL) != sizeof(resp))
+		return -EIO;
+
+	__atomic_store_n(&d->shm, d->shm_link, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Requests to the server itself rather than the debug controller.  Returns
+ * true if the request was consumed.
+ */
+static bool handle_server_request(struct jtag_debug_data *d,
+				  const struct dbg_request *req)
+{
+	struct dbg_response resp = { .status = -EINVAL };
+
+	if (req->addr < REG_VERSION)
+		return false;
+
+	if (req->addr == REG_VERSION && req->read_not_write) {
+		resp.status = 0;
+		resp.data = DBG_PROTOCOL_VERSION;
+	} else if (req->addr == REG_BATCH && !req->read_not_write &&
+		   !d->batch_remaining && req->value > 0 &&
+		   req->value <= DBG_MAX_BATCH) {
+		d->batch_remaining = req->value;
+		d->nr_batched = 0;
+		return true;
+	} else if (req->addr == REG_SHM_LINK && req->read_not_write &&
+		   d->unix_client && !d->shm && !d->batch_remaining &&
+		   !d->notify &&
+		   !shm_attach(d)) {
+		return true;
+	}
+
+	send_response(d, &resp);
+
+	return true;
+}
+
+/*
+ * Run-until and waiting for a stop for consumers without native support:
+ * the command's response is held back while the server steps or polls the
+ * CPU.  Returns true if req was consumed.
+ */
+static bool handle_run_control(struct jtag_debug_data *d,
+			       const struct dbg_request *req)
+{
+	struct dbg_response resp = {};
+
+	if (d->native_blocks)
+		return false;
+
+	if (req->addr == REG_RDATA && req->read_not_write &&
+	    d->run_cycles_pending) {
+		d->run_cycles_pending = false;
+		resp.data = d->run_cycles;
+		send_response(d, &resp);
+		return true;
+	}
+
+	if (req->addr != REG_CMD || req->read_not_write)
+		return false;
+
+	d->run_cycles_pending = req->value == CMD_GET_RUN_CYCLES;
+	if (d->run_cycles_pending) {
+		send_response(d, &resp);
+		return true;
+	}
+
+	/* The set commands are rejected once their payload has arrived. */
+	if (req->value == CMD_GET_WATCH_ADDR) {
+		resp.status = -EINVAL;
+		send_response(d, &resp);
+		return true;
+	}
+
+	if (req->value != CMD_RUN_UNTIL && req->value != CMD_WAIT_STOPPED)
+		return false;
+
+	d->block_req = *req;
+	d->block_expanding = true;
+	d->block_issued = d->block_completed = 0;
+	d->run_limit = d->shadow_wdata;
+	d->run_cycles = 0;
+	d->stop_status = EXEC_STATUS_RUNNING;
+	d->next_stop_poll = 0;
+
+	return true;
+}
+
+/* Returns 0 if more requests were read, -EAGAIN if none were waiting. */
+static int rx_fill(struct jtag_debug_data *d)
+{
+	ssize_t br;
+
+	if (!d->more_data)
 		return -EAGAIN;
-	else if (bs != sizeof(*resp))
+
+	memmove(d->rx_buf, d->rx_buf + d->rx_pos, d->rx_len - d->rx_pos);
+	d->rx_len -= d->rx_pos;
+	d->rx_pos = 0;
+
+	if (d->gdb_client)
+		return gdb_fill(d);
+
+	if (d->shm) {
+		br = shm_ring_read(&d->shm->to_target, d->rx_buf + d->rx_len,
+				   sizeof(d->rx_buf) - d->rx_len);
+		if (!br) {
+			d->more_data = 0;
+			return -EAGAIN;
+		}
+		d->rx_len += br;
+
+		return 0;
+	}
+
+	br = read(d->client_fd, d->rx_buf + d->rx_len,
+		  sizeof(d->rx_buf) - d->rx_len);
+	if (br < 0 && errno == EAGAIN) {
+		d->more_data = 0;
+		return -EAGAIN;
+	} else if (br <= 0) {
+		d->more_data = 0;
 		return -EIO;
+	}
+	d->rx_len += br;
 
 	return 0;
 }
 
+/* Another request ends a wait for the CPU to stop. */
+static bool stop_wait_interrupted(struct jtag_debug_data *d)
+{
+	return d->block_req.value == CMD_WAIT_STOPPED &&
+		(d->rx_pos < d->rx_len || !rx_fill(d));
+}
+
+int get_request(struct jtag_debug_data *d, struct dbg_request *req)
+{
+	int rc = -EAGAIN;
+
+	pthread_mutex_lock(&d->lock);
+
+	if (d->client_fd < 0)
+		goto out;
+
+	for (;;) {
+		size_t avail = d->rx_len - d->rx_pos;
+
+		if (d->block_expanding) {
+			if (!block_can_issue(d))
+				break;
+			if (stop_wait_interrupted(d)) {
+				end_stop_wait(d, 0);
+				continue;
+			}
+			next_block_request(d, req);
+			rc = 0;
+			break;
+		}
+
+		if (d->block_receiving) {
+			size_t n = d->block_len - d->block_pos;
+
+			if (n > avail)
+				n = avail;
+			if (d->block_valid)
+				memcpy((unsigned char *)d->block_data +
+				       d->block_pos, d->rx_buf + d->rx_pos, n);
+			d->block_pos += n;
+			d->rx_pos += n;
+
+			if (d->block_pos == d->block_len) {
+				d->block_receiving = false;
+				if (block_ready(d, req)) {
+					rc = 0;
+					break;
+				}
+				continue;
+			}
+		} else if (avail >= sizeof(*req)) {
+			memcpy(req, d->rx_buf + d->rx_pos, sizeof(*req));
+			d->rx_pos += sizeof(*req);
+			if (handle_server_request(d, req))
+				continue;
+
+			if (!req->read_not_write && req->addr == REG_ADDRESS)
+				d->shadow_addr = req->value;
+			if (!req->read_not_write && req->addr == REG_WDATA)
+				d->shadow_wdata = req->value;
+			if (handle_run_control(d, req))
+				continue;
+
+			if (!is_block_cmd(req)) {
+				rc = 0;
+				break;
+			}
+
+			start_block(d, req);
+			if (!d->block_receiving && block_ready(d, req)) {
+				rc = 0;
+				break;
+			}
+			continue;
+		}
+
+		rc = rx_fill(d);
+		if (rc)
+			break;
+		rc = -EAGAIN;
+	}
+
+	if (!rc)
+		d->req_connection = d->connection;
+out:
+	pthread_mutex_unlock(&d->lock);
+
+	return rc;
+}
+
 static void enable_reuseaddr(int fd)
 {
 	int val = 1;
@@ -70,7 +743,7 @@ static void enable_reuseaddr(int fd)
 		err(1, "failed to enable SO_REUSEADDR");
 }
 
-static int spawn_server(void)
+static int spawn_server(const char *port)
 {
 	struct addrinfo *result, *rp, hints = {
 		.ai_family	= AF_INET,
@@ -79,7 +752,7 @@ static int spawn_server(void)
 	};
 	int s, fd;
 
-	s = getaddrinfo(NULL, "36000", &hints, &result);
+	s = getaddrinfo(NULL, port, &hints, &result);
 	if (s)
 		err(1, "getaddrinfo failed");
 
@@ -107,16 +780,80 @@ static int spawn_server(void)
 	return fd;
 }
 
+static int spawn_unix_server(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "debug socket path too long");
+	strcpy(addr.sun_path, path);
+	/* Left behind by an earlier run. */
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(1, "failed to create socket");
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		err(1, "failed to bind %s", path);
+	if (listen(fd, 1))
+		err(1, "failed to listen on socket");
+
+	return fd;
+}
+
+static unsigned short bound_port(int fd)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &len))
+		err(1, "failed to get server address");
+
+	return ntohs(addr.sin_port);
+}
+
+static const char *server_port(const char *env, const char *port)
+{
+	const char *override = getenv(env);
+
+	return override && *override ? override : port;
+}
+
 static int establish_connection(struct jtag_debug_data *data)
 {
 	struct epoll_event event = {
 		.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
 		.data.ptr = data,
 	};
-	int client = accept4(data->sock_fd, NULL, NULL, SOCK_NONBLOCK);
+	struct pollfd pfds[] = {
+		{ .fd = data->sock_fd, .events = POLLIN },
+		{ .fd = data->unix_sock_fd, .events = POLLIN },
+		{ .fd = data->gdb_sock_fd, .events = POLLIN },
+	};
+	bool gdb, unix_client;
+	int client, val = 1;
+
+	if (poll(pfds, 3, -1) <= 0)
+		return -EAGAIN;
+
+	/* gdb connects to its own port but otherwise shares the server. */
+	unix_client = !(pfds[0].revents & POLLIN) &&
+		(pfds[1].revents & POLLIN);
+	gdb = !(pfds[0].revents & POLLIN) && !unix_client;
+	client = accept4(pfds[gdb ? 2 : unix_client ? 1 : 0].fd, NULL, NULL,
+			 SOCK_NONBLOCK);
 	if (client < 0)
 		return -EAGAIN;
 
+	/*
+	 * Responses after a block payload would otherwise wait for the
+	 * client to acknowledge it.
+	 */
+	if (!unix_client)
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &val,
+			   sizeof(val));
+
 	if (epoll_ctl(data->epoll_fd, EPOLL_CTL_ADD, client, &event)) {
 		warn("failed to add client to epoll (%d)", client);
 		close(client);
@@ -125,6 +862,9 @@ static int establish_connection(struct jtag_debug_data *data)
 
 	pthread_mutex_lock(&data->lock);
 	data->client_fd = client;
+	data->gdb_client = gdb;
+	data->unix_client = unix_client;
+	gdb_reset(data->gdb);
 	pthread_mutex_unlock(&data->lock);
 
 	return 0;
@@ -132,12 +872,30 @@ static int establish_connection(struct jtag_debug_data *data)
 
 static void close_connection(struct jtag_debug_data *data)
 {
+	struct shm_link *link = __atomic_load_n(&data->shm, __ATOMIC_ACQUIRE);
+
 	epoll_ctl(data->epoll_fd, EPOLL_CTL_DEL, data->client_fd, NULL);
 
+	/*
+	 * The consumer may be waiting on the link with the lock held so it
+	 * has to be told first.
+	 */
+	if (link) {
+		__atomic_store_n(&link->to_target.closed, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&link->to_host.closed, 1, __ATOMIC_RELEASE);
+		shm_futex_wake(&link->to_target.head);
+		shm_futex_wake(&link->to_host.tail);
+	}
+
 	pthread_mutex_lock(&data->lock);
 	shutdown(data->client_fd, SHUT_RDWR);
 	close(data->client_fd);
 	data->client_fd = -1;
+	__atomic_store_n(&data->shm, NULL, __ATOMIC_RELEASE);
+	data->rx_pos = data->rx_len = 0;
+	data->batch_remaining = data->nr_batched = 0;
+	data->block_receiving = data->block_expanding = false;
+	__atomic_add_fetch(&data->connection, 1, __ATOMIC_RELEASE);
 	pthread_mutex_unlock(&data->lock);
 }
 
@@ -161,8 +919,15 @@ static void *server_thread(void *d)
 				if (revent.events & (EPOLLRDHUP | EPOLLHUP))
 					break;
 
-				if (revent.events & EPOLLIN)
-					__sync_val_compare_and_swap(&data->pending, 0, 1);
+				if (revent.events & EPOLLIN) {
+					pthread_mutex_lock(&data->pending_lock);
+					__atomic_store_n(&data->pending, 1,
+							 __ATOMIC_RELEASE);
+					pthread_cond_signal(&data->pending_cond);
+					if (data->notify)
+						data->notify(data->notify_data);
+					pthread_mutex_unlock(&data->pending_lock);
+				}
 			}
 		}
 
@@ -172,7 +937,9 @@ static void *server_thread(void *d)
 	return NULL;
 }
 
-struct jtag_debug_data *start_server(void)
+static struct jtag_debug_data *new_server(const char *port,
+					  const char *gdb_port,
+					  const char *socket_path)
 {
 	pthread_t thread;
 	struct jtag_debug_data *data;
@@ -181,12 +948,21 @@ struct jtag_debug_data *start_server(void)
 	if (!data)
 		err(1, "failed to allocate data");
 
-	data->sock_fd = spawn_server();
+	data->sock_fd = spawn_server(port);
+	data->gdb_sock_fd = spawn_server(gdb_port);
+	data->unix_sock_fd = socket_path ? spawn_unix_server(socket_path) : -1;
+	data->port = bound_port(data->sock_fd);
+	data->gdb_port = bound_port(data->gdb_sock_fd);
+	data->gdb = calloc(1, sizeof(*data->gdb));
+	if (!data->gdb)
+		err(1, "failed to allocate gdb stub");
 	data->epoll_fd = epoll_create(1);
 	data->client_fd = -1;
 	if (data->epoll_fd < 0)
 		err(1, "failed to create epoll fd");
 	pthread_mutex_init(&data->lock, NULL);
+	pthread_mutex_init(&data->pending_lock, NULL);
+	pthread_cond_init(&data->pending_cond, NULL);
 
 	if (pthread_create(&thread, NULL, server_thread, data))
 		err(1, "failed to spawn server thread");
@@ -194,21 +970,100 @@ struct jtag_debug_data *start_server(void)
 	return data;
 }
 
-void notify_runner(void)
+struct jtag_debug_data *start_server(void)
+{
+	return new_server(server_port("OLDLAND_DEBUG_PORT", DEBUG_PORT),
+			  server_port("OLDLAND_GDB_PORT", GDB_PORT),
+			  getenv(DEBUG_SOCKET_ENV));
+}
+
+/* Port 0 stays any free port for every instance. */
+static const char *instance_port(char *buf, size_t len, const char *port,
+				 unsigned int n)
 {
-	int fd;
+	unsigned long base = strtoul(port, NULL, 10);
+
+	if (!base || !n)
+		return port;
+	snprintf(buf, len, "%lu", base + 2 * n);
+
+	return buf;
+}
+
+struct jtag_debug_data *start_server_instance(unsigned int n)
+{
+	const char *port = server_port("OLDLAND_DEBUG_PORT", DEBUG_PORT);
+	const char *gdb_port = server_port("OLDLAND_GDB_PORT", GDB_PORT);
+	const char *base_path = getenv(DEBUG_SOCKET_ENV);
+	char port_buf[16], gdb_port_buf[16], socket_path[PATH_MAX];
+
+	if (base_path)
+		snprintf(socket_path, sizeof(socket_path), "%s.%u", base_path,
+			 n);
+
+	return new_server(instance_port(port_buf, sizeof(port_buf), port, n),
+			  instance_port(gdb_port_buf, sizeof(gdb_port_buf),
+					gdb_port, n),
+			  base_path ? socket_path : NULL);
+}
+
+void set_request_notifier(struct jtag_debug_data *d,
+			  void (*notify)(void *data), void *data)
+{
+	pthread_mutex_lock(&d->pending_lock);
+	d->notify = notify;
+	d->notify_data = data;
+	pthread_mutex_unlock(&d->pending_lock);
+}
+
+void wait_for_request(struct jtag_debug_data *d)
+{
+	struct shm_link *link = __atomic_load_n(&d->shm, __ATOMIC_ACQUIRE);
+
+	if (link) {
+		while (!shm_ring_readable(&link->to_target) &&
+		       !shm_ring_closed(&link->to_target))
+			shm_ring_wait_readable(&link->to_target, 100);
+		return;
+	}
+
+	pthread_mutex_lock(&d->pending_lock);
+	while (!__atomic_load_n(&d->pending, __ATOMIC_RELAXED))
+		pthread_cond_wait(&d->pending_cond, &d->pending_lock);
+	pthread_mutex_unlock(&d->pending_lock);
+}
+
+void disconnect_client(struct jtag_debug_data *d)
+{
+	pthread_mutex_lock(&d->lock);
+	if (d->client_fd >= 0)
+		shutdown(d->client_fd, SHUT_RDWR);
+	pthread_mutex_unlock(&d->lock);
+}
+
+void notify_runner_ports(const unsigned short *ports, unsigned int nr)
+{
+	unsigned int m;
+	FILE *fifo;
 	char *fifo_name = getenv("SIM_NOTIFY_FIFO");
 
 	if (!fifo_name)
 		return;
 
-	fd = open(fifo_name, O_WRONLY);
-	if (fd < 0)
+	fifo = fopen(fifo_name, "w");
+	if (!fifo)
 		err(1, "failed to open notifcation fifo");
 
-	if (write(fd, "O", 1) != 1)
-		err(1, "failed to write notification byte");
-
-	close(fd);
+	/* Runners that only wait for the first byte still work. */
+	fputc('O', fifo);
+	for (m = 0; m < nr; ++m)
+		fprintf(fifo, m ? " %u" : "%u", ports[m]);
+	fputc('\n', fifo);
+	if (fclose(fifo))
+		err(1, "failed to write notification");
 }
 
+void notify_runner(const struct jtag_debug_data *d)
+{
+	notify_runner_ports(&d->port, 1);
+}
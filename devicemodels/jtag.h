@@ -5,21 +5,169 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "../debugger/protocol.h"
+#include "../debugger/shm_link.h"
+
+#define JTAG_RX_BUF_SIZE	(2 * DBG_MAX_BATCH * sizeof(struct dbg_request))
+/*
+ * Overridden with OLDLAND_DEBUG_PORT and OLDLAND_GDB_PORT, port 0 binds any
+ * free port so that several simulators can run at once.
+ */
+#define DEBUG_PORT		"36000"
+/* OLDLAND_DEBUG_SOCKET also listens on a Unix domain socket at that path. */
+#define DEBUG_SOCKET_ENV	"OLDLAND_DEBUG_SOCKET"
+
+struct gdb_stub;
 
 struct jtag_debug_data {
 	int sock_fd;
+	int gdb_sock_fd;
+	int unix_sock_fd;
+	/* The ports actually bound. */
+	unsigned short port;
+	unsigned short gdb_port;
 	int epoll_fd;
 	int client_fd;
+	/* Set while the client speaks the GDB remote protocol. */
+	bool gdb_client;
+	struct gdb_stub *gdb;
+	/* Set while the client is on the Unix domain socket. */
+	bool unix_client;
+	/*
+	 * The shared memory link, created for the first client to ask and
+	 * reused for later ones.  shm is set while the client uses it.
+	 */
+	int shm_fd;
+	struct shm_link *shm_link;
+	struct shm_link *shm;
 	int pending;
 	int more_data;
 	pthread_mutex_t lock;
+	/* Signalled with pending_lock held whenever pending is set. */
+	pthread_mutex_t pending_lock;
+	pthread_cond_t pending_cond;
+	/*
+	 * Called by the server thread with pending_lock held whenever it sets
+	 * pending, for consumers that don't sleep in wait_for_request().
+	 * Shared memory links are refused as their requests would bypass it.
+	 */
+	void (*notify)(void *data);
+	void *notify_data;
+	/*
+	 * Bumped with lock held whenever a client goes away, get_request()
+	 * copies it to req_connection with each request it returns so that
+	 * consumers can tell whether the client that sent it is still there.
+	 */
+	unsigned int connection;
+	unsigned int req_connection;
+
+	/* Requests read from the socket but not yet returned. */
+	unsigned char rx_buf[JTAG_RX_BUF_SIZE];
+	size_t rx_pos;
+	size_t rx_len;
+
+	/* Responses held back until the last request of a batch completes. */
+	unsigned int batch_remaining;
+	unsigned int nr_batched;
+	struct dbg_response batch[DBG_MAX_BATCH];
+
+	/*
+	 * Block transfers.  Consumers that set native_blocks receive block
+	 * commands from get_request() with any write payload already in
+	 * block_data and reply with send_block_response(), they also handle
+	 * CMD_RUN_UNTIL, CMD_GET_RUN_CYCLES and CMD_WAIT_STOPPED themselves,
+	 * along with stop address, breakpoint and watchpoint sets.  For
+	 * everything else the server breaks blocks into word accesses,
+	 * run-until into steps and waits into status polls so that the RTL
+	 * debug controller never sees them, and rejects breakpoint and
+	 * watchpoint sets.
+	 */
+	bool native_blocks;
+	uint32_t shadow_addr;
+	uint32_t shadow_wdata;
+	struct dbg_request block_req;
+	bool block_valid;
+	bool block_receiving;
+	bool block_expanding;
+	uint32_t block_addr;
+	uint32_t block_len;
+	size_t block_pos;
+	unsigned int block_issued;
+	unsigned int block_completed;
+	unsigned int block_item;
+	int block_status;
+	uint32_t block_data[DBG_MAX_BLOCK / sizeof(uint32_t)];
+
+	/* The CMD_RUN_UNTIL address set, sorted. */
+	uint32_t stop_pcs[DBG_MAX_BLOCK / sizeof(uint32_t)];
+	unsigned int nr_stop_pcs;
+	/* Run-until state when the server steps the debug controller. */
+	uint32_t run_limit;
+	uint32_t run_cycles;
+	uint32_t run_pc;
+	bool run_cycles_pending;
+	/* Waiting for a stop without native support. */
+	uint32_t stop_status;
+	unsigned long long next_stop_poll;
 };
 
 struct jtag_debug_data *start_server(void);
+/*
+ * Server n of several in one process: the debug and GDB ports are offset by
+ * 2 * n unless they are 0 and the Unix domain socket, if any, gets ".n"
+ * appended to its path.
+ */
+struct jtag_debug_data *start_server_instance(unsigned int n);
+void set_request_notifier(struct jtag_debug_data *d,
+			  void (*notify)(void *data), void *data);
 int send_response(struct jtag_debug_data *d, const struct dbg_response *resp);
+int send_block_response(struct jtag_debug_data *d,
+			const struct dbg_response *resp,
+			const void *data, size_t len);
 int get_request(struct jtag_debug_data *d, struct dbg_request *req);
-void notify_runner(void);
+
+/*
+ * For the consumer's run loop: a relaxed load of the flag that the server
+ * thread sets when requests arrive, so that get_request() and its lock are
+ * only needed when there is something to do.  Shared memory clients bypass
+ * the server thread so their ring is checked directly.
+ */
+static inline bool request_pending(struct jtag_debug_data *d)
+{
+	struct shm_link *link = __atomic_load_n(&d->shm, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&d->pending, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&d->pending, 0, __ATOMIC_ACQUIRE))
+		d->more_data = 1;
+	if (link && shm_ring_readable(&link->to_target))
+		d->more_data = 1;
+
+	return d->more_data || d->block_expanding;
+}
+
+/* Whether the client that sent requests from connection conn has gone. */
+static inline bool client_gone(struct jtag_debug_data *d, unsigned int conn)
+{
+	return __atomic_load_n(&d->connection, __ATOMIC_ACQUIRE) != conn;
+}
+
+/*
+ * Hang up on the client as exiting would, the server thread cleans up and
+ * waits for the next one.
+ */
+void disconnect_client(struct jtag_debug_data *d);
+/* Sleep until the server thread next sets pending or the ring fills. */
+void wait_for_request(struct jtag_debug_data *d);
+/*
+ * Tell the test runner in SIM_NOTIFY_FIFO that the server is up: "O" then
+ * the debug port in decimal and a newline.
+ */
+void notify_runner(const struct jtag_debug_data *d);
+/* As notify_runner() for several servers, their ports separated by spaces. */
+void notify_runner_ports(const unsigned short *ports, unsigned int nr);
 
 #ifdef __cplusplus
 };
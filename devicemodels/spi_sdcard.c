@@ -6,14 +6,23 @@
  * - master sends ACMD41 until card is ready.
  * - master sends CMD58 to get CCS.
  *
- * The master can then set the block length and perform single block reads.
+ * The master can then set the block length and read and write blocks.
  *
  * Supported features:
  * - reset
- * - single block read
+ * - single and multiple block reads, multiple block reads run until
+ *   STOP_TRANSMISSION.
+ * - single and multiple block writes, multiple block writes run until the
+ *   stop token.
  * - crc validation
  * - set blocklen
  *
+ * The image is mapped into memory and blocks are transferred straight from
+ * and to the mapping.  Writes go back to the image unless the card was
+ * created with SPI_SDCARD_COW, in which case they're kept in a private copy
+ * of the modified pages and discarded on exit.  Those pages are also tracked
+ * so that checkpoints can save them.
+ *
  * The SD spec
  * (http://users.ece.utexas.edu/~valvano/EE345M/SD_Physical_Layer_Spec.pdf)
  * has a habit of not using names for commands and bit fields etc.  So we have
@@ -22,6 +31,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -29,14 +39,23 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "spi_sdcard.h"
 
 #define DATA_BUF_SIZE 1024
 
 #define IN_IDLE_STATE (1 << 0)
 #define ILLEGAL_COMMAND (1 << 2)
+#define PARAMETER_ERROR (1 << 6)
 #define CARD_HIGH_CAPACITY (1 << 6)
 #define DATA_START_TOKEN 0xfe
+#define MULTI_WRITE_START_TOKEN 0xfc
+#define MULTI_WRITE_STOP_TOKEN 0xfd
+#define DATA_ERROR_OUT_OF_RANGE 0x08
+#define DATA_ACCEPTED 0x05
+#define DATA_WRITE_ERROR 0x0d
 
 #ifdef DEBUG
 #define debug printf
@@ -51,6 +70,10 @@ static inline void __attribute__((format(printf,1,2)))
 enum card_state {
 	STATE_READING_COMMAND,
 	STATE_RESPONSE,
+	/* Sending read blocks, a new command ends a multiple block read. */
+	STATE_SENDING_DATA,
+	/* Receiving write blocks, each answered with a data response. */
+	STATE_RECEIVING_DATA,
 };
 
 struct spi_command {
@@ -60,7 +83,12 @@ struct spi_command {
 };
 
 struct spi_sdcard {
-	int fd;
+	uint8_t *image;
+	size_t image_size;
+	bool read_only;
+	/* A bit per page of a copy-on-write image that has been written. */
+	unsigned long *written;
+	size_t page_size;
 	union {
 		struct spi_command current_cmd;
 		uint8_t cmd_buf[sizeof(struct spi_command)];
@@ -74,19 +102,72 @@ struct spi_sdcard {
 	size_t blocklen;
 	size_t msg_len;
 	int ncr_delay;
+
+	/* The block being transferred and the position within it. */
+	bool multiple;
+	uint32_t data_address;
+	size_t data_pos;
+	bool out_of_range;
+	bool data_response_pending;
+	uint8_t data_response;
 };
 
-struct spi_sdcard *spi_sdcard_new(const char *path)
+#define LONG_BITS	(sizeof(unsigned long) * 8)
+
+static inline size_t nr_pages(const struct spi_sdcard *sd)
+{
+	return (sd->image_size + sd->page_size - 1) / sd->page_size;
+}
+
+static void mark_written(struct spi_sdcard *sd, size_t offset, size_t len)
+{
+	size_t page;
+
+	if (!sd->written || !len)
+		return;
+
+	for (page = offset / sd->page_size;
+	     page <= (offset + len - 1) / sd->page_size; ++page)
+		sd->written[page / LONG_BITS] |= 1UL << (page % LONG_BITS);
+}
+
+struct spi_sdcard *spi_sdcard_new(const char *path, int flags)
 {
 	struct spi_sdcard *card;
+	struct stat st;
+	int fd, err, prot = PROT_READ | PROT_WRITE;
 
 	card = calloc(1, sizeof(*card));
 	assert(card != NULL);
 	card->state = STATE_READING_COMMAND;
 	card->ncr_delay = 1;
 
-	card->fd = open(path, O_RDONLY);
-	assert(card->fd >= 0);
+	/* A private mapping is writable even if the image isn't. */
+	fd = open(path, flags & SPI_SDCARD_COW ? O_RDONLY : O_RDWR);
+	if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+		fd = open(path, O_RDONLY);
+		prot = PROT_READ;
+		card->read_only = true;
+	}
+	assert(fd >= 0);
+
+	err = fstat(fd, &st);
+	assert(!err);
+	card->image_size = st.st_size;
+	if (card->image_size) {
+		card->image = mmap(NULL, card->image_size, prot,
+				   flags & SPI_SDCARD_COW ?
+				   MAP_PRIVATE : MAP_SHARED, fd, 0);
+		assert(card->image != MAP_FAILED);
+	}
+	close(fd);
+
+	if (flags & SPI_SDCARD_COW) {
+		card->page_size = sysconf(_SC_PAGESIZE);
+		card->written = calloc(nr_pages(card) / LONG_BITS + 1,
+				       sizeof(*card->written));
+		assert(card->written != NULL);
+	}
 
 	return card;
 }
@@ -96,8 +177,57 @@ static inline bool command_is_complete(const struct spi_sdcard *sd)
 	return sd->num_bytes_rx == sizeof(sd->current_cmd);
 }
 
+static inline bool block_in_image(const struct spi_sdcard *sd,
+				  uint32_t address)
+{
+	return (uint64_t)address + sd->blocklen <= sd->image_size;
+}
+
+static void finish_command(struct spi_sdcard *sd);
+
+/*
+ * Write data: a start token, blocklen bytes then a 16 bit CRC.  Multiple
+ * block writes use their own start token and end with a stop token.
+ */
+static void receive_data(struct spi_sdcard *sd, uint8_t v)
+{
+	if (sd->data_pos == 0) {
+		if (sd->multiple && v == MULTI_WRITE_STOP_TOKEN)
+			finish_command(sd);
+		else if (v == (sd->multiple ? MULTI_WRITE_START_TOKEN :
+			       DATA_START_TOKEN))
+			sd->data_pos = 1;
+		return;
+	}
+
+	if (sd->data_pos <= sd->blocklen)
+		sd->data_buf[sd->data_pos - 1] = v;
+
+	if (sd->data_pos++ < sd->blocklen + 2)
+		return;
+
+	debug("+ write to %08x\n", sd->data_address);
+
+	if (!sd->read_only && block_in_image(sd, sd->data_address)) {
+		memcpy(sd->image + sd->data_address, sd->data_buf,
+		       sd->blocklen);
+		mark_written(sd, sd->data_address, sd->blocklen);
+		sd->data_response = DATA_ACCEPTED;
+	} else {
+		sd->data_response = DATA_WRITE_ERROR;
+	}
+	sd->data_response_pending = true;
+	sd->data_address += sd->blocklen;
+	sd->data_pos = 0;
+}
+
 static void read_data(struct spi_sdcard *sd, uint8_t v)
 {
+	if (sd->state == STATE_RECEIVING_DATA) {
+		receive_data(sd, v);
+		return;
+	}
+
 	assert(sd->num_bytes_rx < DATA_BUF_SIZE + sizeof(sd->current_cmd));
 
 	if (sd->num_bytes_rx == 0 && (v & 0x80))
@@ -105,16 +235,16 @@ static void read_data(struct spi_sdcard *sd, uint8_t v)
 
 	if (sd->num_bytes_rx < sizeof(sd->current_cmd))
 		sd->cmd_buf[sd->num_bytes_rx] = v;
-	else if (sd->num_bytes_rx >= sizeof(sd->current_cmd) &&
-		 sd->state == STATE_READING_COMMAND)
-		sd->data_buf[sd->num_bytes_rx] = v;
 
 	sd->num_bytes_rx++;
 }
 
 static void process_new_command(struct spi_sdcard *sd)
 {
+	/* Commands can arrive while sending read data. */
 	sd->state = STATE_RESPONSE;
+	sd->num_bytes_tx = 0;
+	sd->ncr_delay = 1;
 }
 
 static void set_next_state(struct spi_sdcard *sd)
@@ -190,7 +320,11 @@ enum sd_cmds {
 	SEND_CID = 10,
 	SEND_STATUS = 13,
 	SET_BLOCKLEN = 16,
+	STOP_TRANSMISSION = 12,
 	READ_SINGLE_BLOCK = 17,
+	READ_MULTIPLE_BLOCK = 18,
+	WRITE_BLOCK = 24,
+	WRITE_MULTIPLE_BLOCK = 25,
 	APP_CMD = 55,
 	READ_OCR = 58,
 	/* Application commands. */
@@ -204,31 +338,70 @@ static void do_set_blocklen(struct spi_sdcard *sd)
 			    (sd->current_cmd.argument[2] << 8) |
 			    (sd->current_cmd.argument[3] << 0);
 
-	assert(sd->blocklen < sizeof(sd->data_buf) - 16);
+	assert(blocklen < sizeof(sd->data_buf) - 16);
 	debug("+ set blocklen=%u\n", blocklen);
 	sd->blocklen = blocklen;
 }
 
-static void do_block_read(struct spi_sdcard *sd)
+/*
+ * Start a block read or write, returning the r1 response.  The data follows
+ * the response, with a gap byte before each read block.
+ */
+static uint8_t start_data_transfer(struct spi_sdcard *sd, bool write)
 {
 	uint32_t data_address = (sd->current_cmd.argument[0] << 24) |
 				(sd->current_cmd.argument[1] << 16) |
 				(sd->current_cmd.argument[2] << 8) |
 				(sd->current_cmd.argument[3] << 0);
-	ssize_t br;
+	uint8_t cmd = sd->current_cmd.command & 0x3f;
 
-	debug("+ read from %08x\n", data_address);
+	debug("+ %s at %08x\n", write ? "write" : "read", data_address);
 
-	sd->msg_len = 0;
-	sd->data_buf[sd->msg_len++] = 0; /* r1 response. */
-	sd->data_buf[sd->msg_len++] = DATA_START_TOKEN; /* data start token. */
-	br = pread(sd->fd, sd->data_buf + sd->msg_len, sd->blocklen, data_address);
-	assert(br == sd->blocklen);
-	sd->msg_len += br;
+	if (!block_in_image(sd, data_address)) {
+		finish_command(sd);
+		return PARAMETER_ERROR;
+	}
+
+	sd->multiple = cmd == READ_MULTIPLE_BLOCK ||
+		cmd == WRITE_MULTIPLE_BLOCK;
+	sd->data_address = data_address;
+	sd->data_pos = 0;
+	sd->out_of_range = false;
+	sd->data_response_pending = false;
+	sd->state = write ? STATE_RECEIVING_DATA : STATE_SENDING_DATA;
+	/* Watch for STOP_TRANSMISSION. */
+	sd->num_bytes_rx = 0;
+
+	return 0;
+}
+
+static uint8_t next_read_byte(struct spi_sdcard *sd)
+{
+	size_t pos = sd->data_pos++;
+	uint8_t v;
+
+	if (sd->out_of_range || pos == 0)
+		return 0xff;
+	if (pos == 1) {
+		if (block_in_image(sd, sd->data_address))
+			return DATA_START_TOKEN;
+		/* Wait for STOP_TRANSMISSION. */
+		sd->out_of_range = true;
+		return DATA_ERROR_OUT_OF_RANGE;
+	}
+	if (pos < sd->blocklen + 2)
+		return sd->image[sd->data_address + pos - 2];
 
 	/* CRC16 */
-	sd->data_buf[sd->msg_len++] = 0xde;
-	sd->data_buf[sd->msg_len++] = 0xad;
+	v = pos == sd->blocklen + 2 ? 0xde : 0xad;
+	if (pos == sd->blocklen + 3) {
+		if (!sd->multiple)
+			finish_command(sd);
+		sd->data_address += sd->blocklen;
+		sd->data_pos = 0;
+	}
+
+	return v;
 }
 
 static void do_cid_read(struct spi_sdcard *sd)
@@ -328,12 +501,18 @@ uint8_t spi_sdcard_next_byte_to_master(struct spi_sdcard *sd)
 			v = 0;
 			finish_command(sd);
 			break;
+		case STOP_TRANSMISSION:
+			/* Never busy, so the r1b busy signal is empty. */
+			v = 0;
+			finish_command(sd);
+			break;
 		case READ_SINGLE_BLOCK:
-			if (sd->num_bytes_tx == 0)
-				do_block_read(sd);
-			v = sd->data_buf[sd->num_bytes_tx];
-			if (sd->num_bytes_tx == sd->msg_len - 1)
-				finish_command(sd);
+		case READ_MULTIPLE_BLOCK:
+			v = start_data_transfer(sd, false);
+			break;
+		case WRITE_BLOCK:
+		case WRITE_MULTIPLE_BLOCK:
+			v = start_data_transfer(sd, true);
 			break;
 		case APP_CMD:
 			v = 0x0;
@@ -365,6 +544,14 @@ uint8_t spi_sdcard_next_byte_to_master(struct spi_sdcard *sd)
 			finish_command(sd);
 			break;
 		}
+	} else if (sd->state == STATE_SENDING_DATA) {
+		v = next_read_byte(sd);
+	} else if (sd->state == STATE_RECEIVING_DATA &&
+		   sd->data_response_pending) {
+		v = sd->data_response;
+		sd->data_response_pending = false;
+		if (!sd->multiple)
+			finish_command(sd);
 	}
 
 	if (sd->state == STATE_RESPONSE && sd->ncr_delay != 0) {
@@ -376,3 +563,78 @@ uint8_t spi_sdcard_next_byte_to_master(struct spi_sdcard *sd)
 
 	return v;
 }
+
+size_t spi_sdcard_state_size(void)
+{
+	return sizeof(struct spi_sdcard);
+}
+
+void spi_sdcard_get_state(const struct spi_sdcard *sd, void *state)
+{
+	memcpy(state, sd, sizeof(*sd));
+}
+
+/* Everything but the image and how it is mapped. */
+void spi_sdcard_set_state(struct spi_sdcard *sd, const void *state)
+{
+	struct spi_sdcard saved = *sd;
+
+	memcpy(sd, state, sizeof(*sd));
+	sd->image = saved.image;
+	sd->image_size = saved.image_size;
+	sd->read_only = saved.read_only;
+	sd->written = saved.written;
+	sd->page_size = saved.page_size;
+}
+
+void spi_sdcard_for_each_written(struct spi_sdcard *sd,
+				 void (*fn)(uint64_t offset, const void *page,
+					    size_t len, void *data),
+				 void *data)
+{
+	size_t page;
+
+	if (!sd->written)
+		return;
+
+	for (page = 0; page < nr_pages(sd); ++page) {
+		uint64_t offset = (uint64_t)page * sd->page_size;
+
+		if (!(sd->written[page / LONG_BITS] & (1UL << (page % LONG_BITS))))
+			continue;
+		fn(offset, sd->image + offset,
+		   sd->image_size - offset < sd->page_size ?
+		   sd->image_size - offset : sd->page_size, data);
+	}
+}
+
+/* Dropping the private copies of the pages maps the image back in. */
+void spi_sdcard_discard_writes(struct spi_sdcard *sd)
+{
+	size_t page;
+
+	if (!sd->written)
+		return;
+
+	for (page = 0; page < nr_pages(sd); ++page) {
+		if (!(sd->written[page / LONG_BITS] & (1UL << (page % LONG_BITS))))
+			continue;
+		madvise(sd->image + page * sd->page_size, sd->page_size,
+			MADV_DONTNEED);
+	}
+	memset(sd->written, 0,
+	       (nr_pages(sd) / LONG_BITS + 1) * sizeof(*sd->written));
+}
+
+int spi_sdcard_write_page(struct spi_sdcard *sd, uint64_t offset,
+			  const void *page, size_t len)
+{
+	if (!sd->written || offset % sd->page_size || len > sd->page_size ||
+	    offset + len > sd->image_size)
+		return -EINVAL;
+
+	memcpy(sd->image + offset, page, len);
+	mark_written(sd, offset, len);
+
+	return 0;
+}
@@ -1,6 +1,7 @@
 #ifndef __SPI_SDCARD_H__
 #define __SPI_SDCARD_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -9,11 +10,35 @@ extern "C" {
 
 struct spi_sdcard;
 
-struct spi_sdcard *spi_sdcard_new(const char *path);
+enum spi_sdcard_flags {
+	/* Keep writes in memory rather than modifying the image. */
+	SPI_SDCARD_COW = 1 << 0,
+};
+
+struct spi_sdcard *spi_sdcard_new(const char *path, int flags);
 
 uint8_t spi_sdcard_next_byte_to_master(struct spi_sdcard *sd);
 void spi_sdcard_next_byte_to_slave(struct spi_sdcard *sd, uint8_t v);
 
+/*
+ * Checkpointing.  The state is the card's side of the protocol, the image
+ * isn't part of it.  Writes to a SPI_SDCARD_COW card are tracked in host
+ * pages so they can be saved too, and put back with spi_sdcard_write_page()
+ * after discarding whatever the card has written since.  A card that writes
+ * to its image can't be rolled back.
+ */
+size_t spi_sdcard_state_size(void);
+void spi_sdcard_get_state(const struct spi_sdcard *sd, void *state);
+void spi_sdcard_set_state(struct spi_sdcard *sd, const void *state);
+void spi_sdcard_for_each_written(struct spi_sdcard *sd,
+				 void (*fn)(uint64_t offset, const void *page,
+					    size_t len, void *data),
+				 void *data);
+void spi_sdcard_discard_writes(struct spi_sdcard *sd);
+/* Returns -EINVAL if the card isn't copy-on-write or offset is outside. */
+int spi_sdcard_write_page(struct spi_sdcard *sd, uint64_t offset,
+			  const void *page, size_t len);
+
 #ifdef __cplusplus
 };
 #endif
@@ -13,7 +13,7 @@
 
 #include "uart.h"
 
-int create_pts(void)
+int open_pts(bool announce)
 {
 	int pts = posix_openpt(O_RDWR | O_NONBLOCK);
 	struct termios termios;
@@ -33,7 +33,7 @@ int create_pts(void)
 	if (tcsetattr(pts, TCSANOW, &termios))
 		err(1, "failed to set termios");
 
-	if (sim_is_interactive())
+	if (announce)
 		printf("pts: %s\n", ptsname(pts));
 
 	return pts;
@@ -9,9 +9,17 @@ struct uart_data {
 	int fd;
 };
 
-int create_pts(void);
+#include <stdbool.h>
+
+/* A raw pseudo terminal, printing its name if announce is set. */
+int open_pts(bool announce);
 int sim_is_interactive(void);
 
+static inline int create_pts(void)
+{
+	return open_pts(sim_is_interactive());
+}
+
 #ifdef __cplusplus
 };
 #endif
@@ -15,6 +15,9 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <sys/epoll.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
@@ -29,21 +32,37 @@ struct debug_data {
 	int epoll_fd;
 	int client_fd;
 	int cur_ir;
+
+	/* A partially received request. */
+	unsigned char rx_buf[sizeof(struct dbg_request)];
+	size_t rx_len;
 };
 
+/*
+ * The socket is edge triggered and debuggers pipeline requests, so callers
+ * must keep calling this until it returns -EAGAIN.
+ */
 static int get_request(struct debug_data *d, struct dbg_request *req)
 {
 	ssize_t br;
-	int rc = -EAGAIN;
 
 	if (d->client_fd < 0)
-		goto out;
+		return -EAGAIN;
 
-	br = read(d->client_fd, req, sizeof(*req));
-	rc = br > 0 ? 0 : -EIO;
+	while (d->rx_len < sizeof(d->rx_buf)) {
+		br = read(d->client_fd, d->rx_buf + d->rx_len,
+			  sizeof(d->rx_buf) - d->rx_len);
+		if (br < 0 && errno == EAGAIN)
+			return -EAGAIN;
+		if (br <= 0)
+			return -EIO;
+		d->rx_len += br;
+	}
 
-out:
-	return rc;
+	memcpy(req, d->rx_buf, sizeof(*req));
+	d->rx_len = 0;
+
+	return 0;
 }
 
 static int send_response(struct debug_data *d, const struct dbg_response *resp)
@@ -118,9 +137,14 @@ static int establish_connection(struct debug_data *data)
 		.data.ptr = data,
 	};
 	int client = accept4(data->sock_fd, NULL, NULL, SOCK_NONBLOCK);
+	int val = 1;
+
 	if (client < 0)
 		return -EAGAIN;
 
+	/* Don't hold back responses to pipelined requests. */
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
 	if (epoll_ctl(data->epoll_fd, EPOLL_CTL_ADD, client, &event)) {
 		warn("failed to add client to epoll (%d)", client);
 		close(client);
@@ -139,6 +163,7 @@ static void close_connection(struct debug_data *data)
 	shutdown(data->client_fd, SHUT_RDWR);
 	close(data->client_fd);
 	data->client_fd = -1;
+	data->rx_len = 0;
 }
 
 static int set_vir(struct debug_data *debug, int ir)
@@ -174,6 +199,12 @@ static int handle_req(struct debug_data *debug, struct dbg_request *req)
 	uint32_t addr = req->addr;
 	unsigned out;
 
+	/* Protocol extensions aren't supported, only the controller's regs. */
+	if (resp.status) {
+		send_response(debug, &resp);
+		return 0;
+	}
+
 	if (!req->read_not_write) {
 		addr |= (1 << 3); /* Write enable. */
 
@@ -214,7 +245,7 @@ static void server_loop(struct debug_data *d)
 		for (;;) {
 			struct epoll_event revent;
 			struct dbg_request req;
-			int nevents;
+			int nevents, rc;
 
 			nevents = epoll_wait(d->epoll_fd, &revent, 1, -1);
 			if (nevents < 0)
@@ -224,8 +255,12 @@ static void server_loop(struct debug_data *d)
 				if (revent.events & (EPOLLRDHUP | EPOLLHUP))
 					break;
 
-				if (!get_request(d, &req) &&
-				    handle_req(d, &req))
+				while (!(rc = get_request(d, &req)))
+					if (handle_req(d, &req)) {
+						rc = -EIO;
+						break;
+					}
+				if (rc == -EIO)
 					break;
 			}
 		}
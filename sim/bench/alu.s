@@ -0,0 +1,24 @@
+.include "bench.s"
+
+/* ALU, load and store loop with the caches off, 4M iterations. */
+.globl _start
+_start:
+	movhi	$r0, 0x0040
+	movhi	$r5, 0x2010
+	xor	$r1, $r1, $r1
+	xor	$r2, $r2, $r2
+	BENCH_START
+loop:
+	add	$r1, $r1, 3
+	xor	$r2, $r2, $r1
+	lsl	$r3, $r1, 2
+	str32	$r2, [$r5, 0x0]
+	ldr32	$r4, [$r5, 0x0]
+	add	$r2, $r4, $r3
+	str8	$r2, [$r5, 0x5]
+	ldr16	$r6, [$r5, 0x4]
+	add	$r7, $r7, $r6
+	sub	$r0, $r0, 1
+	cmp	$r0, 0
+	bne	loop
+	BENCH_END
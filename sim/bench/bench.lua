@@ -0,0 +1,49 @@
+-- Simulator throughput on the programs in this directory against a running
+-- simulator, from the sim/bench build directory:
+--
+--   oldland-sim &
+--   oldland-debug -x SRC/sim/bench/bench.lua
+--
+-- Each program leaves its instruction count in $fp, see bench.s.  The best of
+-- nr_runs runs is reported.
+
+host = "localhost"
+port = "36000"
+nr_runs = 5
+programs = { "alu", "alu_cached", "selfmod", "timer", "calls" }
+
+target_override = os.getenv("OLDLAND_TARGET")
+if target_override then
+	host, port = string.match(target_override, "^([^:]+):?(.*)$")
+end
+
+target.connect(host, port)
+
+for _, name in ipairs(programs) do
+	best = nil
+
+	for run = 1, nr_runs do
+		target.reset()
+		target.loadelf(name)
+
+		start = target.clock()
+		target.run()
+		elapsed = target.clock() - start
+
+		pc = target.read_reg(16)
+		if pc ~= syms.done then
+			print(string.format("%s: stopped at %08x", name, pc))
+			os.exit(1)
+		end
+
+		if not best or elapsed < best then
+			best = elapsed
+		end
+	end
+
+	insns = target.read_reg(13)
+	print(string.format("%-12s %10u instructions %7.1f MIPS", name, insns,
+			    insns / best / 1e6))
+end
+
+target.term()
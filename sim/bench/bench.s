@@ -0,0 +1,28 @@
+/*
+ * BENCH_START runs timer 3 freely and BENCH_END stops at done with the ticks
+ * in between in $fp.  The simulator ticks the timers once per instruction so
+ * that is the instruction count.  Both clobber $sp.
+ */
+.equ	BENCH_TIMER,	0x80003030
+
+.macro	BENCH_START
+	movhi	$sp, %hi(BENCH_TIMER)
+	orlo	$sp, $sp, %lo(BENCH_TIMER)
+	movhi	$fp, 0xffff
+	orlo	$fp, $fp, 0xffff
+	str32	$fp, [$sp, 0x4] /* Reload value. */
+	xor	$fp, $fp, $fp
+	orlo	$fp, $fp, 0x3 /* Periodic, enabled. */
+	str32	$fp, [$sp, 0x8]
+	ldr32	$fp, [$sp, 0x0]
+.endm
+
+.macro	BENCH_END
+	movhi	$sp, %hi(BENCH_TIMER)
+	orlo	$sp, $sp, %lo(BENCH_TIMER)
+	ldr32	$sp, [$sp, 0x0]
+	sub	$fp, $fp, $sp
+.globl	done
+done:
+	bkp
+.endm
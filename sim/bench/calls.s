@@ -0,0 +1,37 @@
+.include "bench.s"
+
+/*
+ * Calls, returns and a data dependent branch, so blocks of two to four
+ * instructions that are only fast when chained, 4M iterations.
+ */
+.globl _start
+_start:
+	movhi	$r0, 0x0040
+	xor	$r1, $r1, $r1
+	xor	$r2, $r2, $r2
+	BENCH_START
+loop:
+	call	step
+	call	mix
+	and	$r3, $r2, 1
+	cmp	$r3, 0
+	beq	even
+	add	$r7, $r7, 1
+	b	next
+even:
+	sub	$r7, $r7, 1
+next:
+	sub	$r0, $r0, 1
+	cmp	$r0, 0
+	bne	loop
+	BENCH_END
+
+step:
+	add	$r1, $r1, 3
+	ret
+
+mix:
+	xor	$r2, $r2, $r1
+	lsr	$r4, $r2, 3
+	add	$r2, $r2, $r4
+	ret
@@ -0,0 +1,78 @@
+.include "bench.s"
+
+/*
+ * Code rewritten on every iteration: first through the caches with explicit
+ * flushes and invalidates, then with the caches off, then a straight-line
+ * run that patches the instruction after the store doing the patching.
+ */
+.globl _start
+_start:
+	mov	$r12, 0x60 /* I+D cache enable. */
+	scr	1, $r12
+	movhi	$r0, %hi(patch)
+	orlo	$r0, $r0, %lo(patch)
+	ldr32	$r1, insn_a
+	ldr32	$r2, insn_b
+	ldr32	$r3, insn_ret
+	BENCH_START
+
+	movhi	$r11, 0x0010
+cached:
+	str32	$r1, [$r0, 0x0]
+	str32	$r3, [$r0, 0x4]
+	lsr	$r10, $r0, 5
+	cache	$r10, 2
+	cache	$r10, 0
+	call	$r0
+	str32	$r2, [$r0, 0x0]
+	cache	$r10, 2
+	cache	$r10, 0
+	call	$r0
+	sub	$r11, $r11, 1
+	cmp	$r11, 0
+	bne	cached
+
+	xor	$r12, $r12, $r12
+	scr	1, $r12
+	movhi	$r11, 0x0010
+uncached:
+	str32	$r1, [$r0, 0x0]
+	call	$r0
+	str32	$r2, [$r0, 0x0]
+	call	$r0
+	sub	$r11, $r11, 1
+	cmp	$r11, 0
+	bne	uncached
+
+	movhi	$r11, 0x0001
+	add	$r9, $r0, 0x8
+inline:
+	ldr32	$r8, insn_nop
+	str32	$r8, [$r0, 0xc]
+	str32	$r3, [$r0, 0x10]
+	str32	$r1, [$r0, 0x8]
+	ldr32	$r8, insn_patch
+	str32	$r8, [$r0, 0x8]
+	call	$r9
+	sub	$r11, $r11, 1
+	cmp	$r11, 0
+	bne	inline
+
+	BENCH_END
+
+insn_a:
+	add	$r7, $r7, 1
+insn_b:
+	add	$r7, $r7, 16
+insn_ret:
+	ret
+insn_nop:
+	nop
+insn_patch:
+	str32	$r2, [$r0, 0xc]
+
+	.balign	32
+patch:
+.rept	8
+	.long	0
+.endr
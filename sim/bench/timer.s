@@ -0,0 +1,57 @@
+.include "bench.s"
+
+/* A short loop interrupted by timer 0 every 100 ticks, 400000 times. */
+.globl _start
+_start:
+	movhi	$r0, %hi(ex_table)
+	orlo	$r0, $r0, %lo(ex_table)
+	scr	0, $r0
+
+	movhi	$r1, 0x8000
+	orlo	$r1, $r1, 0x3000
+	movhi	$r5, 0x8000
+	orlo	$r5, $r5, 0x2000
+	xor	$r6, $r6, $r6
+	orlo	$r6, $r6, 0x1
+	str32	$r6, [$r5, 0x4]
+
+	/* Enable interrupts. */
+	gcr	$r0, 1
+	bst	$r0, $r0, 4
+	scr	1, $r0
+
+	movhi	$r11, %hi(400000)
+	orlo	$r11, $r11, %lo(400000)
+	BENCH_START
+
+	xor	$r2, $r2, $r2
+	orlo	$r2, $r2, 100
+	str32	$r2, [$r1, 0x4] /* Reload value. */
+	xor	$r2, $r2, $r2
+	orlo	$r2, $r2, 0x7 /* Periodic, enabled, irq enabled. */
+	str32	$r2, [$r1, 0x8]
+wait:
+	add	$r7, $r7, 1
+	cmp	$r4, $r11
+	blt	wait
+
+	xor	$r2, $r2, $r2
+	str32	$r2, [$r1, 0x8]
+	BENCH_END
+
+irq_vector:
+	add	$r4, $r4, 1
+	str32	$r4, [$r1, 0xc]
+	rfe
+
+bad_vector:
+	bkp
+
+	.balign	64
+ex_table:
+	b	bad_vector	/* RESET */
+	b	bad_vector	/* ILLEGAL_INSTR */
+	b	bad_vector	/* SWI */
+	b	irq_vector	/* IRQ */
+	b	bad_vector	/* IFETCH_ABORT */
+	b	bad_vector	/* DATA_ABORT */
@@ -0,0 +1,39 @@
+/*
+ * Translated block cache.
+ *
+ * Blocks are kept in a direct mapped table indexed by physical address, with
+ * a separate table for blocks built with the instruction cache enabled.  A
+ * conflicting block simply replaces the old one in place.
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include "block_cache.h"
+
+#define NR_BLOCK_BITS		12
+
+struct block_cache {
+	struct block blocks[2][1 << NR_BLOCK_BITS];
+};
+
+struct block_cache *block_cache_new(void)
+{
+	return calloc(1, sizeof(struct block_cache));
+}
+
+struct block *block_cache_lookup(struct block_cache *bc, uint32_t phys,
+				 bool icache)
+{
+	unsigned int idx = (phys >> 2) & ((1 << NR_BLOCK_BITS) - 1);
+
+	return &bc->blocks[icache][idx];
+}
+
+void block_cache_flush(struct block_cache *bc)
+{
+	unsigned int icache, idx;
+
+	for (icache = 0; icache < 2; ++icache)
+		for (idx = 0; idx < (1 << NR_BLOCK_BITS); ++idx)
+			bc->blocks[icache][idx].nr_insns = 0;
+}
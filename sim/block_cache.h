@@ -0,0 +1,81 @@
+#ifndef __BLOCK_CACHE_H__
+#define __BLOCK_CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "decode_cache.h"
+
+#define BLOCK_MAX_INSNS		32
+
+struct block;
+
+/*
+ * A cached link from the end of one block to the block that followed it.
+ * The link can only be followed when the fetch context (MMU, user mode,
+ * instruction cache and ITLB contents) matches the one it was made in,
+ * otherwise the PC may translate to a different physical address.
+ */
+struct block_chain {
+	struct block *block;
+	uint32_t virt;
+	uint32_t phys;
+	unsigned long ctx;
+};
+
+/*
+ * A run of sequential instructions within a single page, ending at the first
+ * instruction that may change control flow or the fetch context.  The decodes
+ * are copies rather than pointers into the decode cache so that blocks built
+ * from the instruction cache keep what was actually fetched.
+ *
+ * A block is valid while *gen_ptr == gen: gen_ptr points at the instruction
+ * cache generation for blocks built with the instruction cache enabled and at
+ * the decode cache page generation otherwise.
+ *
+ * execs counts dispatches of the block for the JIT's hotness threshold.
+ * native is the translated code, only usable while native_gen matches the
+ * JIT's code cache generation.
+ *
+ * idle_candidate blocks end in a branch and have no side effects other than
+ * registers, flags and loads, so if a run that loops back to the start leaves
+ * those unchanged then the block will spin until an event arrives.  loops
+ * paces how often that is checked.
+ */
+struct block {
+	uint32_t virt;
+	uint32_t phys;
+	bool icache;
+	const unsigned long *gen_ptr;
+	unsigned long gen;
+	unsigned int nr_insns;
+	unsigned int execs;
+	bool idle_candidate;
+	unsigned int loops;
+	void *native;
+	unsigned long native_gen;
+	struct block_chain succ[2];
+	struct decoded_insn insns[BLOCK_MAX_INSNS];
+};
+
+struct block_cache;
+
+struct block_cache *block_cache_new(void);
+/*
+ * Return the slot for phys, which may hold a different or stale block that
+ * the caller should replace.  Slots are never freed so chains to them always
+ * point at a block, though not necessarily the one that was linked.
+ */
+struct block *block_cache_lookup(struct block_cache *bc, uint32_t phys,
+				 bool icache);
+/* Invalidate every block, chains to them fail validation. */
+void block_cache_flush(struct block_cache *bc);
+
+static inline bool block_valid(const struct block *b, uint32_t phys,
+			       bool icache)
+{
+	return b->nr_insns && b->phys == phys && b->icache == icache &&
+		*b->gen_ptr == b->gen;
+}
+
+#endif /* __BLOCK_CACHE_H__ */
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "cache.h"
+#include "checkpoint.h"
 #include "io.h"
 
 #define CACHE_OFFSET_SZ		(1 << ICACHE_OFFSET_BITS)
@@ -33,6 +34,7 @@ struct cache {
 	struct mem_map *mem;
 	struct cache_line lines[ICACHE_NUM_WAYS][CACHE_INDEX_SZ];
 	unsigned victimsel;
+	unsigned long generation;
 };
 
 struct cache *cache_new(struct mem_map *mem)
@@ -45,6 +47,11 @@ struct cache *cache_new(struct mem_map *mem)
 	return c;
 }
 
+const unsigned long *cache_generation(const struct cache *cache)
+{
+	return &cache->generation;
+}
+
 static inline uint32_t addr_offs(uint32_t addr)
 {
 	return addr & CACHE_OFFSET_MASK;
@@ -70,6 +77,7 @@ void cache_inval_index(struct cache *cache, uint32_t indx)
 			cache->lines[way][indx].dirty = 0;
 		}
 	}
+	cache->generation++;
 }
 
 void cache_inval_all(struct cache *cache)
@@ -84,9 +92,10 @@ void cache_inval_all(struct cache *cache)
 			cache->lines[way][i].dirty = 0;
 		}
 	}
+	cache->generation++;
 }
 
-static int cache_fill_line(const struct cache *cache, struct cache_line *line,
+static int cache_fill_line(struct cache *cache, struct cache_line *line,
 			   uint32_t addr)
 {
 	uint32_t tag = addr_tag(addr);
@@ -102,6 +111,7 @@ static int cache_fill_line(const struct cache *cache, struct cache_line *line,
 	line->valid = !rc;
 	line->dirty = 0;
 	line->tag = tag;
+	cache->generation++;
 
 	return rc;
 }
@@ -229,3 +239,20 @@ int cache_flush_all(struct cache *cache)
 
 	return rc;
 }
+
+void cache_save(const struct cache *cache, struct checkpoint *cp)
+{
+	checkpoint_put(cp, "CACL", cache->lines, sizeof(cache->lines));
+	checkpoint_put(cp, "CACV", &cache->victimsel, sizeof(cache->victimsel));
+}
+
+void cache_restore(struct cache *cache, struct checkpoint *cp)
+{
+	checkpoint_get(cp, "CACL", cache->lines, sizeof(cache->lines));
+	checkpoint_get(cp, "CACV", &cache->victimsel, sizeof(cache->victimsel));
+	if (cache->victimsel >= ICACHE_NUM_WAYS) {
+		checkpoint_set_error(cp, -EINVAL);
+		cache->victimsel = 0;
+	}
+	cache->generation++;
+}
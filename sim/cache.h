@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+struct checkpoint;
 struct mem_map;
 
 struct cache *cache_new(struct mem_map *mem);
@@ -15,5 +16,13 @@ int cache_read(struct cache *cache, uint32_t virt, uint32_t phys,
 	       unsigned int nr_bits, uint32_t *val);
 int cache_write(struct cache *cache, uint32_t virt, uint32_t phys,
 		unsigned int nr_bits, uint32_t val);
+/*
+ * Incremented whenever a line is filled or invalidated, anything derived
+ * from the cache contents is stale once this changes.
+ */
+const unsigned long *cache_generation(const struct cache *cache);
+/* The lines, dirty or not, and the replacement state. */
+void cache_save(const struct cache *cache, struct checkpoint *cp);
+void cache_restore(struct cache *cache, struct checkpoint *cp);
 
 #endif /* __CACHE_H__ */
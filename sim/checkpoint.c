@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC	"OLDLANDC"
+#define CHECKPOINT_VERSION	1
+
+struct checkpoint_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+};
+
+struct section_header {
+	char tag[4];
+	uint32_t reserved;
+	uint64_t len;
+};
+
+struct checkpoint {
+	int fd;
+	bool writing;
+	/* Renamed over path on closing a checkpoint being written. */
+	char *path;
+	char *tmp_path;
+	off_t offset;
+	size_t page_size;
+	int error;
+};
+
+int checkpoint_error(const struct checkpoint *cp)
+{
+	return cp->error;
+}
+
+void checkpoint_set_error(struct checkpoint *cp, int err)
+{
+	if (!cp->error)
+		cp->error = err;
+}
+
+static void write_bytes(struct checkpoint *cp, const void *data, size_t len)
+{
+	while (len && !cp->error) {
+		ssize_t bw = pwrite(cp->fd, data, len, cp->offset);
+
+		if (bw < 0 && errno == EINTR)
+			continue;
+		if (bw <= 0) {
+			checkpoint_set_error(cp, bw < 0 ? -errno : -EIO);
+			return;
+		}
+		data = (const unsigned char *)data + bw;
+		len -= bw;
+		cp->offset += bw;
+	}
+}
+
+static void read_bytes(struct checkpoint *cp, void *data, size_t len)
+{
+	while (len && !cp->error) {
+		ssize_t br = pread(cp->fd, data, len, cp->offset);
+
+		if (br < 0 && errno == EINTR)
+			continue;
+		/* A truncated checkpoint is as bad as a corrupt one. */
+		if (br <= 0) {
+			checkpoint_set_error(cp, br < 0 ? -errno : -EINVAL);
+			return;
+		}
+		data = (unsigned char *)data + br;
+		len -= br;
+		cp->offset += br;
+	}
+}
+
+static struct checkpoint *checkpoint_alloc(const char *path)
+{
+	struct checkpoint *cp = calloc(1, sizeof(*cp));
+
+	if (!cp)
+		return NULL;
+
+	cp->fd = -1;
+	cp->page_size = sysconf(_SC_PAGESIZE);
+	cp->path = strdup(path);
+	if (!cp->path) {
+		free(cp);
+		return NULL;
+	}
+
+	return cp;
+}
+
+static void checkpoint_free(struct checkpoint *cp)
+{
+	if (cp->fd >= 0)
+		close(cp->fd);
+	free(cp->tmp_path);
+	free(cp->path);
+	free(cp);
+}
+
+/*
+ * CPUs restored from a checkpoint keep it mapped, so a new checkpoint at the
+ * same path has to be a new file rather than written over the old one.
+ */
+struct checkpoint *checkpoint_create(const char *path)
+{
+	struct checkpoint *cp = checkpoint_alloc(path);
+	struct checkpoint_header hdr = {
+		.magic = CHECKPOINT_MAGIC,
+		.version = CHECKPOINT_VERSION,
+	};
+
+	if (!cp)
+		return NULL;
+
+	cp->writing = true;
+	if (asprintf(&cp->tmp_path, "%s.XXXXXX", path) < 0) {
+		cp->tmp_path = NULL;
+		checkpoint_free(cp);
+		return NULL;
+	}
+	cp->fd = mkostemp(cp->tmp_path, O_CLOEXEC);
+	if (cp->fd < 0) {
+		checkpoint_free(cp);
+		return NULL;
+	}
+
+	hdr.page_size = cp->page_size;
+	write_bytes(cp, &hdr, sizeof(hdr));
+
+	return cp;
+}
+
+struct checkpoint *checkpoint_open(const char *path)
+{
+	struct checkpoint *cp = checkpoint_alloc(path);
+	struct checkpoint_header hdr;
+
+	if (!cp)
+		return NULL;
+
+	cp->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (cp->fd < 0) {
+		checkpoint_free(cp);
+		return NULL;
+	}
+
+	read_bytes(cp, &hdr, sizeof(hdr));
+	if (!cp->error &&
+	    (memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) ||
+	     hdr.version != CHECKPOINT_VERSION ||
+	     hdr.page_size != cp->page_size))
+		checkpoint_set_error(cp, -EINVAL);
+
+	return cp;
+}
+
+int checkpoint_close(struct checkpoint *cp)
+{
+	int rc;
+
+	/* Trailing holes still have to be part of the file. */
+	if (cp->writing && !cp->error && ftruncate(cp->fd, cp->offset))
+		checkpoint_set_error(cp, -errno);
+	if (cp->writing && !cp->error && rename(cp->tmp_path, cp->path))
+		checkpoint_set_error(cp, -errno);
+	if (cp->writing && cp->error)
+		unlink(cp->tmp_path);
+
+	rc = cp->error;
+	checkpoint_free(cp);
+
+	return rc;
+}
+
+static void put_header(struct checkpoint *cp, const char *tag, size_t len)
+{
+	struct section_header hdr = { .len = len };
+
+	memcpy(hdr.tag, tag, sizeof(hdr.tag));
+	write_bytes(cp, &hdr, sizeof(hdr));
+}
+
+static void get_header(struct checkpoint *cp, const char *tag, size_t len)
+{
+	struct section_header hdr;
+
+	read_bytes(cp, &hdr, sizeof(hdr));
+	if (!cp->error &&
+	    (memcmp(hdr.tag, tag, sizeof(hdr.tag)) || hdr.len != len))
+		checkpoint_set_error(cp, -EINVAL);
+}
+
+void checkpoint_put(struct checkpoint *cp, const char *tag, const void *data,
+		    size_t len)
+{
+	put_header(cp, tag, len);
+	write_bytes(cp, data, len);
+}
+
+void checkpoint_get(struct checkpoint *cp, const char *tag, void *data,
+		    size_t len)
+{
+	get_header(cp, tag, len);
+	read_bytes(cp, data, len);
+}
+
+static void align_to_page(struct checkpoint *cp)
+{
+	cp->offset = (cp->offset + cp->page_size - 1) & ~(cp->page_size - 1);
+}
+
+static bool page_is_zero(const unsigned char *page, size_t len)
+{
+	return !page[0] && !memcmp(page, page + 1, len - 1);
+}
+
+void checkpoint_put_pages(struct checkpoint *cp, const char *tag,
+			  const void *mem, size_t len)
+{
+	const unsigned char *p = mem;
+	size_t nr_pages = (len + cp->page_size - 1) / cp->page_size, m;
+	off_t base;
+
+	put_header(cp, tag, len);
+	align_to_page(cp);
+	base = cp->offset;
+	if (cp->error)
+		return;
+
+	/*
+	 * Untouched pages read back as zero without being faulted in, so they
+	 * stay holes along with every other zero page.
+	 */
+	for (m = 0; m < nr_pages && !cp->error; ++m) {
+		size_t offs = m * cp->page_size;
+		size_t n = len - offs < cp->page_size ? len - offs :
+			cp->page_size;
+
+		if (page_is_zero(p + offs, n))
+			continue;
+		cp->offset = base + offs;
+		write_bytes(cp, p + offs, n);
+	}
+
+	cp->offset = base + len;
+}
+
+void checkpoint_map_pages(struct checkpoint *cp, const char *tag, void *mem,
+			  size_t len)
+{
+	struct stat st;
+
+	get_header(cp, tag, len);
+	align_to_page(cp);
+	if (cp->error)
+		return;
+
+	/* Touching a page beyond the end of the file would raise SIGBUS. */
+	if (fstat(cp->fd, &st)) {
+		checkpoint_set_error(cp, -errno);
+		return;
+	}
+	if (st.st_size < cp->offset + (off_t)len) {
+		checkpoint_set_error(cp, -EINVAL);
+		return;
+	}
+
+	if (mmap(mem, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+		 cp->fd, cp->offset) == MAP_FAILED)
+		checkpoint_set_error(cp, -errno);
+	cp->offset += len;
+}
+
+void checkpoint_discard_pages(void *mem, size_t len)
+{
+	void *p = mmap(mem, len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+	assert(p != MAP_FAILED);
+}
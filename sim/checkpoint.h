@@ -0,0 +1,44 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <stddef.h>
+
+/*
+ * Checkpoint files, see cpu_save_checkpoint().  A checkpoint is a header
+ * followed by sections, each put by one part of the model and read back in
+ * the same order.  Sections are tagged with four characters and their length
+ * so that a checkpoint from a differently configured simulator is rejected
+ * rather than misread.
+ *
+ * Memory sections are aligned to host pages in the file and only pages that
+ * aren't zero are stored, the rest are left as holes.  Restoring maps the
+ * section over the memory privately so pages are only copied once they are
+ * written, and all of the CPUs restored from one checkpoint share the rest
+ * through the page cache.
+ *
+ * Errors are sticky: once a put or get fails the rest do nothing and the
+ * error is returned by checkpoint_close().
+ */
+struct checkpoint;
+
+/* Written to a temporary file that only replaces path once it is closed. */
+struct checkpoint *checkpoint_create(const char *path);
+struct checkpoint *checkpoint_open(const char *path);
+int checkpoint_close(struct checkpoint *cp);
+int checkpoint_error(const struct checkpoint *cp);
+/* Fail the checkpoint with err, if it hasn't already failed. */
+void checkpoint_set_error(struct checkpoint *cp, int err);
+
+void checkpoint_put(struct checkpoint *cp, const char *tag, const void *data,
+		    size_t len);
+void checkpoint_get(struct checkpoint *cp, const char *tag, void *data,
+		    size_t len);
+/* mem must be page aligned, as anything that mmap() returns is. */
+void checkpoint_put_pages(struct checkpoint *cp, const char *tag,
+			  const void *mem, size_t len);
+void checkpoint_map_pages(struct checkpoint *cp, const char *tag, void *mem,
+			  size_t len);
+/* Replace whatever is mapped at mem with fresh zeroed pages. */
+void checkpoint_discard_pages(void *mem, size_t len);
+
+#endif /* __CHECKPOINT_H__ */
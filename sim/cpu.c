@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <libgen.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -9,11 +10,15 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "block_cache.h"
 #include "cache.h"
+#include "checkpoint.h"
 #include "cpu.h"
+#include "decode_cache.h"
 #include "internal.h"
 #include "irq_ctrl.h"
 #include "io.h"
+#include "jit.h"
 #include "microcode.h"
 #include "tlb.h"
 #include "trace.h"
@@ -60,6 +65,51 @@ enum control_register {
 #define MICROCODE_NR_WORDS	(1 << 7)
 #define GPSR_SPSR_MASK          (0xf)
 
+/*
+ * Direct mapped cache of virtual data pages that are backed by host memory,
+ * avoiding the TLB search and region lookup on every load and store.  Entries
+ * are tagged with the MMU mode that they were filled in as the permissions
+ * differ between user and supervisor.
+ */
+#define SOFT_TLB_ENTRIES	64
+
+enum soft_tlb_tag {
+	SOFT_TLB_VALID		= (1 << 0),
+	SOFT_TLB_MMU		= (1 << 1),
+	SOFT_TLB_USER		= (1 << 2),
+	/* Never set in an entry, so a lookup with it always misses. */
+	SOFT_TLB_NEVER		= (1 << 3),
+};
+
+/*
+ * code is set for write entries whose page has decoded instructions, stores
+ * to those have to invalidate the decode cache.  It is set when the entry is
+ * filled and whenever an instruction in the page is decoded.
+ */
+struct soft_tlb_entry {
+	uint32_t tag;
+	uint32_t phys;
+	uint8_t *host;
+	bool code;
+};
+
+struct soft_tlb {
+	struct soft_tlb_entry read[SOFT_TLB_ENTRIES];
+	struct soft_tlb_entry write[SOFT_TLB_ENTRIES];
+};
+
+/*
+ * Debugger breakpoints are kept sorted with a bitmap indexed by the word
+ * address modulo its size, so most PCs are rejected without a search.
+ */
+#define BKPT_FILTER_BITS	4096
+
+struct watchpoint {
+	uint32_t addr;
+	uint32_t len;
+	unsigned int flags;
+};
+
 struct cpu {
 	uint32_t pc;
 	uint32_t next_pc;
@@ -80,10 +130,10 @@ struct cpu {
 	};
 
 	struct mem_map *mem;
-	FILE *trace_file;
+	struct trace *trace;
 	unsigned long long cycle_count;
         uint32_t control_regs[NUM_CONTROL_REGS];
-	uint32_t ucode[MICROCODE_NR_WORDS];
+	const uint32_t *ucode;
 	bool irq_active;
 	struct event_list events;
 	struct irq_ctrl *irq_ctrl;
@@ -93,6 +143,32 @@ struct cpu {
 	struct cache *dcache;
         struct tlb *dtlb;
         struct tlb *itlb;
+	struct decode_cache *decode_cache;
+	struct soft_tlb soft_tlb;
+	struct block_cache *block_cache;
+
+	bool idle_skip;
+	uint32_t idle_regs[16];
+	uint32_t idle_flags;
+	bool idle_io_read;
+	unsigned long long idle_cycles;
+
+	struct jit *jit;
+	unsigned int jit_threshold;
+	/* State for the block currently running natively. */
+	const struct block *jit_block;
+	uint32_t jit_ticks;
+	uint32_t jit_data_tag;
+	bool *jit_breakpoint_hit;
+
+	uint32_t *bkpts;
+	unsigned int nr_bkpts;
+	uint64_t bkpt_filter[BKPT_FILTER_BITS / 64];
+	struct watchpoint watchpoints[CPU_MAX_WATCHPOINTS];
+	unsigned int nr_watchpoints;
+	/* The last instruction touched a watched range, at watch_addr. */
+	bool watch_hit;
+	uint32_t watch_addr;
 };
 
 enum cpuid_reg_names {
@@ -268,6 +344,110 @@ static int translate_instruction_address(struct cpu *c,
 	return 0;
 }
 
+static void soft_tlb_flush(struct cpu *c)
+{
+	memset(&c->soft_tlb, 0, sizeof(c->soft_tlb));
+}
+
+static inline uint32_t soft_tlb_tag(const struct cpu *c, uint32_t virt)
+{
+	uint32_t tag = (virt & ~(PAGE_SIZE - 1)) | SOFT_TLB_VALID;
+
+	if (mmu_enabled(c))
+		tag |= SOFT_TLB_MMU | (c->flagsbf.u ? SOFT_TLB_USER : 0);
+
+	return tag;
+}
+
+static inline struct soft_tlb_entry *
+soft_tlb_entry(struct soft_tlb_entry *entries, uint32_t virt)
+{
+	return &entries[(virt / PAGE_SIZE) % SOFT_TLB_ENTRIES];
+}
+
+/*
+ * Only naturally aligned accesses take the fast path so that misaligned ones
+ * still fault in the memory map.
+ */
+static inline struct soft_tlb_entry *
+soft_tlb_lookup(struct cpu *c, struct soft_tlb_entry *entries, uint32_t virt,
+		size_t nbits)
+{
+	struct soft_tlb_entry *e = soft_tlb_entry(entries, virt);
+
+	if (e->tag != soft_tlb_tag(c, virt) || (virt & (nbits / 8 - 1)))
+		return NULL;
+
+	return e;
+}
+
+static void soft_tlb_fill(struct cpu *c, struct soft_tlb_entry *entries,
+			  const struct translation *translation, bool write)
+{
+	uint32_t phys = translation->phys & ~(PAGE_SIZE - 1);
+	uint8_t *host = mem_map_host_ptr(c->mem, phys, write);
+	struct soft_tlb_entry *e;
+
+	if (!host)
+		return;
+
+	e = soft_tlb_entry(entries, translation->virt);
+	e->tag = soft_tlb_tag(c, translation->virt);
+	e->phys = phys;
+	e->host = host;
+	e->code = write && decode_cache_has_page(c->decode_cache, phys);
+}
+
+static void soft_tlb_mark_code(struct cpu *c, uint32_t phys)
+{
+	unsigned int m;
+
+	for (m = 0; m < SOFT_TLB_ENTRIES; ++m) {
+		struct soft_tlb_entry *e = &c->soft_tlb.write[m];
+
+		if (e->tag && e->phys == (phys & ~(PAGE_SIZE - 1)))
+			e->code = true;
+	}
+}
+
+static inline int host_read(const uint8_t *p, size_t nbits, uint32_t *v)
+{
+	switch (nbits) {
+	case 8:
+		*v = *p;
+		break;
+	case 16:
+		*v = *(const uint16_t *)p;
+		break;
+	case 32:
+		*v = *(const uint32_t *)p;
+		break;
+	default:
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static inline int host_write(uint8_t *p, size_t nbits, uint32_t v)
+{
+	switch (nbits) {
+	case 8:
+		*p = v;
+		break;
+	case 16:
+		*(uint16_t *)p = v;
+		break;
+	case 32:
+		*(uint32_t *)p = v;
+		break;
+	default:
+		return -EIO;
+	}
+
+	return 0;
+}
+
 int cpu_read_mem(struct cpu *c, uint32_t addr, uint32_t *v, size_t nbits,
 		 int *tlb_miss)
 {
@@ -275,6 +455,18 @@ int cpu_read_mem(struct cpu *c, uint32_t addr, uint32_t *v, size_t nbits,
 		.virt = addr,
 		.phys = addr,
 	};
+	struct soft_tlb_entry *e = soft_tlb_lookup(c, c->soft_tlb.read, addr,
+						   nbits);
+	uint32_t offs = addr & (PAGE_SIZE - 1);
+
+	if (e) {
+		*tlb_miss = 0;
+		/* Host backed memory is always cacheable. */
+		if (data_cache_enabled(c))
+			return cache_read(c->dcache, addr, e->phys | offs,
+					  nbits, v);
+		return host_read(e->host + offs, nbits, v);
+	}
 
 	/*
 	 * Translation failure triggers a TLB miss, we don't want to take a
@@ -289,12 +481,16 @@ int cpu_read_mem(struct cpu *c, uint32_t addr, uint32_t *v, size_t nbits,
 		return -1;
 
 	*tlb_miss = 0;
+	soft_tlb_fill(c, c->soft_tlb.read, &translation, false);
 
 	if (mem_map_addr_cacheable(c->mem, translation.phys) &&
 	    data_cache_enabled(c))
 		return cache_read(c->dcache, addr, translation.phys, nbits,
 				  v);
 
+	if (!mem_map_addr_stable(c->mem, translation.phys))
+		c->idle_io_read = true;
+
 	return mem_map_read(c->mem, translation.phys, nbits, v);
 }
 
@@ -304,6 +500,24 @@ int cpu_write_mem(struct cpu *c, uint32_t addr, uint32_t v, size_t nbits)
 		.virt = addr,
 		.phys = addr,
 	};
+	struct soft_tlb_entry *e = soft_tlb_lookup(c, c->soft_tlb.write, addr,
+						   nbits);
+	uint32_t offs = addr & (PAGE_SIZE - 1);
+
+	if (e) {
+		int rc;
+
+		if (data_cache_enabled(c))
+			return cache_write(c->dcache, addr, e->phys | offs,
+					   nbits, v);
+		/* Bypasses the memory map so do the write notification. */
+		rc = host_write(e->host + offs, nbits, v);
+		if (e->code)
+			decode_cache_inval_addr(c->decode_cache,
+						e->phys | offs);
+
+		return rc;
+	}
 
 	/*
 	 * Translation failure triggers a TLB miss, we don't want to take a
@@ -313,6 +527,7 @@ int cpu_write_mem(struct cpu *c, uint32_t addr, uint32_t v, size_t nbits)
 		return 0;
 	if (!(translation.perms & TLB_WRITE))
 		return -1;
+	soft_tlb_fill(c, c->soft_tlb.write, &translation, true);
 	if (mem_map_addr_cacheable(c->mem, translation.phys) &&
 	    data_cache_enabled(c))
 		return cache_write(c->dcache, addr, translation.phys, nbits,
@@ -363,11 +578,16 @@ static inline uint32_t instr_imm24(uint32_t instr)
 
 static void cpu_wr_reg(struct cpu *c, enum regs r, uint32_t v)
 {
-	trace(c->trace_file, TRACE_R0 + r, v);
+	trace(c->trace, TRACE_R0 + r, v);
 	c->regs[r] = v;
 }
 
-static int load_microcode(struct cpu *c, const char *path)
+struct cpu_assets {
+	void *rom;
+	uint32_t ucode[MICROCODE_NR_WORDS];
+};
+
+static int load_microcode(struct cpu_assets *a, const char *path)
 {
 	FILE *fp = fopen(path, "r");
 	unsigned m = 0;
@@ -391,7 +611,7 @@ static int load_microcode(struct cpu *c, const char *path)
 		if (m == MICROCODE_NR_WORDS)
 			errx(1, "malformed microcode file, too many words");
 
-		c->ucode[m++] = v;
+		a->ucode[m++] = v;
 	}
 
 	fclose(fp);
@@ -399,6 +619,13 @@ static int load_microcode(struct cpu *c, const char *path)
 	return 0;
 }
 
+static void cpu_mem_written(physaddr_t addr, void *data)
+{
+	struct cpu *c = data;
+
+	decode_cache_inval_addr(c->decode_cache, addr);
+}
+
 static void cpu_raise_irq(void *data)
 {
 	struct cpu *c = data;
@@ -413,9 +640,36 @@ static void cpu_clear_irq(void *data)
 	c->irq_active = false;
 }
 
+struct cpu_assets *cpu_assets_load(const char *bootrom_image)
+{
+	struct cpu_assets *a = calloc(1, sizeof(*a));
+	int err;
+
+	assert(a);
+
+	a->rom = rom_map(bootrom_image ? bootrom_image : ROM_FILE,
+			 BOOTROM_SIZE);
+	assert(a->rom);
+
+	err = load_microcode(a, MICROCODE_FILE);
+	assert(!err);
+
+	return a;
+}
+
+static void jit_init(struct cpu *c);
+
 struct cpu *new_cpu(const char *binary, int flags,
 		    const char *bootrom_image,
 		    const char *sdcard_image)
+{
+	return new_cpu_shared(binary, flags, cpu_assets_load(bootrom_image),
+			      sdcard_image);
+}
+
+struct cpu *new_cpu_shared(const char *binary, int flags,
+			   const struct cpu_assets *assets,
+			   const char *sdcard_image)
 {
 	int err;
 	struct cpu *c;
@@ -425,8 +679,14 @@ struct cpu *new_cpu(const char *binary, int flags,
 	c = calloc(1, sizeof(*c));
 	assert(c);
 
-	if (!(flags & CPU_NOTRACE))
-		c->trace_file = init_trace_file();
+	if (!(flags & CPU_NOTRACE)) {
+		if (flags & CPU_BINARY_TRACE)
+			c->trace = trace_open("oldland.trace",
+					      TRACE_FORMAT_BINARY);
+		else
+			c->trace = trace_open("oldland.vcd", TRACE_FORMAT_VCD);
+		assert(c->trace);
+	}
 
 	event_list_init(&c->events);
 
@@ -436,7 +696,7 @@ struct cpu *new_cpu(const char *binary, int flags,
 	err = ram_init(c->mem, RAM_ADDRESS, RAM_SIZE, binary);
 	assert(!err);
 
-	err = rom_init(c->mem, BOOTROM_ADDRESS, BOOTROM_SIZE, bootrom_image);
+	err = rom_init(c->mem, BOOTROM_ADDRESS, BOOTROM_SIZE, assets->rom);
 	assert(!err);
 
 	err = ram_init(c->mem, SDRAM_ADDRESS, SDRAM_SIZE, NULL);
@@ -445,7 +705,8 @@ struct cpu *new_cpu(const char *binary, int flags,
 	err = sdram_ctrl_init(c->mem, SDRAM_CTRL_ADDRESS, SDRAM_CTRL_SIZE);
 	assert(!err);
 
-	err = debug_uart_init(c->mem, UART_ADDRESS, UART_SIZE);
+	err = debug_uart_init(c->mem, UART_ADDRESS, UART_SIZE,
+			      flags & CPU_INTERACTIVE);
 	assert(!err);
 
 	c->irq_ctrl = irq_ctrl_init(c->mem, IRQ_ADDRESS, cpu_raise_irq,
@@ -462,7 +723,9 @@ struct cpu *new_cpu(const char *binary, int flags,
 	spislaves = calloc(1, sizeof(*spislaves));
 	assert(spislaves != NULL);
 	if (sdcard_image)
-		spislaves[0] = sdcard_new(sdcard_image);
+		spislaves[0] = sdcard_new(sdcard_image,
+					  flags & CPU_SDCARD_COW ?
+					  SPI_SDCARD_COW : 0);
 	c->spimaster = spimaster_init(c->mem, SPIMASTER_ADDRESS, spislaves,
 				      ARRAY_SIZE(spislaves));
         assert(c->spimaster);
@@ -478,8 +741,18 @@ struct cpu *new_cpu(const char *binary, int flags,
         c->itlb = tlb_new(ITLB_NUM_ENTRIES);
         assert(c->itlb);
 
-	err = load_microcode(c, MICROCODE_FILE);
-	assert(!err);
+	c->ucode = assets->ucode;
+
+	c->decode_cache = decode_cache_new();
+	assert(c->decode_cache);
+	mem_map_set_write_notifier(c->mem, cpu_mem_written, c);
+
+	c->block_cache = block_cache_new();
+	assert(c->block_cache);
+
+	c->idle_skip = !(flags & CPU_NO_IDLE_SKIP);
+	if (flags & CPU_JIT)
+		jit_init(c);
 
 	cpu_reset(c);
 
@@ -494,32 +767,43 @@ static void do_vector(struct cpu *c, enum exception_vector vector)
 	c->flagsbf.i = 0;
 	c->flagsbf.u = 0;
 	cpu_set_next_pc(c, c->control_regs[CR_VECTOR_ADDRESS] | vector);
+
+	if (vector == VECTOR_DATA_ABORT)
+		trace_dump(c->trace, "data abort");
+	else if (vector == VECTOR_ILLEGAL_INSTR)
+		trace_dump(c->trace, "illegal instruction");
 }
 
 static int cpu_mem_map_write(struct cpu *c, physaddr_t addr,
 			     unsigned int nr_bits, uint32_t val)
 {
-	trace(c->trace_file, TRACE_DADDR, addr);
-	trace(c->trace_file, TRACE_DOUT, val);
+	trace(c->trace, TRACE_DADDR, addr);
+	trace(c->trace, TRACE_DOUT, val);
 
 	return cpu_write_mem(c, addr, val, nr_bits);
 }
 
-static uint32_t fetch_op1(struct cpu *c, uint32_t instr, uint32_t ucode)
+static inline uint32_t fetch_op1(struct cpu *c,
+				 const struct decoded_insn *insn)
 {
-	if (ucode_op1ra(ucode))
-		return c->regs[instr_ra(instr)];
-	else if (ucode_op1rb(ucode))
-		return c->regs[instr_rb(instr)];
-	else
+	switch (insn->op1) {
+	case OP1_RA:
+		return c->regs[insn->ra];
+	case OP1_RB:
+		return c->regs[insn->rb];
+	default:
 		return c->pc + 4;
+	}
 }
 
-static uint32_t fetch_op2(struct cpu *c, uint32_t instr, uint32_t ucode)
+static inline uint32_t fetch_op2(struct cpu *c,
+				 const struct decoded_insn *insn)
 {
-	if (ucode_op2rb(ucode))
-		return c->regs[instr_rb(instr)];
+	return insn->op2rb ? c->regs[insn->rb] : insn->imm;
+}
 
+static uint32_t decode_imm(uint32_t instr, uint32_t ucode)
+{
 	switch (ucode_imsel(ucode)) {
 	case IMSEL_IMM13:
 		return ((int32_t)instr_imm13(instr) << 19) >> 19;
@@ -587,16 +871,16 @@ struct alu_result {
 	uint32_t mem_write_val;
 };
 
-static void do_alu(struct cpu *c, uint32_t instr, uint32_t ucode,
+static void do_alu(struct cpu *c, const struct decoded_insn *insn,
 		   struct alu_result *alu)
 {
-	uint64_t op1 = fetch_op1(c, instr, ucode);
-	uint64_t op2 = fetch_op2(c, instr, ucode);
+	uint64_t op1 = fetch_op1(c, insn);
+	uint64_t op2 = fetch_op2(c, insn);
 	uint64_t v;
 
 	alu->alu_z = !(op1 ^ op2);
 
-	switch (ucode_aluop(ucode)) {
+	switch (insn->aluop) {
 	case ALU_OPCODE_ADD:
 		v = op1 + op2;
 		alu->alu_q = v;
@@ -696,7 +980,7 @@ static void do_alu(struct cpu *c, uint32_t instr, uint32_t ucode,
                 break;
 	}
 
-	alu->mem_write_val = c->regs[instr_rb(instr)];
+	alu->mem_write_val = c->regs[insn->rb];
 }
 
 static bool branch_taken(const struct cpu *c, uint32_t instr, uint32_t ucode)
@@ -708,9 +992,11 @@ static bool branch_taken(const struct cpu *c, uint32_t instr, uint32_t ucode)
 		 ucode_swi(ucode) || ucode_rfe(ucode);
 }
 
-static void commit_alu(struct cpu *c, uint32_t instr, uint32_t ucode,
+static void commit_alu(struct cpu *c, const struct decoded_insn *insn,
 		       const struct alu_result *alu)
 {
+	uint32_t ucode = insn->ucode;
+
 	if (ucode_upc(ucode))
 		c->flagsbf.c = alu->alu_c;
 
@@ -721,17 +1007,18 @@ static void commit_alu(struct cpu *c, uint32_t instr, uint32_t ucode,
 	}
 
 	if (ucode_wrrd(ucode)) {
-		int rd = ucode_rdlr(ucode) ? LR : instr_rd(instr);
 		uint32_t v = ucode_icall(ucode) ? c->pc + 4 : alu->alu_q;
 
-		cpu_wr_reg(c, rd, v);
+		cpu_wr_reg(c, insn->rd, v);
 	}
 }
 
-static void process_branch(struct cpu *c, uint32_t instr, uint32_t ucode,
+static void process_branch(struct cpu *c, const struct decoded_insn *insn,
 			   const struct alu_result *alu)
 {
-	if (branch_taken(c, instr, ucode))
+	uint32_t ucode = insn->ucode;
+
+	if (branch_taken(c, insn->instr, ucode))
 		cpu_set_next_pc(c, alu->alu_q);
 
 	if (ucode_rfe(ucode))
@@ -745,12 +1032,12 @@ static void process_branch(struct cpu *c, uint32_t instr, uint32_t ucode,
 	}
 }
 
-static void do_scr(struct cpu *c, uint32_t instr, uint32_t ucode,
+static void do_scr(struct cpu *c, const struct decoded_insn *insn,
 		   const struct alu_result *alu)
 {
-	unsigned cr_sel = (instr >> 12) & 0x7;
+	unsigned cr_sel = (insn->instr >> 12) & 0x7;
 
-	if (!ucode_wcr(ucode))
+	if (!ucode_wcr(insn->ucode))
 		return;
 
 	if (cr_sel >= NUM_CONTROL_REGS)
@@ -761,12 +1048,12 @@ static void do_scr(struct cpu *c, uint32_t instr, uint32_t ucode,
 		set_psr(c, c->control_regs[CR_PSR]);
 }
 
-static void do_spsr(struct cpu *c, uint32_t instr, uint32_t ucode,
+static void do_spsr(struct cpu *c, const struct decoded_insn *insn,
                     const struct alu_result *alu)
 {
         uint32_t cr1 = c->control_regs[CR_PSR];
 
-	if (!ucode_spsr(ucode))
+	if (!ucode_spsr(insn->ucode))
 		return;
 
         cr1 &= ~GPSR_SPSR_MASK;
@@ -789,10 +1076,56 @@ static unsigned maw_to_bits(enum maw maw)
 	}
 }
 
-static int do_memory(struct cpu *c, uint32_t instr, uint32_t ucode,
+static int compare_addrs(const void *a, const void *b)
+{
+	uint32_t va = *(const uint32_t *)a, vb = *(const uint32_t *)b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+static inline bool is_breakpoint(const struct cpu *c, uint32_t pc)
+{
+	uint32_t bit = (pc / sizeof(uint32_t)) % BKPT_FILTER_BITS;
+
+	return c->nr_bkpts &&
+		(c->bkpt_filter[bit / 64] & (1ULL << (bit % 64))) &&
+		bsearch(&pc, c->bkpts, c->nr_bkpts, sizeof(pc), compare_addrs);
+}
+
+/* Checked after each instruction, with the PC at the next one. */
+static inline bool debug_stop(const struct cpu *c)
+{
+	return c->watch_hit || is_breakpoint(c, c->pc);
+}
+
+/* Native stops save the flight recorder just as a bkp instruction does. */
+static void debug_stop_dump(const struct cpu *c)
+{
+	trace_dump(c->trace, c->watch_hit ? "watchpoint" : "breakpoint");
+}
+
+static void check_watchpoints(struct cpu *c, uint32_t addr,
+			      unsigned int nbits, unsigned int flags)
+{
+	unsigned int m;
+
+	for (m = 0; m < c->nr_watchpoints; ++m) {
+		const struct watchpoint *w = &c->watchpoints[m];
+
+		if ((w->flags & flags) && addr < w->addr + w->len &&
+		    addr + nbits / 8 > w->addr) {
+			c->watch_hit = true;
+			c->watch_addr = addr;
+			return;
+		}
+	}
+}
+
+static int do_memory(struct cpu *c, const struct decoded_insn *insn,
 		     const struct alu_result *alu)
 {
 	uint32_t v, addr = alu->alu_q;
+	uint32_t ucode = insn->ucode;
 	int err = 0;
 
 	if (!ucode_mstr(ucode) && !ucode_mldr(ucode) && !ucode_cache(ucode))
@@ -802,15 +1135,24 @@ static int do_memory(struct cpu *c, uint32_t instr, uint32_t ucode,
 		err = cpu_mem_map_write(c, alu->alu_q,
 					maw_to_bits(ucode_maw(ucode)),
 					alu->mem_write_val);
+		/* A TLB miss moves the next PC to the handler instead. */
+		if (!err && c->nr_watchpoints && c->next_pc == c->pc + 4)
+			check_watchpoints(c, addr,
+					  maw_to_bits(ucode_maw(ucode)),
+					  CPU_WATCH_WRITE);
 	} else if (ucode_mldr(ucode)) {
 		int tlb_miss;
 		err = cpu_read_mem(c, alu->alu_q,
 				   &v, maw_to_bits(ucode_maw(ucode)),
 				   &tlb_miss);
 		if (!err && !tlb_miss)
-			cpu_wr_reg(c, instr_rd(instr), v);
+			cpu_wr_reg(c, insn->rd, v);
+		if (!err && !tlb_miss && c->nr_watchpoints)
+			check_watchpoints(c, addr,
+					  maw_to_bits(ucode_maw(ucode)),
+					  CPU_WATCH_READ);
 	} else if (ucode_cache(ucode)) {
-		uint32_t op2 = fetch_op2(c, instr, ucode);
+		uint32_t op2 = fetch_op2(c, insn);
 
 		switch (op2) {
 		case 0x0:
@@ -825,12 +1167,14 @@ static int do_memory(struct cpu *c, uint32_t instr, uint32_t ucode,
 		case 0x3:
 			tlb_inval(c->dtlb);
 			tlb_inval(c->itlb);
+			soft_tlb_flush(c);
 			break;
 		case 0x4:
 			tlb_set_virt(c->dtlb, alu->alu_q);
 			break;
 		case 0x5:
 			tlb_set_phys(c->dtlb, alu->alu_q);
+			soft_tlb_flush(c);
 			break;
 		case 0x6:
 			tlb_set_virt(c->itlb, alu->alu_q);
@@ -857,45 +1201,155 @@ static bool instr_is_breakpoint(uint32_t instr)
 	return true;
 }
 
-static void emul_insn(struct cpu *c, uint32_t instr, bool *breakpoint_hit)
+static void emul_illegal(struct cpu *c, const struct decoded_insn *insn,
+			 bool *breakpoint_hit)
+{
+	do_vector(c, VECTOR_ILLEGAL_INSTR);
+}
+
+static void emul_breakpoint(struct cpu *c, const struct decoded_insn *insn,
+			    bool *breakpoint_hit)
+{
+	*breakpoint_hit = true;
+	trace_dump(c->trace, "breakpoint");
+}
+
+/*
+ * Arithmetic instructions with no side effects other than the register file
+ * and flags.
+ */
+static void emul_alu(struct cpu *c, const struct decoded_insn *insn,
+		     bool *breakpoint_hit)
+{
+	struct alu_result alu = {};
+
+	do_alu(c, insn, &alu);
+	commit_alu(c, insn, &alu);
+}
+
+static void emul_generic(struct cpu *c, const struct decoded_insn *insn,
+			 bool *breakpoint_hit)
+{
+	struct alu_result alu = {};
+
+	do_alu(c, insn, &alu);
+	commit_alu(c, insn, &alu);
+	process_branch(c, insn, &alu);
+	do_scr(c, insn, &alu);
+        do_spsr(c, insn, &alu);
+	do_memory(c, insn, &alu);
+}
+
+static bool ucode_is_alu_only(uint32_t instr, uint32_t ucode)
+{
+	return instr_class(instr) != INSTR_BRANCH &&
+		!ucode_mstr(ucode) && !ucode_mldr(ucode) &&
+		!ucode_cache(ucode) && !ucode_wcr(ucode) &&
+		!ucode_spsr(ucode) && !ucode_swi(ucode) && !ucode_rfe(ucode);
+}
+
+static void decode_insn(const struct cpu *c, uint32_t instr,
+			struct decoded_insn *insn)
 {
 	/* 7 MSB's are the microcode address. */
 	uint32_t ucode = c->ucode[instr >> (32 - 7)];
-	struct alu_result alu = {};
 
+	insn->instr = instr;
+	insn->ucode = ucode;
+	insn->rd = ucode_rdlr(ucode) ? LR : instr_rd(instr);
+	insn->ra = instr_ra(instr);
+	insn->rb = instr_rb(instr);
+	insn->aluop = ucode_aluop(ucode);
+	insn->op2rb = ucode_op2rb(ucode);
+	insn->imm = insn->op2rb ? 0 : decode_imm(instr, ucode);
+
+	if (ucode_op1ra(ucode))
+		insn->op1 = OP1_RA;
+	else if (ucode_op1rb(ucode))
+		insn->op1 = OP1_RB;
+	else
+		insn->op1 = OP1_PC;
+
+	if (!ucode_valid(ucode))
+		insn->exec = emul_illegal;
+	else if (instr_is_breakpoint(instr))
+		insn->exec = emul_breakpoint;
+	else if (ucode_is_alu_only(instr, ucode))
+		insn->exec = emul_alu;
+	else
+		insn->exec = emul_generic;
+}
+
+static void emul_insn(struct cpu *c, const struct decoded_insn *insn,
+		      bool *breakpoint_hit)
+{
 	if (c->irq_active && c->flagsbf.i) {
 		do_vector(c, VECTOR_IRQ);
 		return;
 	}
 
-	if (!ucode_valid(ucode) ||
-	    (ucode_priv(ucode) && c->flagsbf.u)) {
+	if (ucode_priv(insn->ucode) && c->flagsbf.u) {
 		do_vector(c, VECTOR_ILLEGAL_INSTR);
 		return;
 	}
 
-	if (instr_is_breakpoint(instr))
-		*breakpoint_hit = true;
-
-	do_alu(c, instr, ucode, &alu);
-	commit_alu(c, instr, ucode, &alu);
-	process_branch(c, instr, ucode, &alu);
-	do_scr(c, instr, ucode, &alu);
-        do_spsr(c, instr, ucode, &alu);
-	do_memory(c, instr, ucode, &alu);
-
+	insn->exec(c, insn, breakpoint_hit);
 }
 
-static int instruction_read(struct cpu *c, uint32_t phys, uint32_t *instr)
+/*
+ * Fetch the instruction at phys, decoded.
+ *
+ * Uncached fetches read memory, and every write to a cacheable region
+ * invalidates the matching decode cache entry, so a valid entry can be used
+ * without touching memory at all.  The instruction cache may legitimately
+ * hold stale lines though, so cached fetches still read through it and only
+ * reuse the decode if the instruction word matches.
+ */
+static const struct decoded_insn *instruction_fetch(struct cpu *c,
+						    uint32_t virt,
+						    uint32_t phys,
+						    struct decoded_insn *tmp)
 {
-	if (instruction_cache_enabled(c))
-		return cache_read(c->icache, c->pc, phys, 32, instr);
-	return mem_map_read(c->mem, c->pc, 32, instr);
+	struct decoded_insn *insn = decode_cache_lookup(c->decode_cache, phys);
+	uint32_t instr;
+
+	if (instruction_cache_enabled(c)) {
+		if (cache_read(c->icache, virt, phys, 32, &instr))
+			return NULL;
+		if (insn->exec && insn->instr == instr)
+			return insn;
+		/* Blocks built from this decode must see it change. */
+		decode_cache_inval_addr(c->decode_cache, phys);
+		decode_insn(c, instr, insn);
+		insn->valid = false;
+		soft_tlb_mark_code(c, phys);
+
+		return insn;
+	}
+
+	if (insn->valid)
+		return insn;
+
+	if (mem_map_read(c->mem, phys, 32, &instr))
+		return NULL;
+
+	/* Reads of I/O regions may have side effects, never cache them. */
+	if (!mem_map_addr_cacheable(c->mem, phys)) {
+		decode_insn(c, instr, tmp);
+		return tmp;
+	}
+
+	decode_insn(c, instr, insn);
+	insn->valid = true;
+	soft_tlb_mark_code(c, phys);
+
+	return insn;
 }
 
 int cpu_cycle(struct cpu *c, bool *breakpoint_hit)
 {
-	uint32_t instr;
+	const struct decoded_insn *insn;
+	struct decoded_insn tmp;
 	struct translation translation = {
 		.virt = c->pc,
 		.phys = c->pc,
@@ -904,10 +1358,11 @@ int cpu_cycle(struct cpu *c, bool *breakpoint_hit)
 	event_list_tick(&c->events);
 
 	c->next_pc = c->pc + 4;
+	c->watch_hit = false;
 
-	if (c->trace_file)
-		fprintf(c->trace_file, "#%llu\n", c->cycle_count++);
-	trace(c->trace_file, TRACE_PC, c->pc);
+	if (c->trace)
+		trace_cycle(c->trace, c->cycle_count++);
+	trace(c->trace, TRACE_PC, c->pc);
 
 	/*
 	 * Translation failure triggers a TLB miss.
@@ -915,22 +1370,987 @@ int cpu_cycle(struct cpu *c, bool *breakpoint_hit)
 	if (translate_instruction_address(c, &translation))
 		goto out;
 	if (!(translation.perms & TLB_READ) ||
-	    instruction_read(c, translation.phys, &instr)) {
+	    !(insn = instruction_fetch(c, c->pc, translation.phys, &tmp))) {
 		do_vector(c, VECTOR_IFETCH_ABORT);
 		goto out;
 	}
-	if (c->trace_file)
-		trace(c->trace_file, TRACE_INSTR, instr);
+	trace(c->trace, TRACE_INSTR, insn->instr);
 
-	emul_insn(c, instr, breakpoint_hit);
+	emul_insn(c, insn, breakpoint_hit);
 
 out:
 	if (!*breakpoint_hit)
 		c->pc = c->next_pc;
+	if (!*breakpoint_hit && debug_stop(c)) {
+		*breakpoint_hit = true;
+		debug_stop_dump(c);
+	}
+
+	return 0;
+}
+
+/*
+ * Block translation.
+ *
+ * Straight line runs of instructions are fetched and decoded once into a
+ * block, then executed back to back without the per-instruction address
+ * translation, fetch and trace overhead of cpu_cycle().  Blocks end at any
+ * instruction that may change control flow or the fetch context and are
+ * chained to their successors so that loops go from block to block without
+ * a table lookup.
+ *
+ * Anything out of the ordinary (tracing, aborts, TLB misses, fetches from I/O
+ * regions) falls back to cpu_cycle() so there is only one implementation of
+ * the corner cases.
+ */
+static unsigned long fetch_context(const struct cpu *c)
+{
+	unsigned long ctx = instruction_cache_enabled(c) ? 1 : 0;
+
+	if (mmu_enabled(c))
+		ctx |= 2 | (c->flagsbf.u << 2) | (tlb_generation(c->itlb) << 3);
+
+	return ctx;
+}
+
+static bool insn_ends_block(const struct decoded_insn *insn)
+{
+	return insn->exec == emul_illegal || insn->exec == emul_breakpoint ||
+		instr_class(insn->instr) == INSTR_BRANCH ||
+		ucode_wcr(insn->ucode) || ucode_cache(insn->ucode);
+}
+
+static bool insn_may_idle(const struct decoded_insn *insn)
+{
+	uint32_t ucode = insn->ucode;
+
+	return (insn->exec == emul_alu || insn->exec == emul_generic) &&
+		!ucode_mstr(ucode) && !ucode_wcr(ucode) &&
+		!ucode_cache(ucode) && !ucode_spsr(ucode) &&
+		!ucode_swi(ucode) && !ucode_rfe(ucode);
+}
+
+static int translate_block(struct cpu *c, struct block *b, uint32_t virt,
+			   uint32_t phys)
+{
+	bool icache = instruction_cache_enabled(c);
+	int attempt;
+
+	b->virt = virt;
+	b->phys = phys;
+	b->icache = icache;
+	b->gen_ptr = icache ? cache_generation(c->icache) :
+		decode_cache_generation(c->decode_cache, phys);
+	b->execs = 0;
+	b->native = NULL;
+	memset(b->succ, 0, sizeof(b->succ));
+
+	/*
+	 * Fetching through the instruction cache may fill lines and bump the
+	 * generation, a second pass should then hit on every line.  If it
+	 * doesn't then the block is evicting itself and can't be cached.
+	 */
+	for (attempt = 0; attempt < 2; ++attempt) {
+		const struct decoded_insn *insn;
+		struct decoded_insn tmp;
+		unsigned int n = 0;
+
+		b->gen = *b->gen_ptr;
+		do {
+			uint32_t offs = n * sizeof(uint32_t);
+
+			insn = instruction_fetch(c, virt + offs, phys + offs,
+						 &tmp);
+			if (!insn || insn == &tmp)
+				break;
+			b->insns[n++] = *insn;
+		} while (n < BLOCK_MAX_INSNS && !insn_ends_block(insn) &&
+			 ((phys + n * sizeof(uint32_t)) & (PAGE_SIZE - 1)) &&
+			 !is_breakpoint(c, virt + n * sizeof(uint32_t)));
+
+		b->nr_insns = n;
+		if (*b->gen_ptr == b->gen)
+			break;
+	}
+
+	if (attempt < 2 && b->nr_insns) {
+		unsigned int m;
+
+		b->idle_candidate = instr_class(b->insns[b->nr_insns - 1].instr) ==
+			INSTR_BRANCH;
+		for (m = 0; m < b->nr_insns; ++m)
+			b->idle_candidate &= insn_may_idle(&b->insns[m]);
+
+		return 0;
+	}
+
+	b->nr_insns = 0;
+
+	return -EFAULT;
+}
+
+/*
+ * Find the block starting at the current PC, following the chain from prev if
+ * possible.  Returns NULL if the next instruction should be run through
+ * cpu_cycle().
+ */
+static struct block *next_block(struct cpu *c, struct block *prev)
+{
+	unsigned long ctx = fetch_context(c);
+	bool icache = ctx & 1;
+	struct block_chain *chain = NULL;
+	struct translation translation = {
+		.virt = c->pc,
+		.phys = c->pc,
+		.perms = TLB_PERMS_MASK,
+		.in_user_mode = c->flagsbf.u,
+	};
+	struct block *b;
+
+	if (prev) {
+		uint32_t fallthrough = prev->virt +
+			prev->nr_insns * sizeof(uint32_t);
+
+		chain = &prev->succ[c->pc == fallthrough ? 0 : 1];
+		b = chain->block;
+		if (b && chain->virt == c->pc && chain->ctx == ctx &&
+		    block_valid(b, chain->phys, icache))
+			return b;
+	}
+
+	if (c->pc & 0x3)
+		return NULL;
+	/* Leave the miss handling to cpu_cycle(). */
+	if (mmu_enabled(c) && tlb_translate(c->itlb, &translation))
+		return NULL;
+	if (!(translation.perms & TLB_READ))
+		return NULL;
+	/* Reads of I/O regions may have side effects, only fetch once. */
+	if (!icache && !mem_map_addr_cacheable(c->mem, translation.phys))
+		return NULL;
+
+	b = block_cache_lookup(c->block_cache, translation.phys, icache);
+	/* Blocks are split at breakpoints by virtual address. */
+	if ((!block_valid(b, translation.phys, icache) ||
+	     (c->nr_bkpts && b->virt != c->pc)) &&
+	    translate_block(c, b, c->pc, translation.phys))
+		return NULL;
+
+	if (chain)
+		*chain = (struct block_chain) {
+			.block = b,
+			.virt = c->pc,
+			.phys = translation.phys,
+			.ctx = ctx,
+		};
+
+	return b;
+}
+
+static unsigned long run_block(struct cpu *c, const struct block *b,
+			       unsigned long max_cycles, bool *breakpoint_hit)
+{
+	unsigned long gen = b->gen;
+	unsigned int i;
+
+	for (i = 0; i < b->nr_insns && i < max_cycles; ++i) {
+		uint32_t pc = c->pc;
+
+		event_list_tick(&c->events);
+
+		if (c->trace) {
+			trace_cycle(c->trace, c->cycle_count++);
+			trace(c->trace, TRACE_PC, pc);
+			trace(c->trace, TRACE_INSTR, b->insns[i].instr);
+		}
+
+		c->next_pc = pc + 4;
+		emul_insn(c, &b->insns[i], breakpoint_hit);
+		if (*breakpoint_hit)
+			return i + 1;
+		c->pc = c->next_pc;
+		if (c->watch_hit) {
+			*breakpoint_hit = true;
+			debug_stop_dump(c);
+			return i + 1;
+		}
+
+		/* Taken branches, exceptions and self modifying code. */
+		if (c->pc != pc + 4 || *b->gen_ptr != gen)
+			return i + 1;
+	}
+
+	return i;
+}
+
+/*
+ * JIT.
+ *
+ * Blocks that have been dispatched jit_threshold times are translated to
+ * x86-64.  The generated code works directly on struct cpu, it doesn't keep
+ * guest registers in host registers across instructions, and returns the
+ * number of instructions run with the PC updated.  ALU operations, branches
+ * and loads and stores that hit the soft TLB are generated inline.
+ * Everything else, including soft TLB misses, MMIO and any instruction that
+ * may fault, calls back into the interpreter through jit_exec_insn().
+ *
+ * Timers and interrupts are kept exact by only entering a native block when
+ * no event can fire within it and no interrupt is pending.  Only the
+ * interpreter callbacks can change either, so they catch the timers up before
+ * running the instruction and end the block if an interrupt or event is now
+ * due.  Exceptions end the block too, leaving delivery to the interpreter.
+ */
+#ifdef HAVE_JIT
+
+#define JIT_CACHE_SIZE		(16 * 1024 * 1024)
+#define JIT_DEFAULT_THRESHOLD	16
+
+typedef unsigned int (*jit_block_fn)(struct cpu *c);
+
+#define CPU_OFFS(field)		((int32_t)offsetof(struct cpu, field))
+#define REG_OFFS(r)		(CPU_OFFS(regs) + (int32_t)(r) * 4)
+
+/* Bit positions of the flags in flagsw, filled in by jit_init(). */
+static struct {
+	unsigned int z, c, o, n;
+} jit_flag_bits;
+
+static unsigned int flag_bit(const struct cpu *c)
+{
+	return __builtin_ctz(c->flagsw);
+}
+
+static void jit_init(struct cpu *c)
+{
+	struct cpu *tmp = calloc(1, sizeof(*tmp));
+
+	assert(tmp);
+	tmp->flagsbf.z = 1;
+	jit_flag_bits.z = flag_bit(tmp);
+	tmp->flagsw = 0;
+	tmp->flagsbf.c = 1;
+	jit_flag_bits.c = flag_bit(tmp);
+	tmp->flagsw = 0;
+	tmp->flagsbf.o = 1;
+	jit_flag_bits.o = flag_bit(tmp);
+	tmp->flagsw = 0;
+	tmp->flagsbf.n = 1;
+	jit_flag_bits.n = flag_bit(tmp);
+	free(tmp);
+
+	c->jit = jit_new(JIT_CACHE_SIZE);
+	if (!c->jit)
+		warnx("failed to allocate JIT code cache, interpreting");
+	c->jit_threshold = JIT_DEFAULT_THRESHOLD;
+}
+
+static int jit_exec_insn(struct cpu *c, const struct decoded_insn *insn,
+			 uint32_t pc, unsigned int idx)
+{
+	const struct block *b = c->jit_block;
+
+	/* Catch the timers up so that they read as they would interpreted. */
+	event_list_advance(&c->events, idx + 1 - c->jit_ticks);
+	c->jit_ticks = idx + 1;
+
+	c->pc = pc;
+	c->next_pc = pc + 4;
+	emul_insn(c, insn, c->jit_breakpoint_hit);
+	if (*c->jit_breakpoint_hit)
+		return 1;
+	c->pc = c->next_pc;
+
+	return c->pc != pc + 4 || *b->gen_ptr != b->gen ||
+		(c->irq_active && c->flagsbf.i) ||
+		event_list_next(&c->events) <= b->nr_insns - c->jit_ticks;
+}
+
+static bool jit_can_translate(const struct decoded_insn *insn)
+{
+	uint32_t ucode = insn->ucode;
+
+	if (insn->exec != emul_alu && insn->exec != emul_generic)
+		return false;
+	/* Privilege depends on the mode the block is run in. */
+	if (ucode_priv(ucode) || ucode_wcr(ucode) || ucode_spsr(ucode) ||
+	    ucode_cache(ucode) || ucode_swi(ucode) || ucode_rfe(ucode))
+		return false;
+	if (ucode_upcc(ucode) && insn->aluop != ALU_OPCODE_CMP)
+		return false;
+	if ((ucode_mldr(ucode) || ucode_mstr(ucode)) &&
+	    (ucode_wrrd(ucode) || ucode_upc(ucode) ||
+	     insn->aluop != ALU_OPCODE_ADD))
+		return false;
+
+	switch (insn->aluop) {
+	case ALU_OPCODE_GCR:
+	case ALU_OPCODE_SWI:
+	case ALU_OPCODE_RFE:
+	case ALU_OPCODE_CPUID:
+	case ALU_OPCODE_GPSR:
+		return false;
+	default:
+		return true;
+	}
+}
+
+static void jit_exit(struct jit_buf *buf, unsigned int n)
+{
+	jit_mov_imm32(buf, JIT_RAX, n);
+	jit_pop(buf, JIT_RBX);
+	jit_ret(buf);
+}
+
+static void jit_emit_callout(struct jit_buf *buf,
+			     const struct decoded_insn *insn, uint32_t pc,
+			     unsigned int idx)
+{
+	uint8_t *cont;
+
+	jit_mov_rr(buf, true, JIT_RDI, JIT_RBX);
+	jit_mov_imm64(buf, JIT_RSI, (uintptr_t)insn);
+	jit_mov_imm32(buf, JIT_RDX, pc);
+	jit_mov_imm32(buf, JIT_RCX, idx);
+	jit_call(buf, jit_exec_insn);
+	jit_alu_rr(buf, JIT_OR, false, JIT_RAX, JIT_RAX);
+	cont = jit_jcc(buf, JIT_CC_Z);
+	jit_exit(buf, idx + 1);
+	jit_patch(buf, cont);
+}
+
+static void jit_emit_operands(struct jit_buf *buf,
+			      const struct decoded_insn *insn, uint32_t pc)
+{
+	switch (insn->op1) {
+	case OP1_RA:
+		jit_load(buf, 32, JIT_RAX, JIT_RBX, REG_OFFS(insn->ra));
+		break;
+	case OP1_RB:
+		jit_load(buf, 32, JIT_RAX, JIT_RBX, REG_OFFS(insn->rb));
+		break;
+	default:
+		jit_mov_imm32(buf, JIT_RAX, pc + 4);
+	}
+
+	if (insn->op2rb)
+		jit_load(buf, 32, JIT_RDX, JIT_RBX, REG_OFFS(insn->rb));
+	else
+		jit_mov_imm32(buf, JIT_RDX, insn->imm);
+}
+
+/* dst = (src >> bit) & 1 */
+static void jit_emit_bit(struct jit_buf *buf, enum jit_reg dst,
+			 enum jit_reg src, unsigned int bit)
+{
+	jit_mov_rr(buf, false, dst, src);
+	jit_shift_ri(buf, JIT_SHR, false, dst, bit);
+	jit_alu_ri(buf, JIT_AND, false, dst, 1);
+}
+
+/* Replace the flags in mask with the new values in ecx. */
+static void jit_emit_set_flags(struct jit_buf *buf, uint32_t mask)
+{
+	jit_load(buf, 32, JIT_R8, JIT_RBX, CPU_OFFS(flagsw));
+	jit_alu_ri(buf, JIT_AND, false, JIT_R8, ~mask);
+	jit_alu_rr(buf, JIT_OR, false, JIT_R8, JIT_RCX);
+	jit_store(buf, 32, JIT_RBX, CPU_OFFS(flagsw), JIT_R8);
+}
+
+/*
+ * The 64-bit result of do_alu() in rax, op1 in rax and op2 in rdx on entry.
+ * Only the low 32 bits are the ALU result, bit 32 is the carry for the
+ * operations that produce one.
+ */
+static void jit_emit_alu(struct jit_buf *buf, const struct decoded_insn *insn)
+{
+	switch (insn->aluop) {
+	case ALU_OPCODE_ADD:
+		jit_alu_rr(buf, JIT_ADD, true, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_ADDC:
+	case ALU_OPCODE_SUBC:
+		jit_load(buf, 32, JIT_RCX, JIT_RBX, CPU_OFFS(flagsw));
+		jit_shift_ri(buf, JIT_SHR, false, JIT_RCX, jit_flag_bits.c);
+		jit_alu_ri(buf, JIT_AND, false, JIT_RCX, 1);
+		if (insn->aluop == ALU_OPCODE_ADDC) {
+			jit_alu_rr(buf, JIT_ADD, true, JIT_RAX, JIT_RDX);
+			jit_alu_rr(buf, JIT_ADD, true, JIT_RAX, JIT_RCX);
+		} else {
+			jit_alu_rr(buf, JIT_SUB, true, JIT_RAX, JIT_RDX);
+			jit_alu_rr(buf, JIT_SUB, true, JIT_RAX, JIT_RCX);
+		}
+		break;
+	case ALU_OPCODE_SUB:
+		jit_alu_rr(buf, JIT_SUB, true, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_MUL:
+		jit_imul_rr(buf, true, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_LSL:
+		jit_mov_rr(buf, false, JIT_RCX, JIT_RDX);
+		jit_alu_ri(buf, JIT_AND, false, JIT_RCX, 0x1f);
+		jit_shift_cl(buf, JIT_SHL, true, JIT_RAX);
+		break;
+	case ALU_OPCODE_LSR:
+		jit_mov_rr(buf, false, JIT_RCX, JIT_RDX);
+		jit_shift_cl(buf, JIT_SHR, false, JIT_RAX);
+		break;
+	case ALU_OPCODE_ASR:
+		jit_mov_rr(buf, false, JIT_RCX, JIT_RDX);
+		jit_shift_cl(buf, JIT_SAR, false, JIT_RAX);
+		break;
+	case ALU_OPCODE_AND:
+		jit_alu_rr(buf, JIT_AND, false, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_XOR:
+		jit_alu_rr(buf, JIT_XOR, false, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_OR:
+		jit_alu_rr(buf, JIT_OR, false, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_BIC:
+		jit_bitop_rr(buf, JIT_BTR, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_BST:
+		jit_bitop_rr(buf, JIT_BTS, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_COPYB:
+		jit_mov_rr(buf, false, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_MOVHI:
+		jit_alu_ri(buf, JIT_AND, false, JIT_RDX, 0xffff);
+		jit_alu_rr(buf, JIT_OR, false, JIT_RAX, JIT_RDX);
+		break;
+	case ALU_OPCODE_CMP:
+		/* Keep op1 for the flags, the result goes in rsi. */
+		jit_mov_rr(buf, true, JIT_RSI, JIT_RAX);
+		jit_alu_rr(buf, JIT_SUB, true, JIT_RSI, JIT_RDX);
+		break;
+	default:
+		/* COPYA: op1 is already in place. */
+		break;
+	}
+}
+
+static void jit_emit_flags(struct jit_buf *buf, const struct decoded_insn *insn)
+{
+	uint32_t mask = 1 << jit_flag_bits.c;
+
+	if (insn->aluop == ALU_OPCODE_CMP) {
+		/* c = !v[32] */
+		jit_mov_rr(buf, true, JIT_RCX, JIT_RSI);
+		jit_shift_ri(buf, JIT_SHR, true, JIT_RCX, 32);
+		jit_alu_ri(buf, JIT_AND, false, JIT_RCX, 1);
+		jit_alu_ri(buf, JIT_XOR, false, JIT_RCX, 1);
+		jit_shift_ri(buf, JIT_SHL, false, JIT_RCX, jit_flag_bits.c);
+
+		if (ucode_upcc(insn->ucode)) {
+			/* z = op1 == op2 */
+			jit_alu_rr(buf, JIT_CMP, false, JIT_RAX, JIT_RDX);
+			jit_setcc(buf, JIT_CC_Z, JIT_R9);
+			jit_shift_ri(buf, JIT_SHL, false, JIT_R9,
+				     jit_flag_bits.z);
+			jit_alu_rr(buf, JIT_OR, false, JIT_RCX, JIT_R9);
+			/* n = q[31] */
+			jit_mov_rr(buf, false, JIT_R9, JIT_RSI);
+			jit_shift_ri(buf, JIT_SHR, false, JIT_R9, 31);
+			jit_shift_ri(buf, JIT_SHL, false, JIT_R9,
+				     jit_flag_bits.n);
+			jit_alu_rr(buf, JIT_OR, false, JIT_RCX, JIT_R9);
+			/* o = ((op1 ^ op2) & ~(q ^ op2))[31] */
+			jit_mov_rr(buf, false, JIT_R9, JIT_RAX);
+			jit_alu_rr(buf, JIT_XOR, false, JIT_R9, JIT_RDX);
+			jit_mov_rr(buf, false, JIT_R10, JIT_RSI);
+			jit_alu_rr(buf, JIT_XOR, false, JIT_R10, JIT_RDX);
+			jit_alu_ri(buf, JIT_XOR, false, JIT_R10, -1);
+			jit_alu_rr(buf, JIT_AND, false, JIT_R9, JIT_R10);
+			jit_shift_ri(buf, JIT_SHR, false, JIT_R9, 31);
+			jit_shift_ri(buf, JIT_SHL, false, JIT_R9,
+				     jit_flag_bits.o);
+			jit_alu_rr(buf, JIT_OR, false, JIT_RCX, JIT_R9);
+			mask |= (1 << jit_flag_bits.z) |
+				(1 << jit_flag_bits.n) |
+				(1 << jit_flag_bits.o);
+		}
+	} else {
+		switch (insn->aluop) {
+		case ALU_OPCODE_ADD:
+		case ALU_OPCODE_ADDC:
+		case ALU_OPCODE_SUB:
+		case ALU_OPCODE_SUBC:
+		case ALU_OPCODE_LSL:
+		case ALU_OPCODE_MUL:
+			jit_mov_rr(buf, true, JIT_RCX, JIT_RAX);
+			jit_shift_ri(buf, JIT_SHR, true, JIT_RCX, 32);
+			jit_alu_ri(buf, JIT_AND, false, JIT_RCX, 1);
+			jit_shift_ri(buf, JIT_SHL, false, JIT_RCX,
+				     jit_flag_bits.c);
+			break;
+		default:
+			/* do_alu() leaves the carry clear. */
+			jit_alu_rr(buf, JIT_XOR, false, JIT_RCX, JIT_RCX);
+		}
+	}
+
+	jit_emit_set_flags(buf, mask);
+}
+
+/* Leaves the condition in ecx, branch_condition_met() on the flags. */
+static void jit_emit_condition(struct jit_buf *buf, enum branch_condition cond)
+{
+	jit_load(buf, 32, JIT_R8, JIT_RBX, CPU_OFFS(flagsw));
+	jit_emit_bit(buf, JIT_RCX, JIT_R8, jit_flag_bits.z);
+	jit_emit_bit(buf, JIT_RSI, JIT_R8, jit_flag_bits.c);
+	/* r9 = n != o */
+	jit_emit_bit(buf, JIT_R9, JIT_R8, jit_flag_bits.n);
+	jit_emit_bit(buf, JIT_R10, JIT_R8, jit_flag_bits.o);
+	jit_alu_rr(buf, JIT_XOR, false, JIT_R9, JIT_R10);
+
+	switch (cond) {
+	case BRANCH_CC_NE:
+		jit_alu_ri(buf, JIT_XOR, false, JIT_RCX, 1);
+		break;
+	case BRANCH_CC_EQ:
+		break;
+	case BRANCH_CC_GT:
+		jit_alu_ri(buf, JIT_XOR, false, JIT_RCX, 1);
+		jit_alu_rr(buf, JIT_AND, false, JIT_RCX, JIT_RSI);
+		break;
+	case BRANCH_CC_LT:
+		jit_mov_rr(buf, false, JIT_RCX, JIT_RSI);
+		jit_alu_ri(buf, JIT_XOR, false, JIT_RCX, 1);
+		break;
+	case BRANCH_CC_GTS:
+		jit_alu_ri(buf, JIT_XOR, false, JIT_RCX, 1);
+		jit_alu_ri(buf, JIT_XOR, false, JIT_R9, 1);
+		jit_alu_rr(buf, JIT_AND, false, JIT_RCX, JIT_R9);
+		break;
+	case BRANCH_CC_LTS:
+		jit_mov_rr(buf, false, JIT_RCX, JIT_R9);
+		break;
+	case BRANCH_CC_B:
+		jit_mov_imm32(buf, JIT_RCX, 1);
+		break;
+	case BRANCH_CC_GTE:
+		jit_mov_rr(buf, false, JIT_RCX, JIT_RSI);
+		break;
+	case BRANCH_CC_GTES:
+		jit_mov_rr(buf, false, JIT_RCX, JIT_R9);
+		jit_alu_ri(buf, JIT_XOR, false, JIT_RCX, 1);
+		break;
+	case BRANCH_CC_LTE:
+		jit_alu_ri(buf, JIT_XOR, false, JIT_RSI, 1);
+		jit_alu_rr(buf, JIT_OR, false, JIT_RCX, JIT_RSI);
+		break;
+	case BRANCH_CC_LTES:
+		jit_alu_rr(buf, JIT_OR, false, JIT_RCX, JIT_R9);
+		break;
+	default:
+		jit_alu_rr(buf, JIT_XOR, false, JIT_RCX, JIT_RCX);
+	}
+}
+
+/*
+ * The address is in eax.  Falls back to the interpreter on a soft TLB miss,
+ * a misaligned access or a store to a page with decoded instructions.
+ */
+static void jit_emit_memory(struct jit_buf *buf,
+			    const struct decoded_insn *insn, uint32_t pc,
+			    unsigned int idx)
+{
+	uint32_t ucode = insn->ucode;
+	unsigned int nbits = maw_to_bits(ucode_maw(ucode));
+	bool store = ucode_mstr(ucode);
+	int32_t entries = store ? CPU_OFFS(soft_tlb.write) :
+		CPU_OFFS(soft_tlb.read);
+	uint8_t *miss, *misaligned = NULL, *code = NULL, *done;
+
+	/* rcx = the soft TLB entry */
+	jit_mov_rr(buf, false, JIT_RCX, JIT_RAX);
+	jit_shift_ri(buf, JIT_SHR, false, JIT_RCX, 12);
+	jit_alu_ri(buf, JIT_AND, false, JIT_RCX, SOFT_TLB_ENTRIES - 1);
+	jit_imul_rri(buf, JIT_RCX, JIT_RCX, sizeof(struct soft_tlb_entry));
+	jit_alu_rr(buf, JIT_ADD, true, JIT_RCX, JIT_RBX);
+
+	jit_mov_rr(buf, false, JIT_RDX, JIT_RAX);
+	jit_alu_ri(buf, JIT_AND, false, JIT_RDX, ~(PAGE_SIZE - 1));
+	jit_alu_rm(buf, JIT_OR, JIT_RDX, JIT_RBX, CPU_OFFS(jit_data_tag));
+	jit_alu_rm(buf, JIT_CMP, JIT_RDX, JIT_RCX,
+		   entries + offsetof(struct soft_tlb_entry, tag));
+	miss = jit_jcc(buf, JIT_CC_NZ);
+	if (nbits > 8) {
+		jit_mov_rr(buf, false, JIT_RDX, JIT_RAX);
+		jit_alu_ri(buf, JIT_AND, false, JIT_RDX, nbits / 8 - 1);
+		misaligned = jit_jcc(buf, JIT_CC_NZ);
+	}
+	if (store) {
+		jit_cmp_m8_imm(buf, JIT_RCX,
+			       entries + offsetof(struct soft_tlb_entry, code),
+			       0);
+		code = jit_jcc(buf, JIT_CC_NZ);
+	}
+
+	jit_load(buf, 64, JIT_RDX, JIT_RCX,
+		 entries + offsetof(struct soft_tlb_entry, host));
+	jit_alu_ri(buf, JIT_AND, false, JIT_RAX, PAGE_SIZE - 1);
+	jit_alu_rr(buf, JIT_ADD, true, JIT_RDX, JIT_RAX);
+	if (store) {
+		jit_load(buf, 32, JIT_RCX, JIT_RBX, REG_OFFS(insn->rb));
+		jit_store(buf, nbits, JIT_RDX, 0, JIT_RCX);
+	} else {
+		jit_load(buf, nbits, JIT_RAX, JIT_RDX, 0);
+		jit_store(buf, 32, JIT_RBX, REG_OFFS(insn->rd), JIT_RAX);
+	}
+	done = jit_jmp(buf);
+
+	jit_patch(buf, miss);
+	if (misaligned)
+		jit_patch(buf, misaligned);
+	if (code)
+		jit_patch(buf, code);
+	jit_emit_callout(buf, insn, pc, idx);
+	jit_patch(buf, done);
+}
+
+/* Returns true if the instruction ended the block. */
+static bool jit_emit_insn(struct jit_buf *buf, const struct block *b,
+			  unsigned int idx)
+{
+	const struct decoded_insn *insn = &b->insns[idx];
+	uint32_t ucode = insn->ucode;
+	uint32_t pc = b->virt + idx * sizeof(uint32_t);
+	uint8_t *not_taken;
+
+	if (!jit_can_translate(insn)) {
+		jit_emit_callout(buf, insn, pc, idx);
+		return false;
+	}
+
+	jit_emit_operands(buf, insn, pc);
+	jit_emit_alu(buf, insn);
+	if (ucode_upc(ucode) || ucode_upcc(ucode))
+		jit_emit_flags(buf, insn);
+
+	if (ucode_wrrd(ucode)) {
+		if (ucode_icall(ucode)) {
+			jit_mov_imm32(buf, JIT_RCX, pc + 4);
+			jit_store(buf, 32, JIT_RBX, REG_OFFS(insn->rd),
+				  JIT_RCX);
+		} else {
+			jit_store(buf, 32, JIT_RBX, REG_OFFS(insn->rd),
+				  JIT_RAX);
+		}
+	}
+
+	if (ucode_mldr(ucode) || ucode_mstr(ucode))
+		jit_emit_memory(buf, insn, pc, idx);
+
+	if (instr_class(insn->instr) != INSTR_BRANCH)
+		return false;
+
+	jit_emit_condition(buf, ucode_bcc(ucode));
+	jit_alu_rr(buf, JIT_OR, false, JIT_RCX, JIT_RCX);
+	not_taken = jit_jcc(buf, JIT_CC_Z);
+	jit_store(buf, 32, JIT_RBX, CPU_OFFS(pc), JIT_RAX);
+	jit_exit(buf, idx + 1);
+	jit_patch(buf, not_taken);
+	jit_mov_imm32(buf, JIT_RCX, pc + 4);
+	jit_store(buf, 32, JIT_RBX, CPU_OFFS(pc), JIT_RCX);
+	jit_exit(buf, idx + 1);
+
+	return true;
+}
+
+static void *jit_emit_block(struct cpu *c, const struct block *b)
+{
+	struct jit_buf buf;
+	unsigned int i;
+
+	jit_begin(c->jit, &buf);
+
+	jit_push(&buf, JIT_RBX);
+	jit_mov_rr(&buf, true, JIT_RBX, JIT_RDI);
+
+	for (i = 0; i < b->nr_insns; ++i)
+		if (jit_emit_insn(&buf, b, i))
+			break;
+
+	if (i == b->nr_insns) {
+		jit_mov_imm32(&buf, JIT_RCX,
+			      b->virt + b->nr_insns * sizeof(uint32_t));
+		jit_store(&buf, 32, JIT_RBX, CPU_OFFS(pc), JIT_RCX);
+		jit_exit(&buf, b->nr_insns);
+	}
+
+	return jit_commit(c->jit, &buf);
+}
+
+static bool jit_translate_block(struct cpu *c, struct block *b)
+{
+	b->native = jit_emit_block(c, b);
+	if (!b->native) {
+		/* Out of space, start again with an empty cache. */
+		jit_flush(c->jit);
+		b->native = jit_emit_block(c, b);
+	}
+	b->native_gen = jit_generation(c->jit);
+
+	return b->native != NULL;
+}
+
+/*
+ * Whether b can be run natively now, translating it if it has become hot.
+ * Blocks are entered at their first instruction with nothing due that the
+ * generated code doesn't check for.
+ */
+static bool jit_block_ready(struct cpu *c, struct block *b,
+			    unsigned long max_cycles)
+{
+	if (b->nr_insns > max_cycles || c->pc != b->virt ||
+	    (c->irq_active && c->flagsbf.i) ||
+	    event_list_next(&c->events) <= b->nr_insns)
+		return false;
+
+	if (b->native && b->native_gen == jit_generation(c->jit))
+		return true;
+
+	if (++b->execs < c->jit_threshold)
+		return false;
+	b->execs = 0;
+
+	return jit_translate_block(c, b);
+}
+
+static unsigned long run_native(struct cpu *c, const struct block *b,
+				bool *breakpoint_hit)
+{
+	unsigned int n;
+
+	c->jit_block = b;
+	c->jit_ticks = 0;
+	c->jit_breakpoint_hit = breakpoint_hit;
+	/*
+	 * Data cache enabled accesses always take the slow path, even to page
+	 * zero whose address matches an empty entry's tag.
+	 */
+	c->jit_data_tag = data_cache_enabled(c) ? SOFT_TLB_NEVER :
+		soft_tlb_tag(c, 0);
+
+	n = ((jit_block_fn)b->native)(c);
+	event_list_advance(&c->events, n - c->jit_ticks);
+
+	return n;
+}
+
+void cpu_set_jit_threshold(struct cpu *c, unsigned int threshold)
+{
+	c->jit_threshold = threshold ? threshold : 1;
+}
+
+#else /* !HAVE_JIT */
+
+static void jit_init(struct cpu *c)
+{
+	warnx("no JIT support for this host, interpreting");
+}
+
+static bool jit_block_ready(struct cpu *c, struct block *b,
+			    unsigned long max_cycles)
+{
+	return false;
+}
+
+static unsigned long run_native(struct cpu *c, const struct block *b,
+				bool *breakpoint_hit)
+{
+	return 0;
+}
+
+void cpu_set_jit_threshold(struct cpu *c, unsigned int threshold)
+{
+}
+
+#endif /* HAVE_JIT */
+
+/*
+ * Idle loops.
+ *
+ * Firmware waiting for an interrupt or polling a status register spins in a
+ * loop that changes nothing until a timer event fires.  Every
+ * IDLE_CHECK_INTERVAL dispatches of a candidate block the registers and flags
+ * are snapshotted, if a run of the block then loops straight back to its
+ * start with them unchanged it is a fixed point: with no stores, loads from
+ * memory and MEM_MAPF_STABLE regions can only return something different once
+ * an event has fired.  Any other I/O read, such as the timer count or the SPI
+ * master which transfers on reads, rules the iteration out.  The loop is then
+ * skipped forward by whole iterations to just before the next event so that
+ * it fires on the same instruction as it would have without skipping.
+ *
+ * Skipped cycles don't count towards cpu_run()'s max_cycles, they are
+ * accounted separately in idle_cycles.
+ */
+#define IDLE_CHECK_INTERVAL	64
+
+static bool idle_check_begin(struct cpu *c, struct block *b)
+{
+	if (!c->idle_skip || c->trace || !b->idle_candidate || c->pc != b->virt ||
+	    ++b->loops % IDLE_CHECK_INTERVAL)
+		return false;
+
+	memcpy(c->idle_regs, c->regs, sizeof(c->idle_regs));
+	c->idle_flags = c->flagsw;
+	c->idle_io_read = false;
+
+	return true;
+}
+
+static void idle_fast_forward(struct cpu *c, const struct block *b)
+{
+	uint32_t next = event_list_next(&c->events);
+	uint32_t skip;
+
+	if (c->pc != b->virt || c->idle_flags != c->flagsw || c->idle_io_read ||
+	    memcmp(c->idle_regs, c->regs, sizeof(c->idle_regs)))
+		return;
+
+	/* Nothing scheduled, the loop only ends on a debugger request. */
+	if (next == UINT32_MAX || (c->irq_active && c->flagsbf.i))
+		return;
+
+	skip = (next - 1) / b->nr_insns * b->nr_insns;
+	event_list_advance(&c->events, skip);
+	c->idle_cycles += skip;
+}
+
+void cpu_start_flight_recorder(struct cpu *c, unsigned int nr_cycles)
+{
+	trace_close(c->trace);
+	c->trace = trace_ring_new("oldland-flight.trace", nr_cycles);
+}
+
+int cpu_dump_trace(struct cpu *c)
+{
+	if (!c->trace)
+		return -EINVAL;
+
+	return trace_dump(c->trace, "debugger");
+}
+
+void cpu_flush_trace(struct cpu *c)
+{
+	trace_flush(c->trace);
+}
+
+unsigned long long cpu_idle_cycles(const struct cpu *c)
+{
+	return c->idle_cycles;
+}
+
+/*
+ * Run for up to max_cycles cycles, stopping early on a breakpoint.  Returns
+ * the number of cycles run.
+ */
+unsigned long cpu_run(struct cpu *c, unsigned long max_cycles,
+		      bool *breakpoint_hit)
+{
+	struct block *b = NULL;
+	unsigned long n = 0;
+
+	c->watch_hit = false;
+
+	while (n < max_cycles && !*breakpoint_hit) {
+		unsigned long ran;
+		bool idle_check;
+
+		b = next_block(c, b);
+		if (!b) {
+			cpu_cycle(c, breakpoint_hit);
+			++n;
+			continue;
+		}
+
+		idle_check = idle_check_begin(c, b);
+		/*
+		 * Native code and idle skipping would leave gaps in a trace,
+		 * and native loads and stores skip the watchpoints.
+		 */
+		if (c->jit && !c->trace && !c->nr_watchpoints &&
+		    jit_block_ready(c, b, max_cycles - n))
+			ran = run_native(c, b, breakpoint_hit);
+		else
+			ran = run_block(c, b, max_cycles - n, breakpoint_hit);
+		n += ran;
+		if (!*breakpoint_hit && is_breakpoint(c, c->pc)) {
+			*breakpoint_hit = true;
+			debug_stop_dump(c);
+		}
+
+		if (idle_check && ran == b->nr_insns && !*breakpoint_hit)
+			idle_fast_forward(c, b);
+	}
+
+	return n;
+}
+
+int cpu_set_breakpoints(struct cpu *c, const uint32_t *pcs, unsigned int nr)
+{
+	uint32_t *bkpts = NULL;
+	unsigned int m;
+
+	if (nr) {
+		bkpts = malloc(nr * sizeof(*pcs));
+		if (!bkpts)
+			return -ENOMEM;
+		memcpy(bkpts, pcs, nr * sizeof(*pcs));
+		qsort(bkpts, nr, sizeof(*pcs), compare_addrs);
+	}
+
+	free(c->bkpts);
+	c->bkpts = bkpts;
+	c->nr_bkpts = nr;
+
+	memset(c->bkpt_filter, 0, sizeof(c->bkpt_filter));
+	for (m = 0; m < nr; ++m) {
+		uint32_t bit = (pcs[m] / sizeof(uint32_t)) % BKPT_FILTER_BITS;
+
+		c->bkpt_filter[bit / 64] |= 1ULL << (bit % 64);
+	}
+
+	/* Existing blocks may run straight through a new breakpoint. */
+	block_cache_flush(c->block_cache);
+
+	return 0;
+}
+
+void cpu_clear_watchpoints(struct cpu *c)
+{
+	c->nr_watchpoints = 0;
+}
+
+int cpu_add_watchpoint(struct cpu *c, uint32_t addr, uint32_t len,
+		       unsigned int flags)
+{
+	if (c->nr_watchpoints == CPU_MAX_WATCHPOINTS || !len ||
+	    addr + len < addr)
+		return -EINVAL;
+
+	c->watchpoints[c->nr_watchpoints++] = (struct watchpoint) {
+		.addr = addr,
+		.len = len,
+		.flags = flags,
+	};
 
 	return 0;
 }
 
+bool cpu_watch_hit(const struct cpu *c, uint32_t *addr)
+{
+	if (c->watch_hit)
+		*addr = c->watch_addr;
+
+	return c->watch_hit;
+}
+
 void cpu_cache_sync(struct cpu *cpu)
 {
 	cache_flush_all(cpu->dcache);
@@ -964,4 +2384,116 @@ void cpu_reset(struct cpu *c)
 	cache_inval_all(c->dcache);
 	tlb_inval(c->dtlb);
 	tlb_inval(c->itlb);
+	soft_tlb_flush(c);
+}
+
+struct cpu_state {
+	uint32_t pc;
+	uint32_t next_pc;
+	uint32_t regs[16];
+	uint32_t flagsw;
+	uint32_t control_regs[NUM_CONTROL_REGS];
+	uint32_t irq_active;
+	uint64_t cycle_count;
+	uint64_t now;
+};
+
+/*
+ * Everything that the running software can observe: the registers, caches,
+ * TLBs, devices and memory.  Breakpoints, watchpoints and tracing belong to
+ * whoever is driving the CPU so they are left alone, as is everything
+ * derived from memory which is rebuilt on restore.
+ */
+int cpu_save_checkpoint(struct cpu *c, const char *path)
+{
+	struct checkpoint *cp = checkpoint_create(path);
+	struct cpu_state state = {
+		.pc = c->pc,
+		.next_pc = c->next_pc,
+		.flagsw = c->flagsw,
+		.irq_active = c->irq_active,
+		.cycle_count = c->cycle_count,
+		.now = c->events.now,
+	};
+
+	if (!cp)
+		return -errno;
+
+	memcpy(state.regs, c->regs, sizeof(state.regs));
+	memcpy(state.control_regs, c->control_regs, sizeof(state.control_regs));
+	checkpoint_put(cp, "CPU ", &state, sizeof(state));
+
+	cache_save(c->icache, cp);
+	cache_save(c->dcache, cp);
+	tlb_save(c->itlb, cp);
+	tlb_save(c->dtlb, cp);
+	irq_ctrl_save(c->irq_ctrl, cp);
+	timers_save(c->timers, cp);
+	spimaster_save(c->spimaster, cp);
+
+	checkpoint_put_pages(cp, "RAM ", mem_map_host_ptr(c->mem, RAM_ADDRESS,
+							  true), RAM_SIZE);
+	checkpoint_put_pages(cp, "SDRM", mem_map_host_ptr(c->mem, SDRAM_ADDRESS,
+							  true), SDRAM_SIZE);
+
+	return checkpoint_close(cp);
+}
+
+/*
+ * The CPU is untouched if the checkpoint can't be opened.  Once started, a
+ * restore that fails resets the CPU and replaces RAM and SDRAM with zeroed
+ * memory so that nothing is left half restored or mapped from a bad file.
+ */
+int cpu_restore_checkpoint(struct cpu *c, const char *path)
+{
+	struct checkpoint *cp = checkpoint_open(path);
+	struct cpu_state state;
+	int rc;
+
+	if (!cp)
+		return -errno;
+
+	checkpoint_get(cp, "CPU ", &state, sizeof(state));
+	if (!checkpoint_error(cp)) {
+		c->pc = state.pc;
+		c->next_pc = state.next_pc;
+		memcpy(c->regs, state.regs, sizeof(c->regs));
+		c->flagsw = state.flagsw;
+		memcpy(c->control_regs, state.control_regs,
+		       sizeof(c->control_regs));
+		c->irq_active = state.irq_active;
+		c->cycle_count = state.cycle_count;
+		c->events.now = state.now;
+	}
+
+	cache_restore(c->icache, cp);
+	cache_restore(c->dcache, cp);
+	tlb_restore(c->itlb, cp);
+	tlb_restore(c->dtlb, cp);
+	irq_ctrl_restore(c->irq_ctrl, cp);
+	timers_restore(c->timers, cp);
+	spimaster_restore(c->spimaster, cp);
+
+	checkpoint_map_pages(cp, "RAM ", mem_map_host_ptr(c->mem, RAM_ADDRESS,
+							  true), RAM_SIZE);
+	checkpoint_map_pages(cp, "SDRM", mem_map_host_ptr(c->mem, SDRAM_ADDRESS,
+							  true), SDRAM_SIZE);
+
+	rc = checkpoint_close(cp);
+
+	decode_cache_inval_all(c->decode_cache);
+	block_cache_flush(c->block_cache);
+	soft_tlb_flush(c);
+	if (c->jit)
+		jit_flush(c->jit);
+	if (rc) {
+		checkpoint_discard_pages(mem_map_host_ptr(c->mem, RAM_ADDRESS,
+							  true), RAM_SIZE);
+		checkpoint_discard_pages(mem_map_host_ptr(c->mem,
+							  SDRAM_ADDRESS, true),
+					 SDRAM_SIZE);
+		cpu_reset(c);
+	}
+
+	return rc;
 }
@@ -14,18 +14,84 @@ enum regs {
 
 enum cpu_flags {
 	CPU_NOTRACE = 1 << 0,
+	CPU_JIT = 1 << 1,
+	CPU_NO_IDLE_SKIP = 1 << 2,
+	CPU_BINARY_TRACE = 1 << 3,
+	/* Discard SD card writes rather than modifying the image. */
+	CPU_SDCARD_COW = 1 << 4,
+	/* Connect the UART to a new pseudo terminal rather than stdout. */
+	CPU_INTERACTIVE = 1 << 5,
 };
 
+/*
+ * The CPU and the devices wired up to it, loading the installed bootrom if
+ * bootrom_image is NULL.  oldland-sim drives it from its debug server and
+ * liboldlandsim gives the same API to anything else, the debugger's local
+ * target included.
+ */
 struct cpu *new_cpu(const char *binary, int flags,
 		    const char *bootrom_image,
 		    const char *sdcard_image);
+/*
+ * The read-only state that CPUs can share rather than each loading their
+ * own: the bootrom mapping and the microcode table.
+ */
+struct cpu_assets;
+
+struct cpu_assets *cpu_assets_load(const char *bootrom_image);
+/* new_cpu() with shared assets, which must outlive the CPU. */
+struct cpu *new_cpu_shared(const char *binary, int flags,
+			   const struct cpu_assets *assets,
+			   const char *sdcard_image);
 int cpu_cycle(struct cpu *c, bool *breakpoint_hit);
+unsigned long cpu_run(struct cpu *c, unsigned long max_cycles,
+		      bool *breakpoint_hit);
+/* Number of times a block runs before the JIT translates it. */
+void cpu_set_jit_threshold(struct cpu *c, unsigned int threshold);
+/*
+ * Keep the last nr_cycles cycles of trace in memory instead of writing a
+ * trace file, saving them to oldland-flight.trace on a data abort, illegal
+ * instruction, breakpoint or cpu_dump_trace().
+ */
+void cpu_start_flight_recorder(struct cpu *c, unsigned int nr_cycles);
+int cpu_dump_trace(struct cpu *c);
+void cpu_flush_trace(struct cpu *c);
+/* Cycles fast-forwarded over idle loops since the CPU was created. */
+unsigned long long cpu_idle_cycles(const struct cpu *c);
 int cpu_read_reg(struct cpu *c, unsigned regnum, uint32_t *v);
 int cpu_write_reg(struct cpu *c, unsigned regnum, uint32_t v);
 int cpu_read_mem(struct cpu *c, uint32_t addr, uint32_t *v, size_t nbits,
 		 int *tlb_miss);
 int cpu_write_mem(struct cpu *c, uint32_t addr, uint32_t v, size_t nbits);
 void cpu_reset(struct cpu *c);
+/*
+ * Save the whole machine to a checkpoint file and restore it into a CPU
+ * created with the same configuration and SD card image.  Restored memory
+ * is mapped copy-on-write from the file, so any number of CPUs can restore
+ * one checkpoint and only pay for the pages that they write.
+ */
+int cpu_save_checkpoint(struct cpu *c, const char *path);
+int cpu_restore_checkpoint(struct cpu *c, const char *path);
+/*
+ * Breakpoints and watchpoints checked by the simulator rather than patched
+ * into memory, see CMD_SET_BREAKPOINTS.  Hitting either stops cpu_cycle()
+ * and cpu_run() as a bkp instruction would, but a breakpoint stops before
+ * the instruction at its address and a watchpoint after the load or store.
+ * Both use virtual addresses.
+ */
+#define CPU_MAX_WATCHPOINTS	16
+
+enum cpu_watch_flags {
+	CPU_WATCH_READ	= (1 << 0),
+	CPU_WATCH_WRITE	= (1 << 1),
+};
+
+int cpu_set_breakpoints(struct cpu *c, const uint32_t *pcs, unsigned int nr);
+void cpu_clear_watchpoints(struct cpu *c);
+int cpu_add_watchpoint(struct cpu *c, uint32_t addr, uint32_t len,
+		       unsigned int flags);
+/* Whether the last stop was a watchpoint, and the address accessed. */
+bool cpu_watch_hit(const struct cpu *c, uint32_t *addr);
 void cpu_cache_sync(struct cpu *cpu);
 uint32_t cpu_cpuid(unsigned int reg);
 
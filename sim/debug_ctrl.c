@@ -0,0 +1,435 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "debug_ctrl.h"
+
+struct debug_ctrl {
+	struct cpu *cpu;
+	bool running;
+	bool terminated;
+	const char *reset_checkpoint;
+
+	bool breakpoint_hit;
+	uint32_t regs[4];
+
+	bool run_until;
+	uint32_t run_limit;
+	uint32_t run_cycles;
+	/* The CMD_SET_STOP_PCS address set, sorted. */
+	uint32_t stop_pcs[DBG_MAX_BLOCK / sizeof(uint32_t)];
+	unsigned int nr_stop_pcs;
+
+	/* A CMD_WAIT_STOPPED response is owed once the CPU stops. */
+	bool stop_waiter;
+};
+
+struct debug_ctrl *debug_ctrl_new(struct cpu *cpu)
+{
+	struct debug_ctrl *d = calloc(1, sizeof(*d));
+
+	if (!d)
+		return NULL;
+
+	d->cpu = cpu;
+	/* The CPU runs from reset until the debugger stops it. */
+	d->running = true;
+
+	return d;
+}
+
+void debug_ctrl_free(struct debug_ctrl *d)
+{
+	free(d);
+}
+
+void debug_ctrl_set_reset_checkpoint(struct debug_ctrl *d, const char *path)
+{
+	d->reset_checkpoint = path;
+}
+
+bool debug_ctrl_running(const struct debug_ctrl *d)
+{
+	return d->running;
+}
+
+bool debug_ctrl_terminated(const struct debug_ctrl *d)
+{
+	return d->terminated;
+}
+
+static bool valid_block(uint32_t addr, uint32_t len)
+{
+	return len <= DBG_MAX_BLOCK && !(len & 3) && !(addr & 3);
+}
+
+static int read_block(struct cpu *cpu, uint32_t addr, uint32_t *data,
+		      uint32_t len)
+{
+	uint32_t m;
+
+	for (m = 0; m < len / sizeof(*data); ++m) {
+		int tlb_miss = 0;
+		int rc = cpu_read_mem(cpu, addr + m * sizeof(*data), &data[m],
+				      32, &tlb_miss);
+
+		if (!rc && tlb_miss)
+			rc = -1;
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int write_block(struct cpu *cpu, uint32_t addr, const uint32_t *data,
+		       uint32_t len)
+{
+	uint32_t m;
+
+	if (!valid_block(addr, len))
+		return -EINVAL;
+
+	for (m = 0; m < len / sizeof(*data); ++m) {
+		int rc = cpu_write_mem(cpu, addr + m * sizeof(*data), data[m],
+				       32);
+
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int read_all_regs(struct cpu *cpu, uint32_t *regs)
+{
+	unsigned int m;
+
+	for (m = 0; m < DBG_SNAPSHOT_REGS; ++m) {
+		int rc = cpu_read_reg(cpu, dbg_snapshot_regnum(m), &regs[m]);
+
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int write_regs(struct cpu *cpu, uint32_t mask, const uint32_t *regs)
+{
+	unsigned int m;
+
+	for (m = 0; m < DBG_SNAPSHOT_REGS; ++m) {
+		int rc;
+
+		if (!(mask & (1U << m)))
+			continue;
+		rc = cpu_write_reg(cpu, dbg_snapshot_regnum(m), regs[m]);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int compare_pcs(const void *a, const void *b)
+{
+	uint32_t pa = *(const uint32_t *)a, pb = *(const uint32_t *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static int set_stop_pcs(struct debug_ctrl *d, const uint32_t *pcs,
+			uint32_t len)
+{
+	if (len > sizeof(d->stop_pcs) || (len & 3))
+		return -EINVAL;
+
+	d->nr_stop_pcs = len / sizeof(uint32_t);
+	memcpy(d->stop_pcs, pcs, len);
+	qsort(d->stop_pcs, d->nr_stop_pcs, sizeof(uint32_t), compare_pcs);
+
+	return 0;
+}
+
+static bool is_stop_pc(const struct debug_ctrl *d, uint32_t pc)
+{
+	return d->nr_stop_pcs &&
+		bsearch(&pc, d->stop_pcs, d->nr_stop_pcs, sizeof(pc),
+			compare_pcs);
+}
+
+static int set_watchpoints(struct cpu *cpu,
+			   const struct dbg_watchpoint *watchpoints,
+			   uint32_t len)
+{
+	unsigned int m;
+
+	if (len > DBG_MAX_WATCHPOINTS * sizeof(*watchpoints) ||
+	    len % sizeof(*watchpoints))
+		return -EINVAL;
+
+	cpu_clear_watchpoints(cpu);
+	for (m = 0; m < len / sizeof(*watchpoints); ++m) {
+		int rc = cpu_add_watchpoint(cpu, watchpoints[m].addr,
+					    watchpoints[m].len,
+					    watchpoints[m].flags);
+
+		if (rc) {
+			cpu_clear_watchpoints(cpu);
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/* The path is NUL terminated within the block. */
+static int checkpoint(struct cpu *cpu, const uint32_t *data, uint32_t len,
+		      bool save)
+{
+	const char *path = (const char *)data;
+
+	if (!valid_block(0, len) || !memchr(path, '\0', len))
+		return -EINVAL;
+
+	return save ? cpu_save_checkpoint(cpu, path) :
+		cpu_restore_checkpoint(cpu, path);
+}
+
+static uint32_t exec_status(const struct debug_ctrl *d)
+{
+	uint32_t watch_addr;
+
+	return d->running |
+		((!!d->breakpoint_hit) << 1) |
+		(cpu_watch_hit(d->cpu, &watch_addr) << 2);
+}
+
+bool debug_ctrl_stop_response(struct debug_ctrl *d, bool end_wait,
+			      struct dbg_response *resp)
+{
+	if (!d->stop_waiter || (d->running && !end_wait))
+		return false;
+
+	d->stop_waiter = false;
+	*resp = (struct dbg_response) { .data = exec_status(d) };
+
+	return true;
+}
+
+void debug_ctrl_cancel_stop_wait(struct debug_ctrl *d)
+{
+	d->stop_waiter = false;
+}
+
+/*
+ * Step until the PC reaches one of the debugger's stop addresses, exactly as
+ * if the debugger had stepped and checked each PC itself.
+ */
+static void run_until(struct debug_ctrl *d, unsigned long max_cycles)
+{
+	unsigned long n;
+
+	for (n = 0; n < max_cycles; ++n) {
+		uint32_t pc;
+
+		cpu_cycle(d->cpu, &d->breakpoint_hit);
+		++d->run_cycles;
+		cpu_read_reg(d->cpu, PC, &pc);
+		if (d->breakpoint_hit || is_stop_pc(d, pc) ||
+		    d->run_cycles == d->run_limit) {
+			d->running = false;
+			d->run_until = false;
+			return;
+		}
+	}
+}
+
+void debug_ctrl_run(struct debug_ctrl *d, unsigned long max_cycles)
+{
+	if (!d->running)
+		return;
+
+	d->breakpoint_hit = false;
+	if (d->run_until)
+		run_until(d, max_cycles);
+	else
+		cpu_run(d->cpu, max_cycles, &d->breakpoint_hit);
+	if (d->breakpoint_hit)
+		d->running = false;
+}
+
+bool debug_ctrl_request(struct debug_ctrl *d, const struct dbg_request *req,
+			uint32_t *data, struct dbg_response *resp,
+			uint32_t *payload_len)
+{
+	struct cpu *cpu = d->cpu;
+	uint32_t *regs = d->regs;
+	int tlb_miss = 0;
+
+	*resp = (struct dbg_response) {
+		.status = req->addr > 3 ? -EINVAL : 0,
+	};
+	*payload_len = 0;
+
+	if (!req->read_not_write)
+		regs[req->addr & 0x3] = req->value;
+
+	if (req->addr == REG_CMD && !req->read_not_write) {
+		switch (regs[REG_CMD]) {
+		case CMD_STOP:
+			d->running = false;
+			d->run_until = false;
+			cpu_flush_trace(cpu);
+			cpu_read_reg(cpu, PC, &regs[REG_RDATA]);
+			break;
+		case CMD_RUN:
+			d->running = true;
+			d->run_until = false;
+			break;
+		case CMD_RUN_UNTIL:
+			d->running = true;
+			d->run_until = true;
+			d->run_limit = regs[REG_WDATA];
+			d->run_cycles = 0;
+			break;
+		case CMD_GET_RUN_CYCLES:
+			regs[REG_RDATA] = d->run_cycles;
+			break;
+		case CMD_STEP:
+			d->running = false;
+			d->run_until = false;
+			d->breakpoint_hit = false;
+			cpu_cycle(cpu, &d->breakpoint_hit);
+			cpu_read_reg(cpu, PC, &regs[REG_RDATA]);
+			break;
+		case CMD_READ_REG:
+			resp->status = cpu_read_reg(cpu, regs[REG_ADDRESS],
+						    &regs[REG_RDATA]);
+			break;
+		case CMD_WRITE_REG:
+			resp->status = cpu_write_reg(cpu, regs[REG_ADDRESS],
+						     regs[REG_WDATA]);
+			break;
+		case CMD_RMEM32:
+			resp->status = cpu_read_mem(cpu, regs[REG_ADDRESS],
+						    &regs[REG_RDATA], 32,
+						    &tlb_miss);
+			if (tlb_miss && !resp->status)
+				resp->status = -1;
+			break;
+		case CMD_WMEM32:
+			resp->status = cpu_write_mem(cpu, regs[REG_ADDRESS],
+						     regs[REG_WDATA], 32);
+			break;
+		case CMD_RMEM16:
+			resp->status = cpu_read_mem(cpu, regs[REG_ADDRESS],
+						    &regs[REG_RDATA], 16,
+						    &tlb_miss);
+			if (tlb_miss && !resp->status)
+				resp->status = -1;
+			break;
+		case CMD_WMEM16:
+			resp->status = cpu_write_mem(cpu, regs[REG_ADDRESS],
+						     regs[REG_WDATA], 16);
+			break;
+		case CMD_RMEM8:
+			resp->status = cpu_read_mem(cpu, regs[REG_ADDRESS],
+						    &regs[REG_RDATA], 8,
+						    &tlb_miss);
+			if (tlb_miss && !resp->status)
+				resp->status = -1;
+			break;
+		case CMD_WMEM8:
+			resp->status = cpu_write_mem(cpu, regs[REG_ADDRESS],
+						     regs[REG_WDATA], 8);
+			break;
+		case CMD_RESET:
+			if (d->reset_checkpoint)
+				resp->status = cpu_restore_checkpoint(cpu,
+					d->reset_checkpoint);
+			else
+				cpu_reset(cpu);
+			break;
+		case CMD_CACHE_SYNC:
+			cpu_cache_sync(cpu);
+			break;
+		case CMD_CPUID:
+			regs[REG_RDATA] = cpu_cpuid(regs[REG_ADDRESS]);
+			break;
+		case CMD_GET_EXEC_STATUS:
+			regs[REG_RDATA] = exec_status(d);
+			break;
+		case CMD_WAIT_STOPPED:
+			if (d->running) {
+				d->stop_waiter = true;
+				return false;
+			}
+			resp->data = exec_status(d);
+			break;
+		case CMD_RMEM_BLOCK:
+			if (!valid_block(regs[REG_ADDRESS], regs[REG_WDATA])) {
+				resp->status = -EINVAL;
+				break;
+			}
+			*payload_len = regs[REG_WDATA];
+			resp->status = read_block(cpu, regs[REG_ADDRESS], data,
+						  *payload_len);
+			resp->data = *payload_len;
+			break;
+		case CMD_WMEM_BLOCK:
+			resp->status = write_block(cpu, regs[REG_ADDRESS], data,
+						   regs[REG_WDATA]);
+			break;
+		case CMD_READ_ALL_REGS:
+			*payload_len = DBG_SNAPSHOT_SIZE;
+			resp->status = read_all_regs(cpu, data);
+			resp->data = *payload_len;
+			break;
+		case CMD_WRITE_REGS:
+			resp->status = write_regs(cpu, regs[REG_ADDRESS], data);
+			break;
+		case CMD_SET_STOP_PCS:
+			resp->status = set_stop_pcs(d, data, regs[REG_WDATA]);
+			break;
+		case CMD_SET_BREAKPOINTS:
+			resp->status = cpu_set_breakpoints(cpu, data,
+				regs[REG_WDATA] / sizeof(uint32_t));
+			break;
+		case CMD_SET_WATCHPOINTS:
+			resp->status = set_watchpoints(cpu,
+				(const struct dbg_watchpoint *)data,
+				regs[REG_WDATA]);
+			break;
+		case CMD_GET_WATCH_ADDR:
+			if (!cpu_watch_hit(cpu, &regs[REG_RDATA]))
+				regs[REG_RDATA] = 0;
+			break;
+		case CMD_SAVE_CHECKPOINT:
+			resp->status = checkpoint(cpu, data, regs[REG_WDATA],
+						  true);
+			break;
+		case CMD_RESTORE_CHECKPOINT:
+			resp->status = checkpoint(cpu, data, regs[REG_WDATA],
+						  false);
+			break;
+		case CMD_DUMP_TRACE:
+			resp->status = cpu_dump_trace(cpu);
+			break;
+		case CMD_SIM_TERM:
+			d->terminated = true;
+			return false;
+		default:
+			resp->status = -EINVAL;
+		}
+	}
+
+	if (req->read_not_write)
+		resp->data = regs[req->addr & 0x3];
+
+	return true;
+}
@@ -0,0 +1,52 @@
+#ifndef __DEBUG_CTRL_H__
+#define __DEBUG_CTRL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../debugger/protocol.h"
+
+struct cpu;
+
+/*
+ * The simulator's debug controller: the registers behind debug requests and
+ * running or stopping the CPU.  oldland-sim feeds it from the debug server,
+ * the debugger's local target calls it directly.
+ */
+struct debug_ctrl;
+
+struct debug_ctrl *debug_ctrl_new(struct cpu *cpu);
+void debug_ctrl_free(struct debug_ctrl *d);
+/*
+ * Make CMD_RESET restore the checkpoint at path instead, which must outlive
+ * the controller, so that every debugger connecting starts from it.
+ */
+void debug_ctrl_set_reset_checkpoint(struct debug_ctrl *d, const char *path);
+/*
+ * Handle a request, filling in resp.  Block commands take any payload from
+ * data and leave the payload to send back there, with its length in
+ * *payload_len.  Returns false if there is no response yet: CMD_WAIT_STOPPED
+ * while the CPU is running or CMD_SIM_TERM.
+ */
+bool debug_ctrl_request(struct debug_ctrl *d, const struct dbg_request *req,
+			uint32_t *data, struct dbg_response *resp,
+			uint32_t *payload_len);
+bool debug_ctrl_running(const struct debug_ctrl *d);
+/* Set once CMD_SIM_TERM has been received. */
+bool debug_ctrl_terminated(const struct debug_ctrl *d);
+/*
+ * Run the CPU for up to max_cycles if it is running, stopping early at a
+ * breakpoint or an address in the stop set when running until one.
+ */
+void debug_ctrl_run(struct debug_ctrl *d, unsigned long max_cycles);
+/*
+ * The CMD_WAIT_STOPPED response held back by debug_ctrl_request(), owed once
+ * the CPU has stopped or, with end_wait, straight away because another
+ * request has arrived.  Returns false if none is owed.
+ */
+bool debug_ctrl_stop_response(struct debug_ctrl *d, bool end_wait,
+			      struct dbg_response *resp);
+/* Drop the owed CMD_WAIT_STOPPED response, its client has gone. */
+void debug_ctrl_cancel_stop_wait(struct debug_ctrl *d);
+
+#endif /* __DEBUG_CTRL_H__ */
@@ -66,7 +66,8 @@ static const struct io_ops uart_io_ops = {
 	.read = uart_read,
 };
 
-int debug_uart_init(struct mem_map *mem, physaddr_t base, size_t len)
+int debug_uart_init(struct mem_map *mem, physaddr_t base, size_t len,
+		    bool interactive)
 {
 	struct region *r;
 	struct uart_data *u;
@@ -74,8 +75,8 @@ int debug_uart_init(struct mem_map *mem, physaddr_t base, size_t len)
 	u = malloc(sizeof(*u));
 	assert(u);
 
-	if (sim_is_interactive()) {
-		u->fd = create_pts();
+	if (interactive) {
+		u->fd = open_pts(true);
 		assert(u->fd >= 0);
 	} else {
 		u->fd = STDOUT_FILENO;
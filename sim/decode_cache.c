@@ -0,0 +1,138 @@
+/*
+ * Predecoded instruction cache.
+ *
+ * Decoded instructions are stored per physical page, with pages allocated
+ * on first execution.  The page table is sparse in the same way as the
+ * memory map: a table of supersections each holding a table of pages.
+ *
+ * Entries are invalidated a word at a time when memory is written so that
+ * code and data sharing a page don't keep throwing the whole page away.
+ * Each page also has a generation count that is bumped whenever a valid
+ * entry is invalidated so that translated blocks built from the page can
+ * cheaply tell whether any of their instructions have been rewritten.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode_cache.h"
+
+#define NR_SUPERSECT_BITS	10
+#define SUPERSECT_SHIFT		22
+#define NR_SECT_BITS		10
+#define SECT_SHIFT		12
+#define INSNS_PER_PAGE		(PAGE_SIZE / sizeof(uint32_t))
+
+struct decode_page {
+	struct decoded_insn insns[INSNS_PER_PAGE];
+	unsigned long generation;
+};
+
+struct decode_supersect {
+	struct decode_page *pages[1 << NR_SECT_BITS];
+};
+
+struct decode_cache {
+	struct decode_supersect *supersects[1 << NR_SUPERSECT_BITS];
+};
+
+static inline unsigned int supersect_idx(physaddr_t p)
+{
+	return p >> SUPERSECT_SHIFT;
+}
+
+static inline unsigned int sect_idx(physaddr_t p)
+{
+	return (p >> SECT_SHIFT) & ((1 << NR_SECT_BITS) - 1);
+}
+
+static inline unsigned int insn_idx(physaddr_t p)
+{
+	return (p & (PAGE_SIZE - 1)) / sizeof(uint32_t);
+}
+
+struct decode_cache *decode_cache_new(void)
+{
+	return calloc(1, sizeof(struct decode_cache));
+}
+
+static struct decode_page *find_page(struct decode_cache *dc, physaddr_t addr)
+{
+	struct decode_supersect *ss = dc->supersects[supersect_idx(addr)];
+
+	return ss ? ss->pages[sect_idx(addr)] : NULL;
+}
+
+static struct decode_page *get_page(struct decode_cache *dc, physaddr_t addr)
+{
+	struct decode_supersect **ss = &dc->supersects[supersect_idx(addr)];
+	struct decode_page **page;
+
+	if (!*ss) {
+		*ss = calloc(1, sizeof(**ss));
+		assert(*ss != NULL);
+	}
+
+	page = &(*ss)->pages[sect_idx(addr)];
+	if (!*page) {
+		*page = calloc(1, sizeof(**page));
+		assert(*page != NULL);
+	}
+
+	return *page;
+}
+
+struct decoded_insn *decode_cache_lookup(struct decode_cache *dc,
+					 physaddr_t addr)
+{
+	return &get_page(dc, addr)->insns[insn_idx(addr)];
+}
+
+const unsigned long *decode_cache_generation(struct decode_cache *dc,
+					     physaddr_t addr)
+{
+	return &get_page(dc, addr)->generation;
+}
+
+bool decode_cache_has_page(struct decode_cache *dc, physaddr_t addr)
+{
+	return find_page(dc, addr) != NULL;
+}
+
+void decode_cache_inval_addr(struct decode_cache *dc, physaddr_t addr)
+{
+	struct decode_page *page = find_page(dc, addr);
+	struct decoded_insn *insn;
+
+	if (!page)
+		return;
+
+	insn = &page->insns[insn_idx(addr)];
+	if (insn->valid) {
+		insn->valid = false;
+		page->generation++;
+	}
+}
+
+void decode_cache_inval_all(struct decode_cache *dc)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < (1 << NR_SUPERSECT_BITS); ++i) {
+		struct decode_supersect *ss = dc->supersects[i];
+
+		if (!ss)
+			continue;
+
+		for (j = 0; j < (1 << NR_SECT_BITS); ++j) {
+			struct decode_page *page = ss->pages[j];
+
+			if (!page)
+				continue;
+
+			memset(page->insns, 0, sizeof(page->insns));
+			page->generation++;
+		}
+	}
+}
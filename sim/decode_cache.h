@@ -0,0 +1,56 @@
+#ifndef __DECODE_CACHE_H__
+#define __DECODE_CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "io.h"
+
+struct cpu;
+struct decoded_insn;
+
+typedef void (*insn_handler)(struct cpu *c, const struct decoded_insn *insn,
+			     bool *breakpoint_hit);
+
+enum op1_sel {
+	OP1_RA,
+	OP1_RB,
+	OP1_PC,
+};
+
+/*
+ * An instruction with the microcode lookup and operand extraction already
+ * done.  valid means that the decode was made from a read of memory and that
+ * there have been no writes to the address since.
+ */
+struct decoded_insn {
+	insn_handler exec;
+	uint32_t instr;
+	uint32_t ucode;
+	uint32_t imm;
+	uint8_t rd;
+	uint8_t ra;
+	uint8_t rb;
+	uint8_t aluop;
+	uint8_t op1;
+	bool op2rb;
+	bool valid;
+};
+
+struct decode_cache;
+
+struct decode_cache *decode_cache_new(void);
+struct decoded_insn *decode_cache_lookup(struct decode_cache *dc,
+					 physaddr_t addr);
+/*
+ * The generation count for the page containing addr, changes whenever a valid
+ * decode in that page is invalidated.
+ */
+const unsigned long *decode_cache_generation(struct decode_cache *dc,
+					     physaddr_t addr);
+/* Whether anything has been decoded from the page containing addr. */
+bool decode_cache_has_page(struct decode_cache *dc, physaddr_t addr);
+void decode_cache_inval_addr(struct decode_cache *dc, physaddr_t addr);
+void decode_cache_inval_all(struct decode_cache *dc);
+
+#endif /* __DECODE_CACHE_H__ */
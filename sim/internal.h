@@ -36,6 +36,4 @@ static inline void __die(const char *file, unsigned int line, const char *fmt, .
 }
 #define die(fmt, ...) __die(__FILE__, __LINE__, (fmt), ##__VA_ARGS__)
 
-extern bool interactive_mode;
-
 #endif /* __INTERNAL_H__ */
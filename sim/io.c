@@ -34,6 +34,8 @@ struct region {
 		    void *priv);
 	int (*write)(unsigned int offs, uint32_t val, size_t nr_bits,
 		     void *priv);
+	uint8_t *host;
+	bool host_writable;
 };
 
 static inline unsigned int supersect_idx(physaddr_t p)
@@ -52,6 +54,8 @@ struct supersect {
 
 struct mem_map {
 	struct supersect *supersects[1 << NR_SUPERSECT_BITS];
+	void (*write_notify)(physaddr_t addr, void *priv);
+	void *write_notify_priv;
 };
 
 struct mem_map *mem_map_new(void)
@@ -154,6 +158,7 @@ int mem_map_write(struct mem_map *map, physaddr_t addr, unsigned int nr_bits,
 		  uint32_t val)
 {
 	const struct region *r;
+	int rc;
 
 	if (addr & ((nr_bits / 8) - 1))
 		return -EIO;
@@ -161,7 +166,11 @@ int mem_map_write(struct mem_map *map, physaddr_t addr, unsigned int nr_bits,
 	r = mem_map_lookup(map, addr);
 
 	val &= (uint32_t)((1LU << (unsigned long)nr_bits) - 1LU);
-	return r->write(addr - r->base, val, nr_bits, r->priv);
+	rc = r->write(addr - r->base, val, nr_bits, r->priv);
+	if (!rc && (r->flags & MEM_MAPF_CACHEABLE) && map->write_notify)
+		map->write_notify(addr, map->write_notify_priv);
+
+	return rc;
 }
 
 int mem_map_read(struct mem_map *map, physaddr_t addr, unsigned int nr_bits,
@@ -181,6 +190,22 @@ int mem_map_read(struct mem_map *map, physaddr_t addr, unsigned int nr_bits,
 	return rc;
 }
 
+void mem_map_region_set_host(struct region *r, void *host, bool writable)
+{
+	r->host = host;
+	r->host_writable = writable;
+}
+
+void *mem_map_host_ptr(struct mem_map *map, physaddr_t addr, bool write)
+{
+	const struct region *r = mem_map_lookup(map, addr);
+
+	if (!r->host || (write && !r->host_writable))
+		return NULL;
+
+	return r->host + (addr - r->base);
+}
+
 int mem_map_addr_cacheable(struct mem_map *map, physaddr_t addr)
 {
 	const struct region *r = mem_map_lookup(map, addr);
@@ -190,3 +215,21 @@ int mem_map_addr_cacheable(struct mem_map *map, physaddr_t addr)
 
 	return 0;
 }
+
+int mem_map_addr_stable(struct mem_map *map, physaddr_t addr)
+{
+	const struct region *r = mem_map_lookup(map, addr);
+
+	if (r)
+		return !!(r->flags & MEM_MAPF_STABLE);
+
+	return 0;
+}
+
+void mem_map_set_write_notifier(struct mem_map *map,
+				void (*notify)(physaddr_t addr, void *priv),
+				void *priv)
+{
+	map->write_notify = notify;
+	map->write_notify_priv = priv;
+}
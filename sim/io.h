@@ -11,8 +11,10 @@
 #ifndef __IO_H__
 #define __IO_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
+struct checkpoint;
 struct event_list;
 
 #define PAGE_SIZE		(1 << 12)
@@ -33,6 +35,8 @@ struct io_ops {
 
 enum {
     MEM_MAPF_CACHEABLE = (1 << 0),
+    /* Reads have no side effects and only change when an event fires. */
+    MEM_MAPF_STABLE = (1 << 1),
 };
 
 /*
@@ -46,15 +50,35 @@ int mem_map_write(struct mem_map *map, physaddr_t addr, unsigned int nr_bits,
 int mem_map_read(struct mem_map *map, physaddr_t addr, unsigned int nr_bits,
 		 uint32_t *val);
 int mem_map_addr_cacheable(struct mem_map *map, physaddr_t addr);
+int mem_map_addr_stable(struct mem_map *map, physaddr_t addr);
+/*
+ * Regions backed by host memory can be accessed directly without going
+ * through the region's io_ops.  mem_map_host_ptr() returns NULL for regions
+ * that aren't, or aren't writable when write is set.  Direct writes bypass
+ * the write notifier so the caller is responsible for coherency.
+ */
+void mem_map_region_set_host(struct region *r, void *host, bool writable);
+void *mem_map_host_ptr(struct mem_map *map, physaddr_t addr, bool write);
+/*
+ * Register a callback to be run after each successful write to a cacheable
+ * region so that copies of memory held outside of the map can be kept
+ * coherent.
+ */
+void mem_map_set_write_notifier(struct mem_map *map,
+				void (*notify)(physaddr_t addr, void *priv),
+				void *priv);
 
 /*
  * Devices.
  */
-int debug_uart_init(struct mem_map *mem, physaddr_t base, size_t len);
+/* An interactive UART is a pseudo terminal rather than stdout. */
+int debug_uart_init(struct mem_map *mem, physaddr_t base, size_t len,
+		    bool interactive);
 int ram_init(struct mem_map *mem, physaddr_t base, size_t len,
 	     const char *init_contents);
-int rom_init(struct mem_map *mem, physaddr_t base, size_t len,
-	     const char *filename);
+/* A read-only mapping of a ROM image that any number of ROMs can share. */
+void *rom_map(const char *filename, size_t len);
+int rom_init(struct mem_map *mem, physaddr_t base, size_t len, void *rom);
 int sdram_ctrl_init(struct mem_map *mem, physaddr_t base, size_t len);
 
 struct irq_ctrl;
@@ -70,5 +94,8 @@ struct timer_base *timers_init(struct mem_map *mem, physaddr_t base,
 			       struct event_list *events,
 			       const struct timer_init_data *init_data);
 void timers_reset(struct timer_base *timers);
+/* The event list's now must be restored before the timers. */
+void timers_save(const struct timer_base *timers, struct checkpoint *cp);
+void timers_restore(struct timer_base *timers, struct checkpoint *cp);
 
 #endif /* __IO_H__ */
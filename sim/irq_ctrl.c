@@ -4,8 +4,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "checkpoint.h"
 #include "internal.h"
 #include "io.h"
+#include "irq_ctrl.h"
 
 struct irq_ctrl {
 	uint32_t	status;
@@ -123,7 +125,8 @@ struct irq_ctrl *irq_ctrl_init(struct mem_map *mem, physaddr_t base,
 	ctrl->cpu_clear_irq = cpu_clear_irq;
 	ctrl->cb_data = data;
 
-	r = mem_map_region_add(mem, base, 4096, &irq_ctrl_ops, ctrl, 0);
+	r = mem_map_region_add(mem, base, 4096, &irq_ctrl_ops, ctrl,
+			       MEM_MAPF_STABLE);
 	assert(r);
 
 	return ctrl;
@@ -137,3 +140,36 @@ void irq_ctrl_reset(struct irq_ctrl *irq_ctrl)
 	irq_ctrl->irq_raised = false;
 	irq_ctrl->cpu_clear_irq(irq_ctrl->cb_data);
 }
+
+struct irq_ctrl_state {
+	uint32_t status;
+	uint32_t raw_status;
+	uint32_t enable_mask;
+	uint32_t irq_raised;
+};
+
+void irq_ctrl_save(const struct irq_ctrl *ctrl, struct checkpoint *cp)
+{
+	struct irq_ctrl_state state = {
+		.status = ctrl->status,
+		.raw_status = ctrl->raw_status,
+		.enable_mask = ctrl->enable_mask,
+		.irq_raised = ctrl->irq_raised,
+	};
+
+	checkpoint_put(cp, "IRQC", &state, sizeof(state));
+}
+
+void irq_ctrl_restore(struct irq_ctrl *ctrl, struct checkpoint *cp)
+{
+	struct irq_ctrl_state state;
+
+	checkpoint_get(cp, "IRQC", &state, sizeof(state));
+	if (checkpoint_error(cp))
+		return;
+
+	ctrl->status = state.status;
+	ctrl->raw_status = state.raw_status;
+	ctrl->enable_mask = state.enable_mask;
+	ctrl->irq_raised = state.irq_raised;
+}
@@ -3,6 +3,7 @@
 
 #include "io.h"
 
+struct checkpoint;
 struct irq_ctrl;
 
 struct irq_ctrl *irq_ctrl_init(struct mem_map *mem, physaddr_t base,
@@ -11,5 +12,8 @@ struct irq_ctrl *irq_ctrl_init(struct mem_map *mem, physaddr_t base,
 void irq_ctrl_raise_irq(struct irq_ctrl *ctrl, unsigned int irq_num);
 void irq_ctrl_clear_irq(struct irq_ctrl *ctrl, unsigned int irq_num);
 void irq_ctrl_reset(struct irq_ctrl *irq_ctrl);
+/* Restoring doesn't call back into the CPU, it restores its own IRQ line. */
+void irq_ctrl_save(const struct irq_ctrl *ctrl, struct checkpoint *cp);
+void irq_ctrl_restore(struct irq_ctrl *ctrl, struct checkpoint *cp);
 
 #endif /* __IRQ_CTRL_H__ */
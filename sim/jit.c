@@ -0,0 +1,330 @@
+/*
+ * x86-64 code cache and emitter.
+ *
+ * The emitter only knows the handful of instruction forms that block
+ * translation needs.  Memory operands are always [base + disp32] which
+ * wastes a few bytes but keeps the encoding in one place.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "jit.h"
+
+struct jit {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	unsigned long generation;
+};
+
+#ifdef HAVE_JIT
+
+struct jit *jit_new(size_t size)
+{
+	struct jit *j = calloc(1, sizeof(*j));
+
+	if (!j)
+		return NULL;
+
+	j->base = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j->base == MAP_FAILED) {
+		free(j);
+		return NULL;
+	}
+	j->size = size;
+
+	return j;
+}
+
+#else /* !HAVE_JIT */
+
+struct jit *jit_new(size_t size)
+{
+	return NULL;
+}
+
+#endif /* HAVE_JIT */
+
+unsigned long jit_generation(const struct jit *j)
+{
+	return j->generation;
+}
+
+void jit_flush(struct jit *j)
+{
+	j->used = 0;
+	++j->generation;
+}
+
+void jit_begin(struct jit *j, struct jit_buf *buf)
+{
+	buf->start = buf->p = j->base + j->used;
+	buf->end = j->base + j->size;
+	buf->overflow = false;
+}
+
+void *jit_commit(struct jit *j, struct jit_buf *buf)
+{
+	if (buf->overflow)
+		return NULL;
+
+	/* Keep entry points 16 byte aligned. */
+	j->used = ((buf->p - j->base) + 15) & ~15UL;
+	if (j->used > j->size)
+		j->used = j->size;
+
+	return buf->start;
+}
+
+static void emit8(struct jit_buf *buf, uint8_t v)
+{
+	if (buf->p >= buf->end) {
+		buf->overflow = true;
+		return;
+	}
+
+	*buf->p++ = v;
+}
+
+static void emit32(struct jit_buf *buf, uint32_t v)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; ++i)
+		emit8(buf, v >> (i * 8));
+}
+
+/*
+ * byte_regs forces a REX prefix so that registers 4-7 mean spl-dil rather
+ * than ah-bh for 8-bit operands.
+ */
+static void emit_rex(struct jit_buf *buf, bool w, unsigned int reg,
+		     unsigned int rm, bool byte_regs)
+{
+	uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+
+	if (rex != 0x40 || (byte_regs && (reg >= 4 || rm >= 4)))
+		emit8(buf, rex);
+}
+
+static void emit_modrm_reg(struct jit_buf *buf, unsigned int reg,
+			   unsigned int rm)
+{
+	emit8(buf, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_modrm_mem(struct jit_buf *buf, unsigned int reg,
+			   enum jit_reg base, int32_t disp)
+{
+	emit8(buf, 0x80 | ((reg & 7) << 3) | (base & 7));
+	/* rsp and r12 as a base need a SIB byte. */
+	if ((base & 7) == JIT_RSP)
+		emit8(buf, 0x24);
+	emit32(buf, disp);
+}
+
+void jit_mov_rr(struct jit_buf *buf, bool w, enum jit_reg dst,
+		enum jit_reg src)
+{
+	emit_rex(buf, w, src, dst, false);
+	emit8(buf, 0x89);
+	emit_modrm_reg(buf, src, dst);
+}
+
+void jit_mov_imm32(struct jit_buf *buf, enum jit_reg dst, uint32_t imm)
+{
+	emit_rex(buf, false, 0, dst, false);
+	emit8(buf, 0xb8 + (dst & 7));
+	emit32(buf, imm);
+}
+
+void jit_mov_imm64(struct jit_buf *buf, enum jit_reg dst, uint64_t imm)
+{
+	emit_rex(buf, true, 0, dst, false);
+	emit8(buf, 0xb8 + (dst & 7));
+	emit32(buf, imm);
+	emit32(buf, imm >> 32);
+}
+
+void jit_load(struct jit_buf *buf, unsigned int nbits, enum jit_reg dst,
+	      enum jit_reg base, int32_t disp)
+{
+	emit_rex(buf, nbits == 64, dst, base, false);
+	switch (nbits) {
+	case 8:
+		emit8(buf, 0x0f);
+		emit8(buf, 0xb6);
+		break;
+	case 16:
+		emit8(buf, 0x0f);
+		emit8(buf, 0xb7);
+		break;
+	default:
+		emit8(buf, 0x8b);
+	}
+	emit_modrm_mem(buf, dst, base, disp);
+}
+
+void jit_store(struct jit_buf *buf, unsigned int nbits, enum jit_reg base,
+	       int32_t disp, enum jit_reg src)
+{
+	if (nbits == 16)
+		emit8(buf, 0x66);
+	emit_rex(buf, nbits == 64, src, base, nbits == 8);
+	emit8(buf, nbits == 8 ? 0x88 : 0x89);
+	emit_modrm_mem(buf, src, base, disp);
+}
+
+void jit_alu_rr(struct jit_buf *buf, enum jit_alu op, bool w,
+		enum jit_reg dst, enum jit_reg src)
+{
+	emit_rex(buf, w, src, dst, false);
+	emit8(buf, op * 8 + 1);
+	emit_modrm_reg(buf, src, dst);
+}
+
+void jit_alu_ri(struct jit_buf *buf, enum jit_alu op, bool w,
+		enum jit_reg dst, int32_t imm)
+{
+	emit_rex(buf, w, 0, dst, false);
+	if (imm >= -128 && imm <= 127) {
+		emit8(buf, 0x83);
+		emit_modrm_reg(buf, op, dst);
+		emit8(buf, imm);
+	} else {
+		emit8(buf, 0x81);
+		emit_modrm_reg(buf, op, dst);
+		emit32(buf, imm);
+	}
+}
+
+void jit_alu_rm(struct jit_buf *buf, enum jit_alu op, enum jit_reg dst,
+		enum jit_reg base, int32_t disp)
+{
+	emit_rex(buf, false, dst, base, false);
+	emit8(buf, op * 8 + 3);
+	emit_modrm_mem(buf, dst, base, disp);
+}
+
+void jit_cmp_m8_imm(struct jit_buf *buf, enum jit_reg base, int32_t disp,
+		    uint8_t imm)
+{
+	emit_rex(buf, false, 0, base, false);
+	emit8(buf, 0x80);
+	emit_modrm_mem(buf, JIT_CMP, base, disp);
+	emit8(buf, imm);
+}
+
+void jit_shift_cl(struct jit_buf *buf, enum jit_shift op, bool w,
+		  enum jit_reg dst)
+{
+	emit_rex(buf, w, 0, dst, false);
+	emit8(buf, 0xd3);
+	emit_modrm_reg(buf, op, dst);
+}
+
+void jit_shift_ri(struct jit_buf *buf, enum jit_shift op, bool w,
+		  enum jit_reg dst, uint8_t imm)
+{
+	emit_rex(buf, w, 0, dst, false);
+	emit8(buf, 0xc1);
+	emit_modrm_reg(buf, op, dst);
+	emit8(buf, imm);
+}
+
+void jit_imul_rr(struct jit_buf *buf, bool w, enum jit_reg dst,
+		 enum jit_reg src)
+{
+	emit_rex(buf, w, dst, src, false);
+	emit8(buf, 0x0f);
+	emit8(buf, 0xaf);
+	emit_modrm_reg(buf, dst, src);
+}
+
+void jit_imul_rri(struct jit_buf *buf, enum jit_reg dst, enum jit_reg src,
+		  int32_t imm)
+{
+	emit_rex(buf, false, dst, src, false);
+	emit8(buf, 0x69);
+	emit_modrm_reg(buf, dst, src);
+	emit32(buf, imm);
+}
+
+void jit_bitop_rr(struct jit_buf *buf, enum jit_bitop op, enum jit_reg dst,
+		  enum jit_reg bit)
+{
+	emit_rex(buf, false, bit, dst, false);
+	emit8(buf, 0x0f);
+	emit8(buf, op);
+	emit_modrm_reg(buf, bit, dst);
+}
+
+void jit_setcc(struct jit_buf *buf, enum jit_cc cc, enum jit_reg dst)
+{
+	emit_rex(buf, false, 0, dst, true);
+	emit8(buf, 0x0f);
+	emit8(buf, 0x90 + cc);
+	emit_modrm_reg(buf, 0, dst);
+	/* movzx dst, dst8 */
+	emit_rex(buf, false, dst, dst, true);
+	emit8(buf, 0x0f);
+	emit8(buf, 0xb6);
+	emit_modrm_reg(buf, dst, dst);
+}
+
+void jit_push(struct jit_buf *buf, enum jit_reg r)
+{
+	emit_rex(buf, false, 0, r, false);
+	emit8(buf, 0x50 + (r & 7));
+}
+
+void jit_pop(struct jit_buf *buf, enum jit_reg r)
+{
+	emit_rex(buf, false, 0, r, false);
+	emit8(buf, 0x58 + (r & 7));
+}
+
+void jit_ret(struct jit_buf *buf)
+{
+	emit8(buf, 0xc3);
+}
+
+/* Clobbers rax, which isn't preserved by the callee anyway. */
+void jit_call(struct jit_buf *buf, const void *fn)
+{
+	jit_mov_imm64(buf, JIT_RAX, (uintptr_t)fn);
+	emit8(buf, 0xff);
+	emit_modrm_reg(buf, 2, JIT_RAX);
+}
+
+uint8_t *jit_jcc(struct jit_buf *buf, enum jit_cc cc)
+{
+	emit8(buf, 0x0f);
+	emit8(buf, 0x80 + cc);
+	emit32(buf, 0);
+
+	return buf->p - 4;
+}
+
+uint8_t *jit_jmp(struct jit_buf *buf)
+{
+	emit8(buf, 0xe9);
+	emit32(buf, 0);
+
+	return buf->p - 4;
+}
+
+void jit_patch(struct jit_buf *buf, uint8_t *rel)
+{
+	int32_t v = buf->p - (rel + 4);
+
+	if (buf->overflow)
+		return;
+
+	memcpy(rel, &v, sizeof(v));
+}
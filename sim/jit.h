@@ -0,0 +1,121 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * x86-64 code cache and a minimal instruction emitter for translating hot
+ * blocks to native code.  Code is bump allocated from a single executable
+ * mapping, when that fills the whole cache is thrown away and the generation
+ * incremented so that anything holding a pointer into it can tell the code
+ * is gone.
+ *
+ * Only 64-bit hosts are supported, on anything else jit_new() returns NULL.
+ */
+#if defined(__x86_64__)
+#define HAVE_JIT	1
+#endif
+
+enum jit_reg {
+	JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI,
+	JIT_R8, JIT_R9, JIT_R10, JIT_R11, JIT_R12, JIT_R13, JIT_R14, JIT_R15,
+};
+
+/* Group 1 arithmetic, the value is the /digit in the ModRM reg field. */
+enum jit_alu {
+	JIT_ADD	= 0,
+	JIT_OR	= 1,
+	JIT_ADC	= 2,
+	JIT_SBB	= 3,
+	JIT_AND	= 4,
+	JIT_SUB	= 5,
+	JIT_XOR	= 6,
+	JIT_CMP	= 7,
+};
+
+enum jit_shift {
+	JIT_SHL	= 4,
+	JIT_SHR	= 5,
+	JIT_SAR	= 7,
+};
+
+enum jit_bitop {
+	JIT_BT	= 0xa3,
+	JIT_BTS	= 0xab,
+	JIT_BTR	= 0xb3,
+};
+
+enum jit_cc {
+	JIT_CC_C	= 0x2,
+	JIT_CC_NC	= 0x3,
+	JIT_CC_Z	= 0x4,
+	JIT_CC_NZ	= 0x5,
+};
+
+struct jit;
+
+/*
+ * Emission is into a window of the code cache.  Running off the end sets
+ * overflow rather than writing past it, the caller finds out at
+ * jit_commit().
+ */
+struct jit_buf {
+	uint8_t *start;
+	uint8_t *p;
+	uint8_t *end;
+	bool overflow;
+};
+
+struct jit *jit_new(size_t size);
+unsigned long jit_generation(const struct jit *j);
+void jit_flush(struct jit *j);
+void jit_begin(struct jit *j, struct jit_buf *buf);
+/*
+ * Returns the entry point of the code emitted since jit_begin(), or NULL if
+ * it didn't fit.
+ */
+void *jit_commit(struct jit *j, struct jit_buf *buf);
+
+void jit_mov_rr(struct jit_buf *buf, bool w, enum jit_reg dst,
+		enum jit_reg src);
+void jit_mov_imm32(struct jit_buf *buf, enum jit_reg dst, uint32_t imm);
+void jit_mov_imm64(struct jit_buf *buf, enum jit_reg dst, uint64_t imm);
+/* Loads zero extend to the full register. */
+void jit_load(struct jit_buf *buf, unsigned int nbits, enum jit_reg dst,
+	      enum jit_reg base, int32_t disp);
+void jit_store(struct jit_buf *buf, unsigned int nbits, enum jit_reg base,
+	       int32_t disp, enum jit_reg src);
+void jit_alu_rr(struct jit_buf *buf, enum jit_alu op, bool w,
+		enum jit_reg dst, enum jit_reg src);
+void jit_alu_ri(struct jit_buf *buf, enum jit_alu op, bool w,
+		enum jit_reg dst, int32_t imm);
+void jit_alu_rm(struct jit_buf *buf, enum jit_alu op, enum jit_reg dst,
+		enum jit_reg base, int32_t disp);
+void jit_cmp_m8_imm(struct jit_buf *buf, enum jit_reg base, int32_t disp,
+		    uint8_t imm);
+void jit_shift_cl(struct jit_buf *buf, enum jit_shift op, bool w,
+		  enum jit_reg dst);
+void jit_shift_ri(struct jit_buf *buf, enum jit_shift op, bool w,
+		  enum jit_reg dst, uint8_t imm);
+void jit_imul_rr(struct jit_buf *buf, bool w, enum jit_reg dst,
+		 enum jit_reg src);
+void jit_imul_rri(struct jit_buf *buf, enum jit_reg dst, enum jit_reg src,
+		  int32_t imm);
+void jit_bitop_rr(struct jit_buf *buf, enum jit_bitop op, enum jit_reg dst,
+		  enum jit_reg bit);
+void jit_setcc(struct jit_buf *buf, enum jit_cc cc, enum jit_reg dst);
+void jit_push(struct jit_buf *buf, enum jit_reg r);
+void jit_pop(struct jit_buf *buf, enum jit_reg r);
+void jit_ret(struct jit_buf *buf);
+void jit_call(struct jit_buf *buf, const void *fn);
+/*
+ * Forward branches: the returned pointer is passed to jit_patch() once the
+ * target has been emitted.
+ */
+uint8_t *jit_jcc(struct jit_buf *buf, enum jit_cc cc);
+uint8_t *jit_jmp(struct jit_buf *buf);
+void jit_patch(struct jit_buf *buf, uint8_t *rel);
+
+#endif /* __JIT_H__ */
@@ -38,6 +38,11 @@ static inline void list_del(struct list_head *h)
 	next->prev = prev;
 }
 
+static inline int list_empty(const struct list_head *l)
+{
+	return l->next == l;
+}
+
 #define list_for_each(pos, list) \
 	for ((pos) = (list)->next; (pos) != (list); (pos) = (pos)->next)
 
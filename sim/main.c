@@ -20,150 +20,267 @@
 #include <sys/types.h>
 
 #include "cpu.h"
+#include "debug_ctrl.h"
 #include "internal.h"
 
 #include "../debugger/protocol.h"
 #include "../devicemodels/jtag.h"
 
-static int sim_interactive = 0;
+/*
+ * Maximum number of cycles to run between checking for debug requests.
+ */
+#define RUN_QUANTUM		16384
 
-int sim_is_interactive(void)
-{
-	return sim_interactive;
-}
+struct pool;
 
-struct debug_data {
+/* One CPU and the debug server that drives it. */
+struct instance {
+	unsigned int index;
+	struct cpu *cpu;
+	struct debug_ctrl *ctrl;
 	struct jtag_debug_data *jtag;
+	struct pool *pool;
+	/* On the run queue or with a worker, otherwise parked. */
+	bool scheduled;
+	/* The connection that the last request handled came from. */
+	unsigned int connection;
+};
 
-	bool breakpoint_hit;
-	uint32_t debug_regs[4];
+/*
+ * Several instances share a pool of worker threads.  Workers take the
+ * instance at the head of the run queue and run it for a quantum, handing
+ * it back to the tail while the CPU is running.  Stopped instances are
+ * parked until their server thread sees a request.
+ */
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct instance **queue;
+	unsigned int nr_instances;
+	unsigned int head;
+	unsigned int nr_queued;
+	/* Instances yet to receive CMD_SIM_TERM. */
+	unsigned int nr_live;
 };
 
-static enum {
-	SIM_STATE_STOPPED,
-	SIM_STATE_RUNNING,
-} sim_state = SIM_STATE_RUNNING;
+static void handle_req(struct instance *in, const struct dbg_request *req)
+{
+	struct dbg_response resp;
+	uint32_t payload_len;
+
+	in->connection = in->jtag->req_connection;
+	if (debug_ctrl_request(in->ctrl, req, in->jtag->block_data, &resp,
+			       &payload_len))
+		send_block_response(in->jtag, &resp, in->jtag->block_data,
+				    payload_len);
+}
 
-static void handle_req(struct debug_data *debug, struct dbg_request *req,
-		       struct cpu *cpu)
+static void answer_stop_waiter(struct instance *in, bool end_wait)
 {
-	struct dbg_response resp = { .status = req->addr > 3 ? -EINVAL : 0 };
-	int tlb_miss = 0;
+	struct dbg_response resp;
 
-	if (!req->read_not_write)
-		debug->debug_regs[req->addr & 0x3] = req->value;
+	/*
+	 * A wait is only owed to the client that sent it, answering once it
+	 * has gone would shift every response to the next client by one.
+	 */
+	if (client_gone(in->jtag, in->connection))
+		debug_ctrl_cancel_stop_wait(in->ctrl);
+	if (debug_ctrl_stop_response(in->ctrl, end_wait, &resp))
+		send_response(in->jtag, &resp);
+}
 
-	if (req->addr == REG_CMD && !req->read_not_write) {
-		switch (debug->debug_regs[REG_CMD]) {
-		case CMD_STOP:
-			sim_state = SIM_STATE_STOPPED;
-			cpu_read_reg(cpu, PC, &debug->debug_regs[REG_RDATA]);
-			break;
-		case CMD_RUN:
-			sim_state = SIM_STATE_RUNNING;
-			break;
-		case CMD_STEP:
-			sim_state = SIM_STATE_STOPPED;
-			debug->breakpoint_hit = false;
-			cpu_cycle(cpu, &debug->breakpoint_hit);
-			cpu_read_reg(cpu, PC, &debug->debug_regs[REG_RDATA]);
-			break;
-		case CMD_READ_REG:
-			resp.status = cpu_read_reg(cpu,
-						   debug->debug_regs[REG_ADDRESS],
-						   &debug->debug_regs[REG_RDATA]);
-			break;
-		case CMD_WRITE_REG:
-			resp.status = cpu_write_reg(cpu,
-						    debug->debug_regs[REG_ADDRESS],
-						    debug->debug_regs[REG_WDATA]);
-			break;
-		case CMD_RMEM32:
-			resp.status = cpu_read_mem(cpu,
-						   debug->debug_regs[REG_ADDRESS],
-						   &debug->debug_regs[REG_RDATA],
-						   32, &tlb_miss);
-			if (tlb_miss && !resp.status)
-				resp.status = -1;
-			break;
-		case CMD_WMEM32:
-			resp.status = cpu_write_mem(cpu,
-						    debug->debug_regs[REG_ADDRESS],
-						    debug->debug_regs[REG_WDATA],
-						    32);
-			break;
-		case CMD_RMEM16:
-			resp.status = cpu_read_mem(cpu,
-						   debug->debug_regs[REG_ADDRESS],
-						   &debug->debug_regs[REG_RDATA],
-						   16, &tlb_miss);
-			if (tlb_miss && !resp.status)
-				resp.status = -1;
-			break;
-		case CMD_WMEM16:
-			resp.status = cpu_write_mem(cpu,
-						    debug->debug_regs[REG_ADDRESS],
-						    debug->debug_regs[REG_WDATA],
-						    16);
-			break;
-		case CMD_RMEM8:
-			resp.status = cpu_read_mem(cpu,
-						   debug->debug_regs[REG_ADDRESS],
-						   &debug->debug_regs[REG_RDATA],
-						   8, &tlb_miss);
-			if (tlb_miss && !resp.status)
-				resp.status = -1;
-			break;
-		case CMD_WMEM8:
-			resp.status = cpu_write_mem(cpu,
-						    debug->debug_regs[REG_ADDRESS],
-						    debug->debug_regs[REG_WDATA],
-						    8);
-			break;
-		case CMD_RESET:
-			cpu_reset(cpu);
-			break;
-		case CMD_CACHE_SYNC:
-			cpu_cache_sync(cpu);
-			break;
-		case CMD_CPUID:
-			debug->debug_regs[REG_RDATA] =
-				cpu_cpuid(debug->debug_regs[REG_ADDRESS]);
-			break;
-		case CMD_GET_EXEC_STATUS:
-			debug->debug_regs[REG_RDATA] =
-				(sim_state == SIM_STATE_RUNNING) |
-				((!!debug->breakpoint_hit) << 1);
-			break;
-		case CMD_SIM_TERM:
+/* Handle any pending requests, returns false once the instance terminates. */
+static bool handle_requests(struct instance *in)
+{
+	struct dbg_request req;
+
+	while (request_pending(in->jtag) && !get_request(in->jtag, &req)) {
+		/* Anything else from the debugger ends a wait. */
+		answer_stop_waiter(in, true);
+		handle_req(in, &req);
+		if (debug_ctrl_terminated(in->ctrl))
+			return false;
+	}
+
+	return true;
+}
+
+static void report_idle_cycles(const struct instance *in)
+{
+	unsigned long long idle = cpu_idle_cycles(in->cpu);
+
+	if (!idle)
+		return;
+	if (in->pool)
+		fprintf(stderr, "instance %u: ", in->index);
+	fprintf(stderr, "skipped %llu idle cycles\n", idle);
+}
+
+static void run_instance(struct instance *in)
+{
+	for (;;) {
+		if (!handle_requests(in)) {
+			report_idle_cycles(in);
 			exit(EXIT_SUCCESS);
-		default:
-			resp.status = -EINVAL;
+		}
+
+		debug_ctrl_run(in->ctrl, RUN_QUANTUM);
+
+		if (!debug_ctrl_running(in->ctrl)) {
+			answer_stop_waiter(in, false);
+			if (!request_pending(in->jtag))
+				wait_for_request(in->jtag);
 		}
 	}
+}
 
-	if (req->read_not_write)
-		resp.data = debug->debug_regs[req->addr & 0x3];
+static void enqueue(struct pool *p, struct instance *in)
+{
+	p->queue[(p->head + p->nr_queued++) % p->nr_instances] = in;
+	pthread_cond_signal(&p->cond);
+}
 
-	send_response(debug->jtag, &resp);
+static struct instance *dequeue(struct pool *p)
+{
+	struct instance *in = p->queue[p->head];
+
+	p->head = (p->head + 1) % p->nr_instances;
+	--p->nr_queued;
+
+	return in;
+}
+
+/* From the instance's server thread when a request arrives. */
+static void wake_instance(void *data)
+{
+	struct instance *in = data;
+	struct pool *p = in->pool;
+
+	pthread_mutex_lock(&p->lock);
+	if (!in->scheduled) {
+		in->scheduled = true;
+		enqueue(p, in);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Handle requests then run for a quantum, returns true if the instance
+ * still has work to do.
+ */
+static bool run_slice(struct instance *in)
+{
+	if (!handle_requests(in))
+		return false;
+
+	debug_ctrl_run(in->ctrl, RUN_QUANTUM);
+	if (debug_ctrl_running(in->ctrl))
+		return true;
+	answer_stop_waiter(in, false);
+
+	return false;
+}
+
+static void *worker(void *data)
+{
+	struct pool *p = data;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		struct instance *in;
+		bool busy;
+
+		while (!p->nr_queued && p->nr_live)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (!p->nr_live)
+			break;
+
+		in = dequeue(p);
+		pthread_mutex_unlock(&p->lock);
+		busy = run_slice(in);
+		pthread_mutex_lock(&p->lock);
+
+		/*
+		 * Terminated instances stay scheduled so that they are never
+		 * queued again.  A request that arrived after run_slice()
+		 * last looked found the instance still scheduled, so check
+		 * for one before parking it.
+		 */
+		if (debug_ctrl_terminated(in->ctrl)) {
+			report_idle_cycles(in);
+			disconnect_client(in->jtag);
+			if (!--p->nr_live)
+				pthread_cond_broadcast(&p->cond);
+		} else if (busy || request_pending(in->jtag)) {
+			enqueue(p, in);
+		} else {
+			in->scheduled = false;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+static void run_pool(struct instance *instances, unsigned int nr_instances,
+		     unsigned int nr_threads)
+{
+	struct pool p = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.nr_instances = nr_instances,
+		.nr_live = nr_instances,
+	};
+	unsigned int m;
+
+	p.queue = calloc(nr_instances, sizeof(*p.queue));
+	if (!p.queue)
+		err(1, "failed to allocate run queue");
+
+	/* Every CPU runs from reset until its debugger stops it. */
+	for (m = 0; m < nr_instances; ++m) {
+		instances[m].pool = &p;
+		instances[m].scheduled = true;
+		p.queue[m] = &instances[m];
+	}
+	p.nr_queued = nr_instances;
+
+	for (m = 0; m < nr_instances; ++m)
+		set_request_notifier(instances[m].jtag, wake_instance,
+				     &instances[m]);
+
+	/* The main thread is a worker too. */
+	for (m = 1; m < nr_threads; ++m) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, worker, &p))
+			err(1, "failed to spawn worker thread");
+	}
+	worker(&p);
 }
 
 int main(int argc, char *argv[])
 {
-	struct cpu *cpu;
-	struct debug_data debug;
+	struct instance *instances;
+	struct cpu_assets *assets;
+	unsigned short *ports;
 	int i, cpu_flags = CPU_NOTRACE;
 	const char *bootrom_image = ROM_FILE;
 	const char *sdcard_image = NULL;
-
-	debug.jtag = start_server();
+	const char *checkpoint = NULL;
+	long jit_threshold = -1;
+	long flight_recorder = 0;
+	long nr_instances = 1, nr_threads = 0;
 
 	for (i = 0; i < argc; ++i) {
 		if (!strcmp(argv[i], "--debug") ||
 		    !strcmp(argv[i], "-d"))
 			cpu_flags &= ~CPU_NOTRACE;
+		if (!strcmp(argv[i], "--binary-trace"))
+			cpu_flags = (cpu_flags & ~CPU_NOTRACE) |
+				CPU_BINARY_TRACE;
 		if (!strcmp(argv[i], "--interactive"))
-			sim_interactive = 1;
+			cpu_flags |= CPU_INTERACTIVE;
 		if (!strcmp(argv[i], "--bootrom") && i + 1 < argc) {
 			bootrom_image = argv[i + 1];
 			++i;
@@ -172,29 +289,88 @@ int main(int argc, char *argv[])
 			sdcard_image = argv[i + 1];
 			++i;
 		}
+		if (!strcmp(argv[i], "--sdcard-cow"))
+			cpu_flags |= CPU_SDCARD_COW;
+		if (!strcmp(argv[i], "--jit"))
+			cpu_flags |= CPU_JIT;
+		if (!strcmp(argv[i], "--flight-recorder") && i + 1 < argc) {
+			flight_recorder = strtol(argv[i + 1], NULL, 0);
+			++i;
+		}
+		if (!strcmp(argv[i], "--no-idle-skip"))
+			cpu_flags |= CPU_NO_IDLE_SKIP;
+		if (!strcmp(argv[i], "--jit-threshold") && i + 1 < argc) {
+			jit_threshold = strtol(argv[i + 1], NULL, 0);
+			++i;
+		}
+		if (!strcmp(argv[i], "--instances") && i + 1 < argc) {
+			nr_instances = strtol(argv[i + 1], NULL, 0);
+			++i;
+		}
+		if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			nr_threads = strtol(argv[i + 1], NULL, 0);
+			++i;
+		}
+		if (!strcmp(argv[i], "--restore") && i + 1 < argc) {
+			checkpoint = argv[i + 1];
+			++i;
+		}
 	}
 
-	cpu = new_cpu(NULL, cpu_flags, bootrom_image, sdcard_image);
+	if (nr_instances < 1)
+		errx(1, "need at least one instance");
+	/* Trace files have fixed names so only one CPU can write them. */
+	if (nr_instances > 1 &&
+	    (!(cpu_flags & CPU_NOTRACE) || flight_recorder > 0))
+		errx(1, "tracing needs a single instance");
+	/* Each instance would be writing to the same image. */
+	if (nr_instances > 1 && sdcard_image && !(cpu_flags & CPU_SDCARD_COW))
+		errx(1, "a shared SD card image needs --sdcard-cow");
+	if (nr_threads < 1)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > nr_instances)
+		nr_threads = nr_instances;
 
-	notify_runner();
+	instances = calloc(nr_instances, sizeof(*instances));
+	ports = calloc(nr_instances, sizeof(*ports));
+	if (!instances || !ports)
+		err(1, "failed to allocate instances");
 
-	for (;;) {
-		struct dbg_request req;
+	assets = cpu_assets_load(bootrom_image);
+	for (i = 0; i < nr_instances; ++i) {
+		struct instance *in = &instances[i];
 
-		if (!debug.jtag->more_data &&
-		    __sync_val_compare_and_swap(&debug.jtag->pending, 1, 0) == 0)
-			debug.jtag->more_data = 1;
+		in->index = i;
+		in->jtag = nr_instances > 1 ?
+			start_server_instance(i) : start_server();
+		in->jtag->native_blocks = true;
+		ports[i] = in->jtag->port;
 
-		if (!get_request(debug.jtag, &req))
-			handle_req(&debug, &req, cpu);
+		in->cpu = new_cpu_shared(NULL, cpu_flags, assets,
+					 sdcard_image);
+		if (checkpoint) {
+			int rc = cpu_restore_checkpoint(in->cpu, checkpoint);
 
-		if (sim_state == SIM_STATE_RUNNING) {
-			debug.breakpoint_hit = false;
-			cpu_cycle(cpu, &debug.breakpoint_hit);
-			if (debug.breakpoint_hit)
-				sim_state = SIM_STATE_STOPPED;
+			if (rc)
+				errx(1, "failed to restore %s: %s", checkpoint,
+				     strerror(-rc));
 		}
+		in->ctrl = debug_ctrl_new(in->cpu);
+		if (!in->ctrl)
+			err(1, "failed to allocate debug controller");
+		if (checkpoint)
+			debug_ctrl_set_reset_checkpoint(in->ctrl, checkpoint);
+		if (jit_threshold >= 0)
+			cpu_set_jit_threshold(in->cpu, jit_threshold);
+		if (flight_recorder > 0)
+			cpu_start_flight_recorder(in->cpu, flight_recorder);
 	}
 
+	notify_runner_ports(ports, nr_instances);
+
+	if (nr_instances == 1)
+		run_instance(&instances[0]);
+	run_pool(instances, nr_instances, nr_threads);
+
 	return 0;
 }
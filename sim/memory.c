@@ -79,8 +79,9 @@ int ram_init(struct mem_map *mem, physaddr_t base, size_t len,
 		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	assert(ram != MAP_FAILED);
 	r = mem_map_region_add(mem, base, len, &ram_io_ops, ram,
-			       MEM_MAPF_CACHEABLE);
+			       MEM_MAPF_CACHEABLE | MEM_MAPF_STABLE);
 	assert(r != NULL);
+	mem_map_region_set_host(r, ram, true);
 
 	if (init_contents) {
 		ssize_t br;
@@ -98,19 +99,27 @@ int ram_init(struct mem_map *mem, physaddr_t base, size_t len,
 }
 
 
-int rom_init(struct mem_map *mem, physaddr_t base, size_t len,
-	     const char *filename)
+void *rom_map(const char *filename, size_t len)
 {
 	void *rom;
-	struct region *r;
 	int fd = open(filename, O_RDONLY);
 
 	assert(fd >= 0);
 	rom = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
 	assert(rom != MAP_FAILED);
+	close(fd);
+
+	return rom;
+}
+
+int rom_init(struct mem_map *mem, physaddr_t base, size_t len, void *rom)
+{
+	struct region *r;
+
 	r = mem_map_region_add(mem, base, len, &rom_io_ops, rom,
-			       MEM_MAPF_CACHEABLE);
+			       MEM_MAPF_CACHEABLE | MEM_MAPF_STABLE);
 	assert(r != NULL);
+	mem_map_region_set_host(r, rom, false);
 
 	return 0;
 }
@@ -137,7 +146,7 @@ static const struct io_ops sdram_ctrl_ops = {
 int sdram_ctrl_init(struct mem_map *mem, physaddr_t base, size_t len)
 {
 	struct region *r = mem_map_region_add(mem, base, len, &sdram_ctrl_ops,
-					      NULL, 0);
+					      NULL, MEM_MAPF_STABLE);
 	assert(r != NULL);
 
 	return 0;
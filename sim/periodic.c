@@ -5,6 +5,50 @@
 #include "internal.h"
 #include "periodic.h"
 
+static inline struct event *first_event(const struct event_list *event_list)
+{
+	return container_of(event_list->events.next, struct event, head);
+}
+
+static void update_next_deadline(struct event_list *event_list)
+{
+	event_list->next_deadline = list_empty(&event_list->events) ? ~0ULL :
+		first_event(event_list)->deadline;
+}
+
+/* A count of zero wraps, taking 2^32 ticks to expire. */
+static inline unsigned long long ticks_to_expiry(uint32_t count)
+{
+	return count ? count : 1ULL << 32;
+}
+
+static void event_schedule(struct event *event, unsigned long long deadline)
+{
+	struct event_list *event_list = event->list;
+	struct list_head *pos;
+
+	event->deadline = deadline;
+	/*
+	 * Equal deadlines expire in the order the events were created, as
+	 * they did when every event was ticked in turn.
+	 */
+	list_for_each(pos, &event_list->events) {
+		struct event *e = container_of(pos, struct event, head);
+
+		if (e->deadline > deadline ||
+		    (e->deadline == deadline && e->seq > event->seq))
+			break;
+	}
+	list_add_tail(&event->head, pos);
+	update_next_deadline(event_list);
+}
+
+static void event_unschedule(struct event *event)
+{
+	list_del(&event->head);
+	update_next_deadline(event->list);
+}
+
 struct event *event_new(struct event_list *event_list, uint32_t reload_val,
 			void (*callback)(struct event *event), void *cookie)
 {
@@ -12,32 +56,58 @@ struct event *event_new(struct event_list *event_list, uint32_t reload_val,
 
 	assert(event != NULL);
 
+	event->list = event_list;
 	event->reload_val = reload_val;
 	event->current = reload_val;
 	event->callback = callback;
 	event->cookie = cookie;
-	list_add_tail(&event->head, &event_list->events);
+	event->seq = event_list->nr_created++;
 
 	return event;
 }
 
-void event_list_tick(struct event_list *event_list)
+void event_list_expire(struct event_list *event_list)
 {
-	struct list_head *pos;
+	/* Callbacks may reschedule or disable any event, so start over. */
+	while (!list_empty(&event_list->events)) {
+		struct event *event = first_event(event_list);
 
-	list_for_each(pos, &event_list->events) {
-		struct event *event = container_of(pos, struct event, head);
+		if (event->deadline > event_list->now)
+			break;
 
-		if (event->enabled && --event->current == 0) {
-			event->current = event->reload_val;
-			event->callback(event);
-		}
+		list_del(&event->head);
+		event->current = event->reload_val;
+		event_schedule(event, event_list->now +
+			       ticks_to_expiry(event->reload_val));
+		event->callback(event);
 	}
+
+	update_next_deadline(event_list);
+}
+
+uint32_t event_list_next(const struct event_list *event_list)
+{
+	unsigned long long ticks;
+
+	if (list_empty(&event_list->events))
+		return UINT32_MAX;
+
+	ticks = event_list->next_deadline - event_list->now;
+
+	return ticks < UINT32_MAX ? ticks : UINT32_MAX;
+}
+
+void event_list_advance(struct event_list *event_list, uint32_t n)
+{
+	event_list->now += n;
+	if (event_list->now >= event_list->next_deadline)
+		event_list_expire(event_list);
 }
 
 void event_delete(struct event *event)
 {
-	list_del(&event->head);
+	if (event->enabled)
+		event_unschedule(event);
 	free(event);
 }
 
@@ -45,4 +115,62 @@ void event_mod(struct event *event, uint32_t reload_val)
 {
 	event->reload_val = reload_val;
 	event->current = reload_val;
+
+	if (event->enabled) {
+		event_unschedule(event);
+		event_schedule(event, event->list->now +
+			       ticks_to_expiry(reload_val));
+	}
+}
+
+void event_enable(struct event *event)
+{
+	if (event->enabled)
+		return;
+
+	event->enabled = true;
+	event_schedule(event, event->list->now +
+		       ticks_to_expiry(event->current));
+}
+
+void event_disable(struct event *event)
+{
+	if (!event->enabled)
+		return;
+
+	event->current = event_current(event);
+	event->enabled = false;
+	event_unschedule(event);
+}
+
+uint32_t event_current(const struct event *event)
+{
+	if (!event->enabled)
+		return event->current;
+
+	/* Truncation gives zero for a wrapped count. */
+	return event->deadline - event->list->now;
+}
+
+void event_get_state(const struct event *event, struct event_state *state)
+{
+	*state = (struct event_state) {
+		.deadline = event->deadline,
+		.reload_val = event->reload_val,
+		.current = event->current,
+		.enabled = event->enabled,
+	};
+}
+
+void event_set_state(struct event *event, const struct event_state *state)
+{
+	if (event->enabled)
+		event_unschedule(event);
+
+	event->reload_val = state->reload_val;
+	event->current = state->current;
+	event->deadline = state->deadline;
+	event->enabled = state->enabled;
+	if (event->enabled)
+		event_schedule(event, state->deadline);
 }
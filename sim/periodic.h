@@ -6,39 +6,81 @@
 
 #include "list.h"
 
+/*
+ * Events count down in ticks of the CPU clock.  Rather than decrementing
+ * every event on every tick, enabled events are kept on a list sorted by the
+ * absolute tick they expire on so that a tick is a single compare against
+ * the earliest deadline.
+ */
 struct event_list {
 	struct list_head events;
+	unsigned long long now;
+	unsigned long long next_deadline;
+	unsigned int nr_created;
 };
 
 static inline void event_list_init(struct event_list *event_list)
 {
 	list_init(&event_list->events);
+	event_list->now = 0;
+	event_list->next_deadline = ~0ULL;
+	event_list->nr_created = 0;
 }
 
-void event_list_tick(struct event_list *event_list);
+void event_list_expire(struct event_list *event_list);
 
+static inline void event_list_tick(struct event_list *event_list)
+{
+	if (++event_list->now >= event_list->next_deadline)
+		event_list_expire(event_list);
+}
+
+/*
+ * The number of ticks until the next enabled event fires, UINT32_MAX if
+ * there are none.  event_list_advance() runs n ticks at once and must only
+ * be used for n up to that, events due on the last tick fire.
+ */
+uint32_t event_list_next(const struct event_list *event_list);
+void event_list_advance(struct event_list *event_list, uint32_t n);
+
+/*
+ * current is the count at the last disable, reload or expiry, while enabled
+ * event_current() computes the live value from the deadline.
+ */
 struct event {
 	struct list_head head;
+	struct event_list *list;
 	uint32_t reload_val;
 	uint32_t current;
+	unsigned long long deadline;
 	void (*callback)(struct event *event);
 	void *cookie;
 	bool enabled;
+	/* Creation order, which events due on the same tick fire in. */
+	unsigned int seq;
 };
 
 struct event *event_new(struct event_list *event_list, uint32_t reload_val,
 			void (*callback)(struct event *event), void *cookie);
 void event_delete(struct event *event);
 void event_mod(struct event *event, uint32_t reload_val);
+void event_enable(struct event *event);
+void event_disable(struct event *event);
+uint32_t event_current(const struct event *event);
 
-static inline void event_enable(struct event *event)
-{
-	event->enabled = true;
-}
+/*
+ * Enough of an event to put it back as it was for a checkpoint.  The list's
+ * now has to be restored before any of its events.
+ */
+struct event_state {
+	uint64_t deadline;
+	uint32_t reload_val;
+	uint32_t current;
+	uint32_t enabled;
+	uint32_t pad;
+};
 
-static inline void event_disable(struct event *event)
-{
-	event->enabled = false;
-}
+void event_get_state(const struct event *event, struct event_state *state);
+void event_set_state(struct event *event, const struct event_state *state);
 
 #endif /* __PERIODIC_H__ */
@@ -1,13 +1,14 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "checkpoint.h"
 #include "sdcard.h"
 
-#include "../devicemodels/spi_sdcard.h"
-
 static void sdcard_exchange_bytes(struct spislave *slave,
 				  uint8_t master_to_slave,
 				  uint8_t *slave_to_master)
@@ -18,18 +19,112 @@ static void sdcard_exchange_bytes(struct spislave *slave,
 	spi_sdcard_next_byte_to_slave(sdcard, master_to_slave);
 }
 
-struct spislave *sdcard_new(const char *sdcard_image)
+struct written_page {
+	uint64_t offset;
+	uint32_t len;
+	uint32_t pad;
+};
+
+static void count_page(uint64_t offset, const void *page, size_t len,
+		       void *data)
+{
+	uint32_t *nr_pages = data;
+
+	++*nr_pages;
+}
+
+static void save_page(uint64_t offset, const void *page, size_t len,
+		      void *data)
+{
+	struct written_page hdr = { .offset = offset, .len = len };
+	struct checkpoint *cp = data;
+
+	checkpoint_put(cp, "SDPH", &hdr, sizeof(hdr));
+	checkpoint_put(cp, "SDPD", page, len);
+}
+
+/*
+ * The card state then the pages written to a copy-on-write image, a card
+ * that writes through to its image keeps whatever it has written since.
+ */
+static void sdcard_save(struct spislave *slave, struct checkpoint *cp)
+{
+	struct spi_sdcard *sdcard = slave->privdata;
+	size_t len = spi_sdcard_state_size();
+	uint32_t nr_pages = 0;
+	void *state = malloc(len);
+
+	if (!state) {
+		checkpoint_set_error(cp, -ENOMEM);
+		return;
+	}
+
+	spi_sdcard_get_state(sdcard, state);
+	checkpoint_put(cp, "SDST", state, len);
+	free(state);
+
+	spi_sdcard_for_each_written(sdcard, count_page, &nr_pages);
+	checkpoint_put(cp, "SDNP", &nr_pages, sizeof(nr_pages));
+	spi_sdcard_for_each_written(sdcard, save_page, cp);
+}
+
+static void sdcard_restore(struct spislave *slave, struct checkpoint *cp)
+{
+	struct spi_sdcard *sdcard = slave->privdata;
+	size_t len = spi_sdcard_state_size();
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	uint32_t nr_pages, m;
+	void *state = malloc(len), *page = malloc(page_size);
+
+	if (!state || !page) {
+		checkpoint_set_error(cp, -ENOMEM);
+		goto out;
+	}
+
+	checkpoint_get(cp, "SDST", state, len);
+	if (!checkpoint_error(cp))
+		spi_sdcard_set_state(sdcard, state);
+
+	checkpoint_get(cp, "SDNP", &nr_pages, sizeof(nr_pages));
+	if (checkpoint_error(cp))
+		goto out;
+
+	spi_sdcard_discard_writes(sdcard);
+	for (m = 0; m < nr_pages && !checkpoint_error(cp); ++m) {
+		struct written_page hdr;
+		int rc;
+
+		checkpoint_get(cp, "SDPH", &hdr, sizeof(hdr));
+		if (!checkpoint_error(cp) && hdr.len > page_size)
+			checkpoint_set_error(cp, -EINVAL);
+		checkpoint_get(cp, "SDPD", page, hdr.len);
+		if (checkpoint_error(cp))
+			break;
+
+		rc = spi_sdcard_write_page(sdcard, hdr.offset, page, hdr.len);
+		if (rc)
+			checkpoint_set_error(cp, rc);
+	}
+
+out:
+	free(page);
+	free(state);
+}
+
+struct spislave *sdcard_new(const char *sdcard_image, int flags)
 {
 	struct spislave *slave;
 	struct spi_sdcard *sdcard;
 
-	sdcard = spi_sdcard_new(sdcard_image);
+	sdcard = spi_sdcard_new(sdcard_image, flags);
 	assert(sdcard != NULL);
 
 	slave = calloc(1, sizeof(*slave));
 	assert(slave != NULL);
 	slave->privdata = sdcard;
 	slave->exchange_bytes = sdcard_exchange_bytes;
+	slave->save = sdcard_save;
+	slave->restore = sdcard_restore;
 
 	return slave;
 }
@@ -2,7 +2,9 @@
 #define __SDCARD_H__
 
 #include "spimaster.h"
+#include "../devicemodels/spi_sdcard.h"
 
-struct spislave *sdcard_new(const char *sdcard_image);
+/* flags are enum spi_sdcard_flags. */
+struct spislave *sdcard_new(const char *sdcard_image, int flags);
 
 #endif /* __SDCARD_H__ */
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "checkpoint.h"
 #include "internal.h"
 #include "io.h"
 #include "spimaster.h"
@@ -146,3 +147,75 @@ struct spimaster *spimaster_init(struct mem_map *mem, physaddr_t base,
 
 	return master;
 }
+
+struct spimaster_state {
+	uint32_t regs[SPIMASTER_NUM_REGS];
+	uint32_t loopback_enabled;
+	uint16_t xfer_length;
+	uint16_t bytes_xfered;
+	/* A bit for each slave that is connected. */
+	uint32_t slaves;
+};
+
+static uint32_t slave_mask(const struct spimaster *master)
+{
+	uint32_t mask = 0;
+	unsigned int m;
+
+	for (m = 0; m < master->nr_slaves; ++m)
+		if (master->slaves[m])
+			mask |= 1U << m;
+
+	return mask;
+}
+
+void spimaster_save(const struct spimaster *master, struct checkpoint *cp)
+{
+	struct spimaster_state state = {
+		.loopback_enabled = master->loopback_enabled,
+		.xfer_length = master->xfer_length,
+		.bytes_xfered = master->bytes_xfered,
+		.slaves = slave_mask(master),
+	};
+	unsigned int m;
+
+	memcpy(state.regs, master->regs, sizeof(state.regs));
+	checkpoint_put(cp, "SPIM", &state, sizeof(state));
+	checkpoint_put(cp, "SPIB", master->xfer_buf, sizeof(master->xfer_buf));
+
+	for (m = 0; m < master->nr_slaves; ++m)
+		if (master->slaves[m] && master->slaves[m]->save)
+			master->slaves[m]->save(master->slaves[m], cp);
+}
+
+void spimaster_restore(struct spimaster *master, struct checkpoint *cp)
+{
+	struct spimaster_state state;
+	uint8_t *xfer_buf = malloc(sizeof(master->xfer_buf));
+	unsigned int m;
+
+	if (!xfer_buf) {
+		checkpoint_set_error(cp, -ENOMEM);
+		return;
+	}
+
+	checkpoint_get(cp, "SPIM", &state, sizeof(state));
+	if (!checkpoint_error(cp) && state.slaves != slave_mask(master))
+		checkpoint_set_error(cp, -EINVAL);
+	checkpoint_get(cp, "SPIB", xfer_buf, sizeof(master->xfer_buf));
+
+	/* The slaves follow in the checkpoint, only apply once they're read. */
+	for (m = 0; m < master->nr_slaves && !checkpoint_error(cp); ++m)
+		if (master->slaves[m] && master->slaves[m]->restore)
+			master->slaves[m]->restore(master->slaves[m], cp);
+
+	if (!checkpoint_error(cp)) {
+		memcpy(master->xfer_buf, xfer_buf, sizeof(master->xfer_buf));
+		memcpy(master->regs, state.regs, sizeof(master->regs));
+		master->loopback_enabled = state.loopback_enabled;
+		master->xfer_length = state.xfer_length;
+		master->bytes_xfered = state.bytes_xfered;
+	}
+
+	free(xfer_buf);
+}
@@ -6,9 +6,14 @@
 
 #include "io.h"
 
+struct checkpoint;
+
+/* Slaves without any state can leave save and restore NULL. */
 struct spislave {
 	void (*exchange_bytes)(struct spislave *slave, uint8_t master_to_slave,
 			       uint8_t *slave_to_master);
+	void (*save)(struct spislave *slave, struct checkpoint *cp);
+	void (*restore)(struct spislave *slave, struct checkpoint *cp);
 	void *privdata;
 };
 
@@ -16,5 +21,8 @@ struct spimaster;
 
 struct spimaster *spimaster_init(struct mem_map *mem, physaddr_t base,
 				 struct spislave **slaves, size_t nr_slaves);
+/* Includes the slaves, which must be the same ones on restore. */
+void spimaster_save(const struct spimaster *master, struct checkpoint *cp);
+void spimaster_restore(struct spimaster *master, struct checkpoint *cp);
 
 #endif /* __SPIMASTER_H__ */
@@ -20,7 +20,9 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "checkpoint.h"
 #include "internal.h"
 #include "periodic.h"
 #include "irq_ctrl.h"
@@ -103,7 +105,7 @@ static int timer_read(unsigned int offs, uint32_t *val, size_t nr_bits,
 	timer = &base->timers[offs / 16];
 	switch (offs % 16) {
 	case TIMER_COUNT_REG_OFFS:
-		*val = timer->event->current;
+		*val = event_current(timer->event);
 		break;
 	case TIMER_RELOAD_REG_OFFS:
 		*val = timer->event->reload_val;
@@ -157,7 +159,43 @@ void timers_reset(struct timer_base *t)
 
 	for (i = 0; i < NR_TIMERS; ++i) {
 		event_disable(t->timers[i].event);
-		t->timers[i].event->current = 0xffffffff;
-		t->timers[i].event->reload_val = 0xffffffff;
+		event_mod(t->timers[i].event, 0xffffffff);
+	}
+}
+
+struct timer_state {
+	struct event_state event;
+	uint32_t periodic;
+	uint32_t irq_enabled;
+};
+
+void timers_save(const struct timer_base *t, struct checkpoint *cp)
+{
+	struct timer_state state[NR_TIMERS];
+	int i;
+
+	memset(state, 0, sizeof(state));
+	for (i = 0; i < NR_TIMERS; ++i) {
+		event_get_state(t->timers[i].event, &state[i].event);
+		state[i].periodic = t->timers[i].periodic;
+		state[i].irq_enabled = t->timers[i].irq_enabled;
+	}
+
+	checkpoint_put(cp, "TIMR", state, sizeof(state));
+}
+
+void timers_restore(struct timer_base *t, struct checkpoint *cp)
+{
+	struct timer_state state[NR_TIMERS];
+	int i;
+
+	checkpoint_get(cp, "TIMR", state, sizeof(state));
+	if (checkpoint_error(cp))
+		return;
+
+	for (i = 0; i < NR_TIMERS; ++i) {
+		event_set_state(t->timers[i].event, &state[i].event);
+		t->timers[i].periodic = state[i].periodic;
+		t->timers[i].irq_enabled = state[i].irq_enabled;
 	}
 }
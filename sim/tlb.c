@@ -1,37 +1,87 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "checkpoint.h"
 #include "tlb.h"
 
 #define PAGE_OFFSET		(4096 - 1)
 #define PAGE_MASK		~(4096 - 1)
 
+/* Marks the end of a hash chain. */
+#define TLB_NO_ENTRY		-1
+
 struct tlb_entry {
 	uint32_t virt;
 	uint32_t phys;
 	int valid;
+	int hash_next;
 };
 
+/*
+ * Valid entries are chained from a hash of their virtual page number, there
+ * are at least twice as many buckets as entries so chains stay short.  There
+ * is never more than one valid entry for a page, tlb_set_phys() updates an
+ * existing mapping in place.
+ *
+ * last_hit remembers the entry that satisfied the previous lookup as
+ * instruction fetches tend to hit the same page over and over.  It is only a
+ * hint and still compared against, so replacing the entry it points to
+ * doesn't need to clear it.
+ */
 struct tlb {
 	uint32_t next_virt;
 	int victim_sel;
+	unsigned long generation;
 	unsigned int num_entries;
+	unsigned int hash_bits;
+	int *buckets;
+	struct tlb_entry *last_hit;
 	struct tlb_entry entries[];
 };
 
+static inline unsigned int tlb_hash(const struct tlb *tlb, uint32_t virt)
+{
+	return ((virt >> 12) * 0x9e3779b1U) >> (32 - tlb->hash_bits);
+}
+
+static inline int tlb_entry_matches(const struct tlb_entry *entry,
+				    uint32_t virt)
+{
+	return entry->valid &&
+		(entry->virt & PAGE_MASK) == (virt & PAGE_MASK);
+}
+
+static void tlb_clear_buckets(struct tlb *tlb)
+{
+	unsigned m;
+
+	for (m = 0; m < (1U << tlb->hash_bits); ++m)
+		tlb->buckets[m] = TLB_NO_ENTRY;
+}
+
 struct tlb *tlb_new(unsigned int num_entries)
 {
 	struct tlb *t;
 	size_t alloc_size = sizeof(*t) + (num_entries * sizeof(struct tlb_entry));
 
+	assert(num_entries > 0);
+
 	t = malloc(alloc_size);
 	assert(t != NULL);
 	memset(t, 0, alloc_size);
 	t->num_entries = num_entries;
 
+	t->hash_bits = 1;
+	while ((1U << t->hash_bits) < num_entries * 2)
+		++t->hash_bits;
+	t->buckets = malloc((1U << t->hash_bits) * sizeof(*t->buckets));
+	assert(t->buckets != NULL);
+	tlb_clear_buckets(t);
+
 	return t;
 }
 
@@ -41,38 +91,63 @@ void tlb_inval(struct tlb *tlb)
 
 	for (m = 0; m < tlb->num_entries; ++m)
 		tlb->entries[m].valid = 0;
+	tlb_clear_buckets(tlb);
+	tlb->last_hit = NULL;
+	tlb->generation++;
 }
 
 static struct tlb_entry *tlb_find_mapping(struct tlb *tlb, uint32_t virt)
 {
-	unsigned m;
+	int m;
 
-	for (m = 0; m < tlb->num_entries; ++m) {
-		struct tlb_entry *entry = &tlb->entries[m];
+	if (tlb->last_hit && tlb_entry_matches(tlb->last_hit, virt))
+		return tlb->last_hit;
 
-		if (!entry->valid)
-			continue;
+	for (m = tlb->buckets[tlb_hash(tlb, virt)]; m != TLB_NO_ENTRY;
+	     m = tlb->entries[m].hash_next) {
+		struct tlb_entry *entry = &tlb->entries[m];
 
-		if ((entry->virt & PAGE_MASK) == (virt & PAGE_MASK))
+		if (tlb_entry_matches(entry, virt)) {
+			tlb->last_hit = entry;
 			return entry;
+		}
 	}
 
 	return NULL;
 }
 
+static void tlb_unhash(struct tlb *tlb, struct tlb_entry *entry)
+{
+	int *link = &tlb->buckets[tlb_hash(tlb, entry->virt)];
+	int index = entry - tlb->entries;
+
+	while (*link != index) {
+		assert(*link != TLB_NO_ENTRY);
+		link = &tlb->entries[*link].hash_next;
+	}
+	*link = entry->hash_next;
+}
+
 void tlb_set_phys(struct tlb *tlb, uint32_t phys)
 {
 	struct tlb_entry *entry;
-	
+
 	entry = tlb_find_mapping(tlb, tlb->next_virt);
-	if (!entry)
+	if (!entry) {
 		entry = &tlb->entries[tlb->victim_sel];
+		if (entry->valid)
+			tlb_unhash(tlb, entry);
+		entry->hash_next = tlb->buckets[tlb_hash(tlb, tlb->next_virt)];
+		tlb->buckets[tlb_hash(tlb, tlb->next_virt)] =
+			entry - tlb->entries;
+	}
 
 	entry->virt = tlb->next_virt;
 	entry->phys = phys & PAGE_MASK;
 	entry->valid = 1;
 
 	tlb->victim_sel = (tlb->victim_sel + 1) % tlb->num_entries;
+	tlb->generation++;
 }
 
 void tlb_set_virt(struct tlb *tlb, uint32_t virt)
@@ -101,3 +176,54 @@ int tlb_translate(struct tlb *tlb, struct translation *translation)
 
 	return 0;
 }
+
+/*
+ * Changes whenever a mapping is added or removed.
+ */
+unsigned long tlb_generation(const struct tlb *tlb)
+{
+	return tlb->generation;
+}
+
+void tlb_save(const struct tlb *tlb, struct checkpoint *cp)
+{
+	checkpoint_put(cp, "TLBN", &tlb->next_virt, sizeof(tlb->next_virt));
+	checkpoint_put(cp, "TLBS", &tlb->victim_sel, sizeof(tlb->victim_sel));
+	checkpoint_put(cp, "TLBE", tlb->entries,
+		       tlb->num_entries * sizeof(*tlb->entries));
+}
+
+/*
+ * The hash chains are rebuilt rather than trusted, a failed restore leaves
+ * the TLB empty.
+ */
+void tlb_restore(struct tlb *tlb, struct checkpoint *cp)
+{
+	unsigned m;
+
+	checkpoint_get(cp, "TLBN", &tlb->next_virt, sizeof(tlb->next_virt));
+	checkpoint_get(cp, "TLBS", &tlb->victim_sel, sizeof(tlb->victim_sel));
+	checkpoint_get(cp, "TLBE", tlb->entries,
+		       tlb->num_entries * sizeof(*tlb->entries));
+	if (!checkpoint_error(cp) &&
+	    (tlb->victim_sel < 0 || tlb->victim_sel >= tlb->num_entries))
+		checkpoint_set_error(cp, -EINVAL);
+	if (checkpoint_error(cp)) {
+		tlb->victim_sel = 0;
+		tlb_inval(tlb);
+		return;
+	}
+
+	tlb_clear_buckets(tlb);
+	for (m = 0; m < tlb->num_entries; ++m) {
+		struct tlb_entry *entry = &tlb->entries[m];
+		unsigned int hash = tlb_hash(tlb, entry->virt);
+
+		if (!entry->valid)
+			continue;
+		entry->hash_next = tlb->buckets[hash];
+		tlb->buckets[hash] = m;
+	}
+	tlb->last_hit = NULL;
+	tlb->generation++;
+}
@@ -1,6 +1,7 @@
 #ifndef __TLB_H__
 #define __TLB_H__
 
+struct checkpoint;
 struct tlb;
 
 enum tlb_perms {
@@ -21,5 +22,8 @@ void tlb_inval(struct tlb *tlb);
 void tlb_set_phys(struct tlb *tlb, uint32_t phys);
 void tlb_set_virt(struct tlb *tlb, uint32_t virt);
 int tlb_translate(struct tlb *tlb, struct translation *translation);
+unsigned long tlb_generation(const struct tlb *tlb);
+void tlb_save(const struct tlb *tlb, struct checkpoint *cp);
+void tlb_restore(struct tlb *tlb, struct checkpoint *cp);
 
 #endif /* __TLB_H__ */
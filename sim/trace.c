@@ -1,13 +1,18 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cpu.h"
 #include "internal.h"
 #include "trace.h"
 
-struct {
+static const struct {
 	int id;
 	int width;
 	const char *name;
@@ -36,42 +41,288 @@ struct {
 	[TRACE_SP]	= { 'F', 32, "SP" },
 };
 
-void trace(FILE *trace_file, enum trace_points tp, uint32_t val)
+#define TRACE_BUFFER_SIZE	(1 << 20)
+/* At most this many cycles of a trace file are lost if the simulator dies. */
+#define TRACE_FLUSH_CYCLES	(1 << 16)
+
+/*
+ * Up to TRACE_RING_VALUES values are kept per cycle, enough for the PC,
+ * instruction, register writes and a data access.  Any more are dropped.
+ */
+#define TRACE_RING_VALUES	8
+
+struct trace_ring_entry {
+	unsigned long long cycle;
+	unsigned int nr_values;
+	struct {
+		uint8_t tp;
+		uint32_t val;
+	} values[TRACE_RING_VALUES];
+};
+
+/*
+ * Rings have no file open, entries[head] is the cycle being traced and
+ * nr_used counts the valid entries leading up to it.
+ */
+struct trace {
+	FILE *fp;
+	enum trace_format format;
+	unsigned long long cycle;
+	unsigned long long flushed_cycle;
+	bool started;
+
+	char *ring_path;
+	struct trace_ring_entry *entries;
+	unsigned int nr_entries;
+	unsigned int nr_used;
+	unsigned int head;
+};
+
+static void put_le(FILE *fp, uint64_t v, unsigned int nbytes)
 {
-	if (!trace_file)
-		return;
+	unsigned int i;
+
+	for (i = 0; i < nbytes; ++i)
+		putc_unlocked((v >> (i * 8)) & 0xff, fp);
+}
+
+static uint64_t get_le(FILE *fp, unsigned int nbytes, int *eof)
+{
+	uint64_t v = 0;
+	unsigned int i;
+
+	for (i = 0; i < nbytes; ++i) {
+		int c = getc_unlocked(fp);
+
+		if (c == EOF)
+			*eof = 1;
+		v |= (uint64_t)(c & 0xff) << (i * 8);
+	}
+
+	return v;
+}
+
+static void vcd_value(FILE *fp, enum trace_points tp, uint32_t val)
+{
+	char buf[32 + 4], *p = buf;
+	int i;
 
 	if (trace_defs[tp].width == 1) {
-		fprintf(trace_file, "%d%c\n", !!val, trace_defs[tp].id);
+		*p++ = '0' + !!val;
 	} else {
-		int i;
-
-		fprintf(trace_file, "b");
+		*p++ = 'b';
 		for (i = trace_defs[tp].width - 1; i >= 0; --i)
-			fprintf(trace_file, "%d", !!(val & (1 << i)));
-		fprintf(trace_file, " %c\n", trace_defs[tp].id);
+			*p++ = '0' + ((val >> i) & 1);
+		*p++ = ' ';
 	}
-	fflush(trace_file);
+	*p++ = trace_defs[tp].id;
+	*p++ = '\n';
+
+	fwrite_unlocked(buf, 1, p - buf, fp);
 }
 
-FILE *init_trace_file(void)
+static void vcd_header(FILE *fp)
 {
-	FILE *trace_file;
 	int i;
 
-	trace_file = fopen("oldland.vcd", "w");
-	assert(trace_file);
-	fprintf(trace_file, "$timescale 1ns $end\n");
-	fprintf(trace_file, "$scope module cpu $end\n");
+	fprintf(fp, "$timescale 1ns $end\n");
+	fprintf(fp, "$scope module cpu $end\n");
 	for (i = 0; i < ARRAY_SIZE(trace_defs); ++i)
-		fprintf(trace_file, "$var wire %u %c %s $end\n",
+		fprintf(fp, "$var wire %u %c %s $end\n",
 			trace_defs[i].width, trace_defs[i].id,
 			trace_defs[i].name);
-	fprintf(trace_file, "$upscope $end\n");
-	fprintf(trace_file, "$enddefinitions $end\n");
-	fprintf(trace_file, "$dumpvars\n");
+	fprintf(fp, "$upscope $end\n");
+	fprintf(fp, "$enddefinitions $end\n");
+	fprintf(fp, "$dumpvars\n");
 	for (i = 0; i < ARRAY_SIZE(trace_defs); ++i)
-		trace(trace_file, i, 0);
+		vcd_value(fp, i, 0);
+}
+
+static void ring_value(struct trace *t, enum trace_points tp, uint32_t val)
+{
+	struct trace_ring_entry *e = &t->entries[t->head];
+
+	if (!t->nr_used || e->nr_values == TRACE_RING_VALUES)
+		return;
+
+	e->values[e->nr_values].tp = tp;
+	e->values[e->nr_values].val = val;
+	++e->nr_values;
+}
+
+static void ring_cycle(struct trace *t, unsigned long long cycle)
+{
+	struct trace_ring_entry *e;
+
+	if (t->nr_used)
+		t->head = (t->head + 1) % t->nr_entries;
+	if (t->nr_used < t->nr_entries)
+		++t->nr_used;
+
+	e = &t->entries[t->head];
+	e->cycle = cycle;
+	e->nr_values = 0;
+}
+
+void trace(struct trace *t, enum trace_points tp, uint32_t val)
+{
+	if (!t)
+		return;
+
+	if (t->entries) {
+		ring_value(t, tp, val);
+	} else if (t->format == TRACE_FORMAT_VCD) {
+		vcd_value(t->fp, tp, val);
+	} else {
+		putc_unlocked(tp, t->fp);
+		put_le(t->fp, val, 4);
+	}
+}
+
+void trace_cycle(struct trace *t, unsigned long long cycle)
+{
+	if (!t)
+		return;
+
+	if (t->entries) {
+		ring_cycle(t, cycle);
+		return;
+	}
+
+	if (t->format == TRACE_FORMAT_VCD) {
+		fprintf(t->fp, "#%llu\n", cycle);
+	} else if (t->started && cycle == t->cycle + 1) {
+		putc_unlocked(TRACE_REC_NEXT_CYCLE, t->fp);
+	} else {
+		putc_unlocked(TRACE_REC_CYCLE, t->fp);
+		put_le(t->fp, cycle, 8);
+	}
+
+	t->cycle = cycle;
+	t->started = true;
+
+	if (cycle - t->flushed_cycle >= TRACE_FLUSH_CYCLES)
+		trace_flush(t);
+}
+
+struct trace *trace_open(const char *path, enum trace_format format)
+{
+	struct trace *t = calloc(1, sizeof(*t));
+
+	assert(t);
+	t->format = format;
+	t->fp = fopen(path, "w");
+	if (!t->fp) {
+		free(t);
+		return NULL;
+	}
+	setvbuf(t->fp, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	if (format == TRACE_FORMAT_VCD)
+		vcd_header(t->fp);
+	else
+		fputs(TRACE_MAGIC, t->fp);
+
+	return t;
+}
+
+struct trace *trace_ring_new(const char *path, unsigned int nr_cycles)
+{
+	struct trace *t = calloc(1, sizeof(*t));
+
+	assert(t);
+	assert(nr_cycles > 0);
+	t->format = TRACE_FORMAT_BINARY;
+	t->ring_path = strdup(path);
+	t->entries = calloc(nr_cycles, sizeof(*t->entries));
+	assert(t->ring_path && t->entries);
+	t->nr_entries = nr_cycles;
+
+	return t;
+}
+
+void trace_flush(struct trace *t)
+{
+	if (!t || !t->fp)
+		return;
+
+	fflush(t->fp);
+	t->flushed_cycle = t->cycle;
+}
+
+int trace_dump(struct trace *t, const char *reason)
+{
+	struct trace *out;
+	unsigned int m, v;
+
+	if (!t)
+		return 0;
+	if (!t->entries) {
+		trace_flush(t);
+		return 0;
+	}
+
+	out = trace_open(t->ring_path, TRACE_FORMAT_BINARY);
+	if (!out) {
+		warn("failed to open %s", t->ring_path);
+		return -errno;
+	}
+
+	for (m = 0; m < t->nr_used; ++m) {
+		const struct trace_ring_entry *e = &t->entries[
+			(t->head + t->nr_entries - t->nr_used + 1 + m) %
+			t->nr_entries];
+
+		trace_cycle(out, e->cycle);
+		for (v = 0; v < e->nr_values; ++v)
+			trace(out, e->values[v].tp, e->values[v].val);
+	}
+	trace_close(out);
+
+	fprintf(stderr, "%s: dumped last %u cycles to %s\n", reason,
+		t->nr_used, t->ring_path);
+
+	return 0;
+}
+
+void trace_close(struct trace *t)
+{
+	if (!t)
+		return;
+
+	if (t->fp)
+		fclose(t->fp);
+	free(t->entries);
+	free(t->ring_path);
+	free(t);
+}
+
+int trace_replay(FILE *in, struct trace *out)
+{
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	unsigned long long cycle = 0;
+	int eof = 0;
+	int tag;
+
+	if (fread(magic, sizeof(magic), 1, in) != 1 ||
+	    memcmp(magic, TRACE_MAGIC, sizeof(magic)))
+		return -EINVAL;
+
+	while ((tag = getc_unlocked(in)) != EOF) {
+		if (tag == TRACE_REC_NEXT_CYCLE) {
+			trace_cycle(out, ++cycle);
+		} else if (tag == TRACE_REC_CYCLE) {
+			cycle = get_le(in, 8, &eof);
+			trace_cycle(out, cycle);
+		} else if (tag < NR_TRACE_POINTS) {
+			trace(out, tag, get_le(in, 4, &eof));
+		} else {
+			return -EINVAL;
+		}
+
+		if (eof)
+			return -EIO;
+	}
 
-	return trace_file;
+	return 0;
 }
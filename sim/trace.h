@@ -2,6 +2,7 @@
 #define __TRACE_H__
 
 #include <stdint.h>
+#include <stdio.h>
 
 enum trace_points {
 	TRACE_PC,
@@ -26,9 +27,50 @@ enum trace_points {
 	TRACE_DIN,
 	TRACE_DOUT,
 	TRACE_FLAGS,
+	NR_TRACE_POINTS
 };
 
-void trace(FILE *trace_file, enum trace_points tp, uint32_t val);
-FILE *init_trace_file(void);
+/*
+ * Traces are either written as VCD directly or in a compact binary format
+ * that oldland-trace2vcd converts to exactly the same VCD later.  Output is
+ * buffered in both cases but flushed every TRACE_FLUSH_CYCLES cycles and
+ * whenever the CPU stops for an exception or the debugger, so a simulator
+ * that crashes or is killed loses little of the end of a trace.
+ */
+enum trace_format {
+	TRACE_FORMAT_VCD,
+	TRACE_FORMAT_BINARY,
+};
+
+struct trace;
+
+struct trace *trace_open(const char *path, enum trace_format format);
+/*
+ * A flight recorder keeps the last nr_cycles cycles in memory and writes
+ * nothing until trace_dump() saves them to path as a binary trace.
+ */
+struct trace *trace_ring_new(const char *path, unsigned int nr_cycles);
+/* Returns 0 on success, traces that aren't a ring are flushed instead. */
+int trace_dump(struct trace *t, const char *reason);
+void trace_flush(struct trace *t);
+void trace_close(struct trace *t);
+/* Start a new cycle, all values traced until the next one belong to it. */
+void trace_cycle(struct trace *t, unsigned long long cycle);
+void trace(struct trace *t, enum trace_points tp, uint32_t val);
+
+/*
+ * Binary traces start with TRACE_MAGIC, then a stream of records, each a
+ * single tag byte:
+ *
+ * - a trace point number followed by its 32-bit little endian value.
+ * - TRACE_REC_NEXT_CYCLE for the cycle after the previous one.
+ * - TRACE_REC_CYCLE followed by a 64-bit little endian cycle number.
+ */
+#define TRACE_MAGIC		"OLDTRC01"
+#define TRACE_REC_NEXT_CYCLE	0xfe
+#define TRACE_REC_CYCLE		0xff
+
+/* Replay a binary trace into another trace, returns 0 on success. */
+int trace_replay(FILE *in, struct trace *out);
 
 #endif /* __TRACE_H__ */
@@ -0,0 +1,39 @@
+/*
+ * Convert a binary trace from oldland-sim --binary-trace to the VCD that
+ * oldland-sim --debug would have written.
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+int main(int argc, char *argv[])
+{
+	const char *in_path = argc > 1 ? argv[1] : "oldland.trace";
+	const char *out_path = argc > 2 ? argv[2] : "oldland.vcd";
+	struct trace *out;
+	FILE *in;
+	int ret;
+
+	if (argc > 3)
+		errx(EXIT_FAILURE, "usage: %s [TRACE [VCD]]", argv[0]);
+
+	in = fopen(in_path, "r");
+	if (!in)
+		err(EXIT_FAILURE, "failed to open %s", in_path);
+	out = trace_open(out_path, TRACE_FORMAT_VCD);
+	if (!out)
+		err(EXIT_FAILURE, "failed to open %s", out_path);
+
+	ret = trace_replay(in, out);
+	trace_close(out);
+	fclose(in);
+
+	if (ret)
+		errx(EXIT_FAILURE, "%s: %s trace", in_path,
+		     ret == -EIO ? "truncated" : "invalid");
+
+	return EXIT_SUCCESS;
+}
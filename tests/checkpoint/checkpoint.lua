@@ -0,0 +1,74 @@
+-- Checkpoint test, save the machine then scribble over the registers and
+-- memory and check that restoring brings everything back.  The restored
+-- machine is checkpointed and restored again before the program checks its
+-- own state and runs on to success.
+require "common"
+
+function snapshot()
+	local state = {}
+
+	for i = 0, 16 do
+		state[#state + 1] = target.read_reg(i)
+	end
+	state[#state + 1] = target.read32(target.read_reg(12))
+	state[#state + 1] = target.read32(0x20000000)
+	state[#state + 1] = target.read32(0x20100000)
+
+	return state
+end
+
+function scribble(data)
+	for i = 0, 15 do
+		target.write_reg(i, 0xdeadbeef)
+	end
+	target.write_reg(16, 0)
+	target.write32(data, 0)
+	target.write32(0x20000000, 0)
+	target.write32(0x20100000, 0)
+end
+
+function restore_and_check(path, expected, data)
+	scribble(data)
+	target.restore_checkpoint(path)
+
+	local state = snapshot()
+	for i, v in ipairs(expected) do
+		if state[i] ~= v then
+			print(string.format("state %d expected %08x, got %08x",
+					    i, v, state[i]))
+			return -1
+		end
+	end
+end
+
+function checkpoint_round_trip()
+	local path = os.tmpname()
+	local expected = snapshot()
+	local data = target.read_reg(12)
+
+	-- Only the C model can checkpoint, the RTL simulations refuse.
+	if not pcall(target.save_checkpoint, path) then
+		print("target can't checkpoint, skipping")
+		os.remove(path)
+		return
+	end
+
+	local rc = restore_and_check(path, expected, data)
+	if not rc then
+		target.save_checkpoint(path)
+		rc = restore_and_check(path, expected, data)
+	end
+	os.remove(path)
+
+	return rc
+end
+
+return run_test({
+	elf = "checkpoint",
+	max_cycle_count = 1000,
+	modes = {"step", "run"},
+	testpoints = {
+		{ TP_USER, 0, checkpoint_round_trip },
+		{ TP_SUCCESS, 0 },
+	}
+})
@@ -0,0 +1,101 @@
+.include "common.s"
+
+/*
+ * Registers and memory are checked again by the program itself once the
+ * debugger has restored them from a checkpoint, so that execution carries
+ * on from the restored state too.
+ */
+.globl _start
+_start:
+	mov	$r12, 0x60 /* I+D cache enable. */
+	scr	1, $r12
+	/* Wait for SDRAM to initialize. */
+	movhi	$r0, 0x8000
+	orlo	$r0, $r0, 0x1000
+1:
+	ldr32	$r1, [$r0, 0]
+	cmp	$r1, 0x0
+	beq	1b
+
+	movhi	$r0, %hi(0x0defaced)
+	orlo	$r0, $r0, %lo(0x0defaced)
+	movhi	$r1, 0x2000
+	str32	$r0, [$r1, 0x0]
+	movhi	$r1, 0x2010
+	str32	$r0, [$r1, 0x0]
+	movhi	$r1, %hi(data)
+	orlo	$r1, $r1, %lo(data)
+	str32	$r0, [$r1, 0x0]
+
+	mov	$r0,  0x100
+	mov	$r1,  0x101
+	mov	$r2,  0x102
+	mov	$r3,  0x103
+	mov	$r4,  0x104
+	mov	$r5,  0x105
+	mov	$r6,  0x106
+	mov	$r7,  0x107
+	mov	$r8,  0x108
+	mov	$r9,  0x109
+	mov	$r10, 0x10a
+	mov	$r11, 0x10b
+	movhi	$r12, %hi(data)
+	orlo	$r12, $r12, %lo(data)
+	mov	$fp,  0x10d
+	mov	$sp,  0x10e
+	mov	$lr,  0x10f
+
+	TESTPOINT	TP_USER, 0
+
+	cmp	$r0,  0x100
+	bne	failure
+	cmp	$r1,  0x101
+	bne	failure
+	cmp	$r2,  0x102
+	bne	failure
+	cmp	$r3,  0x103
+	bne	failure
+	cmp	$r4,  0x104
+	bne	failure
+	cmp	$r5,  0x105
+	bne	failure
+	cmp	$r6,  0x106
+	bne	failure
+	cmp	$r7,  0x107
+	bne	failure
+	cmp	$r8,  0x108
+	bne	failure
+	cmp	$r9,  0x109
+	bne	failure
+	cmp	$r10, 0x10a
+	bne	failure
+	cmp	$r11, 0x10b
+	bne	failure
+	cmp	$fp,  0x10d
+	bne	failure
+	cmp	$sp,  0x10e
+	bne	failure
+	cmp	$lr,  0x10f
+	bne	failure
+
+	movhi	$r0, %hi(0x0defaced)
+	orlo	$r0, $r0, %lo(0x0defaced)
+	ldr32	$r1, [$r12, 0x0]
+	cmp	$r1, $r0
+	bne	failure
+	movhi	$r2, 0x2000
+	ldr32	$r1, [$r2, 0x0]
+	cmp	$r1, $r0
+	bne	failure
+	movhi	$r2, 0x2010
+	ldr32	$r1, [$r2, 0x0]
+	cmp	$r1, $r0
+	bne	failure
+
+	SUCCESS
+
+failure:
+	FAILURE
+
+data:
+	.long	0
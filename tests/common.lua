@@ -8,10 +8,15 @@ end
 
 cycle_count = 0
 
+-- The target steps to the next testpoint itself, one past the remaining
+-- cycle budget so that running out is still noticed.
 function step_to_tp(max_cycle_count)
 	while true do
-		target.step()
-		cycle_count = cycle_count + 1
+		limit = 0
+		if max_cycle_count then
+			limit = math.max(max_cycle_count - cycle_count + 1, 1)
+		end
+		cycle_count = cycle_count + target.run_until(limit)
 		if max_cycle_count and cycle_count > max_cycle_count then
                         print("Maximum cycle count exceeded")
 			break
@@ -0,0 +1,41 @@
+-- Reconnect test, verify that a debugger hanging up while it waits for the
+-- CPU to stop doesn't leave the response to the wait for the next debugger.
+require "common"
+
+-- A second debugger runs the spinning program and is killed while waiting.
+function abandon_wait()
+	script = os.tmpname()
+	f = io.open(script, "w")
+	f:write('require "common"\n',
+		'connect_test_target()\n',
+		'loadelf("reconnect")\n',
+		'target.write_reg(1, 0)\n',
+		'target.run()\n')
+	f:close()
+	os.execute("timeout -s KILL 2 oldland-debug -x " .. script)
+	os.remove(script)
+end
+
+function release_spin()
+	target.write_reg(1, 1)
+end
+
+function check_regs()
+	if target.read_reg(1) ~= 1 or target.read_reg(2) ~= 0x123 then
+		print("register reads out of step with the target")
+		return -1
+	end
+end
+
+abandon_wait()
+
+return run_test({
+	elf = "reconnect",
+	max_cycle_count = 1000,
+	modes = {"step", "run"},
+	setup = release_spin,
+	testpoints = {
+		{ TP_USER, 0, check_regs },
+		{ TP_SUCCESS, 0 },
+	}
+})
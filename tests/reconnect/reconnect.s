@@ -0,0 +1,12 @@
+.include "common.s"
+
+.globl _start
+_start:
+	/* Spin until the debugger sets r1. */
+1:
+	cmp	$r1, 0
+	beq	1b
+
+	mov	$r2, 0x123
+	TESTPOINT	TP_USER, 0
+	SUCCESS
@@ -0,0 +1,49 @@
+-- Timer reload test, verify that a one-shot timer reads back its reload
+-- value once expired, that the count holds while disabled and carries on
+-- when re-enabled, and that a reload value of zero counts down from 2^32.
+require "common"
+
+function validate_oneshot()
+	count = target.read_reg(2)
+	control = target.read_reg(3)
+	if count ~= 8 or control ~= 0 then
+		print(string.format("one-shot count %08x control %08x",
+				    count, control))
+		return -1
+	end
+end
+
+function validate_disable()
+	counts = {}
+	for i = 2, 6 do
+		counts[#counts + 1] = target.read_reg(i)
+	end
+	print(table.concat(counts, " "))
+	if not (counts[1] <= 0x400 and counts[2] < counts[1] and
+		counts[3] < counts[2] and counts[4] == counts[3] and
+		counts[5] < counts[4] and counts[4] - counts[5] < 0x10) then
+		return -1
+	end
+end
+
+function validate_zero_reload()
+	count = target.read_reg(2)
+	control = target.read_reg(3)
+	if count < 0xffffff00 or control ~= 3 then
+		print(string.format("zero reload count %08x control %08x",
+				    count, control))
+		return -1
+	end
+end
+
+return run_test({
+	elf = "timer_reload",
+	max_cycle_count = 1000,
+	modes = {"step", "run"},
+	testpoints = {
+		{ TP_USER, 0, validate_oneshot },
+		{ TP_USER, 1, validate_disable },
+		{ TP_USER, 2, validate_zero_reload },
+		{ TP_SUCCESS, 0 },
+	}
+})
@@ -0,0 +1,68 @@
+.include "common.s"
+
+.globl _start
+_start:
+	mov	$r12, 0x60 /* I+D cache enable. */
+	scr	1, $r12
+
+	movhi	$r1, 0x8000
+	orlo	$r1, $r1, 0x3000
+
+	/*
+	 * A one-shot timer reloads before it disables itself so it reads back
+	 * its reload value once expired.
+	 */
+	mov	$r2, 0x8
+	str32	$r2, [$r1, 0x4] /* Reload value. */
+	mov	$r2, 0x2 /* One-shot, enabled. */
+	str32	$r2, [$r1, 0x8]
+
+	mov	$r0, 16
+1:
+	sub	$r0, $r0, 1
+	cmp	$r0, 0
+	bne	1b
+
+	ldr32	$r2, [$r1, 0x0]
+	ldr32	$r3, [$r1, 0x8]
+	TESTPOINT	TP_USER, 0
+
+	/*
+	 * The count keeps going down while enabled, holds while disabled and
+	 * carries on from there when re-enabled rather than reloading.
+	 */
+	mov	$r2, 0x400
+	str32	$r2, [$r1, 0x4] /* Reload value. */
+	mov	$r2, 0x3 /* Periodic, enabled. */
+	str32	$r2, [$r1, 0x8]
+
+	ldr32	$r2, [$r1, 0x0]
+	nop
+	nop
+	ldr32	$r3, [$r1, 0x0]
+	xor	$r0, $r0, $r0
+	str32	$r0, [$r1, 0x8] /* Disable timer. */
+	ldr32	$r4, [$r1, 0x0]
+	nop
+	nop
+	ldr32	$r5, [$r1, 0x0]
+	mov	$r0, 0x3 /* Periodic, enabled. */
+	str32	$r0, [$r1, 0x8]
+	nop
+	nop
+	ldr32	$r6, [$r1, 0x0]
+	TESTPOINT	TP_USER, 1
+
+	/* A reload value of zero wraps and takes 2^32 cycles to expire. */
+	xor	$r2, $r2, $r2
+	str32	$r2, [$r1, 0x4] /* Reload value. */
+	nop
+	nop
+	ldr32	$r2, [$r1, 0x0]
+	ldr32	$r3, [$r1, 0x8]
+	TESTPOINT	TP_USER, 2
+
+	xor	$r0, $r0, $r0
+	str32	$r0, [$r1, 0x8] /* Disable timer. */
+
+	SUCCESS
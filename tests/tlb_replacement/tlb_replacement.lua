@@ -0,0 +1,42 @@
+-- TLB replacement test, verify that mapping more pages than the DTLB has
+-- entries evicts them oldest first and that nothing hits after an
+-- invalidate.
+require "common"
+
+function expect(misses, fault, r4, r5)
+	if target.read_reg(11) ~= misses then
+		print(string.format("expected %d misses, got %d", misses,
+				    target.read_reg(11)))
+		return -1
+	end
+	if fault and target.read_reg(10) ~= fault then
+		print(string.format("expected a miss at %08x, got %08x", fault,
+				    target.read_reg(10)))
+		return -1
+	end
+	if r4 and target.read_reg(4) ~= r4 then
+		print(string.format("expected to load %d, got %d", r4,
+				    target.read_reg(4)))
+		return -1
+	end
+	if r5 and target.read_reg(5) ~= r5 then
+		print(string.format("expected to sum to %d, got %d", r5,
+				    target.read_reg(5)))
+		return -1
+	end
+end
+
+return run_test({
+	elf = "tlb_replacement",
+	max_cycle_count = 512,
+	modes = {"step", "run"},
+	testpoints = {
+		{ TP_USER, 0, function() return expect(0, nil, nil, 36) end },
+		{ TP_USER, 1, function() return expect(1, 0x40000000, 0) end },
+		{ TP_USER, 2, function() return expect(2, 0x40001000, 1) end },
+		{ TP_USER, 3, function() return expect(2, nil, nil, 33) end },
+		{ TP_USER, 4, function() return expect(3, 0x40002000, 2) end },
+		{ TP_USER, 5, function() return expect(4, 0x40008000, 8) end },
+		{ TP_SUCCESS, 0 },
+	}
+})
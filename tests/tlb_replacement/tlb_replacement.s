@@ -0,0 +1,164 @@
+.include "common.s"
+
+.equ	TLB_INVAL, 3
+.equ	DTLB_STORE_VIRT, 4
+.equ	DTLB_STORE_PHYS, 5
+.equ	ITLB_STORE_VIRT, 6
+.equ	ITLB_STORE_PHYS, 7
+/* The DTLB has 8 entries, map two more pages than that with the code. */
+.equ	NR_PAGES, 9
+
+.globl _start
+_start:
+	movhi	$r0, %hi(ex_table)
+	orlo	$r0, $r0, %lo(ex_table)
+	scr	0, $r0
+
+	movhi	$r0, %hi(dtlb_miss_handler)
+	orlo	$r0, $r0, %lo(dtlb_miss_handler)
+	scr	5, $r0
+	movhi	$r0, %hi(bad_vector)
+	orlo	$r0, $r0, %lo(bad_vector)
+	scr	6, $r0
+
+	/* Page n of the data in SDRAM holds n. */
+	movhi	$r1, 0x2000
+	movhi	$r2, 0x0000
+	orlo	$r2, $r2, 0x1000
+	xor	$r0, $r0, $r0
+1:
+	str32	$r0, [$r1, 0]
+	add	$r0, $r0, 1
+	add	$r1, $r1, $r2
+	cmp	$r0, NR_PAGES
+	bne	1b
+
+	/* Identity map the code. */
+	mov	$r0, 0x3 /* R|W */
+	cache	$r0, DTLB_STORE_VIRT
+	cache	$r0, ITLB_STORE_VIRT
+	xor	$r0, $r0, $r0
+	cache	$r0, DTLB_STORE_PHYS
+	cache	$r0, ITLB_STORE_PHYS
+
+	/*
+	 * Map virtual page 0x40000000 + n to data page n.  Replacement is
+	 * FIFO so the identity mapping and page 0 are evicted.
+	 */
+	movhi	$r1, 0x4000
+	orlo	$r1, $r1, 0x3 /* R|W */
+	movhi	$r3, 0x2000
+	xor	$r0, $r0, $r0
+1:
+	cache	$r1, DTLB_STORE_VIRT
+	cache	$r3, DTLB_STORE_PHYS
+	add	$r1, $r1, $r2
+	add	$r3, $r3, $r2
+	add	$r0, $r0, 1
+	cmp	$r0, NR_PAGES
+	bne	1b
+
+	xor	$r11, $r11, $r11 /* DTLB misses. */
+	mov	$r0, 0x80 /* Enable the TLB. */
+	scr	1, $r0
+	nop
+	nop
+	nop
+	nop
+	nop
+
+	/* Pages 1-8 are mapped. */
+	movhi	$r1, 0x4000
+	orlo	$r1, $r1, 0x1000
+	xor	$r5, $r5, $r5
+	mov	$r0, 8
+1:
+	ldr32	$r4, [$r1, 0]
+	add	$r5, $r5, $r4
+	add	$r1, $r1, $r2
+	sub	$r0, $r0, 1
+	cmp	$r0, 0
+	bne	1b
+	TESTPOINT	TP_USER, 0
+
+	/* Page 0 misses and replaces the oldest, page 1. */
+	movhi	$r1, 0x4000
+	ldr32	$r4, [$r1, 0]
+	TESTPOINT	TP_USER, 1
+
+	/* Which misses and replaces page 2 in turn. */
+	orlo	$r1, $r1, 0x1000
+	ldr32	$r4, [$r1, 0]
+	TESTPOINT	TP_USER, 2
+
+	/* Pages 3-8 are still mapped. */
+	movhi	$r1, 0x4000
+	orlo	$r1, $r1, 0x3000
+	xor	$r5, $r5, $r5
+	mov	$r0, 6
+1:
+	ldr32	$r4, [$r1, 0]
+	add	$r5, $r5, $r4
+	add	$r1, $r1, $r2
+	sub	$r0, $r0, 1
+	cmp	$r0, 0
+	bne	1b
+	TESTPOINT	TP_USER, 3
+
+	movhi	$r1, 0x4000
+	orlo	$r1, $r1, 0x2000
+	ldr32	$r4, [$r1, 0]
+	TESTPOINT	TP_USER, 4
+
+	/* Nothing is mapped after an invalidate. */
+	xor	$r0, $r0, $r0
+	scr	1, $r0
+	cache	$r0, TLB_INVAL
+	mov	$r0, 0x3 /* R|W */
+	cache	$r0, ITLB_STORE_VIRT
+	xor	$r0, $r0, $r0
+	cache	$r0, ITLB_STORE_PHYS
+	mov	$r0, 0x80
+	scr	1, $r0
+	nop
+	nop
+	nop
+	nop
+	nop
+
+	movhi	$r1, 0x4000
+	orlo	$r1, $r1, 0x8000
+	ldr32	$r4, [$r1, 0]
+	TESTPOINT	TP_USER, 5
+
+	SUCCESS
+
+/* Count the miss and map the faulting page to its data page. */
+dtlb_miss_handler:
+	add	$r11, $r11, 1
+	gcr	$r10, 4
+	bic	$r7, $r10, 0xfff
+	or	$r8, $r7, 0x3 /* R|W */
+	cache	$r8, DTLB_STORE_VIRT
+	movhi	$r8, 0x2000
+	sub	$r7, $r7, $r8
+	cache	$r7, DTLB_STORE_PHYS
+
+	/* Restart the faulting instruction. */
+	gcr	$r8, 3
+	sub	$r8, $r8, 4
+	scr	3, $r8
+
+	rfe
+
+bad_vector:
+	FAILURE
+
+	.balign	64
+ex_table:
+	b	bad_vector	/* RESET */
+	b	bad_vector	/* ILLEGAL_INSTR */
+	b	bad_vector	/* SWI */
+	b	bad_vector	/* IRQ */
+	b	bad_vector	/* IFETCH_ABORT */
+	b	bad_vector	/* DATA_ABORT */
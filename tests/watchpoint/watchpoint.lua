@@ -0,0 +1,73 @@
+-- Watchpoint test, verify that loads and stores stop on read and write
+-- watchpoints with the address accessed, that other accesses don't, and
+-- that the program carries on correctly from the stop.
+require "common"
+
+watchpoints = {}
+have_watchpoints = true
+
+function set_watchpoints()
+	for _, id in pairs(watchpoints) do
+		target.del_watch(id)
+	end
+
+	-- Only simulators checking breakpoints themselves have watchpoints.
+	have_watchpoints, wdata = pcall(target.set_watch, syms["wdata"], 4, "w")
+	if not have_watchpoints then
+		print("target has no watchpoints, skipping")
+		watchpoints = {}
+		return
+	end
+	watchpoints = { wdata, target.set_watch(syms["rdata"], 4, "r") }
+end
+
+function expect_watch(addr)
+	if not have_watchpoints then return end
+
+	hit = target.watch_hit()
+	if hit ~= addr then
+		print(string.format("expected watchpoint hit %s, got %s",
+				    addr and string.format("%08x", addr) or "none",
+				    hit and string.format("%08x", hit) or "none"))
+		return -1
+	end
+end
+
+function no_watch()
+	return expect_watch(nil)
+end
+
+function watch_wdata_store()
+	if expect_watch(syms["wdata"]) then return -1 end
+	if not have_watchpoints then return end
+
+	-- The store has completed by the time the CPU stops.
+	if target.read32(syms["wdata"]) ~= 0x123 then
+		print("watched store didn't complete")
+		return -1
+	end
+end
+
+function watch_rdata_load()
+	if expect_watch(syms["rdata"]) then return -1 end
+	if not have_watchpoints then return end
+
+	if target.read_reg(5) ~= 0x123 then
+		print("watched load didn't complete")
+		return -1
+	end
+end
+
+return run_test({
+	elf = "watchpoint",
+	max_cycle_count = 1000,
+	modes = {"step", "run"},
+	setup = set_watchpoints,
+	testpoints = {
+		{ TP_USER, 0, no_watch },
+		{ TP_USER, 1, no_watch },
+		{ TP_USER, 2, watch_wdata_store },
+		{ TP_USER, 3, watch_rdata_load },
+		{ TP_SUCCESS, 0 },
+	}
+})
@@ -0,0 +1,48 @@
+.include "common.s"
+
+/*
+ * wdata is watched for stores and rdata for loads.  The CPU stops after the
+ * access, so a testpoint straight after one is where a watchpoint stop lands.
+ */
+.globl _start
+_start:
+	mov	$r12, 0x60 /* I+D cache enable. */
+	scr	1, $r12
+
+	movhi	$r1, %hi(wdata)
+	orlo	$r1, $r1, %lo(wdata)
+	movhi	$r2, %hi(rdata)
+	orlo	$r2, $r2, %lo(rdata)
+	mov	$r3, 0x123
+
+	str32	$r3, [$r2, 0x0]
+	TESTPOINT	TP_USER, 0
+	ldr32	$r4, [$r1, 0x0]
+	TESTPOINT	TP_USER, 1
+
+	str32	$r3, [$r1, 0x0]
+	TESTPOINT	TP_USER, 2
+	ldr32	$r5, [$r2, 0x0]
+	TESTPOINT	TP_USER, 3
+
+	/* Resuming from a stop away from a testpoint carries on as normal. */
+	ldr32	$r6, [$r2, 0x0]
+	add	$r6, $r6, 1
+	str32	$r6, [$r1, 0x0]
+	ldr32	$r7, [$r1, 0x0]
+	cmp	$r7, 0x124
+	bne	failure
+	cmp	$r4, 0x0
+	bne	failure
+	cmp	$r5, 0x123
+	bne	failure
+
+	SUCCESS
+
+failure:
+	FAILURE
+
+wdata:
+	.long	0
+rdata:
+	.long	0
@@ -174,7 +174,7 @@ static void debug_stub_register(void)
 
 	data = start_server();
 
-	notify_runner();
+	notify_runner(data);
 
 	for (i = 0; i < ARRAY_SIZE(tasks); ++i) {
 		tasks[i].user_data = (char *)data;
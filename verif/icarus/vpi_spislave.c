@@ -31,6 +31,20 @@ const char *get_sdcard_path(void)
 	return NULL;
 }
 
+static int get_sdcard_flags(void)
+{
+	int i;
+	s_vpi_vlog_info info;
+
+	vpi_get_vlog_info(&info);
+
+	for (i = 0; i < info.argc; ++i)
+		if (!strcmp(info.argv[i], "+sdcard_cow"))
+			return SPI_SDCARD_COW;
+
+	return 0;
+}
+
 static void sdcard_init(void)
 {
 	const char *path = get_sdcard_path();
@@ -38,7 +52,7 @@ static void sdcard_init(void)
 	if (!path)
 		return;
 
-	sdcard = spi_sdcard_new(path);
+	sdcard = spi_sdcard_new(path, get_sdcard_flags());
 	assert(sdcard != NULL);
 }
 
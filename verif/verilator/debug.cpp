@@ -47,5 +47,5 @@ void init_debug()
 {
 	jtag_debug_data = start_server();
 	assert(jtag_debug_data != NULL);
-	notify_runner();
+	notify_runner(jtag_debug_data);
 }
@@ -22,7 +22,9 @@ void init_spi()
 	if (path == "")
 		return;
 
-	sdcard = spi_sdcard_new(path.c_str());
+	sdcard = spi_sdcard_new(path.c_str(),
+				Verilated::commandArgsPlusMatch("sdcard_cow") == "" ?
+				0 : SPI_SDCARD_COW);
 	assert(sdcard != NULL);
 }
 